@@ -0,0 +1,597 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ether.h>
+
+#include "l3fwd.h"
+
+/*
+ * IPv6 routes
+ *
+ * Each node of the trie holds a prefix (with the bits beyond depth cleared)
+ * and, if there is a route for exactly that prefix, its next hop. The
+ * children extend the prefix of their parent, branching on the first bit
+ * after it. Nodes are only created for prefixes with a route, or where the
+ * prefixes of two routes diverge, so a lookup visits at most one node per
+ * route on the way to the longest match.
+ */
+struct l3fwd_lpm6_node {
+	__u8 prefix[16];
+	__u32 depth;
+	int next_hop;
+	struct l3fwd_lpm6_node *child[2];
+};
+
+static inline __u32
+addr6_bit(const __u8 *addr, __u32 pos)
+{
+	return (addr[pos / 8] >> (7 - pos % 8)) & 1;
+}
+
+static void
+addr6_mask(__u8 *dst, const __u8 *src, __u32 depth)
+{
+	__u32 i;
+
+	for (i = 0; i < 16; i++) {
+		if (depth >= 8)
+			dst[i] = src[i];
+		else if (depth)
+			dst[i] = src[i] & (0xff << (8 - depth));
+		else
+			dst[i] = 0;
+
+		depth = depth >= 8 ? depth - 8 : 0;
+	}
+}
+
+/* Number of leading bits that a and b have in common, at most max_depth. */
+static __u32
+addr6_common_depth(const __u8 *a, const __u8 *b, __u32 max_depth)
+{
+	__u32 depth;
+
+	for (depth = 0; depth < max_depth; depth += 8) {
+		__u8 diff = a[depth / 8] ^ b[depth / 8];
+
+		if (diff) {
+			depth += __builtin_clz(diff) - 24;
+			break;
+		}
+	}
+
+	return depth < max_depth ? depth : max_depth;
+}
+
+static struct l3fwd_lpm6_node *
+lpm6_node_create(const __u8 *prefix, __u32 depth, int next_hop)
+{
+	struct l3fwd_lpm6_node *node;
+
+	node = calloc(1, sizeof(struct l3fwd_lpm6_node));
+	if (!node)
+		return NULL;
+
+	addr6_mask(node->prefix, prefix, depth);
+	node->depth = depth;
+	node->next_hop = next_hop;
+
+	return node;
+}
+
+static void
+lpm6_free(struct l3fwd_lpm6_node *node)
+{
+	if (!node)
+		return;
+
+	lpm6_free(node->child[0]);
+	lpm6_free(node->child[1]);
+	free(node);
+}
+
+static int
+lpm6_add(struct l3fwd *l, const __u8 *prefix, __u32 depth, int next_hop)
+{
+	struct l3fwd_lpm6_node **pos = &l->lpm6;
+
+	for ( ; ; ) {
+		struct l3fwd_lpm6_node *node = *pos, *leaf, *branch;
+		__u32 common;
+
+		if (!node) {
+			*pos = lpm6_node_create(prefix, depth, next_hop);
+			return *pos ? 0 : -1;
+		}
+
+		common = addr6_common_depth(node->prefix, prefix,
+					    node->depth < depth ? node->depth : depth);
+
+		/* The route is within the prefix of this node. */
+		if (common == node->depth) {
+			if (depth == node->depth) {
+				node->next_hop = next_hop;
+				return 0;
+			}
+
+			pos = &node->child[addr6_bit(prefix, node->depth)];
+			continue;
+		}
+
+		/* The prefix of this node is within the route. */
+		if (common == depth) {
+			leaf = lpm6_node_create(prefix, depth, next_hop);
+			if (!leaf)
+				return -1;
+
+			leaf->child[addr6_bit(node->prefix, depth)] = node;
+			*pos = leaf;
+			return 0;
+		}
+
+		/* The prefixes diverge after common bits. */
+		leaf = lpm6_node_create(prefix, depth, next_hop);
+		branch = lpm6_node_create(prefix, common, -1);
+		if (!leaf || !branch) {
+			free(leaf);
+			free(branch);
+			return -1;
+		}
+
+		branch->child[addr6_bit(node->prefix, common)] = node;
+		branch->child[addr6_bit(prefix, common)] = leaf;
+		*pos = branch;
+		return 0;
+	}
+}
+
+int
+l3fwd_lookup6(const struct l3fwd *l, const __u8 *daddr)
+{
+	struct l3fwd_lpm6_node *node = l->lpm6;
+	int next_hop = -1;
+
+	while (node) {
+		if (addr6_common_depth(node->prefix, daddr, node->depth) !=
+		    node->depth)
+			break;
+
+		if (node->next_hop >= 0)
+			next_hop = node->next_hop;
+
+		if (node->depth == 128)
+			break;
+
+		node = node->child[addr6_bit(daddr, node->depth)];
+	}
+
+	return next_hop;
+}
+
+/*
+ * IPv4 routes
+ *
+ * The routes are added in order of increasing prefix length, so each route
+ * simply overwrites the entries of any shorter route it overlaps with. This
+ * also means that all the routes up to /24 are in place before the first
+ * tbl8 group is allocated, so a new group starts out as a copy of the tbl24
+ * entry it replaces.
+ */
+static int
+lpm4_add(struct l3fwd *l, __u32 prefix, __u32 depth, int next_hop)
+{
+	__u32 entry = L3FWD_ENTRY_VALID | next_hop;
+	__u32 i, first, n;
+
+	if (depth <= 24) {
+		first = depth ? (prefix >> 8) & ~((1U << (24 - depth)) - 1) : 0;
+		n = 1U << (24 - depth);
+
+		for (i = first; i < first + n; i++)
+			l->tbl24[i] = entry;
+
+		return 0;
+	}
+
+	i = prefix >> 8;
+	if (!(l->tbl24[i] & L3FWD_ENTRY_TBL8)) {
+		__u32 group = l->n_tbl8_groups, j;
+
+		if (group == L3FWD_TBL8_GROUPS_MAX)
+			return -1;
+
+		for (j = 0; j < L3FWD_TBL8_GROUP_ENTRIES; j++)
+			l->tbl8[group * L3FWD_TBL8_GROUP_ENTRIES + j] =
+				l->tbl24[i];
+
+		l->tbl24[i] = L3FWD_ENTRY_VALID | L3FWD_ENTRY_TBL8 | group;
+		l->n_tbl8_groups++;
+	}
+
+	first = (l->tbl24[i] & L3FWD_ENTRY_VALUE_MASK) *
+		L3FWD_TBL8_GROUP_ENTRIES +
+		(prefix & 0xff & ~((1U << (32 - depth)) - 1));
+	n = 1U << (32 - depth);
+
+	for (i = first; i < first + n; i++)
+		l->tbl8[i] = entry;
+
+	return 0;
+}
+
+/*
+ * Neighbors
+ *
+ * Open addressing hash table with linear probing, keyed by the address. IPv4
+ * addresses are stored as IPv4-mapped IPv6 addresses.
+ */
+#ifndef L3FWD_NEIGH_TABLE_SIZE
+#define L3FWD_NEIGH_TABLE_SIZE 8192
+#endif
+
+struct l3fwd_neigh {
+	__u8 addr[16];
+	__u8 mac[6];
+	__u8 valid;
+};
+
+static inline __u32
+neigh_hash(const __u8 *addr)
+{
+	__u32 h = 2166136261U, i;
+
+	for (i = 0; i < 16; i++)
+		h = (h ^ addr[i]) * 16777619U;
+
+	return h & (L3FWD_NEIGH_TABLE_SIZE - 1);
+}
+
+static struct l3fwd_neigh *
+neigh_find(const struct l3fwd *l, const __u8 *addr, int add)
+{
+	__u32 pos = neigh_hash(addr), i;
+
+	for (i = 0; i < L3FWD_NEIGH_TABLE_SIZE; i++) {
+		struct l3fwd_neigh *n = &l->neigh[pos];
+
+		if (!n->valid) {
+			if (!add)
+				return NULL;
+
+			memcpy(n->addr, addr, 16);
+			n->valid = 1;
+			return n;
+		}
+
+		if (!memcmp(n->addr, addr, 16))
+			return n;
+
+		pos = (pos + 1) & (L3FWD_NEIGH_TABLE_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+static inline void
+addr4_mapped(__u8 *dst, __u32 addr)
+{
+	memset(dst, 0, 10);
+	dst[10] = 0xff;
+	dst[11] = 0xff;
+	dst[12] = addr >> 24;
+	dst[13] = addr >> 16;
+	dst[14] = addr >> 8;
+	dst[15] = addr;
+}
+
+const __u8 *
+l3fwd_neigh4(const struct l3fwd *l, __u32 addr)
+{
+	struct l3fwd_neigh *n;
+	__u8 key[16];
+
+	addr4_mapped(key, addr);
+	n = neigh_find(l, key, 0);
+
+	return n ? n->mac : NULL;
+}
+
+const __u8 *
+l3fwd_neigh6(const struct l3fwd *l, const __u8 *addr)
+{
+	struct l3fwd_neigh *n = neigh_find(l, addr, 0);
+
+	return n ? n->mac : NULL;
+}
+
+/*
+ * Route file
+ */
+struct route {
+	int family;
+	__u8 prefix[16];
+	__u32 depth;
+	int has_gateway;
+	__u8 gateway[16];
+	__u32 ifindex;
+	__u32 seq;
+};
+
+#ifndef L3FWD_MAX_ROUTES
+#define L3FWD_MAX_ROUTES 65536
+#endif
+
+/* Parses an IPv4 or IPv6 address into addr, IPv4 addresses as IPv4-mapped. */
+static int
+parse_addr(const char *s, __u8 *addr)
+{
+	struct in_addr a4;
+
+	if (inet_pton(AF_INET, s, &a4) == 1) {
+		addr4_mapped(addr, ntohl(a4.s_addr));
+		return AF_INET;
+	}
+
+	if (inet_pton(AF_INET6, s, addr) == 1)
+		return AF_INET6;
+
+	return -1;
+}
+
+static int
+parse_route(struct route *r, char *prefix, char **args)
+{
+	char *len, *end;
+	__u32 max_depth;
+	__u8 gateway[16];
+	int i;
+
+	len = strchr(prefix, '/');
+	if (len)
+		*len++ = 0;
+
+	r->family = parse_addr(prefix, r->prefix);
+	if (r->family < 0)
+		return -1;
+
+	max_depth = r->family == AF_INET ? 32 : 128;
+	r->depth = max_depth;
+	if (len) {
+		r->depth = strtoul(len, &end, 10);
+		if (!*len || *end || r->depth > max_depth)
+			return -1;
+	}
+
+	for (i = 0; args[i]; i += 2) {
+		if (!args[i + 1])
+			return -1;
+
+		if (!strcmp(args[i], "via")) {
+			if (parse_addr(args[i + 1], gateway) != r->family)
+				return -1;
+
+			memcpy(r->gateway, gateway, 16);
+			r->has_gateway = 1;
+		} else if (!strcmp(args[i], "dev")) {
+			r->ifindex = if_nametoindex(args[i + 1]);
+			if (!r->ifindex)
+				return -1;
+		} else {
+			return -1;
+		}
+	}
+
+	return r->ifindex ? 0 : -1;
+}
+
+static int
+parse_neigh(struct l3fwd *l, char *addr, char **args)
+{
+	struct ether_addr *mac;
+	struct l3fwd_neigh *n;
+	__u8 key[16];
+
+	if (parse_addr(addr, key) < 0)
+		return -1;
+
+	if (!args[0] || strcmp(args[0], "lladdr") || !args[1] || args[2])
+		return -1;
+
+	mac = ether_aton(args[1]);
+	if (!mac)
+		return -1;
+
+	n = neigh_find(l, key, 1);
+	if (!n)
+		return -1;
+
+	memcpy(n->mac, mac, 6);
+	return 0;
+}
+
+static int
+route_cmp(const void *a, const void *b)
+{
+	const struct route *ra = a, *rb = b;
+
+	/* For duplicate routes, the last one in the file wins. */
+	if (ra->depth != rb->depth)
+		return (int)ra->depth - (int)rb->depth;
+
+	return (int)ra->seq - (int)rb->seq;
+}
+
+static int
+next_hop_get(struct l3fwd *l, struct route *r)
+{
+	struct l3fwd_next_hop nh = {.ifindex = r->ifindex};
+	__u32 i;
+
+	if (r->has_gateway) {
+		struct l3fwd_neigh *n = neigh_find(l, r->gateway, 0);
+
+		if (!n)
+			return -1;
+
+		nh.has_gateway = 1;
+		memcpy(nh.gateway_mac, n->mac, 6);
+	}
+
+	for (i = 0; i < l->n_next_hops; i++) {
+		struct l3fwd_next_hop *n = &l->next_hops[i];
+
+		if (n->ifindex == nh.ifindex &&
+		    n->has_gateway == nh.has_gateway &&
+		    !memcmp(n->gateway_mac, nh.gateway_mac, 6))
+			return i;
+	}
+
+	if (l->n_next_hops == L3FWD_MAX_NEXT_HOPS)
+		return -1;
+
+	l->next_hops[l->n_next_hops] = nh;
+	return l->n_next_hops++;
+}
+
+int
+l3fwd_load(struct l3fwd *l, const char *path)
+{
+	struct route *routes;
+	__u32 n_routes = 0, i;
+	char line[256];
+	int line_no = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("Unable to open route file %s (%d).\n", path, errno);
+		return -1;
+	}
+
+	routes = calloc(L3FWD_MAX_ROUTES, sizeof(struct route));
+	if (!routes) {
+		fclose(f);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char *tokens[16], *saveptr = NULL, *tok;
+		int n_tokens = 0, status;
+
+		line_no++;
+
+		for (tok = strtok_r(line, " \t\r\n", &saveptr);
+		     tok && n_tokens < 15;
+		     tok = strtok_r(NULL, " \t\r\n", &saveptr))
+			tokens[n_tokens++] = tok;
+		tokens[n_tokens] = NULL;
+
+		if (!n_tokens || tokens[0][0] == '#')
+			continue;
+
+		if (n_tokens < 2) {
+			status = -1;
+		} else if (!strcmp(tokens[0], "route")) {
+			if (n_routes == L3FWD_MAX_ROUTES)
+				status = -1;
+			else {
+				routes[n_routes].seq = n_routes;
+				status = parse_route(&routes[n_routes++],
+						     tokens[1], &tokens[2]);
+			}
+		} else if (!strcmp(tokens[0], "neigh")) {
+			status = parse_neigh(l, tokens[1], &tokens[2]);
+		} else {
+			status = -1;
+		}
+
+		if (status) {
+			printf("Invalid entry in route file %s, line %d.\n",
+			       path, line_no);
+			goto err;
+		}
+	}
+
+	/* The gateways are resolved once all the neighbors are known. */
+	qsort(routes, n_routes, sizeof(struct route), route_cmp);
+
+	for (i = 0; i < n_routes; i++) {
+		struct route *r = &routes[i];
+		char buf[INET6_ADDRSTRLEN];
+		int next_hop, status;
+
+		next_hop = next_hop_get(l, r);
+		if (next_hop < 0) {
+			status = -1;
+		} else if (r->family == AF_INET) {
+			__u32 prefix = (__u32)r->prefix[12] << 24 |
+				       (__u32)r->prefix[13] << 16 |
+				       (__u32)r->prefix[14] << 8 |
+				       r->prefix[15];
+
+			if (r->depth < 32)
+				prefix &= ~(0xffffffffU >> r->depth);
+
+			status = lpm4_add(l, prefix, r->depth, next_hop);
+		} else {
+			status = lpm6_add(l, r->prefix, r->depth, next_hop);
+		}
+
+		if (status) {
+			inet_ntop(r->family,
+				  r->family == AF_INET ? &r->prefix[12] : r->prefix,
+				  buf, sizeof(buf));
+			printf("Unable to add route %s/%u (gateway without "
+			       "neighbor entry, or out of table space).\n",
+			       buf, r->depth);
+			goto err;
+		}
+	}
+
+	free(routes);
+	fclose(f);
+	return 0;
+
+err:
+	free(routes);
+	fclose(f);
+	return -1;
+}
+
+struct l3fwd *
+l3fwd_create(void)
+{
+	struct l3fwd *l;
+
+	l = calloc(1, sizeof(struct l3fwd));
+	if (!l)
+		return NULL;
+
+	l->tbl24 = calloc(L3FWD_TBL24_ENTRIES, sizeof(__u32));
+	l->tbl8 = calloc(L3FWD_TBL8_GROUPS_MAX * L3FWD_TBL8_GROUP_ENTRIES,
+			 sizeof(__u32));
+	l->neigh = calloc(L3FWD_NEIGH_TABLE_SIZE, sizeof(struct l3fwd_neigh));
+	if (!l->tbl24 || !l->tbl8 || !l->neigh) {
+		l3fwd_free(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+void
+l3fwd_free(struct l3fwd *l)
+{
+	if (!l)
+		return;
+
+	lpm6_free(l->lpm6);
+	free(l->neigh);
+	free(l->tbl8);
+	free(l->tbl24);
+	free(l);
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef L3FWD_H
+#define L3FWD_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/*
+ * Route and neighbor tables for L3 forwarding
+ *
+ * The tables are loaded once from a route file, with one entry per line:
+ *
+ *     route PREFIX/LEN [via GATEWAY] dev INTERFACE
+ *     neigh ADDRESS lladdr MAC
+ *
+ * where the addresses can be either IPv4 or IPv6, and empty lines and lines
+ * starting with '#' are ignored. Routes without a gateway are for directly
+ * connected networks, where the destination address itself is looked up in
+ * the neighbor table. The tables are read-only after loading, so they can be
+ * shared by all the forwarding threads without any locking.
+ *
+ * IPv4 routes are kept in a DIR-24-8 table: the first 24 bits of the address
+ * index a table of 2^24 entries, which either hold the next hop directly, or,
+ * for addresses with routes longer than /24, the index of a group of 256
+ * entries for the last 8 bits. A lookup therefore takes at most two memory
+ * accesses. IPv6 routes are kept in a path-compressed binary trie.
+ */
+#define L3FWD_MAX_NEXT_HOPS 1024
+
+struct l3fwd_next_hop {
+	__u32 ifindex;
+	int has_gateway; /* Otherwise, the destination is the neighbor. */
+	__u8 gateway_mac[6];
+};
+
+#define L3FWD_TBL24_ENTRIES (1 << 24)
+#define L3FWD_TBL8_GROUP_ENTRIES 256
+#define L3FWD_TBL8_GROUPS_MAX 4096
+
+#define L3FWD_ENTRY_VALID (1U << 31)
+#define L3FWD_ENTRY_TBL8 (1U << 30)
+#define L3FWD_ENTRY_VALUE_MASK ((1U << 24) - 1)
+
+struct l3fwd_lpm6_node;
+struct l3fwd_neigh;
+
+struct l3fwd {
+	__u32 *tbl24;
+	__u32 *tbl8;
+	__u32 n_tbl8_groups;
+
+	struct l3fwd_lpm6_node *lpm6;
+
+	struct l3fwd_neigh *neigh;
+
+	struct l3fwd_next_hop next_hops[L3FWD_MAX_NEXT_HOPS];
+	__u32 n_next_hops;
+};
+
+struct l3fwd *l3fwd_create(void);
+void l3fwd_free(struct l3fwd *l);
+
+/* Returns 0 on success, or -1 after printing the offending line. */
+int l3fwd_load(struct l3fwd *l, const char *path);
+
+/* Returns the next hop for the IPv4 address (in host byte order), or -1 if
+ * there is no route for it.
+ */
+static inline int
+l3fwd_lookup4(const struct l3fwd *l, __u32 daddr)
+{
+	__u32 entry = l->tbl24[daddr >> 8];
+
+	if (entry & L3FWD_ENTRY_TBL8)
+		entry = l->tbl8[(entry & L3FWD_ENTRY_VALUE_MASK) *
+				L3FWD_TBL8_GROUP_ENTRIES + (daddr & 0xff)];
+
+	if (!(entry & L3FWD_ENTRY_VALID))
+		return -1;
+
+	return entry & L3FWD_ENTRY_VALUE_MASK;
+}
+
+static inline void
+l3fwd_prefetch4(const struct l3fwd *l, __u32 daddr)
+{
+	__builtin_prefetch(&l->tbl24[daddr >> 8]);
+}
+
+/* Like l3fwd_lookup4(), for IPv6 addresses. */
+int l3fwd_lookup6(const struct l3fwd *l, const __u8 *daddr);
+
+/* Returns the MAC address of the neighbor, or NULL if it is not known. */
+const __u8 *l3fwd_neigh4(const struct l3fwd *l, __u32 addr);
+const __u8 *l3fwd_neigh6(const struct l3fwd *l, const __u8 *addr);
+
+#endif
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <linux/types.h>
+
+/*
+ * Per-thread telemetry of the forwarding threads
+ *
+ * With -t NAME, xsk_fwd places its telemetry in the POSIX shared memory
+ * object /NAME (i.e. /dev/shm/NAME on Linux), which another process can map
+ * read-only and sample at any time, without any cooperation from the
+ * forwarding threads. The object is removed when xsk_fwd quits.
+ *
+ * Each counter is only ever incremented, by a single thread, so a reader gets
+ * rates by sampling twice and dividing the differences by the time between
+ * the samples. The counters of a thread are not updated atomically as a set,
+ * so ratios over very short intervals are approximate. The header is complete
+ * once magic reads TELEMETRY_MAGIC, and version changes with the layout.
+ *
+ * What the counters give:
+ *
+ *     cycles per packet = busy_cycles / n_pkts
+ *     empty poll ratio  = n_polls[0] / sum(n_polls)
+ *     average batch     = n_descs / (sum(n_polls) - n_polls[0])
+ *
+ * A poll is an RX burst for the threads receiving from ports, or a ring
+ * dequeue for the pipeline workers and TX threads, and n_polls is the
+ * histogram of the number of descriptors it returned: bucket 0 counts the
+ * empty polls, and bucket i > 0 those returning 2^(i - 1) to 2^i - 1
+ * descriptors, the last bucket also counting anything larger. The busy cycles
+ * are those spent on the non-empty polls, from the poll until all their
+ * packets are passed on, in units of tsc_hz.
+ */
+#define TELEMETRY_MAGIC 0x58534b54 /* "XSKT" */
+#define TELEMETRY_VERSION 1
+
+#define TELEMETRY_MAX_THREADS 64
+#define TELEMETRY_POLL_HIST_N_BUCKETS 8
+
+struct telemetry_thread {
+	char name[32]; /* E.g. "Thread 0", or "Worker 1" in pipeline mode. */
+	__u32 cpu_core_id;
+
+	__u64 n_polls[TELEMETRY_POLL_HIST_N_BUCKETS];
+	__u64 n_descs;
+	__u64 n_pkts;
+	__u64 busy_cycles;
+
+	/* Syscalls to wake up the kernel: poll() for the fill queue, and
+	 * sendto() for the TX queue.
+	 */
+	__u64 n_wakeups_rx;
+	__u64 n_wakeups_tx;
+
+	/* RX bursts skipped for lack of free buffers to put in the fill
+	 * queue, and TX bursts that found the TX queue full as the kernel
+	 * had not completed enough of the previous packets.
+	 */
+	__u64 n_fq_starved;
+	__u64 n_cq_starved;
+
+	/* Slabs of buffers traded between the buffer caches used by the
+	 * thread and the buffer pool.
+	 */
+	__u64 n_slab_exchanges;
+} __attribute__((aligned(64)));
+
+struct telemetry {
+	__u32 magic;
+	__u32 version;
+	__u64 tsc_hz;
+	__u32 n_threads;
+	__u32 poll_hist_n_buckets;
+
+	struct telemetry_thread threads[TELEMETRY_MAX_THREADS];
+};
+
+#endif
@@ -2,6 +2,8 @@
 /* Copyright(c) 2020 - 2022 Intel Corporation. */
 
 #define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
@@ -12,20 +14,31 @@
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <netinet/ether.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <net/if.h>
 
 #include <linux/err.h>
 #include <linux/if_link.h>
 #include <linux/if_xdp.h>
+#include <linux/mempolicy.h>
 
 #include <xdp/libxdp.h>
 #include <xdp/xsk.h>
 
+#include "l3fwd.h"
+#include "telemetry.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
 typedef __u64 u64;
@@ -53,6 +66,45 @@ typedef __u8  u8;
  *         -c CX -c CY
  */
 
+/*
+ * Time stamp counter
+ *
+ * Used to time the packets in the forwarding threads, as it is much cheaper to
+ * read than the system clock. On architectures other than x86, the monotonic
+ * clock is used instead, counting in nanoseconds.
+ */
+static u64 tsc_hz;
+
+static inline u64
+tsc_read(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void
+tsc_calibrate(void)
+{
+	struct timespec ts0, ts1, delay = { .tv_nsec = 100000000 };
+	u64 tsc0, tsc1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	tsc0 = tsc_read();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	tsc1 = tsc_read();
+
+	ns = (ts1.tv_sec - ts0.tv_sec) * 1000000000ULL +
+		ts1.tv_nsec - ts0.tv_nsec;
+	tsc_hz = (tsc1 - tsc0) * 1000000000. / ns;
+}
+
 /*
  * Buffer pool and buffer cache
  *
@@ -74,12 +126,19 @@ typedef __u8  u8;
  * configuration. For AF_XDP sockets, for this to work with zero-copy of the
  * packet buffers when, it is required that the buffer pool memory fits into the
  * UMEM area shared by all the sockets.
+ *
+ * On systems with multiple NUMA nodes, there is one buffer pool per node, with
+ * its memory allocated on that node, and each port uses the pool of the node
+ * its network interface is attached to. Packets forwarded between ports on
+ * different nodes can therefore not be passed by address, and are copied
+ * instead.
  */
 
 struct bpool_params {
 	u32 n_buffers;
 	u32 buffer_size;
 	int mmap_flags;
+	int numa_node; /* Node to allocate the buffers on, -1 for any node. */
 
 	u32 n_users_max;
 	u32 n_buffers_per_slab;
@@ -87,7 +146,8 @@ struct bpool_params {
 
 /* This buffer pool implementation organizes the buffers into equally sized
  * slabs of *n_buffers_per_slab*. Initially, there are *n_slabs* slabs in the
- * pool that are completely filled with buffer pointers (full slabs).
+ * pool that are completely filled with buffer pointers (full slabs), plus
+ * *n_slabs_reserved* empty slabs, two for each buffer cache.
  *
  * Each buffer cache has a slab for buffer allocation and a slab for buffer
  * free, with both of these slabs initially empty. When the cache's allocation
@@ -99,23 +159,36 @@ struct bpool_params {
  * Partially filled slabs never get traded between the cache and the pool
  * (except when the cache itself is destroyed), which enables fast operation
  * through pointer swapping.
+ *
+ * The pool keeps the full and the empty slabs on two separate lock-free
+ * stacks, so that the slab exchange does not serialize all the threads sharing
+ * the pool on a lock. Each slab is identified by its index, and the stack
+ * links are kept in the *slab_next* array.
  */
+struct bpool_slab_stack {
+	/* The top of the stack in the lower 32 bits, as the slab index + 1
+	 * (0 when the stack is empty), and a tag in the upper 32 bits that is
+	 * incremented on every push and pop to avoid the ABA problem.
+	 */
+	u64 head;
+} __attribute__((aligned(64)));
+
 struct bpool {
 	struct bpool_params params;
-	pthread_mutex_t lock;
 	void *addr;
 
+	struct bpool_slab_stack slabs_full;
+	struct bpool_slab_stack slabs_empty;
+
 	u64 **slabs;
-	u64 **slabs_reserved;
+	u32 *slab_next;
 	u64 *buffers;
-	u64 *buffers_reserved;
 
 	u64 n_slabs;
 	u64 n_slabs_reserved;
 	u64 n_buffers;
 
-	u64 n_slabs_available;
-	u64 n_slabs_reserved_available;
+	u32 n_users;
 
 	struct xsk_umem_config umem_cfg;
 	struct xsk_ring_prod umem_fq;
@@ -123,14 +196,59 @@ struct bpool {
 	struct xsk_umem *umem;
 };
 
+static void
+bpool_slab_push(struct bpool *bp, struct bpool_slab_stack *stack, u32 slab_id)
+{
+	u64 head, new_head;
+
+	head = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&bp->slab_next[slab_id], (u32)head,
+				 __ATOMIC_RELAXED);
+		new_head = (((head >> 32) + 1) << 32) | (slab_id + 1);
+	} while (!__atomic_compare_exchange_n(&stack->head, &head, new_head, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+/* Returns 0 and the index of the popped slab in *slab_id, or -1 when the stack
+ * is empty.
+ */
+static int
+bpool_slab_pop(struct bpool *bp, struct bpool_slab_stack *stack, u32 *slab_id)
+{
+	u64 head, new_head;
+	u32 top;
+
+	head = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+	do {
+		top = (u32)head;
+		if (!top)
+			return -1;
+
+		/* The slab may be popped (and pushed again) by another thread
+		 * before the compare and exchange below, in which case the
+		 * link read here is stale, but then the tag has changed as
+		 * well, so the compare and exchange fails.
+		 */
+		new_head = (((head >> 32) + 1) << 32) |
+			__atomic_load_n(&bp->slab_next[top - 1],
+					__ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&stack->head, &head, new_head, 1,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+
+	*slab_id = top - 1;
+	return 0;
+}
+
 static struct bpool *
 bpool_init(struct bpool_params *params,
 	   struct xsk_umem_config *umem_cfg)
 {
 	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
-	u64 n_slabs, n_slabs_reserved, n_buffers, n_buffers_reserved;
-	u64 slabs_size, slabs_reserved_size;
-	u64 buffers_size, buffers_reserved_size;
+	u64 n_slabs, n_slabs_reserved, n_buffers, n_buffers_total;
+	u64 slabs_size, slab_next_size, buffers_size;
 	u64 total_size, i;
 	struct bpool *bp;
 	u8 *p;
@@ -145,21 +263,23 @@ bpool_init(struct bpool_params *params,
 		params->n_buffers_per_slab;
 	n_slabs_reserved = params->n_users_max * 2;
 	n_buffers = n_slabs * params->n_buffers_per_slab;
-	n_buffers_reserved = n_slabs_reserved * params->n_buffers_per_slab;
+	n_buffers_total = (n_slabs + n_slabs_reserved) *
+		params->n_buffers_per_slab;
 
-	slabs_size = n_slabs * sizeof(u64 *);
-	slabs_reserved_size = n_slabs_reserved * sizeof(u64 *);
-	buffers_size = n_buffers * sizeof(u64);
-	buffers_reserved_size = n_buffers_reserved * sizeof(u64);
+	slabs_size = (n_slabs + n_slabs_reserved) * sizeof(u64 *);
+	slab_next_size = (n_slabs + n_slabs_reserved) * sizeof(u32);
+	buffers_size = n_buffers_total * sizeof(u64);
 
 	total_size = sizeof(struct bpool) +
-		slabs_size + slabs_reserved_size +
-		buffers_size + buffers_reserved_size;
+		slabs_size + slab_next_size + buffers_size;
 
 	/* bpool memory allocation. */
-	p = calloc(total_size, sizeof(u8));
+	p = aligned_alloc(__alignof__(struct bpool),
+			  (total_size + __alignof__(struct bpool) - 1) &
+			  ~(__alignof__(struct bpool) - 1));
 	if (!p)
 		return NULL;
+	memset(p, 0, total_size);
 
 	/* bpool memory initialization. */
 	bp = (struct bpool *)p;
@@ -167,35 +287,28 @@ bpool_init(struct bpool_params *params,
 	bp->params.n_buffers = n_buffers;
 
 	bp->slabs = (u64 **)&p[sizeof(struct bpool)];
-	bp->slabs_reserved = (u64 **)&p[sizeof(struct bpool) +
-		slabs_size];
+	bp->slab_next = (u32 *)&p[sizeof(struct bpool) + slabs_size];
 	bp->buffers = (u64 *)&p[sizeof(struct bpool) +
-		slabs_size + slabs_reserved_size];
-	bp->buffers_reserved = (u64 *)&p[sizeof(struct bpool) +
-		slabs_size + slabs_reserved_size + buffers_size];
+		slabs_size + slab_next_size];
 
 	bp->n_slabs = n_slabs;
 	bp->n_slabs_reserved = n_slabs_reserved;
 	bp->n_buffers = n_buffers;
 
-	for (i = 0; i < n_slabs; i++)
+	/* The first n_slabs slabs are full, the reserved ones after them are
+	 * empty.
+	 */
+	for (i = 0; i < n_slabs + n_slabs_reserved; i++)
 		bp->slabs[i] = &bp->buffers[i * params->n_buffers_per_slab];
-	bp->n_slabs_available = n_slabs;
-
-	for (i = 0; i < n_slabs_reserved; i++)
-		bp->slabs_reserved[i] = &bp->buffers_reserved[i *
-			params->n_buffers_per_slab];
-	bp->n_slabs_reserved_available = n_slabs_reserved;
 
 	for (i = 0; i < n_buffers; i++)
 		bp->buffers[i] = i * params->buffer_size;
 
-	/* lock. */
-	status = pthread_mutex_init(&bp->lock, NULL);
-	if (status) {
-		free(p);
-		return NULL;
-	}
+	for (i = 0; i < n_slabs; i++)
+		bpool_slab_push(bp, &bp->slabs_full, i);
+
+	for (i = n_slabs; i < n_slabs + n_slabs_reserved; i++)
+		bpool_slab_push(bp, &bp->slabs_empty, i);
 
 	/* mmap. */
 	bp->addr = mmap(NULL,
@@ -205,11 +318,30 @@ bpool_init(struct bpool_params *params,
 			-1,
 			0);
 	if (bp->addr == MAP_FAILED) {
-		pthread_mutex_destroy(&bp->lock);
 		free(p);
 		return NULL;
 	}
 
+	/* NUMA node binding, before the pages are faulted in by the UMEM
+	 * registration below.
+	 */
+	if (params->numa_node >= 0) {
+		unsigned long nodemask = 1UL << params->numa_node;
+
+		status = syscall(SYS_mbind,
+				 bp->addr,
+				 n_buffers * params->buffer_size,
+				 MPOL_BIND,
+				 &nodemask,
+				 sizeof(nodemask) * 8,
+				 0);
+		if (status) {
+			munmap(bp->addr, n_buffers * params->buffer_size);
+			free(p);
+			return NULL;
+		}
+	}
+
 	/* umem. */
 	status = xsk_umem__create(&bp->umem,
 				  bp->addr,
@@ -219,7 +351,6 @@ bpool_init(struct bpool_params *params,
 				  umem_cfg);
 	if (status) {
 		munmap(bp->addr, bp->params.n_buffers * bp->params.buffer_size);
-		pthread_mutex_destroy(&bp->lock);
 		free(p);
 		return NULL;
 	}
@@ -236,17 +367,46 @@ bpool_free(struct bpool *bp)
 
 	xsk_umem__delete(bp->umem);
 	munmap(bp->addr, bp->params.n_buffers * bp->params.buffer_size);
-	pthread_mutex_destroy(&bp->lock);
 	free(bp);
 }
 
+/*
+ * Telemetry
+ *
+ * The counters of the calling thread, see telemetry.h. The buffer cache and
+ * port functions don't know which thread they run on, as the port groups move
+ * between threads, hence the thread local pointer. The threads without a
+ * record of their own, e.g. the main thread while setting up the ports, count
+ * into a record that is never read.
+ */
+static struct telemetry_thread telemetry_none;
+static __thread struct telemetry_thread *telemetry_thread = &telemetry_none;
+
+static inline void
+telemetry_poll(struct telemetry_thread *tt, u32 n_descs)
+{
+	u32 bucket = n_descs ? 32 - __builtin_clz(n_descs) : 0;
+
+	if (bucket >= TELEMETRY_POLL_HIST_N_BUCKETS)
+		bucket = TELEMETRY_POLL_HIST_N_BUCKETS - 1;
+
+	tt->n_polls[bucket]++;
+	tt->n_descs += n_descs;
+}
+
+/* In pipeline mode, the consumer half of the buffer cache of a port is used by
+ * its RX thread and the producer half by its TX thread, so each half has its
+ * own cache line.
+ */
 struct bcache {
 	struct bpool *bp;
 
-	u64 *slab_cons;
-	u64 *slab_prod;
-
+	u64 *slab_cons __attribute__((aligned(64)));
+	u32 slab_cons_id;
 	u64 n_buffers_cons;
+
+	u64 *slab_prod __attribute__((aligned(64)));
+	u32 slab_prod_id;
 	u64 n_buffers_prod;
 };
 
@@ -263,27 +423,40 @@ bcache_init(struct bpool *bp)
 {
 	struct bcache *bc;
 
-	bc = calloc(1, sizeof(struct bcache));
+	bc = aligned_alloc(__alignof__(struct bcache), sizeof(struct bcache));
 	if (!bc)
 		return NULL;
 
+	memset(bc, 0, sizeof(struct bcache));
+
 	bc->bp = bp;
 	bc->n_buffers_cons = 0;
 	bc->n_buffers_prod = 0;
 
-	pthread_mutex_lock(&bp->lock);
-	if (bp->n_slabs_reserved_available == 0) {
-		pthread_mutex_unlock(&bp->lock);
-		free(bc);
-		return NULL;
+	/* Each cache needs its two reserved slabs for the guarantee that an
+	 * empty slab is always available in bcache_prod().
+	 */
+	if (__atomic_add_fetch(&bp->n_users, 1, __ATOMIC_RELAXED) >
+	    bp->params.n_users_max)
+		goto err;
+
+	if (bpool_slab_pop(bp, &bp->slabs_empty, &bc->slab_cons_id))
+		goto err;
+
+	if (bpool_slab_pop(bp, &bp->slabs_empty, &bc->slab_prod_id)) {
+		bpool_slab_push(bp, &bp->slabs_empty, bc->slab_cons_id);
+		goto err;
 	}
 
-	bc->slab_cons = bp->slabs_reserved[bp->n_slabs_reserved_available - 1];
-	bc->slab_prod = bp->slabs_reserved[bp->n_slabs_reserved_available - 2];
-	bp->n_slabs_reserved_available -= 2;
-	pthread_mutex_unlock(&bp->lock);
+	bc->slab_cons = bp->slabs[bc->slab_cons_id];
+	bc->slab_prod = bp->slabs[bc->slab_prod_id];
 
 	return bc;
+
+err:
+	__atomic_sub_fetch(&bp->n_users, 1, __ATOMIC_RELAXED);
+	free(bc);
+	return NULL;
 }
 
 static void
@@ -299,11 +472,9 @@ bcache_free(struct bcache *bc)
 	 */
 
 	bp = bc->bp;
-	pthread_mutex_lock(&bp->lock);
-	bp->slabs_reserved[bp->n_slabs_reserved_available] = bc->slab_prod;
-	bp->slabs_reserved[bp->n_slabs_reserved_available + 1] = bc->slab_cons;
-	bp->n_slabs_reserved_available += 2;
-	pthread_mutex_unlock(&bp->lock);
+	bpool_slab_push(bp, &bp->slabs_empty, bc->slab_prod_id);
+	bpool_slab_push(bp, &bp->slabs_empty, bc->slab_cons_id);
+	__atomic_sub_fetch(&bp->n_users, 1, __ATOMIC_RELAXED);
 
 	free(bc);
 }
@@ -319,8 +490,7 @@ bcache_cons_check(struct bcache *bc, u32 n_buffers)
 	struct bpool *bp = bc->bp;
 	u64 n_buffers_per_slab = bp->params.n_buffers_per_slab;
 	u64 n_buffers_cons = bc->n_buffers_cons;
-	u64 n_slabs_available;
-	u64 *slab_full;
+	u32 slab_full_id;
 
 	/*
 	 * Consumer slab is not empty: Use what's available locally. Do not
@@ -334,23 +504,17 @@ bcache_cons_check(struct bcache *bc, u32 n_buffers)
 
 	/*
 	 * Consumer slab is empty: look to trade the current consumer slab
-	 * (full) for a full slab from the pool, if any is available.
+	 * (empty) for a full slab from the pool, if any is available.
 	 */
-	pthread_mutex_lock(&bp->lock);
-	n_slabs_available = bp->n_slabs_available;
-	if (!n_slabs_available) {
-		pthread_mutex_unlock(&bp->lock);
+	if (bpool_slab_pop(bp, &bp->slabs_full, &slab_full_id))
 		return 0;
-	}
 
-	n_slabs_available--;
-	slab_full = bp->slabs[n_slabs_available];
-	bp->slabs[n_slabs_available] = bc->slab_cons;
-	bp->n_slabs_available = n_slabs_available;
-	pthread_mutex_unlock(&bp->lock);
+	bpool_slab_push(bp, &bp->slabs_empty, bc->slab_cons_id);
 
-	bc->slab_cons = slab_full;
+	bc->slab_cons_id = slab_full_id;
+	bc->slab_cons = bp->slabs[slab_full_id];
 	bc->n_buffers_cons = n_buffers_per_slab;
+	telemetry_thread->n_slab_exchanges++;
 	return n_buffers;
 }
 
@@ -371,8 +535,7 @@ bcache_prod(struct bcache *bc, u64 buffer)
 	struct bpool *bp = bc->bp;
 	u64 n_buffers_per_slab = bp->params.n_buffers_per_slab;
 	u64 n_buffers_prod = bc->n_buffers_prod;
-	u64 n_slabs_available;
-	u64 *slab_empty;
+	u32 slab_empty_id;
 
 	/*
 	 * Producer slab is not yet full: store the current buffer to it.
@@ -386,20 +549,23 @@ bcache_prod(struct bcache *bc, u64 buffer)
 	/*
 	 * Producer slab is full: trade the cache's current producer slab
 	 * (full) for an empty slab from the pool, then store the current
-	 * buffer to the new producer slab. As one full slab exists in the
-	 * cache, it is guaranteed that there is at least one empty slab
-	 * available in the pool.
+	 * buffer to the new producer slab. The full slab is pushed first:
+	 * there are at least 2 * n_users_max slabs that are not full, and
+	 * each cache holds at most two of them, but this one now holds at
+	 * most one, so there is at least one empty slab in the pool. It may
+	 * only be missing from the stack momentarily, while another cache
+	 * is in the middle of its own exchange, hence the retry.
 	 */
-	pthread_mutex_lock(&bp->lock);
-	n_slabs_available = bp->n_slabs_available;
-	slab_empty = bp->slabs[n_slabs_available];
-	bp->slabs[n_slabs_available] = bc->slab_prod;
-	bp->n_slabs_available = n_slabs_available + 1;
-	pthread_mutex_unlock(&bp->lock);
-
-	slab_empty[0] = buffer;
-	bc->slab_prod = slab_empty;
+	bpool_slab_push(bp, &bp->slabs_full, bc->slab_prod_id);
+
+	while (bpool_slab_pop(bp, &bp->slabs_empty, &slab_empty_id))
+		;
+
+	bc->slab_prod_id = slab_empty_id;
+	bc->slab_prod = bp->slabs[slab_empty_id];
+	bc->slab_prod[0] = buffer;
 	bc->n_buffers_prod = 1;
+	telemetry_thread->n_slab_exchanges++;
 }
 
 /*
@@ -417,15 +583,37 @@ bcache_prod(struct bcache *bc, u64 buffer)
 #define MAX_BURST_TX 64
 #endif
 
+/* Per-port histogram of the time packets spend in the forwarder, from their
+ * RX burst to the submission of their TX burst, in TSC cycles. Bucket i counts
+ * the packets that took less than 2^i (and at least 2^(i-1)) cycles, the last
+ * bucket all packets above that.
+ */
+#ifndef LATENCY_HIST_N_BUCKETS
+#define LATENCY_HIST_N_BUCKETS 40
+#endif
+
+/* The bursts hold descriptors rather than packets: with multi-buffer
+ * enabled, a packet larger than a UMEM frame is received and sent as a chain
+ * of descriptors, each with XDP_PKT_CONTD set in its options except for the
+ * last one. The chains are never split between TX bursts, while an RX burst
+ * keeps the descriptors of an incomplete packet at its end (n_descs_contd)
+ * until the rest of the packet is received.
+ */
 struct burst_rx {
 	u64 addr[MAX_BURST_RX];
 	u32 len[MAX_BURST_RX];
+	u32 options[MAX_BURST_RX];
+	u32 n_descs;
+	u32 n_descs_contd;
+	u64 tsc;
 };
 
 struct burst_tx {
 	u64 addr[MAX_BURST_TX];
 	u32 len[MAX_BURST_TX];
-	u32 n_pkts;
+	u32 options[MAX_BURST_TX];
+	u64 tsc_rx[MAX_BURST_TX];
+	u32 n_descs;
 };
 
 struct port_params {
@@ -433,6 +621,7 @@ struct port_params {
 	struct bpool *bp;
 	const char *iface;
 	u32 iface_queue;
+	int numa_node;
 };
 
 struct port {
@@ -447,8 +636,13 @@ struct port {
 	struct xsk_socket *xsk;
 	int umem_fq_initialized;
 
+	u32 ifindex;
+	u8 mac[ETH_ALEN];
+
 	u64 n_pkts_rx;
 	u64 n_pkts_tx;
+	u64 n_pkts_drop; /* Atomic, the pipeline workers drop too. */
+	u64 latency_hist[LATENCY_HIST_N_BUCKETS];
 };
 
 static void
@@ -522,21 +716,46 @@ port_init(struct port_params *params)
 	return p;
 }
 
+/* Returns the number of descriptors of the complete packets in the burst. The
+ * buffers of a dropped packet go to bc_drop, a buffer cache of the calling
+ * thread, as the producer half of the port cache belongs to the TX thread in
+ * pipeline mode.
+ */
 static inline u32
-port_rx_burst(struct port *p, struct burst_rx *b)
+port_rx_burst(struct port *p, struct burst_rx *b, struct bcache *bc_drop)
 {
-	u32 n_pkts, pos, i;
+	u32 n_descs, n_contd, pos, i;
+
+	/* Incomplete packet from the previous burst. */
+	n_contd = b->n_descs_contd;
+	if (n_contd && b->n_descs) {
+		memmove(b->addr, &b->addr[b->n_descs], n_contd * sizeof(u64));
+		memmove(b->len, &b->len[b->n_descs], n_contd * sizeof(u32));
+		memmove(b->options, &b->options[b->n_descs],
+			n_contd * sizeof(u32));
+	}
+	b->n_descs = 0;
+
+	/* A packet with more fragments than fit in a burst is dropped. */
+	if (n_contd == ARRAY_SIZE(b->addr)) {
+		for (i = 0; i < n_contd; i++)
+			bcache_prod(bc_drop, b->addr[i]);
+		__atomic_fetch_add(&p->n_pkts_drop, 1, __ATOMIC_RELAXED);
+		b->n_descs_contd = n_contd = 0;
+	}
 
 	/* Free buffers for FQ replenish. */
-	n_pkts = ARRAY_SIZE(b->addr);
+	n_descs = ARRAY_SIZE(b->addr) - n_contd;
 
-	n_pkts = bcache_cons_check(p->bc, n_pkts);
-	if (!n_pkts)
+	n_descs = bcache_cons_check(p->bc, n_descs);
+	if (!n_descs) {
+		telemetry_thread->n_fq_starved++;
 		return 0;
+	}
 
 	/* RXQ. */
-	n_pkts = xsk_ring_cons__peek(&p->rxq, n_pkts, &pos);
-	if (!n_pkts) {
+	n_descs = xsk_ring_cons__peek(&p->rxq, n_descs, &pos);
+	if (!n_descs) {
 		if (xsk_ring_prod__needs_wakeup(&p->umem_fq)) {
 			struct pollfd pollfd = {
 				.fd = xsk_socket__fd(p->xsk),
@@ -544,24 +763,39 @@ port_rx_burst(struct port *p, struct burst_rx *b)
 			};
 
 			poll(&pollfd, 1, 0);
+			telemetry_thread->n_wakeups_rx++;
 		}
 		return 0;
 	}
 
-	for (i = 0; i < n_pkts; i++) {
-		b->addr[i] = xsk_ring_cons__rx_desc(&p->rxq, pos + i)->addr;
-		b->len[i] = xsk_ring_cons__rx_desc(&p->rxq, pos + i)->len;
+	for (i = 0; i < n_descs; i++) {
+		const struct xdp_desc *desc;
+
+		desc = xsk_ring_cons__rx_desc(&p->rxq, pos + i);
+		b->addr[n_contd + i] = desc->addr;
+		b->len[n_contd + i] = desc->len;
+		b->options[n_contd + i] = desc->options;
+		p->n_pkts_rx += !(desc->options & XDP_PKT_CONTD);
 	}
 
-	xsk_ring_cons__release(&p->rxq, n_pkts);
-	p->n_pkts_rx += n_pkts;
+	xsk_ring_cons__release(&p->rxq, n_descs);
+	b->tsc = tsc_read();
+
+	/* Split off the descriptors of an incomplete packet at the end. */
+	b->n_descs = n_contd + n_descs;
+	b->n_descs_contd = 0;
+	while (b->n_descs &&
+	       (b->options[b->n_descs - 1] & XDP_PKT_CONTD)) {
+		b->n_descs--;
+		b->n_descs_contd++;
+	}
 
 	/* UMEM FQ. */
 	for ( ; ; ) {
 		int status;
 
-		status = xsk_ring_prod__reserve(&p->umem_fq, n_pkts, &pos);
-		if (status == n_pkts)
+		status = xsk_ring_prod__reserve(&p->umem_fq, n_descs, &pos);
+		if (status == n_descs)
 			break;
 
 		if (xsk_ring_prod__needs_wakeup(&p->umem_fq)) {
@@ -571,78 +805,136 @@ port_rx_burst(struct port *p, struct burst_rx *b)
 			};
 
 			poll(&pollfd, 1, 0);
+			telemetry_thread->n_wakeups_rx++;
 		}
 	}
 
-	for (i = 0; i < n_pkts; i++)
+	for (i = 0; i < n_descs; i++)
 		*xsk_ring_prod__fill_addr(&p->umem_fq, pos + i) =
 			bcache_cons(p->bc);
 
-	xsk_ring_prod__submit(&p->umem_fq, n_pkts);
+	xsk_ring_prod__submit(&p->umem_fq, n_descs);
 
-	return n_pkts;
+	return b->n_descs;
 }
 
 static inline void
 port_tx_burst(struct port *p, struct burst_tx *b)
 {
-	u32 n_pkts, pos, i;
-	int status;
+	u32 n_descs, pos, i;
+	int status, cq_starved = 0;
+	u64 tsc;
 
 	/* UMEM CQ. */
-	n_pkts = p->params.bp->umem_cfg.comp_size;
+	n_descs = p->params.bp->umem_cfg.comp_size;
 
-	n_pkts = xsk_ring_cons__peek(&p->umem_cq, n_pkts, &pos);
+	n_descs = xsk_ring_cons__peek(&p->umem_cq, n_descs, &pos);
 
-	for (i = 0; i < n_pkts; i++) {
+	for (i = 0; i < n_descs; i++) {
 		u64 addr = *xsk_ring_cons__comp_addr(&p->umem_cq, pos + i);
 
 		bcache_prod(p->bc, addr);
 	}
 
-	xsk_ring_cons__release(&p->umem_cq, n_pkts);
+	xsk_ring_cons__release(&p->umem_cq, n_descs);
 
 	/* TXQ. */
-	n_pkts = b->n_pkts;
+	n_descs = b->n_descs;
 
 	for ( ; ; ) {
-		status = xsk_ring_prod__reserve(&p->txq, n_pkts, &pos);
-		if (status == n_pkts)
+		status = xsk_ring_prod__reserve(&p->txq, n_descs, &pos);
+		if (status == n_descs)
 			break;
 
-		if (xsk_ring_prod__needs_wakeup(&p->txq))
+		cq_starved = 1;
+		if (xsk_ring_prod__needs_wakeup(&p->txq)) {
 			sendto(xsk_socket__fd(p->xsk), NULL, 0, MSG_DONTWAIT,
 			       NULL, 0);
+			telemetry_thread->n_wakeups_tx++;
+		}
 	}
+	telemetry_thread->n_cq_starved += cq_starved;
 
-	for (i = 0; i < n_pkts; i++) {
+	for (i = 0; i < n_descs; i++) {
 		xsk_ring_prod__tx_desc(&p->txq, pos + i)->addr = b->addr[i];
 		xsk_ring_prod__tx_desc(&p->txq, pos + i)->len = b->len[i];
+		xsk_ring_prod__tx_desc(&p->txq, pos + i)->options =
+			b->options[i];
 	}
 
-	xsk_ring_prod__submit(&p->txq, n_pkts);
-	if (xsk_ring_prod__needs_wakeup(&p->txq))
+	xsk_ring_prod__submit(&p->txq, n_descs);
+	if (xsk_ring_prod__needs_wakeup(&p->txq)) {
 		sendto(xsk_socket__fd(p->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
-	p->n_pkts_tx += n_pkts;
+		telemetry_thread->n_wakeups_tx++;
+	}
+
+	/* Latency, once per packet. */
+	tsc = tsc_read();
+
+	for (i = 0; i < n_descs; i++) {
+		u64 cycles = tsc - b->tsc_rx[i];
+		u32 bucket = 64 - __builtin_clzll(cycles | 1);
+
+		if (b->options[i] & XDP_PKT_CONTD)
+			continue;
+
+		p->n_pkts_tx++;
+
+		if (bucket >= LATENCY_HIST_N_BUCKETS)
+			bucket = LATENCY_HIST_N_BUCKETS - 1;
+		p->latency_hist[bucket]++;
+	}
 }
 
 /*
  * Thread
  *
  * Packet forwarding threads.
+ *
+ * The ports are organized into port groups, where the packets received by a
+ * port of the group are only sent on ports of the same group. The TX queue of
+ * a port can therefore only be used by the thread handling its group, which is
+ * the unit that is moved between threads for load balancing. A thread hands a
+ * group over by taking it out of its list on request (group_out), after which
+ * the main thread passes it on to the new thread (group_in). The release and
+ * acquire ordering of the two handovers makes all the state of the group,
+ * including its pending bursts and buffer caches, visible to the new thread.
  */
-#ifndef MAX_PORTS_PER_THREAD
-#define MAX_PORTS_PER_THREAD 16
+#ifndef MAX_PORTS_PER_GROUP
+#define MAX_PORTS_PER_GROUP 16
+#endif
+
+struct port_group {
+	struct port *ports_rx[MAX_PORTS_PER_GROUP];
+	struct port *ports_tx[MAX_PORTS_PER_GROUP];
+	u32 n_ports;
+	struct burst_rx burst_rx[MAX_PORTS_PER_GROUP];
+	struct burst_tx burst_tx[MAX_PORTS_PER_GROUP];
+	int nh_port[L3FWD_MAX_NEXT_HOPS]; /* Index in ports_tx, or -1. */
+
+	/* Load balancing, only used by the main thread. */
+	u32 thread_id;
+	u64 n_pkts_rx_prev;
+	double load;
+};
+
+#ifndef MAX_PORT_GROUPS
+#define MAX_PORT_GROUPS 64
 #endif
 
 struct thread_data {
-	struct port *ports_rx[MAX_PORTS_PER_THREAD];
-	struct port *ports_tx[MAX_PORTS_PER_THREAD];
-	u32 n_ports_rx;
-	struct burst_rx burst_rx;
-	struct burst_tx burst_tx[MAX_PORTS_PER_THREAD];
+	struct port_group *groups[MAX_PORT_GROUPS];
+	u32 n_groups;
+	struct port_group *group_in;
+	struct port_group *group_out;
+	u64 tx_flush_tsc;
+	struct telemetry_thread *telemetry;
 	u32 cpu_core_id;
 	int quit;
+
+	/* Load balancing, only used by the main thread. */
+	u64 busy_tsc_prev;
+	double load;
 };
 
 static void swap_mac_addresses(void *data)
@@ -657,196 +949,1746 @@ static void swap_mac_addresses(void *data)
 	*dst_addr = tmp;
 }
 
-static void *
-thread_func(void *arg)
+/* Packets forwarded between ports using different buffer pools (i.e. ports on
+ * different NUMA nodes) are copied to buffers from the pool of the TX port,
+ * and the RX buffers are recycled to the pool of the RX port. Returns 0 and
+ * the addresses of the copies in addr[], or -1 when the packet is dropped
+ * because the TX port's pool is out of buffers.
+ */
+static inline int
+port_copy_pkt(struct bcache *bc_rx, struct bcache *bc_tx, u64 *addr, u32 *len,
+	      u32 n_frags)
 {
-	struct thread_data *t = arg;
-	cpu_set_t cpu_cores;
 	u32 i;
 
-	CPU_ZERO(&cpu_cores);
-	CPU_SET(t->cpu_core_id, &cpu_cores);
-	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_cores);
-
-	for (i = 0; !t->quit; i = (i + 1) & (t->n_ports_rx - 1)) {
-		struct port *port_rx = t->ports_rx[i];
-		struct port *port_tx = t->ports_tx[i];
-		struct burst_rx *brx = &t->burst_rx;
-		struct burst_tx *btx = &t->burst_tx[i];
-		u32 n_pkts, j;
-
-		/* RX. */
-		n_pkts = port_rx_burst(port_rx, brx);
-		if (!n_pkts)
-			continue;
-
-		/* Process & TX. */
-		for (j = 0; j < n_pkts; j++) {
-			u64 addr = xsk_umem__add_offset_to_addr(brx->addr[j]);
-			u8 *pkt = xsk_umem__get_data(port_rx->params.bp->addr,
-						     addr);
+	if (bcache_cons_check(bc_tx, n_frags) < n_frags) {
+		for (i = 0; i < n_frags; i++)
+			bcache_prod(bc_rx, addr[i]);
+		return -1;
+	}
 
-			swap_mac_addresses(pkt);
+	for (i = 0; i < n_frags; i++) {
+		u64 addr_tx = bcache_cons(bc_tx);
 
-			btx->addr[btx->n_pkts] = brx->addr[j];
-			btx->len[btx->n_pkts] = brx->len[j];
-			btx->n_pkts++;
+		memcpy(xsk_umem__get_data(bc_tx->bp->addr, addr_tx),
+		       xsk_umem__get_data(bc_rx->bp->addr,
+				xsk_umem__add_offset_to_addr(addr[i])),
+		       len[i]);
+		bcache_prod(bc_rx, addr[i]);
 
-			if (btx->n_pkts == MAX_BURST_TX) {
-				port_tx_burst(port_tx, btx);
-				btx->n_pkts = 0;
-			}
-		}
+		addr[i] = addr_tx;
 	}
 
-	return NULL;
+	return 0;
 }
 
 /*
- * Process
+ * L3 forwarding
+ *
+ * With a route file, the packets are routed instead of being sent back out
+ * of the paired port: the destination address is looked up in the route
+ * table, the TTL (hop limit) is decremented, and the Ethernet header is
+ * rewritten for the next hop. The egress port is the thread's own port on
+ * the interface of the route, as the TX queue of each port is only used by
+ * the thread handling its port group. Packets that cannot be routed (non-IP,
+ * no route or neighbor, TTL expired, or no port on the egress interface) are
+ * dropped.
  */
-static const struct bpool_params bpool_params_default = {
-	.n_buffers = 64 * 1024,
-	.buffer_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
-	.mmap_flags = 0,
+static struct l3fwd *l3fwd;
 
-	.n_users_max = 16,
-	.n_buffers_per_slab = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
-};
-
-static const struct xsk_umem_config umem_cfg_default = {
-	.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
-	.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
-	.frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
-	.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
-	.flags = 0,
-};
-
-static const struct port_params port_params_default = {
-	.xsk_cfg = {
-		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
-		.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
-		.libxdp_flags = 0,
-		.xdp_flags = XDP_FLAGS_DRV_MODE,
-		.bind_flags = XDP_USE_NEED_WAKEUP,
-	},
-
-	.bp = NULL,
-	.iface = NULL,
-	.iface_queue = 0,
-};
-
-#ifndef MAX_PORTS
-#define MAX_PORTS 64
-#endif
-
-#ifndef MAX_THREADS
-#define MAX_THREADS 64
+/* The packets are prefetched in two stages, L3FWD_PREFETCH_OFFSET descriptors
+ * apart: the packet headers 2 * L3FWD_PREFETCH_OFFSET descriptors ahead of the
+ * packet being processed, and the IPv4 route table entries, which need the
+ * headers, L3FWD_PREFETCH_OFFSET descriptors ahead, when the headers should
+ * already be in the cache.
+ */
+#ifndef L3FWD_PREFETCH_OFFSET
+#define L3FWD_PREFETCH_OFFSET 4
 #endif
 
-static struct bpool_params bpool_params;
-static struct xsk_umem_config umem_cfg;
-static struct bpool *bp;
-
-static struct port_params port_params[MAX_PORTS];
-static struct port *ports[MAX_PORTS];
-static u64 n_pkts_rx[MAX_PORTS];
-static u64 n_pkts_tx[MAX_PORTS];
-static int n_ports;
-
-static pthread_t threads[MAX_THREADS];
-static struct thread_data thread_data[MAX_THREADS];
-static int n_threads;
-
-static void
-print_usage(char *prog_name)
+/* Returns the index of the egress port in ports_tx, as mapped from the next
+ * hop by nh_port, or -1 when the packet is to be dropped.
+ */
+static inline int
+l3fwd_pkt(const int *nh_port, struct port **ports_tx, u8 *pkt, u32 len)
 {
-	const char *usage =
-		"Usage:\n"
-		"\t%s [ -b SIZE ] -c CORE -i INTERFACE [ -q QUEUE ]\n"
-		"\n"
-		"-c CORE        CPU core to run a packet forwarding thread\n"
-		"               on. May be invoked multiple times.\n"
-		"\n"
-		"-b SIZE        Number of buffers in the buffer pool shared\n"
-		"               by all the forwarding threads. Default: %u.\n"
-		"\n"
-		"-i INTERFACE   Network interface. Each (INTERFACE, QUEUE)\n"
-		"               pair specifies one forwarding port. May be\n"
-		"               invoked multiple times.\n"
-		"\n"
-		"-q QUEUE       Network interface queue for RX and TX. Each\n"
-		"               (INTERFACE, QUEUE) pair specified one\n"
-		"               forwarding port. Default: %u. May be invoked\n"
-		"               multiple times.\n"
-		"\n";
-	printf(usage,
-	       prog_name,
-	       bpool_params_default.n_buffers,
-	       port_params_default.iface_queue);
-}
+	struct ether_header *eth = (struct ether_header *)pkt;
+	const struct l3fwd_next_hop *nh;
+	const u8 *mac;
+	int next_hop, port;
 
-static int
-parse_args(int argc, char **argv)
-{
-	struct option lgopts[] = {
-		{ NULL,  0, 0, 0 }
-	};
-	int opt, option_index;
+	if (len < sizeof(struct ether_header))
+		return -1;
 
-	/* Parse the input arguments. */
-	for ( ; ;) {
-		opt = getopt_long(argc, argv, "c:i:q:", lgopts, &option_index);
-		if (opt == EOF)
-			break;
+	switch (ntohs(eth->ether_type)) {
+	case ETHERTYPE_IP: {
+		struct iphdr *iph = (struct iphdr *)(eth + 1);
+		u32 daddr, check;
 
-		switch (opt) {
-		case 'b':
-			bpool_params.n_buffers = atoi(optarg);
-			break;
+		if (len < sizeof(struct ether_header) + sizeof(struct iphdr) ||
+		    iph->version != 4 || iph->ihl < 5 || iph->ttl <= 1)
+			return -1;
 
-		case 'c':
-			if (n_threads == MAX_THREADS) {
-				printf("Max number of threads (%d) reached.\n",
-				       MAX_THREADS);
-				return -1;
-			}
+		daddr = ntohl(iph->daddr);
+		next_hop = l3fwd_lookup4(l3fwd, daddr);
+		if (next_hop < 0)
+			return -1;
 
-			thread_data[n_threads].cpu_core_id = atoi(optarg);
-			n_threads++;
-			break;
+		nh = &l3fwd->next_hops[next_hop];
+		mac = nh->has_gateway ? nh->gateway_mac :
+					l3fwd_neigh4(l3fwd, daddr);
+		port = nh_port[next_hop];
+		if (!mac || port < 0)
+			return -1;
 
-		case 'i':
-			if (n_ports == MAX_PORTS) {
-				printf("Max number of ports (%d) reached.\n",
-				       MAX_PORTS);
-				return -1;
-			}
+		/* Incremental checksum update for the TTL decrement (RFC
+		 * 1624), as in the kernel's ip_decrease_ttl().
+		 */
+		check = iph->check;
+		check += htons(0x0100);
+		iph->check = check + (check >= 0xFFFF);
+		iph->ttl--;
+		break;
+	}
 
-			port_params[n_ports].iface = optarg;
-			port_params[n_ports].iface_queue = 0;
-			n_ports++;
-			break;
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr *ip6h = (struct ip6_hdr *)(eth + 1);
 
-		case 'q':
-			if (n_ports == 0) {
-				printf("No port specified for queue.\n");
-				return -1;
-			}
-			port_params[n_ports - 1].iface_queue = atoi(optarg);
-			break;
+		if (len < sizeof(struct ether_header) + sizeof(struct ip6_hdr) ||
+		    ip6h->ip6_hlim <= 1)
+			return -1;
 
-		default:
-			printf("Illegal argument.\n");
+		next_hop = l3fwd_lookup6(l3fwd, ip6h->ip6_dst.s6_addr);
+		if (next_hop < 0)
 			return -1;
-		}
-	}
 
-	optind = 1; /* reset getopt lib */
+		nh = &l3fwd->next_hops[next_hop];
+		mac = nh->has_gateway ? nh->gateway_mac :
+					l3fwd_neigh6(l3fwd, ip6h->ip6_dst.s6_addr);
+		port = nh_port[next_hop];
+		if (!mac || port < 0)
+			return -1;
 
-	/* Check the input arguments. */
-	if (!n_ports) {
-		printf("No ports specified.\n");
+		ip6h->ip6_hlim--;
+		break;
+	}
+
+	default:
+		return -1;
+	}
+
+	memcpy(eth->ether_dhost, mac, ETH_ALEN);
+	memcpy(eth->ether_shost, ports_tx[port]->mac, ETH_ALEN);
+
+	return port;
+}
+
+/* Returns the packet starting at descriptor j of the burst, or NULL if there
+ * is none, as only the first descriptor of each packet has headers.
+ */
+static inline u8 *
+l3fwd_burst_pkt(struct port *port_rx, struct burst_rx *brx, u32 n_descs,
+		u32 j)
+{
+	if (j >= n_descs || (j && (brx->options[j - 1] & XDP_PKT_CONTD)))
+		return NULL;
+
+	return xsk_umem__get_data(port_rx->params.bp->addr,
+				  xsk_umem__add_offset_to_addr(brx->addr[j]));
+}
+
+static inline void
+l3fwd_prefetch_hdr(struct port *port_rx, struct burst_rx *brx, u32 n_descs,
+		   u32 j)
+{
+	u8 *pkt = l3fwd_burst_pkt(port_rx, brx, n_descs, j);
+
+	if (pkt)
+		__builtin_prefetch(pkt);
+}
+
+static inline void
+l3fwd_prefetch_route(struct port *port_rx, struct burst_rx *brx, u32 n_descs,
+		     u32 j)
+{
+	u8 *pkt = l3fwd_burst_pkt(port_rx, brx, n_descs, j);
+	struct ether_header *eth = (struct ether_header *)pkt;
+
+	if (pkt &&
+	    brx->len[j] >= sizeof(struct ether_header) + sizeof(struct iphdr) &&
+	    eth->ether_type == htons(ETHERTYPE_IP))
+		l3fwd_prefetch4(l3fwd,
+				ntohl(((struct iphdr *)(eth + 1))->daddr));
+}
+
+/* Advances both prefetch stages past descriptor j. */
+static inline void
+l3fwd_prefetch(struct port *port_rx, struct burst_rx *brx, u32 n_descs, u32 j)
+{
+	l3fwd_prefetch_hdr(port_rx, brx, n_descs,
+			   j + 2 * L3FWD_PREFETCH_OFFSET);
+	l3fwd_prefetch_route(port_rx, brx, n_descs, j + L3FWD_PREFETCH_OFFSET);
+}
+
+static inline void
+port_group_fwd(struct thread_data *t, struct port_group *g, u32 i)
+{
+	struct port *port_rx = g->ports_rx[i];
+	struct burst_rx *brx = &g->burst_rx[i];
+	u32 n_descs, n_frags, n_pkts = 0, j, k;
+
+	/* RX. When there is nothing more to receive, don't hold back the
+	 * packets waiting for a full TX burst.
+	 */
+	n_descs = port_rx_burst(port_rx, brx, port_rx->bc);
+	telemetry_poll(t->telemetry, n_descs);
+	if (!n_descs) {
+		struct burst_tx *btx = &g->burst_tx[i];
+
+		if (btx->n_descs) {
+			port_tx_burst(g->ports_tx[i], btx);
+			btx->n_descs = 0;
+		}
+		return;
+	}
+
+	/* Fill the prefetch pipeline. The route entries of the first packets
+	 * are prefetched right after their headers, so these stall.
+	 */
+	if (l3fwd) {
+		for (j = 0; j < 2 * L3FWD_PREFETCH_OFFSET; j++)
+			l3fwd_prefetch_hdr(port_rx, brx, n_descs, j);
+		for (j = 0; j < L3FWD_PREFETCH_OFFSET; j++)
+			l3fwd_prefetch_route(port_rx, brx, n_descs, j);
+	}
+
+	/* Process & TX, one packet (chain of descriptors) at a time. */
+	for (j = 0; j < n_descs; j += n_frags) {
+		u64 addr = xsk_umem__add_offset_to_addr(brx->addr[j]);
+		u8 *pkt = xsk_umem__get_data(port_rx->params.bp->addr, addr);
+		struct port *port_tx;
+		struct burst_tx *btx;
+		int port;
+
+		for (n_frags = 1;
+		     brx->options[j + n_frags - 1] & XDP_PKT_CONTD;
+		     n_frags++)
+			;
+		n_pkts++;
+
+		if (l3fwd) {
+			for (k = 0; k < n_frags; k++)
+				l3fwd_prefetch(port_rx, brx, n_descs, j + k);
+
+			port = l3fwd_pkt(g->nh_port, g->ports_tx, pkt,
+					 brx->len[j]);
+			if (port < 0) {
+				for (k = 0; k < n_frags; k++)
+					bcache_prod(port_rx->bc,
+						    brx->addr[j + k]);
+				__atomic_fetch_add(&port_rx->n_pkts_drop, 1,
+						   __ATOMIC_RELAXED);
+				continue;
+			}
+		} else {
+			swap_mac_addresses(pkt);
+			port = i;
+		}
+
+		port_tx = g->ports_tx[port];
+		btx = &g->burst_tx[port];
+
+		if (port_tx->params.bp != port_rx->params.bp &&
+		    port_copy_pkt(port_rx->bc, port_tx->bc, &brx->addr[j],
+				  &brx->len[j], n_frags)) {
+			__atomic_fetch_add(&port_rx->n_pkts_drop, 1,
+					   __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* Don't split the chain between TX bursts. */
+		if (btx->n_descs + n_frags > MAX_BURST_TX) {
+			port_tx_burst(port_tx, btx);
+			btx->n_descs = 0;
+		}
+
+		for (k = 0; k < n_frags; k++) {
+			btx->addr[btx->n_descs] = brx->addr[j + k];
+			btx->len[btx->n_descs] = brx->len[j + k];
+			btx->options[btx->n_descs] = brx->options[j + k];
+			btx->tsc_rx[btx->n_descs] = brx->tsc;
+			btx->n_descs++;
+		}
+
+		if (btx->n_descs == MAX_BURST_TX) {
+			port_tx_burst(port_tx, btx);
+			btx->n_descs = 0;
+		}
+	}
+
+	/* TX flush: the oldest packet in a burst has used up the latency
+	 * budget.
+	 */
+	for (k = 0; k < g->n_ports; k++) {
+		struct burst_tx *btx = &g->burst_tx[k];
+
+		if (btx->n_descs &&
+		    brx->tsc - btx->tsc_rx[0] >= t->tx_flush_tsc) {
+			port_tx_burst(g->ports_tx[k], btx);
+			btx->n_descs = 0;
+		}
+	}
+
+	t->telemetry->n_pkts += n_pkts;
+	t->telemetry->busy_cycles += tsc_read() - brx->tsc;
+}
+
+/* Port group handover requests from the main thread. */
+static inline void
+thread_groups_update(struct thread_data *t)
+{
+	struct port_group *g;
+	u32 i, j;
+
+	g = __atomic_load_n(&t->group_out, __ATOMIC_ACQUIRE);
+	if (g) {
+		/* Don't leave the packets of the group waiting for its next
+		 * thread. Incomplete RX packets simply move along with it.
+		 */
+		for (i = 0; i < g->n_ports; i++)
+			if (g->burst_tx[i].n_descs) {
+				port_tx_burst(g->ports_tx[i], &g->burst_tx[i]);
+				g->burst_tx[i].n_descs = 0;
+			}
+
+		for (i = 0; i < t->n_groups; i++)
+			if (t->groups[i] == g)
+				break;
+
+		for (j = i; j + 1 < t->n_groups; j++)
+			t->groups[j] = t->groups[j + 1];
+		if (i < t->n_groups)
+			t->n_groups--;
+
+		__atomic_store_n(&t->group_out, NULL, __ATOMIC_RELEASE);
+	}
+
+	g = __atomic_load_n(&t->group_in, __ATOMIC_ACQUIRE);
+	if (g) {
+		t->groups[t->n_groups++] = g;
+		__atomic_store_n(&t->group_in, NULL, __ATOMIC_RELEASE);
+	}
+}
+
+static void *
+thread_func(void *arg)
+{
+	struct thread_data *t = arg;
+	cpu_set_t cpu_cores;
+	u32 i, j;
+
+	CPU_ZERO(&cpu_cores);
+	CPU_SET(t->cpu_core_id, &cpu_cores);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_cores);
+	telemetry_thread = t->telemetry;
+
+	while (!t->quit) {
+		thread_groups_update(t);
+
+		for (i = 0; i < t->n_groups; i++) {
+			struct port_group *g = t->groups[i];
+
+			for (j = 0; j < g->n_ports; j++)
+				port_group_fwd(t, g, j);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Buffer pool benchmark
+ *
+ * Measures how the buffer pool scales with the number of threads, without any
+ * ports: each thread repeatedly allocates a burst of buffers from its cache and
+ * frees them back, which is the same buffer cache traffic as forwarding one
+ * burst of packets (minus the packet I/O). Each run uses a fresh buffer pool.
+ */
+#ifndef BPOOL_BENCH_DURATION_S
+#define BPOOL_BENCH_DURATION_S 2
+#endif
+
+struct bpool_bench_data {
+	struct bcache *bc;
+	u32 cpu_core_id;
+	u64 n_buffers;
+	volatile int quit;
+	struct telemetry_thread telemetry;
+};
+
+static void *
+bpool_bench_thread_func(void *arg)
+{
+	struct bpool_bench_data *b = arg;
+	struct bcache *bc = b->bc;
+	u64 buffers[MAX_BURST_RX];
+	cpu_set_t cpu_cores;
+	u32 n_buffers, i;
+
+	CPU_ZERO(&cpu_cores);
+	CPU_SET(b->cpu_core_id, &cpu_cores);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_cores);
+	telemetry_thread = &b->telemetry;
+
+	while (!b->quit) {
+		n_buffers = bcache_cons_check(bc, MAX_BURST_RX);
+
+		for (i = 0; i < n_buffers; i++)
+			buffers[i] = bcache_cons(bc);
+
+		for (i = 0; i < n_buffers; i++)
+			bcache_prod(bc, buffers[i]);
+
+		b->n_buffers += n_buffers;
+	}
+
+	return NULL;
+}
+
+static int
+bpool_bench_run(struct bpool_params *params, struct xsk_umem_config *umem_cfg,
+		const u32 *cpu_core_ids, u32 n_bench_threads, double *mpps)
+{
+	struct bpool_bench_data bench_data[n_bench_threads];
+	pthread_t bench_threads[n_bench_threads];
+	struct timespec ts0, ts1;
+	u64 n_buffers = 0, ns;
+	struct bpool *bpool;
+	u32 n_started, i;
+	int status = 0;
+
+	bpool = bpool_init(params, umem_cfg);
+	if (!bpool)
+		return -1;
+
+	memset(bench_data, 0, sizeof(bench_data));
+	for (i = 0; i < n_bench_threads; i++) {
+		bench_data[i].bc = bcache_init(bpool);
+		bench_data[i].cpu_core_id = cpu_core_ids[i];
+		if (!bench_data[i].bc) {
+			status = -1;
+			goto free;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	for (n_started = 0; n_started < n_bench_threads; n_started++) {
+		if (pthread_create(&bench_threads[n_started], NULL,
+				   bpool_bench_thread_func,
+				   &bench_data[n_started])) {
+			status = -1;
+			break;
+		}
+	}
+
+	if (!status)
+		sleep(BPOOL_BENCH_DURATION_S);
+
+	for (i = 0; i < n_started; i++)
+		bench_data[i].quit = 1;
+
+	for (i = 0; i < n_started; i++) {
+		pthread_join(bench_threads[i], NULL);
+		n_buffers += bench_data[i].n_buffers;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+	ns = (ts1.tv_sec - ts0.tv_sec) * 1000000000UL +
+		ts1.tv_nsec - ts0.tv_nsec;
+	*mpps = n_buffers * 1000. / ns;
+
+free:
+	for (i = 0; i < n_bench_threads; i++)
+		bcache_free(bench_data[i].bc);
+	bpool_free(bpool);
+	return status;
+}
+
+/*
+ * Runs the benchmark with 1, 2, 4, ... threads, up to one thread per CPU core
+ * given on the command line.
+ */
+static int
+bpool_bench(struct bpool_params *params, struct xsk_umem_config *umem_cfg,
+	    const u32 *cpu_core_ids, u32 n_cores)
+{
+	struct bpool_params bench_params;
+	u32 n_bench_threads = 1;
+	double mpps;
+
+	memcpy(&bench_params, params, sizeof(bench_params));
+	if (bench_params.n_users_max < n_cores)
+		bench_params.n_users_max = n_cores;
+
+	printf("Buffer pool benchmark: %u buffers, %u buffers per slab, "
+	       "bursts of %u buffers\n",
+	       bench_params.n_buffers,
+	       bench_params.n_buffers_per_slab,
+	       MAX_BURST_RX);
+	printf("| %7s | %10s | %17s |\n",
+	       "Threads", "Mpps", "Mpps per thread");
+
+	for ( ; ; ) {
+		if (bpool_bench_run(&bench_params, umem_cfg, cpu_core_ids,
+				    n_bench_threads, &mpps)) {
+			printf("Benchmark with %u threads failed.\n",
+			       n_bench_threads);
+			return -1;
+		}
+
+		printf("| %7u | %10.2f | %17.2f |\n",
+		       n_bench_threads, mpps, mpps / n_bench_threads);
+
+		if (n_bench_threads == n_cores)
+			break;
+
+		n_bench_threads *= 2;
+		if (n_bench_threads > n_cores)
+			n_bench_threads = n_cores;
+	}
+
+	return 0;
+}
+
+/*
+ * Process
+ */
+static const struct bpool_params bpool_params_default = {
+	.n_buffers = 64 * 1024,
+	.buffer_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+	.mmap_flags = 0,
+	.numa_node = -1,
+
+	.n_users_max = 16,
+	.n_buffers_per_slab = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
+};
+
+static const struct xsk_umem_config umem_cfg_default = {
+	.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
+	.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+	.frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+	.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+	.flags = 0,
+};
+
+static const struct port_params port_params_default = {
+	.xsk_cfg = {
+		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.libxdp_flags = 0,
+		.xdp_flags = XDP_FLAGS_DRV_MODE,
+		.bind_flags = XDP_USE_NEED_WAKEUP,
+	},
+
+	.bp = NULL,
+	.iface = NULL,
+	.iface_queue = 0,
+	.numa_node = 0,
+};
+
+#ifndef MAX_PORTS
+#define MAX_PORTS 64
+#endif
+
+#ifndef MAX_THREADS
+#define MAX_THREADS 64
+#endif
+
+#if MAX_THREADS > TELEMETRY_MAX_THREADS
+#error "MAX_THREADS exceeds TELEMETRY_MAX_THREADS"
+#endif
+
+#ifndef MAX_NUMA_NODES
+#define MAX_NUMA_NODES 8
+#endif
+
+/* Upper bound for -f, which keeps the budget in TSC cycles from overflowing. */
+#ifndef TX_FLUSH_US_MAX
+#define TX_FLUSH_US_MAX 1000000
+#endif
+
+static struct bpool_params bpool_params;
+static struct xsk_umem_config umem_cfg;
+static struct bpool *bpools[MAX_NUMA_NODES];
+
+static struct port_params port_params[MAX_PORTS];
+static struct port *ports[MAX_PORTS];
+static u64 n_pkts_rx[MAX_PORTS];
+static u64 n_pkts_tx[MAX_PORTS];
+static u64 latency_hist[MAX_PORTS][LATENCY_HIST_N_BUCKETS];
+static int n_ports;
+
+static pthread_t threads[MAX_THREADS];
+static struct thread_data thread_data[MAX_THREADS];
+static int n_threads;
+
+static struct port_group port_groups[MAX_PORT_GROUPS];
+static int n_port_groups;
+static int n_ports_per_group;
+
+static int bench;
+static int auto_cores;
+static u32 tx_flush_us = 100;
+static const char *route_file;
+static int multi_buffer;
+static const char *telemetry_name;
+static struct telemetry *telemetry;
+
+/*
+ * Pipeline
+ *
+ * Alternative to the run-to-completion threads, where the packets pass
+ * through three stages of threads instead: the RX threads receive the packets
+ * from their ports and spread them over the worker threads by flow, the
+ * workers process them (MAC swap or L3 forwarding), and the TX threads send
+ * them out of their ports. The stages are connected by rings of packet
+ * descriptors (UMEM addresses, the packets themselves are not copied): a
+ * single-producer ring from each RX thread to each worker, and a
+ * multi-producer ring from all the workers to each TX thread.
+ *
+ * Each port is received from by one RX thread and sent on by one TX thread,
+ * which use the consumer and the producer side of its buffer cache
+ * respectively. The workers have buffer caches of their own, for the packets
+ * they drop or copy between buffer pools.
+ */
+#ifndef PIPE_RING_SIZE
+#define PIPE_RING_SIZE 4096
+#endif
+
+#ifndef MAX_PIPE_THREADS_PER_STAGE
+#define MAX_PIPE_THREADS_PER_STAGE 16
+#endif
+
+#ifndef MAX_PORTS_PER_PIPE_THREAD
+#define MAX_PORTS_PER_PIPE_THREAD 16
+#endif
+
+enum pipe_stage {
+	PIPE_STAGE_RX,
+	PIPE_STAGE_WORKER,
+	PIPE_STAGE_TX,
+	PIPE_N_STAGES,
+};
+
+static const char * const pipe_stage_names[PIPE_N_STAGES] = {
+	"RX", "Worker", "TX",
+};
+
+struct pipe_desc {
+	u64 addr;
+	u64 tsc; /* RX burst time. */
+	u32 len;
+	u16 options;
+	u16 port; /* RX port to the workers, TX port to the TX threads. */
+};
+
+/* A packet is always enqueued with all its descriptors at once, so a chain is
+ * only incomplete at the end of a dequeue that was cut short by its size.
+ */
+struct pipe_ring {
+	u32 prod_head __attribute__((aligned(64)));
+	u32 prod_tail;
+
+	u32 cons __attribute__((aligned(64)));
+	u64 n_dequeues;
+	u64 occupancy_sum; /* Descriptors in the ring, summed over dequeues. */
+	u32 occupancy_max;
+
+	char name[32];
+	u64 n_dequeues_prev;
+	u64 occupancy_sum_prev;
+	u64 n_stalls_prev;
+
+	struct pipe_desc descs[PIPE_RING_SIZE] __attribute__((aligned(64)));
+};
+
+static inline int
+pipe_ring_enqueue(struct pipe_ring *r, const struct pipe_desc *descs, u32 n,
+		  int multi_producer)
+{
+	u32 head, cons, i;
+
+	head = __atomic_load_n(&r->prod_head, __ATOMIC_RELAXED);
+	for ( ; ; ) {
+		cons = __atomic_load_n(&r->cons, __ATOMIC_ACQUIRE);
+		if (PIPE_RING_SIZE - (head - cons) < n)
+			return -1;
+
+		if (!multi_producer) {
+			r->prod_head = head + n;
+			break;
+		}
+
+		if (__atomic_compare_exchange_n(&r->prod_head, &head, head + n,
+						1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	for (i = 0; i < n; i++)
+		r->descs[(head + i) & (PIPE_RING_SIZE - 1)] = descs[i];
+
+	/* The producers publish their descriptors in order of reservation. */
+	if (multi_producer)
+		while (__atomic_load_n(&r->prod_tail, __ATOMIC_RELAXED) != head)
+			;
+
+	__atomic_store_n(&r->prod_tail, head + n, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline u32
+pipe_ring_dequeue(struct pipe_ring *r, struct pipe_desc *descs, u32 n_max)
+{
+	u32 cons = r->cons, n, i;
+
+	n = __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) - cons;
+
+	r->n_dequeues++;
+	r->occupancy_sum += n;
+	if (n > r->occupancy_max)
+		r->occupancy_max = n;
+
+	if (n > n_max)
+		n = n_max;
+
+	for (i = 0; i < n; i++)
+		descs[i] = r->descs[(cons + i) & (PIPE_RING_SIZE - 1)];
+
+	while (n && (descs[n - 1].options & XDP_PKT_CONTD))
+		n--;
+
+	__atomic_store_n(&r->cons, cons + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+struct pipe_thread {
+	enum pipe_stage stage;
+	u32 id; /* Within the stage. */
+	u32 cpu_core_id;
+	int quit;
+	struct telemetry_thread *telemetry;
+
+	/* RX and TX threads. */
+	struct port *ports[MAX_PORTS_PER_PIPE_THREAD];
+	u16 port_ids[MAX_PORTS_PER_PIPE_THREAD];
+	u32 n_ports;
+	struct burst_rx burst_rx[MAX_PORTS_PER_PIPE_THREAD];
+	struct burst_tx burst_tx[MAX_PORTS_PER_PIPE_THREAD];
+	u64 tx_flush_tsc;
+
+	/* Rings from the previous stage, and to the next stage. */
+	struct pipe_ring *rings_in[MAX_PIPE_THREADS_PER_STAGE];
+	u32 n_rings_in;
+	struct pipe_ring *rings_out[MAX_PIPE_THREADS_PER_STAGE];
+	u32 n_rings_out;
+	struct pipe_desc stage_out[MAX_PIPE_THREADS_PER_STAGE][MAX_BURST_RX];
+	u32 n_stage_out[MAX_PIPE_THREADS_PER_STAGE];
+	u64 n_stalls[MAX_PIPE_THREADS_PER_STAGE]; /* Flushes to a full ring. */
+
+	/* RX threads and workers: buffer cache for each pool. */
+	struct bcache *bc[MAX_NUMA_NODES];
+
+	/* Workers. */
+	int nh_port[L3FWD_MAX_NEXT_HOPS]; /* Index in ports, or -1. */
+} __attribute__((aligned(64)));
+
+static int pipeline;
+static u32 n_pipe_threads[PIPE_N_STAGES];
+static struct pipe_thread *pipe_threads[MAX_THREADS];
+static struct pipe_ring *pipe_rings[MAX_PIPE_THREADS_PER_STAGE *
+				    (MAX_PIPE_THREADS_PER_STAGE + 1)];
+static u32 n_pipe_rings;
+
+/* Index of the TX thread of each port, and of the port within it. */
+static u16 pipe_port_tx_thread[MAX_PORTS];
+static u16 pipe_port_tx_index[MAX_PORTS];
+
+/* The paired TX port of each port for MAC swap forwarding. */
+static u16 pipe_port_tx[MAX_PORTS];
+
+static inline u32
+pkt_flow_hash(const u8 *pkt, u32 len)
+{
+	const struct ether_header *eth = (const struct ether_header *)pkt;
+	u32 addrs[8], h = 0, i;
+
+	if (len >= sizeof(*eth) + sizeof(struct iphdr) &&
+	    eth->ether_type == htons(ETHERTYPE_IP)) {
+		const struct iphdr *iph = (const struct iphdr *)(eth + 1);
+
+		h = iph->saddr ^ iph->daddr;
+	} else if (len >= sizeof(*eth) + sizeof(struct ip6_hdr) &&
+		   eth->ether_type == htons(ETHERTYPE_IPV6)) {
+		const struct ip6_hdr *ip6h = (const struct ip6_hdr *)(eth + 1);
+
+		memcpy(addrs, &ip6h->ip6_src, sizeof(addrs));
+		for (i = 0; i < 8; i++)
+			h ^= addrs[i];
+	}
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Enqueues the staged descriptors for each next stage thread, waiting for
+ * room in its ring. Returns -1 if the thread is asked to quit meanwhile.
+ */
+static inline int
+pipe_stage_flush(struct pipe_thread *t, int multi_producer)
+{
+	u32 i;
+
+	for (i = 0; i < t->n_rings_out; i++) {
+		struct pipe_ring *r = t->rings_out[i];
+		struct pipe_desc *descs = t->stage_out[i];
+		u32 n = t->n_stage_out[i];
+
+		if (!n)
+			continue;
+
+		if (pipe_ring_enqueue(r, descs, n, multi_producer)) {
+			t->n_stalls[i]++;
+
+			while (pipe_ring_enqueue(r, descs, n, multi_producer))
+				if (t->quit)
+					return -1;
+		}
+
+		t->n_stage_out[i] = 0;
+	}
+
+	return 0;
+}
+
+static void
+pipe_rx(struct pipe_thread *t)
+{
+	u32 i = 0;
+
+	while (!t->quit) {
+		struct port *port = t->ports[i];
+		struct burst_rx *brx = &t->burst_rx[i];
+		u32 n_descs, n_frags, n_pkts = 0, j, k;
+
+		n_descs = port_rx_burst(port, brx,
+					t->bc[port->params.numa_node]);
+		telemetry_poll(t->telemetry, n_descs);
+
+		for (j = 0; j < n_descs; j += n_frags) {
+			u8 *pkt = xsk_umem__get_data(port->params.bp->addr,
+				xsk_umem__add_offset_to_addr(brx->addr[j]));
+			u32 w, n;
+
+			w = ((u64)pkt_flow_hash(pkt, brx->len[j]) *
+			     t->n_rings_out) >> 32;
+			n = t->n_stage_out[w];
+
+			for (n_frags = 1;
+			     brx->options[j + n_frags - 1] & XDP_PKT_CONTD;
+			     n_frags++)
+				;
+			n_pkts++;
+
+			for (k = 0; k < n_frags; k++) {
+				struct pipe_desc *d = &t->stage_out[w][n + k];
+
+				d->addr = brx->addr[j + k];
+				d->len = brx->len[j + k];
+				d->options = brx->options[j + k];
+				d->tsc = brx->tsc;
+				d->port = t->port_ids[i];
+			}
+			t->n_stage_out[w] = n + n_frags;
+		}
+
+		if (n_descs) {
+			if (pipe_stage_flush(t, 0))
+				return;
+
+			t->telemetry->n_pkts += n_pkts;
+			t->telemetry->busy_cycles += tsc_read() - brx->tsc;
+		}
+
+		if (++i == t->n_ports)
+			i = 0;
+	}
+}
+
+static void
+pipe_worker(struct pipe_thread *t)
+{
+	struct pipe_desc descs[MAX_BURST_RX];
+	u32 i = 0;
+
+	while (!t->quit) {
+		u32 n_descs, n_frags, n_pkts = 0, j, k;
+		u64 tsc = 0;
+
+		n_descs = pipe_ring_dequeue(t->rings_in[i], descs,
+					    MAX_BURST_RX);
+		telemetry_poll(t->telemetry, n_descs);
+		if (n_descs)
+			tsc = tsc_read();
+
+		for (j = 0; j < n_descs; j++)
+			if (!j || !(descs[j - 1].options & XDP_PKT_CONTD))
+				__builtin_prefetch(xsk_umem__get_data(
+					ports[descs[j].port]->params.bp->addr,
+					xsk_umem__add_offset_to_addr(
+						descs[j].addr)));
+
+		for (j = 0; j < n_descs; j += n_frags) {
+			struct port *port_rx = ports[descs[j].port];
+			struct bcache *bc_rx =
+				t->bc[port_rx->params.numa_node];
+			u8 *pkt = xsk_umem__get_data(port_rx->params.bp->addr,
+				xsk_umem__add_offset_to_addr(descs[j].addr));
+			struct port *port_tx;
+			u32 tx, n;
+			int port;
+
+			for (n_frags = 1;
+			     descs[j + n_frags - 1].options & XDP_PKT_CONTD;
+			     n_frags++)
+				;
+			n_pkts++;
+
+			if (l3fwd) {
+				port = l3fwd_pkt(t->nh_port, ports, pkt,
+						 descs[j].len);
+			} else {
+				swap_mac_addresses(pkt);
+				port = pipe_port_tx[descs[j].port];
+			}
+
+			if (port < 0) {
+				for (k = 0; k < n_frags; k++)
+					bcache_prod(bc_rx, descs[j + k].addr);
+				__atomic_fetch_add(&port_rx->n_pkts_drop, 1,
+						   __ATOMIC_RELAXED);
+				continue;
+			}
+
+			port_tx = ports[port];
+			if (port_tx->params.bp != port_rx->params.bp) {
+				u64 addr[n_frags];
+				u32 len[n_frags];
+
+				for (k = 0; k < n_frags; k++) {
+					addr[k] = descs[j + k].addr;
+					len[k] = descs[j + k].len;
+				}
+
+				if (port_copy_pkt(bc_rx,
+					t->bc[port_tx->params.numa_node],
+					addr, len, n_frags)) {
+					__atomic_fetch_add(
+						&port_rx->n_pkts_drop, 1,
+						__ATOMIC_RELAXED);
+					continue;
+				}
+
+				for (k = 0; k < n_frags; k++)
+					descs[j + k].addr = addr[k];
+			}
+
+			tx = pipe_port_tx_thread[port];
+			n = t->n_stage_out[tx];
+			for (k = 0; k < n_frags; k++) {
+				t->stage_out[tx][n + k] = descs[j + k];
+				t->stage_out[tx][n + k].port = port;
+			}
+			t->n_stage_out[tx] = n + n_frags;
+		}
+
+		if (n_descs) {
+			if (pipe_stage_flush(t, 1))
+				return;
+
+			t->telemetry->n_pkts += n_pkts;
+			t->telemetry->busy_cycles += tsc_read() - tsc;
+		}
+
+		if (++i == t->n_rings_in)
+			i = 0;
+	}
+}
+
+static void
+pipe_tx(struct pipe_thread *t)
+{
+	struct pipe_desc descs[MAX_BURST_TX];
+	struct pipe_ring *r = t->rings_in[0];
+
+	while (!t->quit) {
+		u32 n_descs, n_frags, n_pkts = 0, i, j, k;
+		u64 tsc, tsc0;
+
+		n_descs = pipe_ring_dequeue(r, descs, MAX_BURST_TX);
+		telemetry_poll(t->telemetry, n_descs);
+
+		/* When there is nothing more to send, don't hold back the
+		 * packets waiting for a full TX burst.
+		 */
+		if (!n_descs) {
+			for (i = 0; i < t->n_ports; i++)
+				if (t->burst_tx[i].n_descs) {
+					port_tx_burst(t->ports[i],
+						      &t->burst_tx[i]);
+					t->burst_tx[i].n_descs = 0;
+				}
+			continue;
+		}
+		tsc0 = tsc_read();
+
+		for (j = 0; j < n_descs; j += n_frags) {
+			i = pipe_port_tx_index[descs[j].port];
+
+			for (n_frags = 1;
+			     descs[j + n_frags - 1].options & XDP_PKT_CONTD;
+			     n_frags++)
+				;
+			n_pkts++;
+
+			/* Don't split the chain between TX bursts. */
+			if (t->burst_tx[i].n_descs + n_frags > MAX_BURST_TX) {
+				port_tx_burst(t->ports[i], &t->burst_tx[i]);
+				t->burst_tx[i].n_descs = 0;
+			}
+
+			for (k = 0; k < n_frags; k++) {
+				struct burst_tx *btx = &t->burst_tx[i];
+
+				btx->addr[btx->n_descs] = descs[j + k].addr;
+				btx->len[btx->n_descs] = descs[j + k].len;
+				btx->options[btx->n_descs] =
+					descs[j + k].options;
+				btx->tsc_rx[btx->n_descs] = descs[j + k].tsc;
+				btx->n_descs++;
+			}
+
+			if (t->burst_tx[i].n_descs == MAX_BURST_TX) {
+				port_tx_burst(t->ports[i], &t->burst_tx[i]);
+				t->burst_tx[i].n_descs = 0;
+			}
+		}
+
+		/* TX flush: the oldest packet in a burst has used up the
+		 * latency budget.
+		 */
+		tsc = tsc_read();
+		for (i = 0; i < t->n_ports; i++) {
+			struct burst_tx *btx = &t->burst_tx[i];
+
+			if (btx->n_descs &&
+			    tsc - btx->tsc_rx[0] >= t->tx_flush_tsc) {
+				port_tx_burst(t->ports[i], btx);
+				btx->n_descs = 0;
+			}
+		}
+
+		t->telemetry->n_pkts += n_pkts;
+		t->telemetry->busy_cycles += tsc_read() - tsc0;
+	}
+}
+
+static void *
+pipe_thread_func(void *arg)
+{
+	struct pipe_thread *t = arg;
+	cpu_set_t cpu_cores;
+
+	CPU_ZERO(&cpu_cores);
+	CPU_SET(t->cpu_core_id, &cpu_cores);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_cores);
+	telemetry_thread = t->telemetry;
+
+	switch (t->stage) {
+	case PIPE_STAGE_RX:
+		pipe_rx(t);
+		break;
+
+	case PIPE_STAGE_WORKER:
+		pipe_worker(t);
+		break;
+
+	default:
+		pipe_tx(t);
+		break;
+	}
+
+	return NULL;
+}
+
+static struct pipe_ring *
+pipe_ring_create(void)
+{
+	struct pipe_ring *r;
+
+	r = aligned_alloc(64, sizeof(struct pipe_ring));
+	if (!r)
+		return NULL;
+
+	memset(r, 0, sizeof(struct pipe_ring));
+	pipe_rings[n_pipe_rings++] = r;
+	return r;
+}
+
+/* NUMA node for the thread with -n: that of its first port, or of the first
+ * port overall for the workers.
+ */
+static int
+pipe_thread_numa_node(u32 thread_id)
+{
+	u32 n_rx = n_pipe_threads[PIPE_STAGE_RX];
+	u32 n_workers = n_pipe_threads[PIPE_STAGE_WORKER];
+
+	if (thread_id < n_rx)
+		return ports[thread_id]->params.numa_node;
+
+	if (thread_id < n_rx + n_workers)
+		return ports[0]->params.numa_node;
+
+	return ports[thread_id - n_rx - n_workers]->params.numa_node;
+}
+
+/* Creates the pipeline threads (in the order of the CPU cores: RX, worker, TX)
+ * and the rings between them, and distributes the ports to the RX and TX
+ * threads round-robin.
+ */
+static int
+pipe_init(void)
+{
+	u32 n_rx = n_pipe_threads[PIPE_STAGE_RX];
+	u32 n_workers = n_pipe_threads[PIPE_STAGE_WORKER];
+	u32 n_tx = n_pipe_threads[PIPE_STAGE_TX];
+	u32 i, j, k;
+	int numa_node;
+
+	for (i = 0; i < n_threads; i++) {
+		struct pipe_thread *t;
+
+		t = aligned_alloc(64, sizeof(struct pipe_thread));
+		if (!t)
+			return -1;
+
+		memset(t, 0, sizeof(struct pipe_thread));
+		t->cpu_core_id = thread_data[i].cpu_core_id;
+		if (i < n_rx) {
+			t->stage = PIPE_STAGE_RX;
+			t->id = i;
+		} else if (i < n_rx + n_workers) {
+			t->stage = PIPE_STAGE_WORKER;
+			t->id = i - n_rx;
+		} else {
+			t->stage = PIPE_STAGE_TX;
+			t->id = i - n_rx - n_workers;
+		}
+		pipe_threads[i] = t;
+	}
+
+	/* Ports. */
+	for (i = 0; i < n_ports; i++) {
+		struct pipe_thread *t_rx = pipe_threads[i % n_rx];
+		struct pipe_thread *t_tx = pipe_threads[n_rx + n_workers +
+							i % n_tx];
+
+		if (t_rx->n_ports == MAX_PORTS_PER_PIPE_THREAD ||
+		    t_tx->n_ports == MAX_PORTS_PER_PIPE_THREAD) {
+			printf("Max number of ports per pipeline thread (%d) "
+			       "exceeded.\n", MAX_PORTS_PER_PIPE_THREAD);
+			return -1;
+		}
+
+		t_rx->ports[t_rx->n_ports] = ports[i];
+		t_rx->port_ids[t_rx->n_ports++] = i;
+
+		numa_node = ports[i]->params.numa_node;
+		if (!t_rx->bc[numa_node]) {
+			t_rx->bc[numa_node] = bcache_init(ports[i]->params.bp);
+			if (!t_rx->bc[numa_node]) {
+				printf("RX %u buffer cache initialization "
+				       "failed.\n", i % n_rx);
+				return -1;
+			}
+		}
+
+		pipe_port_tx_thread[i] = i % n_tx;
+		pipe_port_tx_index[i] = t_tx->n_ports;
+		t_tx->ports[t_tx->n_ports] = ports[i];
+		t_tx->port_ids[t_tx->n_ports++] = i;
+	}
+
+	/* Rings. */
+	for (i = 0; i < n_rx; i++)
+		for (j = 0; j < n_workers; j++) {
+			struct pipe_thread *t_rx = pipe_threads[i];
+			struct pipe_thread *t_w = pipe_threads[n_rx + j];
+			struct pipe_ring *r;
+
+			r = pipe_ring_create();
+			if (!r)
+				return -1;
+
+			snprintf(r->name, sizeof(r->name),
+				 "RX %u -> Worker %u", i, j);
+
+			t_rx->rings_out[t_rx->n_rings_out++] = r;
+			t_w->rings_in[t_w->n_rings_in++] = r;
+		}
+
+	for (i = 0; i < n_tx; i++) {
+		struct pipe_thread *t_tx = pipe_threads[n_rx + n_workers + i];
+		struct pipe_ring *r;
+
+		r = pipe_ring_create();
+		if (!r)
+			return -1;
+
+		snprintf(r->name, sizeof(r->name), "Workers -> TX %u", i);
+
+		t_tx->rings_in[t_tx->n_rings_in++] = r;
+		for (j = 0; j < n_workers; j++) {
+			struct pipe_thread *t_w = pipe_threads[n_rx + j];
+
+			t_w->rings_out[t_w->n_rings_out++] = r;
+		}
+	}
+
+	/* Workers: buffer caches for each pool, and the egress ports of the
+	 * next hops, spread over the ports (queues) of each interface.
+	 */
+	for (i = 0; i < n_workers; i++) {
+		struct pipe_thread *t = pipe_threads[n_rx + i];
+
+		for (j = 0; j < MAX_NUMA_NODES; j++) {
+			if (!bpools[j])
+				continue;
+
+			t->bc[j] = bcache_init(bpools[j]);
+			if (!t->bc[j]) {
+				printf("Worker %u buffer cache initialization "
+				       "failed.\n", i);
+				return -1;
+			}
+		}
+
+		for (j = 0; l3fwd && j < l3fwd->n_next_hops; j++) {
+			u32 ifindex = l3fwd->next_hops[j].ifindex;
+			int candidates[MAX_PORTS], n_candidates = 0;
+
+			for (k = 0; k < n_ports; k++)
+				if (ports[k]->ifindex == ifindex)
+					candidates[n_candidates++] = k;
+
+			t->nh_port[j] = n_candidates ?
+					candidates[i % n_candidates] : -1;
+
+			if (!i && !n_candidates)
+				printf("Warning: no port on the interface of "
+				       "next hop %u, the packets routed to it "
+				       "are dropped.\n", j);
+		}
+	}
+
+	return 0;
+}
+
+static void
+pipe_free(void)
+{
+	u32 i, j;
+
+	for (i = 0; i < n_threads; i++) {
+		struct pipe_thread *t = pipe_threads[i];
+
+		if (!t)
+			continue;
+
+		for (j = 0; j < MAX_NUMA_NODES; j++)
+			bcache_free(t->bc[j]);
+		free(t);
+	}
+
+	for (i = 0; i < n_pipe_rings; i++)
+		free(pipe_rings[i]);
+}
+
+/*
+ * Telemetry export
+ *
+ * The telemetry records of the threads live in a POSIX shared memory object
+ * with -t, or in private memory otherwise, as they are also used for the
+ * statistics and the load balancing.
+ */
+static struct telemetry *
+telemetry_create(const char *name)
+{
+	struct telemetry *tm;
+	char path[NAME_MAX];
+	int fd = -1;
+
+	if (name) {
+		snprintf(path, sizeof(path), "/%s", name);
+
+		fd = shm_open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+		if (fd < 0)
+			return NULL;
+
+		if (ftruncate(fd, sizeof(struct telemetry))) {
+			close(fd);
+			shm_unlink(path);
+			return NULL;
+		}
+	}
+
+	tm = mmap(NULL, sizeof(struct telemetry), PROT_READ | PROT_WRITE,
+		  name ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS, fd, 0);
+	if (fd >= 0)
+		close(fd);
+
+	if (tm == MAP_FAILED) {
+		if (name)
+			shm_unlink(path);
+		return NULL;
+	}
+
+	return tm;
+}
+
+/* Fills in the header and the thread names, and publishes the object to the
+ * readers. Called once the threads are set up, before they start.
+ */
+static void
+telemetry_publish(struct telemetry *tm)
+{
+	u32 i;
+
+	tm->version = TELEMETRY_VERSION;
+	tm->tsc_hz = tsc_hz;
+	tm->n_threads = n_threads;
+	tm->poll_hist_n_buckets = TELEMETRY_POLL_HIST_N_BUCKETS;
+
+	for (i = 0; i < n_threads; i++) {
+		struct telemetry_thread *tt = &tm->threads[i];
+
+		if (pipeline)
+			snprintf(tt->name, sizeof(tt->name), "%s %u",
+				 pipe_stage_names[pipe_threads[i]->stage],
+				 pipe_threads[i]->id);
+		else
+			snprintf(tt->name, sizeof(tt->name), "Thread %u", i);
+		tt->cpu_core_id = thread_data[i].cpu_core_id;
+	}
+
+	__atomic_store_n(&tm->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void
+telemetry_free(struct telemetry *tm, const char *name)
+{
+	char path[NAME_MAX];
+
+	if (!tm)
+		return;
+
+	munmap(tm, sizeof(struct telemetry));
+
+	if (name) {
+		snprintf(path, sizeof(path), "/%s", name);
+		shm_unlink(path);
+	}
+}
+
+/*
+ * Interfaces and NUMA topology
+ */
+static int
+read_sysfs_str(const char *path, char *buf, size_t size)
+{
+	FILE *f;
+	int status = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (!fgets(buf, size, f))
+		status = -1;
+
+	fclose(f);
+	return status;
+}
+
+/* Returns the NUMA node the network interface is attached to, or 0 when it is
+ * not known (e.g. for virtual interfaces or systems without NUMA).
+ */
+static int
+iface_numa_node(const char *iface)
+{
+	char path[256], buf[32];
+	int numa_node;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+		 iface);
+	if (read_sysfs_str(path, buf, sizeof(buf)))
+		return 0;
+
+	numa_node = atoi(buf);
+	if (numa_node < 0 || numa_node >= MAX_NUMA_NODES)
+		return 0;
+
+	return numa_node;
+}
+
+/* Reads the MAC address of the network interface into mac. */
+static int
+iface_mac_addr(const char *iface, u8 *mac)
+{
+	struct ether_addr *addr;
+	char path[256], buf[32];
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/address", iface);
+	if (read_sysfs_str(path, buf, sizeof(buf)))
+		return -1;
+
+	addr = ether_aton(buf);
+	if (!addr)
+		return -1;
+
+	memcpy(mac, addr, ETH_ALEN);
+	return 0;
+}
+
+/* Parses a CPU list such as "0-7,16-23". */
+static int
+parse_cpu_list(const char *str, cpu_set_t *cpus)
+{
+	const char *p = str;
+	char *end;
+	long first, last, cpu;
+
+	CPU_ZERO(cpus);
+	while (*p && *p != '\n') {
+		first = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, cpus);
+
+		p = end;
+		if (*p == ',')
+			p++;
+	}
+
+	return 0;
+}
+
+static int
+numa_node_cpus(int numa_node, cpu_set_t *cpus)
+{
+	char path[256], buf[1024];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 numa_node);
+	if (read_sysfs_str(path, buf, sizeof(buf)))
+		return -1;
+
+	return parse_cpu_list(buf, cpus);
+}
+
+/* Returns the NUMA node of the CPU core, or -1 when it is not known. */
+static int
+cpu_numa_node(u32 cpu_core_id)
+{
+	cpu_set_t cpus;
+	int numa_node;
+
+	for (numa_node = 0; numa_node < MAX_NUMA_NODES; numa_node++)
+		if (!numa_node_cpus(numa_node, &cpus) &&
+		    CPU_ISSET(cpu_core_id, &cpus))
+			return numa_node;
+
+	return -1;
+}
+
+/* Picks the first CPU core from the NUMA node that the process is allowed to
+ * run on and that is not used yet, falling back to a core from any node.
+ */
+static int
+select_cpu_core(int numa_node, cpu_set_t *cpus_used)
+{
+	cpu_set_t cpus_allowed, cpus_node;
+	int cpu, pass;
+
+	if (sched_getaffinity(0, sizeof(cpus_allowed), &cpus_allowed))
+		return -1;
+
+	if (numa_node_cpus(numa_node, &cpus_node))
+		CPU_ZERO(&cpus_node);
+
+	for (pass = 0; pass < 2; pass++)
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &cpus_allowed) ||
+			    CPU_ISSET(cpu, cpus_used) ||
+			    (!pass && !CPU_ISSET(cpu, &cpus_node)))
+				continue;
+
+			if (pass)
+				printf("No free CPU core on NUMA node %d, "
+				       "using CPU core %d.\n",
+				       numa_node, cpu);
+
+			CPU_SET(cpu, cpus_used);
+			return cpu;
+		}
+
+	return -1;
+}
+
+static void
+print_usage(char *prog_name)
+{
+	const char *usage =
+		"Usage:\n"
+		"\t%s [ -b SIZE ] { -c CORE | -n THREADS } -i INTERFACE"
+		" [ -q QUEUE ]\n"
+		"\t%s [ -b SIZE ] -c CORE -B\n"
+		"\n"
+		"-c CORE        CPU core to run a packet forwarding thread\n"
+		"               on. May be invoked multiple times.\n"
+		"\n"
+		"-n THREADS     Number of packet forwarding threads, each\n"
+		"               running on a CPU core selected automatically\n"
+		"               from the NUMA node of its ports. Cannot be\n"
+		"               combined with -c.\n"
+		"\n"
+		"-p RX,WORKERS,TX\n"
+		"               Pipeline mode: instead of each thread\n"
+		"               receiving, processing and sending its\n"
+		"               packets, the given numbers of RX, worker and\n"
+		"               TX threads (in this order of the CPU cores)\n"
+		"               pass the packets on through rings.\n"
+		"\n"
+		"-g PORTS       Number of ports per port group. The packets\n"
+		"               are forwarded between the ports of a group,\n"
+		"               and the groups are moved between the threads\n"
+		"               to balance their load. Default: the number of\n"
+		"               ports divided by the number of threads.\n"
+		"\n"
+		"-b SIZE        Number of buffers in the buffer pool of each\n"
+		"               NUMA node, shared by all the forwarding\n"
+		"               threads. Default: %u.\n"
+		"\n"
+		"-f USEC        Latency budget for the packets waiting for a\n"
+		"               full TX burst, after which they are sent\n"
+		"               anyway. Packets are also sent as soon as a\n"
+		"               port has nothing more to receive. Default: %u.\n"
+		"\n"
+		"-m             Enable multi-buffer packets, e.g. for jumbo\n"
+		"               frames larger than a UMEM frame (%u bytes).\n"
+		"               Requires driver support for XDP multi-buffer.\n"
+		"\n"
+		"-r ROUTE_FILE  Route packets with the routes and neighbors\n"
+		"               from the file, instead of sending them back\n"
+		"               out of the paired port. See README.org for\n"
+		"               the file format.\n"
+		"\n"
+		"-t NAME        Export per-thread telemetry (cycles per\n"
+		"               packet, RX batch sizes, wakeup syscalls, ...)\n"
+		"               in the shared memory object /NAME, see\n"
+		"               telemetry.h for its layout.\n"
+		"\n"
+		"-B             Instead of forwarding packets, benchmark the\n"
+		"               buffer pool with 1, 2, 4, ... threads, up to\n"
+		"               one thread per CPU core given with -c.\n"
+		"\n"
+		"-i INTERFACE   Network interface. Each (INTERFACE, QUEUE)\n"
+		"               pair specifies one forwarding port. May be\n"
+		"               invoked multiple times.\n"
+		"\n"
+		"-q QUEUE       Network interface queue for RX and TX. Each\n"
+		"               (INTERFACE, QUEUE) pair specified one\n"
+		"               forwarding port. Default: %u. May be invoked\n"
+		"               multiple times.\n"
+		"\n";
+	printf(usage,
+	       prog_name,
+	       prog_name,
+	       bpool_params_default.n_buffers,
+	       tx_flush_us,
+	       umem_cfg_default.frame_size,
+	       port_params_default.iface_queue);
+}
+
+static int
+parse_args(int argc, char **argv)
+{
+	struct option lgopts[] = {
+		{ NULL,  0, 0, 0 }
+	};
+	int opt, option_index;
+	char *end;
+	long val;
+
+	/* Parse the input arguments. */
+	for ( ; ;) {
+		opt = getopt_long(argc, argv, "b:Bc:f:g:i:mn:p:q:r:t:", lgopts,
+				  &option_index);
+		if (opt == EOF)
+			break;
+
+		switch (opt) {
+		case 'b':
+			bpool_params.n_buffers = atoi(optarg);
+			break;
+
+		case 'B':
+			bench = 1;
+			break;
+
+		case 'c':
+			if (auto_cores) {
+				printf("-c cannot be combined with -n.\n");
+				return -1;
+			}
+
+			if (n_threads == MAX_THREADS) {
+				printf("Max number of threads (%d) reached.\n",
+				       MAX_THREADS);
+				return -1;
+			}
+
+			thread_data[n_threads].cpu_core_id = atoi(optarg);
+			n_threads++;
+			break;
+
+		case 'f':
+			val = strtol(optarg, &end, 10);
+			if (end == optarg || *end || val < 0 ||
+			    val > TX_FLUSH_US_MAX) {
+				printf("TX latency budget must be 0 to %d us.\n",
+				       TX_FLUSH_US_MAX);
+				return -1;
+			}
+			tx_flush_us = val;
+			break;
+
+		case 'g':
+			n_ports_per_group = atoi(optarg);
+			if (n_ports_per_group <= 0 ||
+			    n_ports_per_group > MAX_PORTS_PER_GROUP) {
+				printf("Number of ports per group must be 1 to "
+				       "%d.\n", MAX_PORTS_PER_GROUP);
+				return -1;
+			}
+			break;
+
+		case 'i':
+			if (n_ports == MAX_PORTS) {
+				printf("Max number of ports (%d) reached.\n",
+				       MAX_PORTS);
+				return -1;
+			}
+
+			port_params[n_ports].iface = optarg;
+			port_params[n_ports].iface_queue = 0;
+			n_ports++;
+			break;
+
+		case 'm':
+			multi_buffer = 1;
+			break;
+
+		case 'n':
+			if (n_threads) {
+				printf("-n cannot be combined with -c.\n");
+				return -1;
+			}
+
+			n_threads = atoi(optarg);
+			if (n_threads <= 0 || n_threads > MAX_THREADS) {
+				printf("Number of threads must be 1 to %d.\n",
+				       MAX_THREADS);
+				return -1;
+			}
+			auto_cores = 1;
+			break;
+
+		case 'p':
+			if (sscanf(optarg, "%u,%u,%u",
+				   &n_pipe_threads[PIPE_STAGE_RX],
+				   &n_pipe_threads[PIPE_STAGE_WORKER],
+				   &n_pipe_threads[PIPE_STAGE_TX]) != 3) {
+				printf("Invalid pipeline thread counts.\n");
+				return -1;
+			}
+			pipeline = 1;
+			break;
+
+		case 'q':
+			if (n_ports == 0) {
+				printf("No port specified for queue.\n");
+				return -1;
+			}
+			port_params[n_ports - 1].iface_queue = atoi(optarg);
+			break;
+
+		case 'r':
+			route_file = optarg;
+			break;
+
+		case 't':
+			telemetry_name = optarg;
+			break;
+
+		default:
+			printf("Illegal argument.\n");
+			return -1;
+		}
+	}
+
+	optind = 1; /* reset getopt lib */
+
+	/* Check the input arguments. */
+	if (bench) {
+		if (auto_cores) {
+			printf("-B requires the CPU cores to be given with -c.\n");
+			return -1;
+		}
+
+		if (!n_threads) {
+			printf("No threads specified.\n");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (!n_ports) {
+		printf("No ports specified.\n");
 		return -1;
 	}
 
@@ -855,8 +2697,69 @@ parse_args(int argc, char **argv)
 		return -1;
 	}
 
-	if (n_ports % n_threads) {
-		printf("Ports cannot be evenly distributed to threads.\n");
+	if (pipeline) {
+		u32 n = 0, i;
+
+		for (i = 0; i < PIPE_N_STAGES; i++) {
+			if (!n_pipe_threads[i] ||
+			    n_pipe_threads[i] > MAX_PIPE_THREADS_PER_STAGE) {
+				printf("Number of %s threads must be 1 to %d.\n",
+				       pipe_stage_names[i],
+				       MAX_PIPE_THREADS_PER_STAGE);
+				return -1;
+			}
+			n += n_pipe_threads[i];
+		}
+
+		if (n != n_threads) {
+			printf("Pipeline needs %u threads, %d given.\n",
+			       n, n_threads);
+			return -1;
+		}
+
+		if (n_pipe_threads[PIPE_STAGE_RX] > n_ports ||
+		    n_pipe_threads[PIPE_STAGE_TX] > n_ports) {
+			printf("More RX or TX threads than ports.\n");
+			return -1;
+		}
+
+		/* The port groups only pair the ports for MAC swap
+		 * forwarding, by default all ports are in one group.
+		 */
+		if (!n_ports_per_group) {
+			n_ports_per_group = n_ports;
+			if (n_ports_per_group > MAX_PORTS_PER_GROUP) {
+				printf("Max number of ports per group (%d) "
+				       "exceeded, see -g.\n",
+				       MAX_PORTS_PER_GROUP);
+				return -1;
+			}
+		}
+
+		n_port_groups = (n_ports + n_ports_per_group - 1) /
+				n_ports_per_group;
+		return 0;
+	}
+
+	if (!n_ports_per_group) {
+		if (n_ports % n_threads) {
+			printf("Ports cannot be evenly distributed to "
+			       "threads.\n");
+			return -1;
+		}
+
+		n_ports_per_group = n_ports / n_threads;
+		if (n_ports_per_group > MAX_PORTS_PER_GROUP) {
+			printf("Max number of ports per thread (%d) "
+			       "exceeded.\n", MAX_PORTS_PER_GROUP);
+			return -1;
+		}
+	}
+
+	n_port_groups = (n_ports + n_ports_per_group - 1) / n_ports_per_group;
+	if (n_port_groups < n_threads) {
+		printf("Fewer port groups (%d) than threads.\n",
+		       n_port_groups);
 		return -1;
 	}
 
@@ -868,28 +2771,70 @@ print_port(u32 port_id)
 {
 	struct port *port = ports[port_id];
 
-	printf("Port %u: interface = %s, queue = %u\n",
-	       port_id, port->params.iface, port->params.iface_queue);
+	printf("Port %u: interface = %s, queue = %u, NUMA node = %d\n",
+	       port_id, port->params.iface, port->params.iface_queue,
+	       port->params.numa_node);
 }
 
 static void
-print_thread(u32 thread_id)
+print_port_group(struct port_group *g)
 {
-	struct thread_data *t = &thread_data[thread_id];
 	u32 i;
 
-	printf("Thread %u (CPU core %u): ",
-	       thread_id, t->cpu_core_id);
+	printf("[");
+	for (i = 0; i < g->n_ports; i++) {
+		struct port *port_rx = g->ports_rx[i];
+		struct port *port_tx = g->ports_tx[i];
 
-	for (i = 0; i < t->n_ports_rx; i++) {
-		struct port *port_rx = t->ports_rx[i];
-		struct port *port_tx = t->ports_tx[i];
+		if (l3fwd) {
+			printf("%s(%s, %u)", i ? ", " : "",
+			       port_rx->params.iface,
+			       port_rx->params.iface_queue);
+			continue;
+		}
 
-		printf("(%s, %u) -> (%s, %u), ",
+		printf("%s(%s, %u) -> (%s, %u)%s",
+		       i ? ", " : "",
 		       port_rx->params.iface,
 		       port_rx->params.iface_queue,
 		       port_tx->params.iface,
-		       port_tx->params.iface_queue);
+		       port_tx->params.iface_queue,
+		       port_rx->params.bp != port_tx->params.bp ?
+		       " [copy]" : "");
+	}
+	printf("%s] ", l3fwd ? " routed" : "");
+}
+
+static void
+print_thread(u32 thread_id)
+{
+	struct thread_data *t = &thread_data[thread_id];
+	u32 i;
+
+	printf("Thread %u (CPU core %u, NUMA node %d): ",
+	       thread_id, t->cpu_core_id, cpu_numa_node(t->cpu_core_id));
+
+	for (i = 0; i < t->n_groups; i++)
+		print_port_group(t->groups[i]);
+
+	printf("\n");
+}
+
+static void
+print_pipe_thread(u32 thread_id)
+{
+	struct pipe_thread *t = pipe_threads[thread_id];
+	u32 i;
+
+	printf("Thread %u (CPU core %u, NUMA node %d): %s %u",
+	       thread_id, t->cpu_core_id, cpu_numa_node(t->cpu_core_id),
+	       pipe_stage_names[t->stage], t->id);
+
+	if (t->n_ports) {
+		printf(", ports [");
+		for (i = 0; i < t->n_ports; i++)
+			printf(" %u", t->port_ids[i]);
+		printf(" ]");
 	}
 
 	printf("\n");
@@ -898,24 +2843,26 @@ print_thread(u32 thread_id)
 static void
 print_port_stats_separator(void)
 {
-	printf("+-%4s-+-%12s-+-%13s-+-%12s-+-%13s-+\n",
+	printf("+-%4s-+-%12s-+-%13s-+-%12s-+-%13s-+-%12s-+\n",
 	       "----",
 	       "------------",
 	       "-------------",
 	       "------------",
-	       "-------------");
+	       "-------------",
+	       "------------");
 }
 
 static void
 print_port_stats_header(void)
 {
 	print_port_stats_separator();
-	printf("| %4s | %12s | %13s | %12s | %13s |\n",
+	printf("| %4s | %12s | %13s | %12s | %13s | %12s |\n",
 	       "Port",
 	       "RX packets",
 	       "RX rate (pps)",
 	       "TX packets",
-	       "TX_rate (pps)");
+	       "TX_rate (pps)",
+	       "RX drops");
 	print_port_stats_separator();
 }
 
@@ -935,17 +2882,95 @@ print_port_stats(int port_id, u64 ns_diff)
 	rx_pps = (p->n_pkts_rx - n_pkts_rx[port_id]) * 1000000000. / ns_diff;
 	tx_pps = (p->n_pkts_tx - n_pkts_tx[port_id]) * 1000000000. / ns_diff;
 
-	printf("| %4d | %12llu | %13.0f | %12llu | %13.0f |\n",
+	printf("| %4d | %12llu | %13.0f | %12llu | %13.0f | %12llu |\n",
 	       port_id,
 	       p->n_pkts_rx,
 	       rx_pps,
 	       p->n_pkts_tx,
-	       tx_pps);
+	       tx_pps,
+	       p->n_pkts_drop);
 
 	n_pkts_rx[port_id] = p->n_pkts_rx;
 	n_pkts_tx[port_id] = p->n_pkts_tx;
 }
 
+/* Returns the upper bound (in microseconds) of the latency histogram bucket
+ * that the percentile (0-1) of the packets falls into.
+ */
+static double
+latency_hist_percentile(const u64 *hist, u64 n_pkts, double percentile)
+{
+	u64 n = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_HIST_N_BUCKETS - 1; i++) {
+		n += hist[i];
+		if (n >= n_pkts * percentile)
+			break;
+	}
+
+	return (double)(1ULL << i) * 1000000. / tsc_hz;
+}
+
+static void
+print_port_latency_separator(void)
+{
+	printf("+-%4s-+-%12s-+-%10s-+-%10s-+-%10s-+\n",
+	       "----",
+	       "------------",
+	       "----------",
+	       "----------",
+	       "----------");
+}
+
+/* Prints the percentiles of the forwarding latency of the packets sent on each
+ * port since the previous call.
+ */
+static void
+print_port_latency_all(void)
+{
+	u64 hist[LATENCY_HIST_N_BUCKETS];
+	int i, j;
+
+	print_port_latency_separator();
+	printf("| %4s | %12s | %10s | %10s | %10s |\n",
+	       "Port",
+	       "TX packets",
+	       "p50 (us)",
+	       "p99 (us)",
+	       "p99.9 (us)");
+	print_port_latency_separator();
+
+	for (i = 0; i < n_ports; i++) {
+		struct port *p = ports[i];
+		u64 n = 0;
+
+		for (j = 0; j < LATENCY_HIST_N_BUCKETS; j++) {
+			u64 count = p->latency_hist[j];
+
+			hist[j] = count - latency_hist[i][j];
+			latency_hist[i][j] = count;
+			n += hist[j];
+		}
+
+		if (!n) {
+			printf("| %4d | %12d | %10s | %10s | %10s |\n",
+			       i, 0, "-", "-", "-");
+			continue;
+		}
+
+		printf("| %4d | %12llu | %10.1f | %10.1f | %10.1f |\n",
+		       i,
+		       n,
+		       latency_hist_percentile(hist, n, 0.5),
+		       latency_hist_percentile(hist, n, 0.99),
+		       latency_hist_percentile(hist, n, 0.999));
+	}
+
+	print_port_latency_separator();
+	printf("\n");
+}
+
 static void
 print_port_stats_all(u64 ns_diff)
 {
@@ -955,6 +2980,282 @@ print_port_stats_all(u64 ns_diff)
 	for (i = 0; i < n_ports; i++)
 		print_port_stats(i, ns_diff);
 	print_port_stats_trailer();
+
+	print_port_latency_all();
+}
+
+static void
+print_thread_stats_separator(void)
+{
+	printf("+-%-10s-+-%10s-+-%11s-+-%9s-+-%11s-+-%11s-+-%11s-+-%11s-+\n",
+	       "----------",
+	       "----------",
+	       "-----------",
+	       "---------",
+	       "-----------",
+	       "-----------",
+	       "-----------",
+	       "-----------");
+}
+
+/* Per-thread telemetry over the last period, see telemetry.h. */
+static void
+print_thread_stats_all(u64 ns_diff)
+{
+	static struct telemetry_thread prev[MAX_THREADS];
+	double s = ns_diff / 1000000000.;
+	u32 i, j;
+
+	print_thread_stats_separator();
+	printf("| %-10s | %10s | %11s | %9s | %11s | %11s | %11s | %11s |\n",
+	       "Thread",
+	       "Cycles/pkt",
+	       "Empty polls",
+	       "Avg batch",
+	       "Wakeups/s",
+	       "FQ starved",
+	       "CQ starved",
+	       "Slab exch/s");
+	print_thread_stats_separator();
+
+	for (i = 0; i < n_threads; i++) {
+		struct telemetry_thread *tp = &prev[i], tc;
+		u64 n_polls = 0, n_polls_empty, n_pkts, n_wakeups;
+
+		/* Snapshot, as the thread keeps updating its counters. */
+		memcpy(&tc, &telemetry->threads[i], sizeof(tc));
+
+		for (j = 0; j < TELEMETRY_POLL_HIST_N_BUCKETS; j++)
+			n_polls += tc.n_polls[j] - tp->n_polls[j];
+		n_polls_empty = tc.n_polls[0] - tp->n_polls[0];
+		n_pkts = tc.n_pkts - tp->n_pkts;
+		n_wakeups = tc.n_wakeups_rx - tp->n_wakeups_rx +
+			    tc.n_wakeups_tx - tp->n_wakeups_tx;
+
+		printf("| %-10s | %10.1f | %10.1f%% | %9.1f | %11.0f | %11llu | "
+		       "%11llu | %11.0f |\n",
+		       tc.name,
+		       n_pkts ?
+		       (double)(tc.busy_cycles - tp->busy_cycles) / n_pkts : 0,
+		       n_polls ? 100. * n_polls_empty / n_polls : 0,
+		       n_polls - n_polls_empty ?
+		       (double)(tc.n_descs - tp->n_descs) /
+		       (n_polls - n_polls_empty) : 0,
+		       n_wakeups / s,
+		       tc.n_fq_starved - tp->n_fq_starved,
+		       tc.n_cq_starved - tp->n_cq_starved,
+		       (tc.n_slab_exchanges - tp->n_slab_exchanges) / s);
+
+		*tp = tc;
+	}
+
+	print_thread_stats_separator();
+	printf("\n");
+}
+
+static void
+print_pipe_rings_separator(void)
+{
+	printf("+-%-18s-+-%6s-+-%13s-+-%13s-+-%12s-+\n",
+	       "------------------",
+	       "------",
+	       "-------------",
+	       "-------------",
+	       "------------");
+}
+
+/* Flushes of the producers of the ring that found it full. */
+static u64
+pipe_ring_n_stalls(struct pipe_ring *r)
+{
+	u64 n_stalls = 0;
+	u32 i, j;
+
+	for (i = 0; i < n_threads; i++) {
+		struct pipe_thread *t = pipe_threads[i];
+
+		for (j = 0; j < t->n_rings_out; j++)
+			if (t->rings_out[j] == r)
+				n_stalls += t->n_stalls[j];
+	}
+
+	return n_stalls;
+}
+
+/* Ring occupancy (descriptors waiting in the ring at each dequeue) and stalls
+ * (flushes that found the ring full) over the last period. A ring that is
+ * close to full most of the time, or stalls, has a bottleneck downstream.
+ */
+static void
+print_pipe_rings_all(void)
+{
+	u32 i;
+
+	print_pipe_rings_separator();
+	printf("| %-18s | %6s | %13s | %13s | %12s |\n",
+	       "Ring",
+	       "Size",
+	       "Avg occupancy",
+	       "Max occupancy",
+	       "Stalls");
+	print_pipe_rings_separator();
+
+	for (i = 0; i < n_pipe_rings; i++) {
+		struct pipe_ring *r = pipe_rings[i];
+		u64 n_dequeues = r->n_dequeues;
+		u64 occupancy_sum = r->occupancy_sum;
+		u64 n_stalls = pipe_ring_n_stalls(r);
+		u64 n_dequeues_diff = n_dequeues - r->n_dequeues_prev;
+		u32 occupancy_max;
+
+		occupancy_max = __atomic_exchange_n(&r->occupancy_max, 0,
+						    __ATOMIC_RELAXED);
+
+		printf("| %-18s | %6u | %13.1f | %13u | %12llu |\n",
+		       r->name,
+		       PIPE_RING_SIZE,
+		       n_dequeues_diff ?
+		       (double)(occupancy_sum - r->occupancy_sum_prev) /
+		       n_dequeues_diff : 0,
+		       occupancy_max,
+		       n_stalls - r->n_stalls_prev);
+
+		r->n_dequeues_prev = n_dequeues;
+		r->occupancy_sum_prev = occupancy_sum;
+		r->n_stalls_prev = n_stalls;
+	}
+
+	print_pipe_rings_separator();
+	printf("\n");
+}
+
+/*
+ * Load balancing
+ *
+ * Once per statistics period, the load of each thread is measured as the
+ * fraction of its time spent on non-empty RX bursts, and split between its
+ * port groups in proportion to their RX packet rates. When the busiest thread
+ * is busier than the least busy one by more than the threshold, the group that
+ * best evens out their loads is moved from one to the other. At most one group
+ * is moved per period, so the effect of each move is measured before the next.
+ *
+ * The main thread does not wait for the handover: the group is requested from
+ * its thread in one period, and passed on to the new thread in the next one,
+ * once released.
+ */
+#ifndef BALANCE_THRESHOLD
+#define BALANCE_THRESHOLD 0.2
+#endif
+
+static struct port_group *balance_group;
+static int balance_thread_id;
+
+static void
+balance_port_groups(u64 ns_diff)
+{
+	double thread_rate[MAX_THREADS] = { 0 }, diff, best = 0;
+	u32 n_groups[MAX_THREADS] = { 0 };
+	struct port_group *g_move = NULL;
+	int i, j, t_max = 0, t_min = 0;
+	u64 rate[MAX_PORT_GROUPS];
+
+	/* Thread load. */
+	for (i = 0; i < n_threads; i++) {
+		struct thread_data *t = &thread_data[i];
+		u64 busy_tsc = t->telemetry->busy_cycles;
+
+		t->load = (busy_tsc - t->busy_tsc_prev) /
+			  (tsc_hz * (ns_diff / 1000000000.));
+		t->busy_tsc_prev = busy_tsc;
+	}
+
+	/* Port group load. */
+	for (i = 0; i < n_port_groups; i++) {
+		struct port_group *g = &port_groups[i];
+		u64 n_pkts = 0;
+
+		for (j = 0; j < g->n_ports; j++)
+			n_pkts += g->ports_rx[j]->n_pkts_rx;
+
+		rate[i] = n_pkts - g->n_pkts_rx_prev;
+		g->n_pkts_rx_prev = n_pkts;
+		thread_rate[g->thread_id] += rate[i];
+		n_groups[g->thread_id]++;
+	}
+
+	for (i = 0; i < n_port_groups; i++) {
+		struct port_group *g = &port_groups[i];
+
+		g->load = thread_rate[g->thread_id] ?
+			  thread_data[g->thread_id].load * rate[i] /
+			  thread_rate[g->thread_id] : 0;
+	}
+
+	printf("Thread load (%%):");
+	for (i = 0; i < n_threads; i++)
+		printf(" %d: %.1f%s", i, thread_data[i].load * 100,
+		       i < n_threads - 1 ? "," : "\n\n");
+
+	/* Complete the previous handover. */
+	if (balance_group) {
+		struct thread_data *t = &thread_data[balance_group->thread_id];
+
+		if (__atomic_load_n(&t->group_out, __ATOMIC_ACQUIRE))
+			return;
+
+		printf("Port group %d moved from thread %d to thread %d.\n\n",
+		       (int)(balance_group - port_groups),
+		       balance_group->thread_id, balance_thread_id);
+
+		balance_group->thread_id = balance_thread_id;
+		__atomic_store_n(&thread_data[balance_thread_id].group_in,
+				 balance_group, __ATOMIC_RELEASE);
+		balance_group = NULL;
+		return;
+	}
+
+	for (i = 0; i < n_threads; i++)
+		if (__atomic_load_n(&thread_data[i].group_in, __ATOMIC_ACQUIRE))
+			return;
+
+	for (i = 0; i < n_threads; i++) {
+		if (thread_data[i].load > thread_data[t_max].load)
+			t_max = i;
+		if (thread_data[i].load < thread_data[t_min].load)
+			t_min = i;
+	}
+
+	diff = thread_data[t_max].load - thread_data[t_min].load;
+	if (diff < BALANCE_THRESHOLD || n_groups[t_max] < 2)
+		return;
+
+	for (i = 0; i < n_port_groups; i++) {
+		struct port_group *g = &port_groups[i];
+		double score;
+
+		if (g->thread_id != t_max || g->load <= 0 || g->load >= diff)
+			continue;
+
+		/* The closer the load is to half the difference, the more
+		 * even the two threads end up.
+		 */
+		score = diff - 2 * g->load;
+		score = diff - (score < 0 ? -score : score);
+
+		if (score > best) {
+			best = score;
+			g_move = g;
+		}
+	}
+
+	if (!g_move)
+		return;
+
+	/* Handover request, completed on the next period. */
+	balance_group = g_move;
+	balance_thread_id = t_min;
+	__atomic_store_n(&thread_data[t_max].group_out, g_move,
+			 __ATOMIC_RELEASE);
 }
 
 static int quit;
@@ -965,6 +3266,22 @@ signal_handler(int sig)
 	quit = 1;
 }
 
+/* Asks the first n threads to quit, and waits for them. */
+static void
+threads_quit(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		thread_data[i].quit = 1;
+		if (pipeline)
+			pipe_threads[i]->quit = 1;
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+}
+
 static void remove_xdp_program(void)
 {
 	struct xdp_multiprog *mp;
@@ -1003,54 +3320,233 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	/* Buffer pool initialization. */
-	bp = bpool_init(&bpool_params, &umem_cfg);
-	if (!bp) {
-		printf("Buffer pool initialization failed.\n");
+	if (bench) {
+		u32 cpu_core_ids[MAX_THREADS];
+
+		for (i = 0; i < n_threads; i++)
+			cpu_core_ids[i] = thread_data[i].cpu_core_id;
+
+		return bpool_bench(&bpool_params, &umem_cfg, cpu_core_ids,
+				   n_threads) ? -1 : 0;
+	}
+
+	/* Route table. */
+	if (route_file) {
+		l3fwd = l3fwd_create();
+		if (!l3fwd) {
+			printf("Route table initialization failed.\n");
+			return -1;
+		}
+
+		if (l3fwd_load(l3fwd, route_file))
+			return -1;
+		printf("Route table loaded successfully (%u next hops).\n",
+		       l3fwd->n_next_hops);
+	}
+
+	/* Telemetry. */
+	telemetry = telemetry_create(telemetry_name);
+	if (!telemetry) {
+		printf("Telemetry initialization failed.\n");
 		return -1;
 	}
-	printf("Buffer pool created successfully.\n");
 
-	/* Ports initialization. */
-	for (i = 0; i < MAX_PORTS; i++)
-		port_params[i].bp = bp;
+	for (i = 0; i < n_threads; i++)
+		thread_data[i].telemetry = &telemetry->threads[i];
+
+	/* The pipeline RX threads and workers have their own buffer caches. */
+	if (pipeline)
+		bpool_params.n_users_max += n_pipe_threads[PIPE_STAGE_RX] +
+					    n_pipe_threads[PIPE_STAGE_WORKER];
+
+	/* Buffer pool initialization: one pool per NUMA node with ports. */
+	for (i = 0; i < n_ports; i++) {
+		int numa_node = iface_numa_node(port_params[i].iface);
+		struct bpool_params params;
+
+		port_params[i].numa_node = numa_node;
+		if (!bpools[numa_node]) {
+			memcpy(&params, &bpool_params, sizeof(params));
+			params.numa_node = numa_node;
+
+			bpools[numa_node] = bpool_init(&params, &umem_cfg);
+			if (!bpools[numa_node]) {
+				/* Retry without node binding, e.g. for kernels
+				 * without NUMA support.
+				 */
+				params.numa_node = -1;
+				bpools[numa_node] = bpool_init(&params,
+							       &umem_cfg);
+			}
+
+			if (!bpools[numa_node]) {
+				printf("Buffer pool initialization failed.\n");
+				goto err;
+			}
+			printf("Buffer pool for NUMA node %d created "
+			       "successfully.\n", numa_node);
+		}
+
+		port_params[i].bp = bpools[numa_node];
+	}
 
+	/* Ports initialization. */
 	for (i = 0; i < n_ports; i++) {
+		if (multi_buffer)
+			port_params[i].xsk_cfg.bind_flags |= XDP_USE_SG;
+
 		ports[i] = port_init(&port_params[i]);
 		if (!ports[i]) {
 			printf("Port %d initialization failed.\n", i);
-			return -1;
+			goto err;
+		}
+
+		ports[i]->ifindex = if_nametoindex(port_params[i].iface);
+		if (l3fwd && iface_mac_addr(port_params[i].iface,
+					    ports[i]->mac)) {
+			printf("Unable to read the MAC address of %s.\n",
+			       port_params[i].iface);
+			goto err;
 		}
 		print_port(i);
 	}
 	printf("All ports created successfully.\n");
 
-	/* Threads. */
-	for (i = 0; i < n_threads; i++) {
-		struct thread_data *t = &thread_data[i];
-		u32 n_ports_per_thread = n_ports / n_threads, j;
+	/* Port groups, initially assigned to the threads round-robin. In
+	 * pipeline mode, they only pair the ports for MAC swap forwarding.
+	 */
+	for (i = 0; i < n_port_groups; i++) {
+		struct port_group *g = &port_groups[i];
+		struct thread_data *t = &thread_data[i % n_threads];
+		u32 first = i * n_ports_per_group, j;
+
+		g->n_ports = n_ports - first < n_ports_per_group ?
+			     n_ports - first : n_ports_per_group;
+
+		for (j = 0; j < g->n_ports; j++) {
+			g->ports_rx[j] = ports[first + j];
+			g->ports_tx[j] = ports[first + (j + 1) % g->n_ports];
+			pipe_port_tx[first + j] = first + (j + 1) % g->n_ports;
+		}
+
+		if (pipeline)
+			continue;
+
+		g->thread_id = i % n_threads;
+		t->groups[t->n_groups++] = g;
+	}
+
+	/* L3 forwarding: each port sends the packets routed to its interface,
+	 * so map each next hop to the group's port on its interface.
+	 */
+	if (l3fwd && !pipeline)
+		for (i = 0; i < n_port_groups; i++) {
+			struct port_group *g = &port_groups[i];
+			u32 j, k;
+
+			for (j = 0; j < g->n_ports; j++)
+				g->ports_tx[j] = g->ports_rx[j];
+
+			for (j = 0; j < l3fwd->n_next_hops; j++) {
+				u32 ifindex = l3fwd->next_hops[j].ifindex;
+				char ifname[IF_NAMESIZE];
+
+				g->nh_port[j] = -1;
+				for (k = 0; k < g->n_ports; k++)
+					if (g->ports_tx[k]->ifindex == ifindex) {
+						g->nh_port[j] = k;
+						break;
+					}
+
+				if (g->nh_port[j] < 0)
+					printf("Warning: port group %d has no port "
+					       "on %s, the packets routed to it "
+					       "are dropped.\n", i,
+					       if_indextoname(ifindex, ifname) ?
+					       ifname : "?");
+			}
+		}
 
-		for (j = 0; j < n_ports_per_thread; j++) {
-			t->ports_rx[j] = ports[i * n_ports_per_thread + j];
-			t->ports_tx[j] = ports[i * n_ports_per_thread +
-				(j + 1) % n_ports_per_thread];
+	/* CPU cores: with -n, run each thread on the NUMA node of its first
+	 * port, otherwise only warn about threads on a remote node.
+	 */
+	if (auto_cores) {
+		cpu_set_t cpus_used;
+
+		CPU_ZERO(&cpus_used);
+		for (i = 0; i < n_threads; i++) {
+			struct thread_data *t = &thread_data[i];
+			int numa_node = pipeline ? pipe_thread_numa_node(i) :
+				t->groups[0]->ports_rx[0]->params.numa_node;
+			int cpu_core_id;
+
+			cpu_core_id = select_cpu_core(numa_node, &cpus_used);
+			if (cpu_core_id < 0) {
+				printf("No free CPU core for thread %d.\n", i);
+				goto err;
+			}
+			t->cpu_core_id = cpu_core_id;
+		}
+	} else {
+		for (i = 0; i < n_threads; i++) {
+			struct thread_data *t = &thread_data[i];
+			int numa_node = cpu_numa_node(t->cpu_core_id);
+			int port_numa_node = pipeline ?
+				pipe_thread_numa_node(i) :
+				t->groups[0]->ports_rx[0]->params.numa_node;
+
+			if (numa_node >= 0 && numa_node != port_numa_node)
+				printf("Warning: thread %d runs on NUMA node %d, "
+				       "but its ports are on NUMA node %d.\n",
+				       i, numa_node, port_numa_node);
 		}
+	}
+
+	if (pipeline && pipe_init()) {
+		printf("Pipeline initialization failed.\n");
+		goto err;
+	}
 
-		t->n_ports_rx = n_ports_per_thread;
+	for (i = 0; i < n_threads; i++)
+		if (pipeline)
+			print_pipe_thread(i);
+		else
+			print_thread(i);
 
-		print_thread(i);
+	/* TX flush latency budget. */
+	tsc_calibrate();
+	for (i = 0; i < n_threads; i++) {
+		thread_data[i].tx_flush_tsc = tsc_hz * tx_flush_us / 1000000;
+		if (pipeline) {
+			pipe_threads[i]->tx_flush_tsc =
+				thread_data[i].tx_flush_tsc;
+			pipe_threads[i]->telemetry = thread_data[i].telemetry;
+		}
 	}
 
+	telemetry_publish(telemetry);
+	if (telemetry_name)
+		printf("Telemetry exported to /%s.\n", telemetry_name);
+
 	for (i = 0; i < n_threads; i++) {
 		int status;
 
-		status = pthread_create(&threads[i],
-					NULL,
-					thread_func,
-					&thread_data[i]);
+		if (pipeline)
+			status = pthread_create(&threads[i],
+						NULL,
+						pipe_thread_func,
+						pipe_threads[i]);
+		else
+			status = pthread_create(&threads[i],
+						NULL,
+						thread_func,
+						&thread_data[i]);
 		if (status) {
 			printf("Thread %d creation failed.\n", i);
-			return -1;
+
+			/* The started threads write to the telemetry. */
+			threads_quit(i);
+			goto err;
 		}
 	}
 	printf("All threads created successfully.\n");
@@ -1072,22 +3568,35 @@ int main(int argc, char **argv)
 		ns0 = ns1;
 
 		print_port_stats_all(ns_diff);
+		print_thread_stats_all(ns_diff);
+		if (pipeline)
+			print_pipe_rings_all();
+		else
+			balance_port_groups(ns_diff);
 	}
 
 	/* Threads completion. */
 	printf("Quit.\n");
-	for (i = 0; i < n_threads; i++)
-		thread_data[i].quit = 1;
+	threads_quit(n_threads);
 
-	for (i = 0; i < n_threads; i++)
-		pthread_join(threads[i], NULL);
+	pipe_free();
 
 	for (i = 0; i < n_ports; i++)
 		port_free(ports[i]);
 
-	bpool_free(bp);
+	for (i = 0; i < MAX_NUMA_NODES; i++)
+		bpool_free(bpools[i]);
+
+	l3fwd_free(l3fwd);
+
+	telemetry_free(telemetry, telemetry_name);
 
 	remove_xdp_program();
 
 	return 0;
+
+err:
+	/* The telemetry shared memory object outlives the process. */
+	telemetry_free(telemetry, telemetry_name);
+	return -1;
 }
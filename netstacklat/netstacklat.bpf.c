@@ -5,16 +5,43 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include <bpf/bpf_core_read.h>
+#include <bpf/bpf_endian.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
 
 #include "netstacklat.h"
 #include "bits.bpf.h"
 
+#define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86DD
+
+#define AF_INET 2
+#define AF_INET6 10
+
+#define IP_OFFSET 0x1fff
+
 char LICENSE[] SEC("license") = "GPL";
 
 
 volatile const __s64 TAI_OFFSET = (37LL * NS_PER_S);
+// Whether the TX hooks and the backlog-enqueue hook use their side tables
+volatile const bool TRACK_TX_SKBS = false;
+volatile const bool TRACK_BACKLOG_SKBS = false;
 volatile const struct netstacklat_bpf_config user_config = {
 	.filter_pid = false,
+	.filter_cgroup = false,
+	.groupby_cgroup = false,
+	.groupby_netns = false,
+	.groupby_cpu = false,
+	.groupby_rxqueue = false,
+	.loglinear_hist = false,
+	.single_hist_map = false,
+	.mmap_hist = false,
+	.hist_windows = false,
+	.process_hist = false,
+	.outlier_rate_limit = 100,
+	.outlier_thresholds = { 0 },
 };
 
 /*
@@ -43,6 +70,15 @@ struct hist_key {
 	u32 bucket;
 };
 
+/*
+ * The IPv6 addresses of struct sock_common. Defined here rather than in
+ * vmlinux_net.h, as struct in6_addr is taken from <linux/in6.h>.
+ */
+struct sock_common___v6 {
+	struct in6_addr skc_v6_daddr;
+	struct in6_addr skc_v6_rcv_saddr;
+} __attribute__((preserve_access_index));
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(max_entries, HIST_NBUCKETS);
@@ -92,13 +128,200 @@ struct {
 	__type(value, u64);
 } netstack_latency_udp_sock_read_seconds SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HIST_NBUCKETS);
+	__type(key, u32);
+	__type(value, u64);
+} netstack_latency_dev_queue_xmit_seconds SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HIST_NBUCKETS);
+	__type(key, u32);
+	__type(value, u64);
+} netstack_latency_qdisc_dequeue_seconds SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HIST_NBUCKETS);
+	__type(key, u32);
+	__type(value, u64);
+} netstack_latency_net_dev_xmit_seconds SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HIST_NBUCKETS);
+	__type(key, u32);
+	__type(value, u64);
+} netstack_latency_napi_gro_seconds SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HIST_NBUCKETS);
+	__type(key, u32);
+	__type(value, u64);
+} netstack_latency_backlog_enqueue_seconds SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HIST_NBUCKETS);
+	__type(key, u32);
+	__type(value, u64);
+} netstack_latency_netif_receive_seconds SEC(".maps");
+
+/*
+ * Log-linear histograms for all hooks, used instead of the exp2 histograms
+ * above if loglinear_hist is enabled. The histogram for each hook is stored at
+ * index hook * HIST_LOGLIN_NBUCKETS + bucket.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, NETSTACKLAT_N_HOOKS * HIST_LOGLIN_NBUCKETS);
+	__type(key, u32);
+	__type(value, u64);
+} netstack_latency_loglinear_seconds SEC(".maps");
+
+/*
+ * Exp2 histograms for all hooks, used instead of the per-hook maps above if
+ * single_hist_map is enabled, so that userspace can fetch all of them with a
+ * single batch lookup. Keyed by hook and bucket (see struct hook_hist_key), so
+ * that ebpf_exporter can decode the hook as a label. Has room for every bucket
+ * of every hook, so entries can always be created.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, NETSTACKLAT_N_HOOKS * HIST_NBUCKETS);
+	__type(key, struct hook_hist_key);
+	__type(value, u64);
+} netstack_latency_seconds SEC(".maps");
+
+/*
+ * Histograms for all hooks, sharded per CPU (see struct hist_shard). Used
+ * instead of the maps above if mmap_hist is enabled, in which case userspace
+ * resizes it to one entry per CPU and reads it through mmap() rather than with
+ * syscalls.
+ */
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, PID_MAX_LIMIT);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct hist_shard);
+} netstack_latency_shards SEC(".maps");
+
+/*
+ * Sliding-window histograms for all hooks (see struct hist_window_slot), used
+ * in addition to the histograms above if hist_windows is enabled. The slot for
+ * a hook is stored at index
+ * (hook * HIST_WINDOW_N_RINGS + ring) * HIST_WINDOW_NSLOTS + slot.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries,
+	       NETSTACKLAT_N_HOOKS * HIST_WINDOW_N_RINGS * HIST_WINDOW_NSLOTS);
+	__type(key, u32);
+	__type(value, struct hist_window_slot);
+} netstack_latency_window_seconds SEC(".maps");
+
+/*
+ * Histograms for all hooks, additionally grouped by cgroup, network namespace,
+ * CPU and/or RX queue (see struct grouped_hist_key). Only used if grouping is enabled.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, GROUPED_HIST_MAX_ENTRIES);
+	__type(key, struct grouped_hist_key);
+	__type(value, u64);
+} netstack_latency_grouped_seconds SEC(".maps");
+
+/*
+ * Socket read histograms per process (see struct process_hist_key), used in
+ * addition to the histograms above if process_hist is enabled. Entries are
+ * shared between CPUs, so the buckets are updated atomically.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, PROCESS_HIST_MAX_ENTRIES);
+	__type(key, struct process_hist_key);
+	__type(value, struct process_hist);
+} netstack_latency_process_seconds SEC(".maps");
+
+/*
+ * Side table with the time each locally sent skb was passed to the IP layer,
+ * keyed by the skb pointer. Uses the same clock as the RX timestamps (see
+ * time_since()). Unlike on the RX path, skb->tstamp can not be used for this,
+ * as on the TX path it may instead hold e.g. the departure time for pacing.
+ * Entries are removed once the skb has been passed to the driver, or when it
+ * is freed (see netstacklat_kfree_skb()), so that a new skb allocated at the
+ * same address does not pick up a stale start time. The LRU only has to evict
+ * entries for skbs freed without passing the skb free tracepoints.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, TX_TSTAMP_MAX_ENTRIES);
+	__type(key, u64);
+	__type(value, ktime_t);
+} netstack_tx_tstamps SEC(".maps");
+
+/*
+ * Like netstack_tx_tstamps, but with the time each skb was passed to GRO by
+ * the driver. This is needed as the RX timestamp is only set once the packet
+ * leaves GRO (which is instead used as the end time for the napi-gro hook).
+ * Entries are removed once the skb is passed on to the stack, or if GRO
+ * merges the skb into another one.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, GRO_TSTAMP_MAX_ENTRIES);
+	__type(key, u64);
+	__type(value, ktime_t);
+} netstack_gro_tstamps SEC(".maps");
+
+/*
+ * Like netstack_tx_tstamps, but with the time each skb was enqueued to the
+ * backlog of a CPU. The RX timestamp is normally set right before this, so it
+ * can not tell how long the skb then waited in the backlog. Entries are
+ * removed once the skb is dequeued and passed on to the stack, or freed.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, BACKLOG_TSTAMP_MAX_ENTRIES);
+	__type(key, u64);
+	__type(value, ktime_t);
+} netstack_backlog_tstamps SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, OUTLIER_RINGBUF_SIZE);
+} netstack_outlier_events SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct outlier_ratelimit_state);
+} netstack_outlier_ratelimit SEC(".maps");
+
+/*
+ * The processes (tgids) to include with filter_pid. Children of the processes
+ * are added when they are forked, and processes are removed when they exit.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, PID_FILTER_MAX_ENTRIES);
 	__type(key, u32);
 	__type(value, u8);
 } netstack_pidfilter SEC(".maps");
 
+// The cgroups (IDs) to include, together with all their descendants
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, CGROUP_FILTER_MAX_ENTRIES);
+	__type(key, u64);
+	__type(value, u8);
+} netstack_cgroupfilter SEC(".maps");
+
 static u32 get_exp2_histogram_bucket_idx(u64 value, u32 max_bucket)
 {
 	u32 bucket = log2l(value);
@@ -113,6 +336,49 @@ static u32 get_exp2_histogram_bucket_idx(u64 value, u32 max_bucket)
 	return bucket;
 }
 
+/*
+ * Values up to HIST_LOGLIN_SUBBUCKETS get one bucket each, above that each
+ * power of 2 is split into HIST_LOGLIN_SUBBUCKETS linear buckets. Like the
+ * exp2 histogram it's right-inclusive, so bucket 0 is [0, 1], bucket 1 is
+ * (1, 2], ..., bucket 8 is (8, 9], bucket 16 is (16, 18] etc.
+ */
+static u32 get_loglinear_histogram_bucket_idx(u64 value, u32 max_bucket)
+{
+	u64 v = value > 0 ? value - 1 : 0;
+	u32 bucket, exp;
+
+	if (v < HIST_LOGLIN_SUBBUCKETS) {
+		bucket = v;
+	} else {
+		// Use the top HIST_LOGLIN_SUBBUCKET_BITS bits below the MSB
+		exp = log2l(v);
+		bucket = (exp - HIST_LOGLIN_SUBBUCKET_BITS + 1) *
+				 HIST_LOGLIN_SUBBUCKETS +
+			 (v >> (exp - HIST_LOGLIN_SUBBUCKET_BITS)) -
+			 HIST_LOGLIN_SUBBUCKETS;
+	}
+
+	if (bucket > max_bucket)
+		bucket = max_bucket;
+
+	return bucket;
+}
+
+static u32 get_histogram_bucket_idx(u64 value)
+{
+	if (user_config.loglinear_hist)
+		return get_loglinear_histogram_bucket_idx(
+			value, HIST_LOGLIN_MAX_LATENCY_SLOT);
+
+	return get_exp2_histogram_bucket_idx(value, HIST_MAX_LATENCY_SLOT);
+}
+
+static u32 get_histogram_sum_idx(void)
+{
+	return user_config.loglinear_hist ? HIST_LOGLIN_MAX_LATENCY_SLOT + 1 :
+					    HIST_MAX_LATENCY_SLOT + 1;
+}
+
 /*
  * Same call signature as the increment_exp2_histogram_nosync macro from
  * https://github.com/cloudflare/ebpf_exporter/blob/master/examples/maps.bpf.h
@@ -144,6 +410,227 @@ static void increment_exp2_histogram_nosync(void *map, struct hist_key key,
 		*bucket_count += value;
 }
 
+/*
+ * Like increment_exp2_histogram_nosync(), but for the map holding the
+ * log-linear histograms of all hooks (netstack_latency_loglinear_seconds),
+ * where the histogram of each hook starts at index hook * nbuckets.
+ */
+static void increment_multihook_histogram_nosync(void *map,
+						 enum netstacklat_hook hook,
+						 u64 value)
+{
+	u32 nbuckets = user_config.loglinear_hist ? HIST_LOGLIN_NBUCKETS :
+						    HIST_NBUCKETS;
+	u32 idx, base = hook * nbuckets;
+	u64 *bucket_count;
+
+	idx = base + get_histogram_bucket_idx(value);
+	bucket_count = bpf_map_lookup_elem(map, &idx);
+	if (bucket_count)
+		(*bucket_count)++;
+
+	if (value == 0)
+		return;
+
+	idx = base + get_histogram_sum_idx();
+	bucket_count = bpf_map_lookup_elem(map, &idx);
+	if (bucket_count)
+		*bucket_count += value;
+}
+
+static u64 *lookup_or_init_hook_bucket(struct hook_hist_key *key)
+{
+	u64 zero = 0, *bucket_count;
+
+	bucket_count = bpf_map_lookup_elem(&netstack_latency_seconds, key);
+	if (bucket_count)
+		return bucket_count;
+
+	bpf_map_update_elem(&netstack_latency_seconds, key, &zero,
+			    BPF_NOEXIST);
+	return bpf_map_lookup_elem(&netstack_latency_seconds, key);
+}
+
+static void increment_hook_histogram_nosync(enum netstacklat_hook hook,
+					    u64 value)
+{
+	struct hook_hist_key key = { .hook = hook };
+	u64 *bucket_count;
+
+	key.bucket = get_exp2_histogram_bucket_idx(value, HIST_MAX_LATENCY_SLOT);
+	bucket_count = lookup_or_init_hook_bucket(&key);
+	if (bucket_count)
+		(*bucket_count)++;
+
+	if (value == 0)
+		return;
+
+	key.bucket = HIST_MAX_LATENCY_SLOT + 1;
+	bucket_count = lookup_or_init_hook_bucket(&key);
+	if (bucket_count)
+		*bucket_count += value;
+}
+
+/*
+ * Each CPU only updates its own shard, but a hook running in process context
+ * (e.g. the socket read hooks) may be preempted, or interrupted by a softirq,
+ * in the middle of an update, and another hook may then update the same shard.
+ * The odd seq therefore doubles as a busy flag: only the update that takes it
+ * from even to odd closes the seqcount again, while nested updates are covered
+ * by its odd period (and update the buckets atomically, as they may race with
+ * the interrupted one). The cmpxchgs are fully ordered, which keeps the bucket
+ * updates within the odd period on all architectures, matching the acquire
+ * loads in read_hist_shard().
+ */
+static void increment_mmap_histogram(enum netstacklat_hook hook, u64 value)
+{
+	u32 nbuckets = user_config.loglinear_hist ? HIST_LOGLIN_NBUCKETS :
+						    HIST_NBUCKETS;
+	u32 cpu = bpf_get_smp_processor_id();
+	struct hist_shard *shard;
+	u32 idx, sum_idx;
+	bool owner;
+	u64 seq;
+
+	shard = bpf_map_lookup_elem(&netstack_latency_shards, &cpu);
+	if (!shard)
+		return;
+
+	idx = hook * nbuckets + get_histogram_bucket_idx(value);
+	sum_idx = hook * nbuckets + get_histogram_sum_idx();
+	if (idx >= ARRAY_SIZE(shard->buckets) ||
+	    sum_idx >= ARRAY_SIZE(shard->buckets))
+		return;
+
+	/*
+	 * If a nested update completes between reading seq and the cmpxchg,
+	 * this update is not covered by any odd period, so a reader may at
+	 * worst see its bucket and sum out of sync.
+	 */
+	seq = *(volatile u64 *)&shard->seq;
+	owner = !(seq & 1) &&
+		__sync_val_compare_and_swap(&shard->seq, seq, seq + 1) == seq;
+
+	__sync_fetch_and_add(&shard->buckets[idx], 1);
+	__sync_fetch_and_add(&shard->buckets[sum_idx], value);
+
+	if (owner)
+		__sync_val_compare_and_swap(&shard->seq, seq + 1, seq + 2);
+}
+
+/*
+ * Adds the value to the current slot of each ring. Slots are rotated purely
+ * based on the current time: if the slot still holds an older period, it's
+ * reset before being reused. Userspace determines which slots are part of a
+ * window from their epochs, so there's no need for any coordination.
+ */
+static void record_window_latency(enum netstacklat_hook hook, u64 value)
+{
+	u32 bucket = get_exp2_histogram_bucket_idx(value, HIST_MAX_LATENCY_SLOT);
+	u64 now = bpf_ktime_get_ns(), epoch;
+	struct hist_window_slot *slot;
+	u32 ring, idx;
+
+	for (ring = 0; ring < HIST_WINDOW_N_RINGS; ring++) {
+		epoch = now / hist_window_slot_ns(ring);
+		idx = (hook * HIST_WINDOW_N_RINGS + ring) * HIST_WINDOW_NSLOTS +
+		      epoch % HIST_WINDOW_NSLOTS;
+
+		slot = bpf_map_lookup_elem(&netstack_latency_window_seconds, &idx);
+		if (!slot)
+			continue;
+
+		if (slot->epoch != epoch) {
+			__builtin_memset(slot->buckets, 0,
+					 sizeof(slot->buckets));
+			slot->epoch = epoch;
+		}
+
+		if (bucket < HIST_MAX_LATENCY_SLOT + 1)
+			slot->buckets[bucket]++;
+		slot->buckets[HIST_MAX_LATENCY_SLOT + 1] += value;
+	}
+}
+
+/*
+ * Returns the bucket for the key in the grouped histogram map, creating it if
+ * needed. If the map is full, the bucket for the catch-all group (all group
+ * members 0, which is pre-created by userspace) is used instead, which bounds
+ * the number of groups while still keeping the total count of each hook.
+ */
+static u64 *lookup_or_init_grouped_bucket(struct grouped_hist_key *key)
+{
+	u64 zero = 0, *bucket_count;
+
+	bucket_count =
+		bpf_map_lookup_elem(&netstack_latency_grouped_seconds, key);
+	if (bucket_count)
+		return bucket_count;
+
+	bpf_map_update_elem(&netstack_latency_grouped_seconds, key, &zero,
+			    BPF_NOEXIST);
+	bucket_count =
+		bpf_map_lookup_elem(&netstack_latency_grouped_seconds, key);
+	if (bucket_count)
+		return bucket_count;
+
+	key->cgroup = 0;
+	key->netns = 0;
+	key->cpu = 0;
+	key->rxqueue = 0;
+	return bpf_map_lookup_elem(&netstack_latency_grouped_seconds, key);
+}
+
+/*
+ * Like increment_exp2_histogram_nosync(), but for the grouped histogram map,
+ * where buckets are created on demand. Uses the log-linear buckets if
+ * loglinear_hist is enabled.
+ */
+static void increment_grouped_histogram_nosync(struct grouped_hist_key key,
+					       u64 value)
+{
+	u64 *bucket_count;
+
+	key.bucket = get_histogram_bucket_idx(value);
+	bucket_count = lookup_or_init_grouped_bucket(&key);
+	if (bucket_count)
+		(*bucket_count)++;
+
+	if (value == 0)
+		return;
+
+	key.bucket = get_histogram_sum_idx();
+	bucket_count = lookup_or_init_grouped_bucket(&key);
+	if (bucket_count)
+		*bucket_count += value;
+}
+
+static void record_process_latency(enum netstacklat_hook hook, u64 value)
+{
+	u32 bucket = get_exp2_histogram_bucket_idx(value, HIST_MAX_LATENCY_SLOT);
+	static const struct process_hist zero_hist = { 0 };
+	struct process_hist_key key = { 0 };
+	struct process_hist *hist;
+
+	key.tgid = bpf_get_current_pid_tgid() >> 32;
+	key.hook = hook;
+	bpf_get_current_comm(key.comm, sizeof(key.comm));
+
+	hist = bpf_map_lookup_elem(&netstack_latency_process_seconds, &key);
+	if (!hist) {
+		bpf_map_update_elem(&netstack_latency_process_seconds, &key,
+				    &zero_hist, BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&netstack_latency_process_seconds,
+					   &key);
+		if (!hist)
+			return;
+	}
+
+	if (bucket < HIST_MAX_LATENCY_SLOT + 1)
+		__sync_fetch_and_add(&hist->buckets[bucket], 1);
+	__sync_fetch_and_add(&hist->buckets[HIST_MAX_LATENCY_SLOT + 1], value);
+}
+
 static void *hook_to_histmap(enum netstacklat_hook hook)
 {
 	switch (hook) {
@@ -161,6 +648,18 @@ static void *hook_to_histmap(enum netstacklat_hook hook)
 		return &netstack_latency_tcp_sock_read_seconds;
 	case NETSTACKLAT_HOOK_UDP_SOCK_READ:
 		return &netstack_latency_udp_sock_read_seconds;
+	case NETSTACKLAT_HOOK_DEV_QUEUE_XMIT:
+		return &netstack_latency_dev_queue_xmit_seconds;
+	case NETSTACKLAT_HOOK_QDISC_DEQUEUE:
+		return &netstack_latency_qdisc_dequeue_seconds;
+	case NETSTACKLAT_HOOK_NET_DEV_XMIT:
+		return &netstack_latency_net_dev_xmit_seconds;
+	case NETSTACKLAT_HOOK_NAPI_GRO:
+		return &netstack_latency_napi_gro_seconds;
+	case NETSTACKLAT_HOOK_BACKLOG_ENQUEUE:
+		return &netstack_latency_backlog_enqueue_seconds;
+	case NETSTACKLAT_HOOK_NETIF_RECEIVE:
+		return &netstack_latency_netif_receive_seconds;
 	default:
 		return NULL;
 	}
@@ -180,21 +679,326 @@ static ktime_t time_since(ktime_t tstamp)
 	return now - tstamp;
 }
 
-static void record_latency(ktime_t latency, enum netstacklat_hook hook)
+/*
+ * The cgroup is that of the socket (i.e. the cgroup of the process that
+ * created it), so it's only known for hooks that have a socket. The network
+ * namespace is taken from the socket if available, otherwise from the device
+ * the packet was received on. The CPU is the one the hook runs on, which for
+ * the socket read hooks is the CPU of the reading process rather than the one
+ * that processed the packet. The RX queue is only known for RX hooks with a
+ * skb.
+ */
+static void record_grouped_latency(ktime_t latency, enum netstacklat_hook hook,
+				   struct sock *sk, struct sk_buff *skb)
+{
+	struct grouped_hist_key key = { .hook = hook };
+
+	if (user_config.groupby_cgroup && sk &&
+	    bpf_core_field_exists(sk->sk_cgrp_data))
+		key.cgroup = BPF_CORE_READ(sk, sk_cgrp_data.cgroup, kn, id);
+
+	if (user_config.groupby_netns) {
+		if (sk)
+			key.netns = BPF_CORE_READ(sk, __sk_common.skc_net.net,
+						  net_cookie);
+		else if (skb)
+			key.netns = BPF_CORE_READ(skb, dev, nd_net.net,
+						  net_cookie);
+	}
+
+	if (user_config.groupby_cpu)
+		key.cpu = bpf_get_smp_processor_id() + 1;
+
+	// On the TX path, queue_mapping is the TX queue
+	if (user_config.groupby_rxqueue && skb && !netstacklat_hook_is_tx(hook))
+		key.rxqueue = BPF_CORE_READ(skb, queue_mapping);
+
+	increment_grouped_histogram_nosync(key, latency);
+}
+
+/*
+ * Packets on the TX path are sent from the local address of the socket, while
+ * packets on the RX path are sent to it.
+ */
+static void flow_from_sock(struct netstacklat_flow *flow, struct sock *sk,
+			   bool tx)
+{
+	struct sock_common___v6 *skc6 = (void *)sk;
+	__u8 *laddr = tx ? flow->saddr : flow->daddr;
+	__u8 *raddr = tx ? flow->daddr : flow->saddr;
+	__be16 lport, rport;
+	u16 family;
+
+	family = BPF_CORE_READ(sk, __sk_common.skc_family);
+	if (family == AF_INET) {
+		bpf_core_read(laddr, 4, &sk->__sk_common.skc_rcv_saddr);
+		bpf_core_read(raddr, 4, &sk->__sk_common.skc_daddr);
+	} else if (family == AF_INET6) {
+		bpf_core_read(laddr, 16, &skc6->skc_v6_rcv_saddr);
+		bpf_core_read(raddr, 16, &skc6->skc_v6_daddr);
+	} else {
+		return;
+	}
+
+	flow->family = family;
+	flow->ipproto = BPF_CORE_READ(sk, sk_protocol);
+	if (flow->ipproto != IPPROTO_TCP && flow->ipproto != IPPROTO_UDP)
+		return;
+
+	lport = bpf_htons(BPF_CORE_READ(sk, __sk_common.skc_num));
+	rport = BPF_CORE_READ(sk, __sk_common.skc_dport);
+	flow->sport = tx ? lport : rport;
+	flow->dport = tx ? rport : lport;
+}
+
+/*
+ * Parses the flow from the packet headers. Relies on the network header offset
+ * having been set, and does not parse IPv6 extension headers.
+ */
+static void flow_from_skb(struct netstacklat_flow *flow, struct sk_buff *skb)
+{
+	unsigned char *head = BPF_CORE_READ(skb, head);
+	u16 nhoff = BPF_CORE_READ(skb, network_header);
+	__be16 proto = BPF_CORE_READ(skb, protocol);
+	struct ipv6hdr ip6h;
+	struct iphdr iph;
+	__be16 ports[2];
+	u32 thoff;
+
+	// Offset is ~0 if the network header has not been set
+	if (nhoff == (u16)~0U)
+		return;
+
+	if (proto == bpf_htons(ETH_P_IP)) {
+		if (bpf_probe_read_kernel(&iph, sizeof(iph), head + nhoff))
+			return;
+
+		flow->family = AF_INET;
+		flow->ipproto = iph.protocol;
+		__builtin_memcpy(flow->saddr, &iph.saddr, sizeof(iph.saddr));
+		__builtin_memcpy(flow->daddr, &iph.daddr, sizeof(iph.daddr));
+
+		// Only the first fragment has the transport header
+		if (iph.frag_off & bpf_htons(IP_OFFSET))
+			return;
+		thoff = nhoff + iph.ihl * 4;
+	} else if (proto == bpf_htons(ETH_P_IPV6)) {
+		if (bpf_probe_read_kernel(&ip6h, sizeof(ip6h), head + nhoff))
+			return;
+
+		flow->family = AF_INET6;
+		flow->ipproto = ip6h.nexthdr;
+		__builtin_memcpy(flow->saddr, &ip6h.saddr, sizeof(ip6h.saddr));
+		__builtin_memcpy(flow->daddr, &ip6h.daddr, sizeof(ip6h.daddr));
+		thoff = nhoff + sizeof(ip6h);
+	} else {
+		return;
+	}
+
+	if (flow->ipproto != IPPROTO_TCP && flow->ipproto != IPPROTO_UDP)
+		return;
+
+	// Both the TCP and UDP header start with the source and dest port
+	if (bpf_probe_read_kernel(ports, sizeof(ports), head + thoff))
+		return;
+	flow->sport = ports[0];
+	flow->dport = ports[1];
+}
+
+/*
+ * Simple per-CPU rate limit, allowing at most outlier_rate_limit events per
+ * (roughly) one second window.
+ */
+static bool outlier_ratelimit_ok(struct outlier_ratelimit_state *rl)
+{
+	u64 now = bpf_ktime_get_ns();
+
+	if (now - rl->window_start >= NS_PER_S) {
+		rl->window_start = now;
+		rl->nevents = 0;
+	}
+
+	if (rl->nevents >= user_config.outlier_rate_limit) {
+		rl->ratelimited++;
+		return false;
+	}
+
+	rl->nevents++;
+	return true;
+}
+
+/*
+ * The pid and comm are those of the current task, which for hooks that run in
+ * softirq context is whatever task happened to be interrupted.
+ */
+static void record_outlier(ktime_t latency, enum netstacklat_hook hook,
+			   struct sock *sk, struct sk_buff *skb)
+{
+	struct netstacklat_outlier_event *event;
+	struct outlier_ratelimit_state *rl;
+	u32 key = 0;
+
+	if (hook >= NETSTACKLAT_N_HOOKS ||
+	    user_config.outlier_thresholds[hook] == 0 ||
+	    latency < user_config.outlier_thresholds[hook])
+		return;
+
+	rl = bpf_map_lookup_elem(&netstack_outlier_ratelimit, &key);
+	if (!rl || !outlier_ratelimit_ok(rl))
+		return;
+
+	event = bpf_ringbuf_reserve(&netstack_outlier_events, sizeof(*event),
+				    0);
+	if (!event) {
+		rl->dropped++;
+		return;
+	}
+
+	event->latency = latency;
+	event->hook = hook;
+	event->cpu = bpf_get_smp_processor_id();
+	event->pid = bpf_get_current_pid_tgid() >> 32;
+	bpf_get_current_comm(event->comm, sizeof(event->comm));
+
+	__builtin_memset(&event->flow, 0, sizeof(event->flow));
+	if (sk)
+		flow_from_sock(&event->flow, sk, netstacklat_hook_is_tx(hook));
+	else if (skb)
+		flow_from_skb(&event->flow, skb);
+
+	bpf_ringbuf_submit(event, 0);
+}
+
+static bool filter_pid(u32 pid)
+{
+	u8 *pid_ok;
+
+	if (!user_config.filter_pid)
+		// No PID filter - all PIDs ok
+		return true;
+
+	pid_ok = bpf_map_lookup_elem(&netstack_pidfilter, &pid);
+	if (!pid_ok)
+		return false;
+
+	return *pid_ok > 0;
+}
+
+static bool filter_current_cgroup(void)
+{
+	u64 cgroup_id;
+	int level;
+
+	if (!user_config.filter_cgroup)
+		return true;
+
+	for (level = 0; level < CGROUP_MAX_DEPTH; level++) {
+		cgroup_id = bpf_get_current_ancestor_cgroup_id(level);
+		if (cgroup_id == 0)
+			// Past the level of the current cgroup
+			break;
+
+		if (bpf_map_lookup_elem(&netstack_cgroupfilter, &cgroup_id))
+			return true;
+	}
+
+	return false;
+}
+
+static bool filter_current_task(void)
+{
+	__u32 tgid;
+
+	if (!filter_current_cgroup())
+		return false;
+
+	if (!user_config.filter_pid)
+		return true;
+
+	tgid = bpf_get_current_pid_tgid() >> 32;
+	return filter_pid(tgid);
+}
+
+/*
+ * Filters on the cgroup of the socket (i.e. the cgroup of the process that
+ * created it). Latencies from hooks without a socket can not be attributed to
+ * any cgroup, and are therefore not filtered.
+ */
+static bool filter_socket_cgroup(struct sock *sk)
+{
+	struct cgroup *cgrp;
+	u64 cgroup_id;
+	int level;
+
+	if (!user_config.filter_cgroup || !sk)
+		return true;
+
+	if (!bpf_core_field_exists(sk->sk_cgrp_data))
+		return true;
+
+	cgrp = BPF_CORE_READ(sk, sk_cgrp_data.cgroup);
+	for (level = 0; level < CGROUP_MAX_DEPTH && cgrp; level++) {
+		cgroup_id = BPF_CORE_READ(cgrp, kn, id);
+		if (bpf_map_lookup_elem(&netstack_cgroupfilter, &cgroup_id))
+			return true;
+
+		// The cgroup_subsys_state is the first member of struct cgroup
+		cgrp = (void *)BPF_CORE_READ(cgrp, self.parent);
+	}
+
+	return false;
+}
+
+static bool grouping_enabled(void)
+{
+	return user_config.groupby_cgroup || user_config.groupby_netns ||
+	       user_config.groupby_cpu || user_config.groupby_rxqueue;
+}
+
+static void record_latency(ktime_t latency, enum netstacklat_hook hook,
+			   struct sock *sk, struct sk_buff *skb)
 {
 	struct hist_key key = { 0 };
-	increment_exp2_histogram_nosync(hook_to_histmap(hook), key, latency,
-					HIST_MAX_LATENCY_SLOT);
+
+	if (!filter_socket_cgroup(sk))
+		return;
+
+	if (user_config.mmap_hist)
+		increment_mmap_histogram(hook, latency);
+	else if (user_config.loglinear_hist)
+		increment_multihook_histogram_nosync(
+			&netstack_latency_loglinear_seconds, hook, latency);
+	else if (user_config.single_hist_map)
+		increment_hook_histogram_nosync(hook, latency);
+	else
+		increment_exp2_histogram_nosync(hook_to_histmap(hook), key,
+						latency, HIST_MAX_LATENCY_SLOT);
+
+	if (user_config.hist_windows)
+		record_window_latency(hook, latency);
+
+	if (grouping_enabled())
+		record_grouped_latency(latency, hook, sk, skb);
+
+	// The socket read hooks run in the context of the reading process
+	if (user_config.process_hist &&
+	    (hook == NETSTACKLAT_HOOK_TCP_SOCK_READ ||
+	     hook == NETSTACKLAT_HOOK_UDP_SOCK_READ))
+		record_process_latency(hook, latency);
+
+	record_outlier(latency, hook, sk, skb);
 }
 
-static void record_latency_since(ktime_t tstamp, enum netstacklat_hook hook)
+static void record_latency_since(ktime_t tstamp, enum netstacklat_hook hook,
+				 struct sock *sk, struct sk_buff *skb)
 {
 	ktime_t latency = time_since(tstamp);
 	if (latency >= 0)
-		record_latency(latency, hook);
+		record_latency(latency, hook, sk, skb);
 }
 
-static void record_skb_latency(struct sk_buff *skb, enum netstacklat_hook hook)
+static void record_skb_latency(struct sk_buff *skb, struct sock *sk,
+			       enum netstacklat_hook hook)
 {
 	if (bpf_core_field_exists(skb->tstamp_type)) {
 		/*
@@ -219,49 +1023,121 @@ static void record_skb_latency(struct sk_buff *skb, enum netstacklat_hook hook)
 			return;
 	}
 
-	record_latency_since(skb->tstamp, hook);
+	record_latency_since(skb->tstamp, hook, sk, skb);
 }
 
-static bool filter_pid(u32 pid)
+static void record_socket_latency(struct sock *sk, struct sk_buff *skb,
+				  ktime_t tstamp, enum netstacklat_hook hook)
 {
-	u8 *pid_ok;
+	if (!filter_current_task())
+		return;
 
-	if (!user_config.filter_pid)
-		// No PID filter - all PIDs ok
-		return true;
+	record_latency_since(tstamp, hook, sk, skb);
+}
 
-	pid_ok = bpf_map_lookup_elem(&netstack_pidfilter, &pid);
-	if (!pid_ok)
-		return false;
+/*
+ * Helpers for the side tables (netstack_tx_tstamps, netstack_gro_tstamps and
+ * netstack_backlog_tstamps) storing the start time for skbs whose skb->tstamp
+ * can not be used.
+ */
+static void record_start_time(void *side_table, struct sk_buff *skb)
+{
+	ktime_t now = bpf_ktime_get_tai_ns() - TAI_OFFSET;
+	u64 key = (u64)skb;
 
-	return *pid_ok > 0;
+	bpf_map_update_elem(side_table, &key, &now, BPF_ANY);
 }
 
-static bool filter_current_task(void)
+/*
+ * Returns the latency since the start time recorded by record_start_time(),
+ * or -1 if the skb is not tracked. If done is set, the skb has reached the
+ * end of the tracked path, and is removed from the side table.
+ */
+static ktime_t time_since_start(void *side_table, struct sk_buff *skb,
+				bool done)
 {
-	__u32 tgid;
+	u64 key = (u64)skb;
+	ktime_t *tstamp;
+	ktime_t latency;
 
-	if (!user_config.filter_pid)
-		return true;
+	tstamp = bpf_map_lookup_elem(side_table, &key);
+	if (!tstamp)
+		return -1;
 
-	tgid = bpf_get_current_pid_tgid() >> 32;
-	return filter_pid(tgid);
+	latency = time_since(*tstamp);
+
+	if (done)
+		bpf_map_delete_elem(side_table, &key);
+
+	return latency;
 }
 
-static void record_socket_latency(struct sock *sk, ktime_t tstamp,
-				  enum netstacklat_hook hook)
+/*
+ * The GRO latency is the time from the skb being passed to GRO until it's
+ * timestamped when leaving GRO, so that it does not include the time the skb
+ * may have spent in a backlog queue since.
+ */
+static void record_gro_latency(struct sk_buff *skb)
 {
-	if (!filter_current_task())
+	u64 key = (u64)skb;
+	ktime_t *start;
+
+	start = bpf_map_lookup_elem(&netstack_gro_tstamps, &key);
+	if (!start)
 		return;
 
-	record_latency_since(tstamp, hook);
+	if (skb->tstamp > 0 && skb->tstamp >= *start)
+		record_latency(skb->tstamp - *start, NETSTACKLAT_HOOK_NAPI_GRO,
+			       NULL, skb);
+
+	bpf_map_delete_elem(&netstack_gro_tstamps, &key);
+}
+
+static void forget_start_time(void *side_table, struct sk_buff *skb)
+{
+	u64 key = (u64)skb;
+
+	// Most skbs are not tracked, and unlike the delete the lookup takes no
+	// bucket lock
+	if (bpf_map_lookup_elem(side_table, &key))
+		bpf_map_delete_elem(side_table, &key);
+}
+
+/*
+ * Tracked skbs may be freed before reaching the end of the tracked path, e.g.
+ * when dropped by the qdisc or a full backlog, or consumed by GSO after being
+ * segmented.
+ */
+static void forget_freed_skb(struct sk_buff *skb)
+{
+	if (TRACK_TX_SKBS)
+		forget_start_time(&netstack_tx_tstamps, skb);
+	if (TRACK_BACKLOG_SKBS)
+		forget_start_time(&netstack_backlog_tstamps, skb);
+}
+
+static void record_backlog_latency(struct sk_buff *skb)
+{
+	ktime_t latency = time_since_start(&netstack_backlog_tstamps, skb, true);
+
+	if (latency >= 0)
+		record_latency(latency, NETSTACKLAT_HOOK_BACKLOG_ENQUEUE, NULL,
+			       skb);
+}
+
+static void record_tx_latency(struct sk_buff *skb, enum netstacklat_hook hook)
+{
+	ktime_t latency = time_since_start(&netstack_tx_tstamps, skb, false);
+
+	if (latency >= 0)
+		record_latency(latency, hook, skb->sk, skb);
 }
 
 SEC("fentry/ip_rcv_core")
 int BPF_PROG(netstacklat_ip_rcv_core, struct sk_buff *skb, void *block,
 	     void *tp, void *res, bool compat_mode)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_IP_RCV);
+	record_skb_latency(skb, NULL, NETSTACKLAT_HOOK_IP_RCV);
 	return 0;
 }
 
@@ -269,42 +1145,106 @@ SEC("fentry/ip6_rcv_core")
 int BPF_PROG(netstacklat_ip6_rcv_core, struct sk_buff *skb, void *block,
 	     void *tp, void *res, bool compat_mode)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_IP_RCV);
+	record_skb_latency(skb, NULL, NETSTACKLAT_HOOK_IP_RCV);
+	return 0;
+}
+
+SEC("fentry/napi_gro_receive")
+int BPF_PROG(netstacklat_napi_gro_receive, void *napi, struct sk_buff *skb)
+{
+	record_start_time(&netstack_gro_tstamps, skb);
+	return 0;
+}
+
+/*
+ * Unless GRO holds on to the skb (GRO_HELD) or passes it on to the stack
+ * (GRO_NORMAL), it has been merged into another skb (or freed), and will
+ * never reach the stack on its own.
+ */
+SEC("fexit/napi_gro_receive")
+int BPF_PROG(netstacklat_napi_gro_receive_exit, void *napi, struct sk_buff *skb,
+	     int ret)
+{
+	if (ret != 2 /* GRO_HELD */ && ret != 3 /* GRO_NORMAL */)
+		forget_start_time(&netstack_gro_tstamps, skb);
+	return 0;
+}
+
+/*
+ * Only reached if RPS steers the packet to another CPU, or if the driver uses
+ * netif_rx(). The backlog-enqueue hook measures the time from here until
+ * process_backlog() dequeues the packet and passes it to
+ * __netif_receive_skb_core() (see netstacklat_backlog_dequeue()).
+ */
+SEC("fentry/enqueue_to_backlog")
+int BPF_PROG(netstacklat_enqueue_to_backlog, struct sk_buff *skb, int cpu,
+	     unsigned int *qtail)
+{
+	record_start_time(&netstack_backlog_tstamps, skb);
+	return 0;
+}
+
+/*
+ * The netif_receive_skb tracepoint is at the start of
+ * __netif_receive_skb_core(), i.e. where the packet is passed to the protocol
+ * handlers (and the ingress tc hook), after potentially having waited in the
+ * backlog queue of another CPU.
+ */
+SEC("tp_btf/netif_receive_skb")
+int BPF_PROG(netstacklat_netif_receive_skb, struct sk_buff *skb)
+{
+	record_skb_latency(skb, NULL, NETSTACKLAT_HOOK_NETIF_RECEIVE);
+	return 0;
+}
+
+// Separate program so that the napi-gro hook can be enabled on its own
+SEC("tp_btf/netif_receive_skb")
+int BPF_PROG(netstacklat_napi_gro_done, struct sk_buff *skb)
+{
+	record_gro_latency(skb);
+	return 0;
+}
+
+// Separate program so that the backlog-enqueue hook can be enabled on its own
+SEC("tp_btf/netif_receive_skb")
+int BPF_PROG(netstacklat_backlog_dequeue, struct sk_buff *skb)
+{
+	record_backlog_latency(skb);
 	return 0;
 }
 
 SEC("fentry/tcp_v4_rcv")
 int BPF_PROG(netstacklat_tcp_v4_rcv, struct sk_buff *skb)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_TCP_START);
+	record_skb_latency(skb, NULL, NETSTACKLAT_HOOK_TCP_START);
 	return 0;
 }
 
 SEC("fentry/tcp_v6_rcv")
 int BPF_PROG(netstacklat_tcp_v6_rcv, struct sk_buff *skb)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_TCP_START);
+	record_skb_latency(skb, NULL, NETSTACKLAT_HOOK_TCP_START);
 	return 0;
 }
 
 SEC("fentry/udp_rcv")
 int BPF_PROG(netstacklat_udp_rcv, struct sk_buff *skb)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_UDP_START);
+	record_skb_latency(skb, NULL, NETSTACKLAT_HOOK_UDP_START);
 	return 0;
 }
 
 SEC("fentry/udpv6_rcv")
 int BPF_PROG(netstacklat_udpv6_rcv, struct sk_buff *skb)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_UDP_START);
+	record_skb_latency(skb, NULL, NETSTACKLAT_HOOK_UDP_START);
 	return 0;
 }
 
 SEC("fexit/tcp_data_queue")
 int BPF_PROG(netstacklat_tcp_data_queue, struct sock *sk, struct sk_buff *skb)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_TCP_SOCK_ENQUEUED);
+	record_skb_latency(skb, sk, NETSTACKLAT_HOOK_TCP_SOCK_ENQUEUED);
 	return 0;
 }
 
@@ -312,7 +1252,7 @@ SEC("fexit/udp_queue_rcv_one_skb")
 int BPF_PROG(netstacklat_udp_queue_rcv_one_skb, struct sock *sk,
 	     struct sk_buff *skb)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_UDP_SOCK_ENQUEUED);
+	record_skb_latency(skb, sk, NETSTACKLAT_HOOK_UDP_SOCK_ENQUEUED);
 	return 0;
 }
 
@@ -320,7 +1260,7 @@ SEC("fexit/udpv6_queue_rcv_one_skb")
 int BPF_PROG(netstacklat_udpv6_queue_rcv_one_skb, struct sock *sk,
 	     struct sk_buff *skb)
 {
-	record_skb_latency(skb, NETSTACKLAT_HOOK_UDP_SOCK_ENQUEUED);
+	record_skb_latency(skb, sk, NETSTACKLAT_HOOK_UDP_SOCK_ENQUEUED);
 	return 0;
 }
 
@@ -329,7 +1269,8 @@ int BPF_PROG(netstacklat_tcp_recv_timestamp, void *msg, struct sock *sk,
 	     struct scm_timestamping_internal *tss)
 {
 	struct timespec64 *ts = &tss->ts[0];
-	record_socket_latency(sk, (ktime_t)ts->tv_sec * NS_PER_S + ts->tv_nsec,
+	record_socket_latency(sk, NULL,
+			      (ktime_t)ts->tv_sec * NS_PER_S + ts->tv_nsec,
 			      NETSTACKLAT_HOOK_TCP_SOCK_READ);
 	return 0;
 }
@@ -338,6 +1279,135 @@ SEC("fentry/skb_consume_udp")
 int BPF_PROG(netstacklat_skb_consume_udp, struct sock *sk, struct sk_buff *skb,
 	     int len)
 {
-	record_socket_latency(sk, skb->tstamp, NETSTACKLAT_HOOK_UDP_SOCK_READ);
+	record_socket_latency(sk, skb, skb->tstamp,
+			      NETSTACKLAT_HOOK_UDP_SOCK_READ);
+	return 0;
+}
+
+/*
+ * The TX hooks measure the latency from the skb being passed from the
+ * transport layer to the IP layer, which is done by __ip_queue_xmit() and
+ * inet6_csk_xmit() for TCP, and by ip_send_skb() and ip6_send_skb() for UDP.
+ */
+SEC("fentry/__ip_queue_xmit")
+int BPF_PROG(netstacklat_ip_queue_xmit, struct sock *sk, struct sk_buff *skb)
+{
+	record_start_time(&netstack_tx_tstamps, skb);
+	return 0;
+}
+
+SEC("fentry/inet6_csk_xmit")
+int BPF_PROG(netstacklat_inet6_csk_xmit, struct sock *sk, struct sk_buff *skb)
+{
+	record_start_time(&netstack_tx_tstamps, skb);
+	return 0;
+}
+
+SEC("fentry/ip_send_skb")
+int BPF_PROG(netstacklat_ip_send_skb, void *net, struct sk_buff *skb)
+{
+	record_start_time(&netstack_tx_tstamps, skb);
+	return 0;
+}
+
+SEC("fentry/ip6_send_skb")
+int BPF_PROG(netstacklat_ip6_send_skb, struct sk_buff *skb)
+{
+	record_start_time(&netstack_tx_tstamps, skb);
+	return 0;
+}
+
+SEC("fentry/__dev_queue_xmit")
+int BPF_PROG(netstacklat_dev_queue_xmit, struct sk_buff *skb, void *sb_dev)
+{
+	record_tx_latency(skb, NETSTACKLAT_HOOK_DEV_QUEUE_XMIT);
+	return 0;
+}
+
+/*
+ * When dequeuing several packets in bulk, only the first skb is passed to the
+ * tracepoint, so the remaining ones are only recorded by the net-dev-xmit hook.
+ */
+SEC("tp_btf/qdisc_dequeue")
+int BPF_PROG(netstacklat_qdisc_dequeue, void *qdisc, void *txq, int packets,
+	     struct sk_buff *skb)
+{
+	if (skb)
+		record_tx_latency(skb, NETSTACKLAT_HOOK_QDISC_DEQUEUE);
+	return 0;
+}
+
+/*
+ * The driver may already have freed the skb at this point, so only use the skb
+ * pointer as a key, and do not read any skb fields. For the same reason, the
+ * cgroup, netns and RX queue are not known for grouping.
+ */
+SEC("tp_btf/net_dev_xmit")
+int BPF_PROG(netstacklat_net_dev_xmit, struct sk_buff *skb, int rc, void *dev,
+	     unsigned int skb_len)
+{
+	ktime_t latency;
+
+	// Otherwise (NETDEV_TX_BUSY) the skb will be requeued and sent again
+	if (rc != 0)
+		return 0;
+
+	latency = time_since_start(&netstack_tx_tstamps, skb, true);
+	if (latency >= 0)
+		record_latency(latency, NETSTACKLAT_HOOK_NET_DEV_XMIT, NULL,
+			       NULL);
+	return 0;
+}
+
+/*
+ * Run for every freed skb, so only loaded when the side tables are in use.
+ * Drivers that free the skb before returning from ndo_start_xmit() therefore
+ * do not report the net-dev-xmit hook, as the skb is already forgotten when
+ * the net_dev_xmit tracepoint is reached.
+ */
+SEC("tp_btf/kfree_skb")
+int BPF_PROG(netstacklat_kfree_skb, struct sk_buff *skb)
+{
+	forget_freed_skb(skb);
+	return 0;
+}
+
+SEC("tp_btf/consume_skb")
+int BPF_PROG(netstacklat_consume_skb, struct sk_buff *skb)
+{
+	forget_freed_skb(skb);
+	return 0;
+}
+
+/*
+ * Adds new processes forked by a process in the PID filter to the filter, so
+ * that e.g. worker processes are included as well. New threads already share
+ * the tgid of the parent, so only new processes need to be added.
+ */
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(netstacklat_sched_process_fork, struct task_struct *parent,
+	     struct task_struct *child)
+{
+	u32 parent_tgid = parent->tgid, child_tgid = child->tgid;
+	u8 pid_ok = 1;
+
+	if (child->pid != child_tgid || !filter_pid(parent_tgid))
+		return 0;
+
+	bpf_map_update_elem(&netstack_pidfilter, &child_tgid, &pid_ok,
+			    BPF_NOEXIST);
+	return 0;
+}
+
+// Removes processes from the PID filter once all of their threads have exited
+SEC("tp_btf/sched_process_exit")
+int BPF_PROG(netstacklat_sched_process_exit, struct task_struct *task)
+{
+	u32 tgid = task->tgid;
+
+	if (BPF_CORE_READ(task, signal, live.counter) > 0)
+		return 0;
+
+	bpf_map_delete_elem(&netstack_pidfilter, &tgid);
 	return 0;
 }
@@ -1,20 +1,29 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 static const char *__doc__ =
-	"Netstacklat - Monitor latency to various points in the ingress network stack";
+	"Netstacklat - Monitor latency to various points in the network stack";
 
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
 #include <time.h>
 #include <math.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <limits.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/timex.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -34,8 +43,13 @@ static const char *__doc__ =
  */
 #define NETSTACKLAT_EPOLL_SIG (1ULL << 63)
 #define NETSTACKLAT_EPOLL_TIMER (1ULL << 62)
-#define NETSTACKLAT_EPOLL_TYPE_MASK \
-	(NETSTACKLAT_EPOLL_SIG | NETSTACKLAT_EPOLL_TIMER)
+#define NETSTACKLAT_EPOLL_RINGBUF (1ULL << 61)
+#define NETSTACKLAT_EPOLL_METRICS (1ULL << 60)
+#define NETSTACKLAT_EPOLL_METRICS_CLIENT (1ULL << 59)
+#define NETSTACKLAT_EPOLL_TYPE_MASK                            \
+	(NETSTACKLAT_EPOLL_SIG | NETSTACKLAT_EPOLL_TIMER |   \
+	 NETSTACKLAT_EPOLL_RINGBUF | NETSTACKLAT_EPOLL_METRICS | \
+	 NETSTACKLAT_EPOLL_METRICS_CLIENT)
 
 // Magical value used to indicate that the program should be aborted
 #define NETSTACKLAT_ABORT 424242
@@ -49,17 +63,154 @@ static const char *__doc__ =
 // Maximum number of different pids that can be filtered for
 #define MAX_FILTER_PIDS 4096
 
+// Maximum number of groups that can be selected for reporting
+#define MAX_REPORT_GROUPS 256
+
+// Number of grouped histogram entries to fetch per batch
+#define GROUPED_HIST_BATCH_SIZE 256
+
+/*
+ * In the percentile report, a group is flagged as an outlier if its p99 is at
+ * least this many times higher than the median p99 of all groups for the same
+ * hook. The percentiles are bucket upper bounds, and with both histogram types
+ * a bound multiplied by a power of 2 is another bound (two buckets up for the
+ * exp2 histograms, two groups of sub-buckets up for the log-linear ones), so
+ * this should be a power of 2 as well.
+ */
+#define OUTLIER_P99_FACTOR 4
+
+// Number of distinct flows and processes tracked per report interval
+#define OUTLIER_TABLE_SIZE 4096
+
+// Max size of a HTTP request to the metrics endpoint (only the start is parsed)
+#define METRICS_MAX_REQUEST_SIZE 4096
+
+// Maximum number of metrics clients served at the same time
+#define METRICS_MAX_CLIENTS 16
+
+// Time (in seconds) a client gets to send its request and receive the response
+#define METRICS_CLIENT_TIMEOUT_S 5
+
+#define METRICS_CONTENT_TYPE \
+	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/*
+ * Number of attempts to get a consistent read of a histogram shard, before
+ * settling for a possibly inconsistent one (if a CPU keeps updating it)
+ */
+#define HIST_SHARD_MAX_READS 16
+
+// Number of flows and processes to show in the outlier report
+#define OUTLIER_TOP_N 10
+
+// Number of per-process histograms to fetch per batch
+#define PROCESS_HIST_BATCH_SIZE 64
+
 struct hook_prog_collection {
 	struct bpf_program *progs[MAX_HOOK_PROGS];
 	int nprogs;
 };
 
+/*
+ * A group to report the grouped histograms for. Uses the same encoding as
+ * struct grouped_hist_key, and a member of 0 matches any value.
+ */
+struct report_group {
+	__u64 cgroup;
+	__u64 netns;
+	__u32 cpu;
+	__u32 rxqueue;
+};
+
+enum group_dim {
+	GROUP_DIM_CGROUP,
+	GROUP_DIM_NETNS,
+	GROUP_DIM_CPU,
+	GROUP_DIM_RXQUEUE,
+	GROUP_N_DIMS,
+};
+
+struct group_percentiles {
+	struct grouped_hist_key key;
+	__u64 count;
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+};
+
+struct grouped_hist_entry {
+	struct grouped_hist_key key;
+	__u64 count;
+};
+
+/*
+ * Aggregated outlier events for a flow or process. Which of the keys is used
+ * depends on the table the entry is in.
+ */
+struct outlier_entry {
+	bool used;
+	struct netstacklat_flow flow;
+	__u32 pid;
+	char comm[16];
+	__u64 count;
+	__u64 max_latency;
+	__u32 max_hook;
+};
+
+// A per-process socket read histogram, with its count and percentiles
+struct process_hist_entry {
+	struct process_hist_key key;
+	struct process_hist hist;
+	__u64 count;
+	double p50;
+	double p99;
+};
+
+// The memory-mapped histogram shards (see struct hist_shard)
+struct hist_shards {
+	const struct hist_shard *shards;
+	int nshards;
+	size_t mmap_size;
+};
+
+// A window of the sliding-window histograms, made up of nslots slots of ring
+struct hist_window {
+	const char *name;
+	enum hist_window_ring ring;
+	int nslots;
+};
+
+static const struct hist_window hist_windows[] = {
+	{ "1s", HIST_WINDOW_RING_1S, 1 },
+	{ "10s", HIST_WINDOW_RING_1S, 10 },
+	{ "60s", HIST_WINDOW_RING_10S, 6 },
+};
+
+struct outlier_tracker {
+	struct ring_buffer *rb;
+	int rl_map_fd;
+	__u64 nevents;
+	__u64 untracked;
+	__u64 prev_ratelimited;
+	__u64 prev_dropped;
+	struct outlier_entry flows[OUTLIER_TABLE_SIZE];
+	struct outlier_entry procs[OUTLIER_TABLE_SIZE];
+};
+
 struct netstacklat_config {
 	struct netstacklat_bpf_config bpf_conf;
 	double report_interval_s;
 	bool enabled_hooks[NETSTACKLAT_N_HOOKS];
+	bool report_percentiles;
+	const char *metrics_addr;
 	int npids;
+	int ncgroups;
+	int nreport_groups;
+	int top_processes;
 	__u32 pids[MAX_FILTER_PIDS];
+	__u64 cgroups[CGROUP_FILTER_MAX_ENTRIES];
+	struct report_group report_groups[MAX_REPORT_GROUPS];
 };
 
 static const struct option long_options[] = {
@@ -69,6 +220,18 @@ static const struct option long_options[] = {
 	{ "enable-probes",   required_argument, NULL, 'e' },
 	{ "disable-probes",  required_argument, NULL, 'd' },
 	{ "pids",            required_argument, NULL, 'p' },
+	{ "cgroups",         required_argument, NULL, 'c' },
+	{ "groupby",         required_argument, NULL, 'g' },
+	{ "report-groups",   required_argument, NULL, 'G' },
+	{ "percentiles",     no_argument,       NULL, 'P' },
+	{ "hist-type",       required_argument, NULL, 't' },
+	{ "single-map",      no_argument,       NULL, 'S' },
+	{ "mmap-hist",       no_argument,       NULL, 'M' },
+	{ "windows",         no_argument,       NULL, 'w' },
+	{ "outlier-threshold", required_argument, NULL, 'T' },
+	{ "outlier-rate",    required_argument, NULL, 'R' },
+	{ "metrics-listen",  required_argument, NULL, 'm' },
+	{ "top-processes",   required_argument, NULL, 'n' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -162,6 +325,18 @@ static const char *hook_to_str(enum netstacklat_hook hook)
 		return "tcp-socket-read";
 	case NETSTACKLAT_HOOK_UDP_SOCK_READ:
 		return "udp-socket-read";
+	case NETSTACKLAT_HOOK_DEV_QUEUE_XMIT:
+		return "dev-queue-xmit";
+	case NETSTACKLAT_HOOK_QDISC_DEQUEUE:
+		return "qdisc-dequeue";
+	case NETSTACKLAT_HOOK_NET_DEV_XMIT:
+		return "net-dev-xmit";
+	case NETSTACKLAT_HOOK_NAPI_GRO:
+		return "napi-gro";
+	case NETSTACKLAT_HOOK_BACKLOG_ENQUEUE:
+		return "backlog-enqueue";
+	case NETSTACKLAT_HOOK_NETIF_RECEIVE:
+		return "netif-receive";
 	default:
 		return "invalid";
 	}
@@ -196,37 +371,55 @@ static const char *hook_to_description(enum netstacklat_hook hook)
 		return "packet payload has been read from TCP socket, i.e. delivered to user space";
 	case NETSTACKLAT_HOOK_UDP_SOCK_READ:
 		return "packet payload has been read from UDP socket, i.e. delivered to user space";
+	case NETSTACKLAT_HOOK_DEV_QUEUE_XMIT:
+		return "sent packet has reached the device layer, i.e. past the IP (and routing) stack";
+	case NETSTACKLAT_HOOK_QDISC_DEQUEUE:
+		return "sent packet has been dequeued from the qdisc, i.e. past the traffic control layer";
+	case NETSTACKLAT_HOOK_NET_DEV_XMIT:
+		return "sent packet has been passed to the device driver, i.e. end of the kernel transmit stack";
+	case NETSTACKLAT_HOOK_NAPI_GRO:
+		return "time from driver passing packet to GRO until it leaves GRO (not relative to the RX timestamp)";
+	case NETSTACKLAT_HOOK_BACKLOG_ENQUEUE:
+		return "time from packet being enqueued to the backlog of a CPU (by RPS or netif_rx) until it is dequeued (not relative to the RX timestamp)";
+	case NETSTACKLAT_HOOK_NETIF_RECEIVE:
+		return "packet is passed to the protocol handlers, i.e. past the backlog (for RPS) and GRO";
 	default:
 		return "not a valid hook";
 	}
 }
 
-static int hook_to_histmap(enum netstacklat_hook hook,
-			   const struct netstacklat_bpf *obj)
+static struct bpf_map *hook_to_histmap(enum netstacklat_hook hook,
+				       const struct netstacklat_bpf *obj)
 {
 	switch (hook) {
 	case NETSTACKLAT_HOOK_IP_RCV:
-		return bpf_map__fd(obj->maps.netstack_latency_ip_start_seconds);
+		return obj->maps.netstack_latency_ip_start_seconds;
 	case NETSTACKLAT_HOOK_TCP_START:
-		return bpf_map__fd(
-			obj->maps.netstack_latency_tcp_start_seconds);
+		return obj->maps.netstack_latency_tcp_start_seconds;
 	case NETSTACKLAT_HOOK_UDP_START:
-		return bpf_map__fd(
-			obj->maps.netstack_latency_udp_start_seconds);
+		return obj->maps.netstack_latency_udp_start_seconds;
 	case NETSTACKLAT_HOOK_TCP_SOCK_ENQUEUED:
-		return bpf_map__fd(
-			obj->maps.netstack_latency_tcp_sock_enqueued_seconds);
+		return obj->maps.netstack_latency_tcp_sock_enqueued_seconds;
 	case NETSTACKLAT_HOOK_UDP_SOCK_ENQUEUED:
-		return bpf_map__fd(
-			obj->maps.netstack_latency_udp_sock_enqueued_seconds);
+		return obj->maps.netstack_latency_udp_sock_enqueued_seconds;
 	case NETSTACKLAT_HOOK_TCP_SOCK_READ:
-		return bpf_map__fd(
-			obj->maps.netstack_latency_tcp_sock_read_seconds);
+		return obj->maps.netstack_latency_tcp_sock_read_seconds;
 	case NETSTACKLAT_HOOK_UDP_SOCK_READ:
-		return bpf_map__fd(
-			obj->maps.netstack_latency_udp_sock_read_seconds);
+		return obj->maps.netstack_latency_udp_sock_read_seconds;
+	case NETSTACKLAT_HOOK_DEV_QUEUE_XMIT:
+		return obj->maps.netstack_latency_dev_queue_xmit_seconds;
+	case NETSTACKLAT_HOOK_QDISC_DEQUEUE:
+		return obj->maps.netstack_latency_qdisc_dequeue_seconds;
+	case NETSTACKLAT_HOOK_NET_DEV_XMIT:
+		return obj->maps.netstack_latency_net_dev_xmit_seconds;
+	case NETSTACKLAT_HOOK_NAPI_GRO:
+		return obj->maps.netstack_latency_napi_gro_seconds;
+	case NETSTACKLAT_HOOK_BACKLOG_ENQUEUE:
+		return obj->maps.netstack_latency_backlog_enqueue_seconds;
+	case NETSTACKLAT_HOOK_NETIF_RECEIVE:
+		return obj->maps.netstack_latency_netif_receive_seconds;
 	default:
-		return -EINVAL;
+		return NULL;
 	}
 }
 
@@ -268,12 +461,48 @@ static void hook_to_progs(struct hook_prog_collection *progs,
 		progs->progs[0] = obj->progs.netstacklat_skb_consume_udp;
 		progs->nprogs = 1;
 		break;
+	case NETSTACKLAT_HOOK_DEV_QUEUE_XMIT:
+		progs->progs[0] = obj->progs.netstacklat_dev_queue_xmit;
+		progs->nprogs = 1;
+		break;
+	case NETSTACKLAT_HOOK_QDISC_DEQUEUE:
+		progs->progs[0] = obj->progs.netstacklat_qdisc_dequeue;
+		progs->nprogs = 1;
+		break;
+	case NETSTACKLAT_HOOK_NET_DEV_XMIT:
+		progs->progs[0] = obj->progs.netstacklat_net_dev_xmit;
+		progs->nprogs = 1;
+		break;
+	case NETSTACKLAT_HOOK_NAPI_GRO:
+		progs->progs[0] = obj->progs.netstacklat_napi_gro_receive;
+		progs->progs[1] = obj->progs.netstacklat_napi_gro_receive_exit;
+		progs->progs[2] = obj->progs.netstacklat_napi_gro_done;
+		progs->nprogs = 3;
+		break;
+	case NETSTACKLAT_HOOK_BACKLOG_ENQUEUE:
+		progs->progs[0] = obj->progs.netstacklat_enqueue_to_backlog;
+		progs->progs[1] = obj->progs.netstacklat_backlog_dequeue;
+		progs->nprogs = 2;
+		break;
+	case NETSTACKLAT_HOOK_NETIF_RECEIVE:
+		progs->progs[0] = obj->progs.netstacklat_netif_receive_skb;
+		progs->nprogs = 1;
+		break;
 	default:
 		progs->nprogs = 0;
 		break;
 	}
 }
 
+/*
+ * The napi-gro hook adds an fentry and an fexit program to every packet passed
+ * to GRO, so it is only enabled on request.
+ */
+static bool hook_enabled_by_default(enum netstacklat_hook hook)
+{
+	return hook != NETSTACKLAT_HOOK_NAPI_GRO;
+}
+
 static void list_hooks(FILE *stream)
 {
 	enum netstacklat_hook hook;
@@ -403,6 +632,307 @@ exit:
 	return err ?: i;
 }
 
+/*
+ * Parses a comma-delimited list of cgroups, given either as cgroup IDs or as
+ * paths (relative paths are relative to the cgroup2 mount at /sys/fs/cgroup).
+ * For cgroup2, the cgroup ID is the inode number of the cgroup directory.
+ */
+static int parse_cgroups(size_t size, __u64 arr[size], const char *_str,
+			 const char *name)
+{
+	char *cgstr, *str, path[PATH_MAX];
+	char *tokp = NULL, *endptr;
+	int err = 0, i = 0;
+	struct stat st;
+
+	str = malloc(strlen(_str) + 1);
+	if (!str)
+		return -ENOMEM;
+	strcpy(str, _str);
+
+	cgstr = strtok_r(str, ",", &tokp);
+	while (cgstr && i < size) {
+		errno = 0;
+		arr[i] = strtoull(cgstr, &endptr, 10);
+		if (*endptr == '\0' && errno == 0 && arr[i] > 0)
+			goto next;
+
+		if (snprintf(path, sizeof(path), "%s%s",
+			     cgstr[0] == '/' ? "" : "/sys/fs/cgroup/",
+			     cgstr) >= sizeof(path)) {
+			err = -ENAMETOOLONG;
+			goto exit;
+		}
+
+		if (stat(path, &st)) {
+			err = -errno;
+			fprintf(stderr, "%s %s: failed to stat %s: %s\n", name,
+				cgstr, path, strerror(errno));
+			goto exit;
+		}
+		arr[i] = st.st_ino;
+
+next:
+		cgstr = strtok_r(NULL, ",", &tokp);
+		i++;
+	}
+
+	if (cgstr)
+		// Parsed size cgroups, but more still remain
+		err = -E2BIG;
+
+exit:
+	free(str);
+	return err ?: i;
+}
+
+static const char *group_dim_to_str(enum group_dim dim)
+{
+	switch (dim) {
+	case GROUP_DIM_CGROUP:
+		return "cgroup";
+	case GROUP_DIM_NETNS:
+		return "netns";
+	case GROUP_DIM_CPU:
+		return "cpu";
+	case GROUP_DIM_RXQUEUE:
+		return "rxqueue";
+	default:
+		return "invalid";
+	}
+}
+
+static enum group_dim str_to_group_dim(const char *str, size_t len)
+{
+	enum group_dim dim;
+
+	for (dim = 0; dim < GROUP_N_DIMS; dim++) {
+		if (strlen(group_dim_to_str(dim)) == len &&
+		    strncmp(str, group_dim_to_str(dim), len) == 0)
+			return dim;
+	}
+
+	return GROUP_N_DIMS;
+}
+
+static bool grouping_enabled(const struct netstacklat_bpf_config *conf)
+{
+	return conf->groupby_cgroup || conf->groupby_netns ||
+	       conf->groupby_cpu || conf->groupby_rxqueue;
+}
+
+/*
+ * Parses a comma-delimited string of dimensions (cgroup, netns, cpu or
+ * rxqueue) to group the histograms by.
+ */
+static int parse_groupby(struct netstacklat_bpf_config *conf, const char *_str)
+{
+	char *tokp = NULL;
+	char str[1024];
+	char *dimstr;
+
+	if (strlen(_str) >= sizeof(str))
+		return -E2BIG;
+	strcpy(str, _str);
+
+	dimstr = strtok_r(str, ",", &tokp);
+	while (dimstr) {
+		switch (str_to_group_dim(dimstr, strlen(dimstr))) {
+		case GROUP_DIM_CGROUP:
+			conf->groupby_cgroup = true;
+			break;
+		case GROUP_DIM_NETNS:
+			conf->groupby_netns = true;
+			break;
+		case GROUP_DIM_CPU:
+			conf->groupby_cpu = true;
+			break;
+		case GROUP_DIM_RXQUEUE:
+			conf->groupby_rxqueue = true;
+			break;
+		default:
+			fprintf(stderr,
+				"%s is not a valid group (cgroup, netns, cpu or rxqueue)\n",
+				dimstr);
+			return -EINVAL;
+		}
+
+		dimstr = strtok_r(NULL, ",", &tokp);
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a comma-delimited string of groups in the form cgroup:<id>,
+ * netns:<cookie>, cpu:<id> or rxqueue:<queue> into arr. Returns the number of
+ * parsed groups or a negative error code.
+ */
+static int parse_report_groups(size_t size, struct report_group arr[size],
+			       const char *_str)
+{
+	char *groupstr, *str, *valstr;
+	char *tokp = NULL;
+	int err = 0, i = 0;
+	enum group_dim dim;
+	char *endptr;
+	__u64 val;
+
+	str = malloc(strlen(_str) + 1);
+	if (!str)
+		return -ENOMEM;
+	strcpy(str, _str);
+
+	groupstr = strtok_r(str, ",", &tokp);
+	while (groupstr && i < size) {
+		memset(&arr[i], 0, sizeof(arr[i]));
+
+		valstr = strchr(groupstr, ':');
+		dim = valstr ? str_to_group_dim(groupstr, valstr - groupstr) :
+			       GROUP_N_DIMS;
+		if (dim == GROUP_N_DIMS) {
+			fprintf(stderr,
+				"%s is not a valid group (cgroup:<id>, netns:<cookie>, cpu:<id> or rxqueue:<queue>)\n",
+				groupstr);
+			err = -EINVAL;
+			goto exit;
+		}
+		valstr++;
+
+		errno = 0;
+		val = strtoull(valstr, &endptr, 0);
+		if (endptr == valstr || *endptr != '\0' || errno ||
+		    ((dim == GROUP_DIM_CGROUP || dim == GROUP_DIM_NETNS) &&
+		     val == 0) ||
+		    ((dim == GROUP_DIM_CPU || dim == GROUP_DIM_RXQUEUE) &&
+		     val >= UINT32_MAX)) {
+			fprintf(stderr, "%s is not a valid %s\n", valstr,
+				group_dim_to_str(dim));
+			err = -EINVAL;
+			goto exit;
+		}
+
+		switch (dim) {
+		case GROUP_DIM_CGROUP:
+			arr[i].cgroup = val;
+			break;
+		case GROUP_DIM_NETNS:
+			arr[i].netns = val;
+			break;
+		case GROUP_DIM_CPU:
+			arr[i].cpu = val + 1;
+			break;
+		case GROUP_DIM_RXQUEUE:
+			arr[i].rxqueue = val + 1;
+			break;
+		default:
+			break;
+		}
+
+		groupstr = strtok_r(NULL, ",", &tokp);
+		i++;
+	}
+
+	if (groupstr)
+		err = -E2BIG;
+
+exit:
+	free(str);
+	return err ?: i;
+}
+
+static int parse_duration_ns(__u64 *res, const char *str, const char *name)
+{
+	static const struct {
+		const char *suffix;
+		double multiplier;
+	} units[] = {
+		{ "ns", 1 },
+		{ "us", 1e3 },
+		{ "ms", 1e6 },
+		{ "s", 1e9 },
+	};
+	char *endptr;
+	double val;
+	int i;
+
+	errno = 0;
+	val = strtod(str, &endptr);
+	if (endptr == str || errno || val < 0) {
+		fprintf(stderr, "%s %s is not a valid duration\n", name, str);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(units); i++) {
+		if (strcmp(endptr, units[i].suffix) == 0) {
+			*res = val * units[i].multiplier;
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "%s %s lacks a valid unit (ns, us, ms or s)\n", name,
+		str);
+	return -EINVAL;
+}
+
+/*
+ * Parses a comma-delimited list of [hook:]duration, where a duration without a
+ * hook applies to all hooks.
+ */
+static int parse_outlier_thresholds(__u64 thresholds[NETSTACKLAT_N_HOOKS],
+				    const char *_str, const char *name)
+{
+	char *tokp = NULL, *tok, *sep;
+	enum netstacklat_hook hook;
+	char str[1024];
+	__u64 val;
+	int err;
+
+	if (strlen(_str) >= sizeof(str))
+		return -E2BIG;
+	strcpy(str, _str);
+
+	tok = strtok_r(str, ",", &tokp);
+	while (tok) {
+		sep = strchr(tok, ':');
+		if (sep)
+			*sep = '\0';
+
+		err = parse_duration_ns(&val, sep ? sep + 1 : tok, name);
+		if (err)
+			return err;
+
+		if (sep) {
+			hook = str_to_hook(tok);
+			if (hook == NETSTACKLAT_HOOK_INVALID) {
+				fprintf(stderr, "%s is not a valid hook\n",
+					tok);
+				return -EINVAL;
+			}
+			thresholds[hook] = val;
+		} else {
+			for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++)
+				thresholds[hook] = val;
+		}
+
+		tok = strtok_r(NULL, ",", &tokp);
+	}
+
+	return 0;
+}
+
+static bool outliers_enabled(const struct netstacklat_bpf_config *conf)
+{
+	int i;
+
+	for (i = 0; i < NETSTACKLAT_N_HOOKS; i++) {
+		if (conf->outlier_thresholds[i])
+			return true;
+	}
+
+	return false;
+}
+
 static int parse_arguments(int argc, char *argv[],
 			   struct netstacklat_config *conf)
 {
@@ -410,14 +940,32 @@ static int parse_arguments(int argc, char *argv[],
 	bool hooks[NETSTACKLAT_N_HOOKS];
 	int opt, err, ret, i;
 	char optstr[64];
+	long long lval;
 	double fval;
 
 	conf->npids = 0;
+	conf->ncgroups = 0;
+	conf->nreport_groups = 0;
+	conf->top_processes = 0;
 	conf->bpf_conf.filter_pid = false;
+	conf->bpf_conf.filter_cgroup = false;
+	conf->bpf_conf.groupby_cgroup = false;
+	conf->bpf_conf.groupby_netns = false;
+	conf->bpf_conf.groupby_cpu = false;
+	conf->bpf_conf.groupby_rxqueue = false;
+	conf->report_percentiles = false;
+	conf->metrics_addr = NULL;
+	conf->bpf_conf.loglinear_hist = false;
+	conf->bpf_conf.single_hist_map = false;
+	conf->bpf_conf.mmap_hist = false;
+	conf->bpf_conf.hist_windows = false;
+	conf->bpf_conf.process_hist = false;
+	conf->bpf_conf.outlier_rate_limit = 100;
+	memset(conf->bpf_conf.outlier_thresholds, 0,
+	       sizeof(conf->bpf_conf.outlier_thresholds));
 
 	for (i = 0; i < NETSTACKLAT_N_HOOKS; i++)
-		// All probes enabled by default
-		conf->enabled_hooks[i] = true;
+		conf->enabled_hooks[i] = hook_enabled_by_default(i);
 
 	ret = generate_optstr(optstr, sizeof(optstr));
 	if (ret < 0) {
@@ -431,11 +979,18 @@ static int parse_arguments(int argc, char *argv[],
 		switch (opt) {
 		case 'r': // report interval
 			err = parse_bounded_double(
-				&fval, optarg, 0.01, 3600 * 24,
+				&fval, optarg, 0, 3600 * 24,
 				optval_to_longopt(opt)->name);
 			if (err)
 				return err;
 
+			if (fval > 0 && fval < 0.01) {
+				fprintf(stderr,
+					"%s must be 0 (disabled) or at least 0.01\n",
+					optval_to_longopt(opt)->name);
+				return -ERANGE;
+			}
+
 			conf->report_interval_s = fval;
 			break;
 		case 'l': // list-probes
@@ -456,7 +1011,8 @@ static int parse_arguments(int argc, char *argv[],
 				return err;
 
 			for (i = 1; i < NETSTACKLAT_N_HOOKS; i++)
-				conf->enabled_hooks[i] = !hooks[i];
+				conf->enabled_hooks[i] =
+					!hooks[i] && hook_enabled_by_default(i);
 			hooks_off = true;
 			break;
 		case 'p': // filter-pids
@@ -469,6 +1025,85 @@ static int parse_arguments(int argc, char *argv[],
 			conf->npids += ret;
 			conf->bpf_conf.filter_pid = true;
 			break;
+		case 'c': // cgroups
+			ret = parse_cgroups(
+				ARRAY_SIZE(conf->cgroups) - conf->ncgroups,
+				conf->cgroups + conf->ncgroups, optarg,
+				optval_to_longopt(opt)->name);
+			if (ret < 0)
+				return ret;
+
+			conf->ncgroups += ret;
+			conf->bpf_conf.filter_cgroup = true;
+			break;
+		case 'g': // groupby
+			err = parse_groupby(&conf->bpf_conf, optarg);
+			if (err)
+				return err;
+			break;
+		case 'G': // report-groups
+			ret = parse_report_groups(
+				ARRAY_SIZE(conf->report_groups) -
+					conf->nreport_groups,
+				conf->report_groups + conf->nreport_groups,
+				optarg);
+			if (ret < 0)
+				return ret;
+
+			conf->nreport_groups += ret;
+			break;
+		case 'P': // percentiles
+			conf->report_percentiles = true;
+			break;
+		case 't': // hist-type
+			if (strcmp(optarg, "exp2") == 0) {
+				conf->bpf_conf.loglinear_hist = false;
+			} else if (strcmp(optarg, "loglinear") == 0) {
+				conf->bpf_conf.loglinear_hist = true;
+			} else {
+				fprintf(stderr,
+					"%s is not a valid %s (exp2 or loglinear)\n",
+					optarg, optval_to_longopt(opt)->name);
+				return -EINVAL;
+			}
+			break;
+		case 'S': // single-map
+			conf->bpf_conf.single_hist_map = true;
+			break;
+		case 'M': // mmap-hist
+			conf->bpf_conf.mmap_hist = true;
+			break;
+		case 'w': // windows
+			conf->bpf_conf.hist_windows = true;
+			break;
+		case 'T': // outlier-threshold
+			err = parse_outlier_thresholds(
+				conf->bpf_conf.outlier_thresholds, optarg,
+				optval_to_longopt(opt)->name);
+			if (err)
+				return err;
+			break;
+		case 'R': // outlier-rate
+			err = parse_bounded_long(&lval, optarg, 1, 1000000,
+						 optval_to_longopt(opt)->name);
+			if (err)
+				return err;
+
+			conf->bpf_conf.outlier_rate_limit = lval;
+			break;
+		case 'm': // metrics-listen
+			conf->metrics_addr = optarg;
+			break;
+		case 'n': // top-processes
+			err = parse_bounded_long(&lval, optarg, 1,
+						 PROCESS_HIST_MAX_ENTRIES,
+						 optval_to_longopt(opt)->name);
+			if (err)
+				return err;
+
+			conf->top_processes = lval;
+			conf->bpf_conf.process_hist = true;
+			break;
 		case 'h': // help
 			print_usage(stdout, argv[0]);
 			exit(EXIT_SUCCESS);
@@ -487,6 +1122,30 @@ static int parse_arguments(int argc, char *argv[],
 		return -EINVAL;
 	}
 
+	if (conf->nreport_groups > 0 && !grouping_enabled(&conf->bpf_conf)) {
+		fprintf(stderr, "%s requires %s\n",
+			optval_to_longopt('G')->name,
+			optval_to_longopt('g')->name);
+		return -EINVAL;
+	}
+
+	if (conf->report_percentiles && !grouping_enabled(&conf->bpf_conf)) {
+		fprintf(stderr, "%s requires %s\n",
+			optval_to_longopt('P')->name,
+			optval_to_longopt('g')->name);
+		return -EINVAL;
+	}
+
+	if (conf->bpf_conf.process_hist &&
+	    !conf->enabled_hooks[NETSTACKLAT_HOOK_TCP_SOCK_READ] &&
+	    !conf->enabled_hooks[NETSTACKLAT_HOOK_UDP_SOCK_READ]) {
+		fprintf(stderr, "%s requires the %s or %s probe\n",
+			optval_to_longopt('n')->name,
+			hook_to_str(NETSTACKLAT_HOOK_TCP_SOCK_READ),
+			hook_to_str(NETSTACKLAT_HOOK_UDP_SOCK_READ));
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
@@ -578,8 +1237,35 @@ static void print_histbar(FILE *stream, __u64 count, __u64 max_count)
 	fprintf(stream, "|");
 }
 
-static void print_log2hist(FILE *stream, size_t n, const __u64 hist[n],
-			   double multiplier)
+/*
+ * Returns the (inclusive) upper bound of the histogram bucket, see
+ * get_exp2_histogram_bucket_idx() and get_loglinear_histogram_bucket_idx() in
+ * netstacklat.bpf.c.
+ */
+static double hist_bucket_high_bound(bool loglinear, int bucket)
+{
+	int group, sub;
+
+	if (!loglinear)
+		return pow(2, bucket);
+
+	// The upper bound of a bucket is the lower bound of the next one
+	bucket++;
+	if (bucket < HIST_LOGLIN_SUBBUCKETS)
+		return bucket;
+
+	group = bucket / HIST_LOGLIN_SUBBUCKETS;
+	sub = bucket % HIST_LOGLIN_SUBBUCKETS;
+	return ldexp(HIST_LOGLIN_SUBBUCKETS + sub, group - 1);
+}
+
+static size_t hist_nbuckets(const struct netstacklat_bpf_config *conf)
+{
+	return conf->loglinear_hist ? HIST_LOGLIN_NBUCKETS : HIST_NBUCKETS;
+}
+
+static void print_hist(FILE *stream, size_t n, const __u64 hist[n],
+		       double multiplier, bool loglinear)
 {
 	int bucket, start_bucket, end_bucket, max_bucket, len;
 	double low_bound, high_bound, avg;
@@ -591,12 +1277,14 @@ static void print_log2hist(FILE *stream, size_t n, const __u64 hist[n],
 	max_bucket = find_largest_bucket(n - 1, hist);
 
 	for (bucket = max(0, start_bucket); bucket <= end_bucket; bucket++) {
-		low_bound = pow(2, bucket - 1) * multiplier;
-		high_bound = pow(2, bucket) * multiplier;
-
 		// First bucket includes 0 (i.e. [0, 1] rather than (0.5, 1])
-		if (bucket == 0)
-			low_bound = 0;
+		low_bound = bucket == 0 ? 0 :
+					  hist_bucket_high_bound(loglinear,
+								 bucket - 1) *
+						  multiplier;
+		high_bound = hist_bucket_high_bound(loglinear, bucket) *
+			     multiplier;
+
 		// Last bucket includes all values too large for the second-last bucket
 		if (bucket == n - 2)
 			high_bound = INFINITY;
@@ -636,9 +1324,9 @@ static void merge_percpu_hist(size_t n, int ncpus,
 	}
 }
 
-static int fetch_hist_map(int map_fd, __u64 hist[HIST_NBUCKETS])
+static int fetch_hist_map(int map_fd, size_t n, __u64 hist[n])
 {
-	__u32 in_batch, out_batch, count = HIST_NBUCKETS;
+	__u32 in_batch, out_batch, count = n;
 	int ncpus = libbpf_num_possible_cpus();
 	__u32 idx, buckets_fetched = 0;
 	__u64 (*percpu_hist)[ncpus];
@@ -647,14 +1335,14 @@ static int fetch_hist_map(int map_fd, __u64 hist[HIST_NBUCKETS])
 
 	DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, batch_opts, .flags = BPF_EXIST);
 
-	percpu_hist = calloc(HIST_NBUCKETS, sizeof(*percpu_hist));
-	keys = calloc(HIST_NBUCKETS, sizeof(*keys));
+	percpu_hist = calloc(n, sizeof(*percpu_hist));
+	keys = calloc(n, sizeof(*keys));
 	if (!percpu_hist || !keys) {
 		err = -ENOMEM;
 		goto exit;
 	}
 
-	while (buckets_fetched < HIST_NBUCKETS) {
+	while (buckets_fetched < n) {
 		err = bpf_map_lookup_batch(map_fd,
 					   buckets_fetched > 0 ? &in_batch : NULL,
 					   &out_batch, keys + buckets_fetched,
@@ -675,10 +1363,10 @@ static int fetch_hist_map(int map_fd, __u64 hist[HIST_NBUCKETS])
 
 		in_batch = out_batch;
 		buckets_fetched += count;
-		count = HIST_NBUCKETS - buckets_fetched;
+		count = n - buckets_fetched;
 	}
 
-	merge_percpu_hist(HIST_NBUCKETS, ncpus, percpu_hist, hist);
+	merge_percpu_hist(n, ncpus, percpu_hist, hist);
 
 exit:
 	free(percpu_hist);
@@ -686,32 +1374,1808 @@ exit:
 	return err;
 }
 
-static int report_stats(const struct netstacklat_config *conf,
-			const struct netstacklat_bpf *obj)
-{
+/*
+ * Fetches the exp2 histograms of all hooks from the netstack_latency_seconds
+ * map (see struct hook_hist_key). Buckets that have not been used yet are not
+ * in the map, and are left at 0.
+ */
+static int fetch_hook_hist_map(int map_fd,
+			       __u64 hists[NETSTACKLAT_N_HOOKS][HIST_LOGLIN_NBUCKETS])
+{
+	__u32 n = NETSTACKLAT_N_HOOKS * HIST_NBUCKETS, count = n, i;
+	int ncpus = libbpf_num_possible_cpus();
+	struct hook_hist_key *keys = NULL;
+	__u32 in_batch, out_batch;
+	__u64 (*percpu_vals)[ncpus];
+	bool first_batch = true;
+	int err = 0, cpu;
+
+	memset(hists, 0, sizeof(*hists) * NETSTACKLAT_N_HOOKS);
+
+	keys = calloc(n, sizeof(*keys));
+	percpu_vals = calloc(n, sizeof(*percpu_vals));
+	if (!keys || !percpu_vals) {
+		err = -ENOMEM;
+		goto exit;
+	}
+
+	do {
+		count = n;
+		err = bpf_map_lookup_batch(map_fd,
+					   first_batch ? NULL : &in_batch,
+					   &out_batch, keys, percpu_vals,
+					   &count, NULL);
+		if (err && err != -ENOENT)
+			goto exit;
+
+		for (i = 0; i < count; i++) {
+			if (keys[i].hook >= NETSTACKLAT_N_HOOKS ||
+			    keys[i].bucket >= HIST_NBUCKETS)
+				continue;
+
+			for (cpu = 0; cpu < ncpus; cpu++)
+				hists[keys[i].hook][keys[i].bucket] +=
+					percpu_vals[i][cpu];
+		}
+
+		in_batch = out_batch;
+		first_batch = false;
+	} while (!err);
+	err = 0; // -ENOENT indicates all entries have been fetched
+
+exit:
+	free(keys);
+	free(percpu_vals);
+	return err;
+}
+
+static int cmp_grouped_hist_entry(const void *a, const void *b)
+{
+	const struct grouped_hist_key *ka, *kb;
+
+	ka = &((const struct grouped_hist_entry *)a)->key;
+	kb = &((const struct grouped_hist_entry *)b)->key;
+
+	if (ka->cgroup != kb->cgroup)
+		return ka->cgroup < kb->cgroup ? -1 : 1;
+	if (ka->netns != kb->netns)
+		return ka->netns < kb->netns ? -1 : 1;
+	if (ka->cpu != kb->cpu)
+		return ka->cpu < kb->cpu ? -1 : 1;
+	if (ka->rxqueue != kb->rxqueue)
+		return ka->rxqueue < kb->rxqueue ? -1 : 1;
+	if (ka->hook != kb->hook)
+		return ka->hook < kb->hook ? -1 : 1;
+	if (ka->bucket != kb->bucket)
+		return ka->bucket < kb->bucket ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Fetches all entries from the grouped histogram map, merges the per-CPU
+ * values and sorts them by group, hook and bucket. On success, *entries must
+ * be freed by the caller.
+ */
+static int fetch_grouped_hists(const struct bpf_map *map,
+			       struct grouped_hist_entry **entries,
+			       size_t *nentries)
+{
+	__u32 max_entries = bpf_map__max_entries(map);
+	int ncpus = libbpf_num_possible_cpus();
+	int map_fd = bpf_map__fd(map);
+	struct grouped_hist_key *keys = NULL;
+	struct grouped_hist_entry *ents;
+	__u32 in_batch, out_batch, count;
+	__u64 (*percpu_vals)[ncpus];
+	bool first_batch = true;
+	size_t n = 0;
+	int err = 0, i, cpu;
+
+	ents = calloc(max_entries, sizeof(*ents));
+	keys = calloc(GROUPED_HIST_BATCH_SIZE, sizeof(*keys));
+	percpu_vals = calloc(GROUPED_HIST_BATCH_SIZE, sizeof(*percpu_vals));
+	if (!ents || !keys || !percpu_vals) {
+		err = -ENOMEM;
+		goto exit;
+	}
+
+	do {
+		count = GROUPED_HIST_BATCH_SIZE;
+		err = bpf_map_lookup_batch(map_fd,
+					   first_batch ? NULL : &in_batch,
+					   &out_batch, keys, percpu_vals,
+					   &count, NULL);
+		if (err && err != -ENOENT)
+			goto exit;
+
+		for (i = 0; i < count && n < max_entries; i++) {
+			ents[n].key = keys[i];
+			ents[n].count = 0;
+			for (cpu = 0; cpu < ncpus; cpu++)
+				ents[n].count += percpu_vals[i][cpu];
+			n++;
+		}
+
+		in_batch = out_batch;
+		first_batch = false;
+	} while (!err);
+	err = 0; // -ENOENT indicates all entries have been fetched
+
+	qsort(ents, n, sizeof(*ents), cmp_grouped_hist_entry);
+	*entries = ents;
+	*nentries = n;
+
+exit:
+	if (err)
+		free(ents);
+	free(keys);
+	free(percpu_vals);
+	return err;
+}
+
+static bool report_group_match(const struct netstacklat_config *conf,
+			       const struct grouped_hist_key *key)
+{
+	const struct report_group *group;
+	int i;
+
+	if (conf->nreport_groups == 0)
+		return true;
+
+	for (i = 0; i < conf->nreport_groups; i++) {
+		group = &conf->report_groups[i];
+		if ((!group->cgroup || group->cgroup == key->cgroup) &&
+		    (!group->netns || group->netns == key->netns) &&
+		    (!group->cpu || group->cpu == key->cpu) &&
+		    (!group->rxqueue || group->rxqueue == key->rxqueue))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Prints a member of the group. A raw value of 0 means the member is unknown.
+ * If offset is set, the value is stored as the ID + 1 (see struct
+ * grouped_hist_key).
+ */
+static void print_group_member(FILE *stream, const char **sep,
+			       enum group_dim dim, __u64 val, bool offset)
+{
+	fprintf(stream, "%s%s: ", *sep, group_dim_to_str(dim));
+	if (val)
+		fprintf(stream, "%llu", offset ? val - 1 : val);
+	else
+		fprintf(stream, "unknown");
+	*sep = ", ";
+}
+
+static void print_group_name(FILE *stream,
+			     const struct netstacklat_config *conf,
+			     const struct grouped_hist_key *key)
+{
+	const char *sep = "";
+
+	fprintf(stream, "(");
+	if (conf->bpf_conf.groupby_cgroup)
+		print_group_member(stream, &sep, GROUP_DIM_CGROUP, key->cgroup,
+				   false);
+	if (conf->bpf_conf.groupby_netns)
+		print_group_member(stream, &sep, GROUP_DIM_NETNS, key->netns,
+				   false);
+	if (conf->bpf_conf.groupby_cpu)
+		print_group_member(stream, &sep, GROUP_DIM_CPU, key->cpu, true);
+	if (conf->bpf_conf.groupby_rxqueue)
+		print_group_member(stream, &sep, GROUP_DIM_RXQUEUE,
+				   key->rxqueue, true);
+	fprintf(stream, ")");
+}
+
+static bool same_group_and_hook(const struct grouped_hist_key *a,
+				const struct grouped_hist_key *b)
+{
+	return a->cgroup == b->cgroup && a->netns == b->netns &&
+	       a->cpu == b->cpu && a->rxqueue == b->rxqueue &&
+	       a->hook == b->hook;
+}
+
+/*
+ * Builds the histogram for the group + hook of entries[start]. As the entries
+ * are sorted, each group + hook is a continuous range. Returns the index of
+ * the first entry after the range.
+ */
+static size_t build_group_hist(size_t nentries,
+			       const struct grouped_hist_entry entries[nentries],
+			       size_t start, size_t n, __u64 hist[n])
+{
+	size_t i;
+
+	memset(hist, 0, sizeof(*hist) * n);
+
+	for (i = start; i < nentries &&
+			same_group_and_hook(&entries[i].key, &entries[start].key);
+	     i++) {
+		if (entries[i].key.bucket < n)
+			hist[entries[i].key.bucket] = entries[i].count;
+	}
+
+	return i;
+}
+
+static bool report_group_hist(const struct netstacklat_config *conf,
+			      const struct grouped_hist_key *key, size_t n,
+			      const __u64 hist[n])
+{
+	if (key->hook >= NETSTACKLAT_N_HOOKS ||
+	    !conf->enabled_hooks[key->hook] || !report_group_match(conf, key))
+		return false;
+
+	// Skip pre-created but unused catch-all groups
+	return find_first_nonzero_bucket(n - 1, hist) >= 0;
+}
+
+/*
+ * Returns the upper bound (in ns) of the bucket the given percentile (0-1)
+ * falls into, i.e. the percentile rounded up to the histogram resolution.
+ */
+static double hist_percentile(size_t n, const __u64 hist[n], __u64 count,
+			      double percentile, bool loglinear)
+{
+	__u64 target = ceil(count * percentile), cumsum = 0;
+	int bucket;
+
+	// Final "bucket" is the sum, and the second-last has no upper bound
+	for (bucket = 0; bucket < n - 2; bucket++) {
+		cumsum += hist[bucket];
+		if (cumsum >= target)
+			return hist_bucket_high_bound(loglinear, bucket);
+	}
+
+	return INFINITY;
+}
+
+static void calc_group_percentiles(struct group_percentiles *gp,
+				   const struct grouped_hist_key *key,
+				   size_t n, const __u64 hist[n],
+				   bool loglinear)
+{
+	int bucket;
+
+	gp->key = *key;
+	gp->count = 0;
+	for (bucket = 0; bucket < n - 1; bucket++)
+		gp->count += hist[bucket];
+
+	gp->p50 = hist_percentile(n, hist, gp->count, 0.5, loglinear);
+	gp->p90 = hist_percentile(n, hist, gp->count, 0.9, loglinear);
+	gp->p99 = hist_percentile(n, hist, gp->count, 0.99, loglinear);
+	gp->p999 = hist_percentile(n, hist, gp->count, 0.999, loglinear);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static double median_p99(size_t n, const struct group_percentiles gps[n])
+{
+	double *p99s, median;
+	size_t i;
+
+	p99s = calloc(n, sizeof(*p99s));
+	if (!p99s)
+		return INFINITY; // Don't flag any outliers
+
+	for (i = 0; i < n; i++)
+		p99s[i] = gps[i].p99;
+	qsort(p99s, n, sizeof(*p99s), cmp_double);
+	median = n % 2 ? p99s[n / 2] : (p99s[n / 2 - 1] + p99s[n / 2]) / 2;
+
+	free(p99s);
+	return median;
+}
+
+static void print_percentile(FILE *stream, double ns)
+{
+	char *prefix;
+	double val;
+
+	if (isinf(ns)) {
+		fprintf(stream, " %9s", "inf");
+		return;
+	}
+
+	val = ns_to_siprefix(ns, &prefix);
+	fprintf(stream, " %7.3g%ss%s", val, prefix, *prefix ? "" : " ");
+}
+
+/*
+ * Prints a table with the percentiles of each group for the hook, flagging
+ * the groups whose p99 stand out compared to the other groups.
+ */
+static void print_group_percentiles(FILE *stream,
+				    const struct netstacklat_config *conf,
+				    enum netstacklat_hook hook, size_t n,
+				    const struct group_percentiles gps[n])
+{
+	double median;
+	size_t i;
+
+	if (n == 0)
+		return;
+
+	median = median_p99(n, gps);
+
+	fprintf(stream, "%s percentiles (upper bounds):\n", hook_to_str(hook));
+	fprintf(stream, "%*s %9s %9s %9s %9s  %s\n", MAX_BUCKETCOUNT_STRLEN,
+		"count", "p50", "p90", "p99", "p99.9", "group");
+
+	for (i = 0; i < n; i++) {
+		fprintf(stream, "%*llu", MAX_BUCKETCOUNT_STRLEN, gps[i].count);
+		print_percentile(stream, gps[i].p50);
+		print_percentile(stream, gps[i].p90);
+		print_percentile(stream, gps[i].p99);
+		print_percentile(stream, gps[i].p999);
+		fprintf(stream, "  ");
+		print_group_name(stream, conf, &gps[i].key);
+
+		if (n > 1 && gps[i].p99 >= median * OUTLIER_P99_FACTOR)
+			fprintf(stream, " <- OUTLIER (p99 >= %dx median)",
+				OUTLIER_P99_FACTOR);
+		fprintf(stream, "\n");
+	}
+	fprintf(stream, "\n");
+}
+
+static int report_grouped_percentiles(const struct netstacklat_config *conf,
+				      size_t nentries,
+				      const struct grouped_hist_entry entries[nentries])
+{
+	size_t n = hist_nbuckets(&conf->bpf_conf);
+	struct group_percentiles *gps;
+	__u64 hist[HIST_LOGLIN_NBUCKETS];
+	enum netstacklat_hook hook;
+	size_t ngroups, i, j;
+
+	gps = calloc(nentries, sizeof(*gps));
+	if (!gps)
+		return -ENOMEM;
+
+	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
+		ngroups = 0;
+
+		for (i = 0; i < nentries; i = j) {
+			j = build_group_hist(nentries, entries, i, n, hist);
+
+			if (entries[i].key.hook != hook ||
+			    !report_group_hist(conf, &entries[i].key, n, hist))
+				continue;
+
+			calc_group_percentiles(&gps[ngroups++], &entries[i].key,
+					       n, hist,
+					       conf->bpf_conf.loglinear_hist);
+		}
+
+		print_group_percentiles(stdout, conf, hook, ngroups, gps);
+	}
+
+	free(gps);
+	return 0;
+}
+
+static int report_grouped_stats(const struct netstacklat_config *conf,
+				const struct netstacklat_bpf *obj)
+{
+	size_t n = hist_nbuckets(&conf->bpf_conf);
+	struct grouped_hist_entry *entries;
+	__u64 hist[HIST_LOGLIN_NBUCKETS];
+	const struct grouped_hist_key *key;
+	size_t nentries, i, j;
+	int err;
+
+	err = fetch_grouped_hists(obj->maps.netstack_latency_grouped_seconds,
+				  &entries, &nentries);
+	if (err)
+		return err;
+
+	if (conf->report_percentiles) {
+		err = report_grouped_percentiles(conf, nentries, entries);
+		goto exit;
+	}
+
+	for (i = 0; i < nentries; i = j) {
+		key = &entries[i].key;
+		j = build_group_hist(nentries, entries, i, n, hist);
+
+		if (!report_group_hist(conf, key, n, hist))
+			continue;
+
+		printf("%s ", hook_to_str(key->hook));
+		print_group_name(stdout, conf, key);
+		printf(":\n");
+		print_hist(stdout, n, hist, 1, conf->bpf_conf.loglinear_hist);
+		printf("\n");
+	}
+
+exit:
+	free(entries);
+	return err;
+}
+
+/*
+ * Copies the histograms of a shard, retrying if the CPU updated it during the
+ * copy. Returns false if no consistent copy could be made.
+ */
+static bool read_hist_shard(const struct hist_shard *shard, size_t n,
+			    __u64 buckets[n])
+{
+	__u64 seq_start, seq_end;
+	int i;
+
+	for (i = 0; i < HIST_SHARD_MAX_READS; i++) {
+		seq_start = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+		memcpy(buckets, shard->buckets, n * sizeof(*buckets));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq_end = __atomic_load_n(&shard->seq, __ATOMIC_RELAXED);
+
+		if (seq_start == seq_end && !(seq_start & 1))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Sums up the histograms of all hooks over all shards. Does not perform any
+ * syscalls, so this is cheap enough to use with short report intervals.
+ */
+static void read_hist_shards(const struct hist_shards *shards, size_t nbuckets,
+			     __u64 hists[NETSTACKLAT_N_HOOKS][HIST_LOGLIN_NBUCKETS])
+{
+	__u64 buckets[NETSTACKLAT_N_HOOKS * HIST_LOGLIN_NBUCKETS];
+	size_t n = NETSTACKLAT_N_HOOKS * nbuckets;
+	int hook, cpu, inconsistent = 0;
+	size_t bucket;
+
+	memset(hists, 0, sizeof(*hists) * NETSTACKLAT_N_HOOKS);
+	for (cpu = 0; cpu < shards->nshards; cpu++) {
+		if (!read_hist_shard(&shards->shards[cpu], n, buckets))
+			inconsistent++;
+
+		for (hook = 0; hook < NETSTACKLAT_N_HOOKS; hook++) {
+			for (bucket = 0; bucket < nbuckets; bucket++)
+				hists[hook][bucket] +=
+					buckets[hook * nbuckets + bucket];
+		}
+	}
+
+	if (inconsistent)
+		fprintf(stderr,
+			"Warning: Failed to get a consistent read of the histograms from %d CPUs\n",
+			inconsistent);
+}
+
+/*
+ * Fetches the histograms of all enabled hooks, from whichever maps the
+ * histograms are currently stored in. Only the first hist_nbuckets() buckets
+ * of each histogram are used.
+ */
+static int fetch_hook_hists(const struct netstacklat_config *conf,
+			    const struct netstacklat_bpf *obj,
+			    const struct hist_shards *shards,
+			    __u64 hists[NETSTACKLAT_N_HOOKS][HIST_LOGLIN_NBUCKETS])
+{
+	__u64 hist[HIST_NBUCKETS];
+	enum netstacklat_hook hook;
+	int err;
+
+	if (shards) {
+		read_hist_shards(shards, hist_nbuckets(&conf->bpf_conf), hists);
+		return 0;
+	}
+
+	if (conf->bpf_conf.loglinear_hist)
+		// All hooks share the same map, so fetch them all at once
+		return fetch_hist_map(
+			bpf_map__fd(obj->maps.netstack_latency_loglinear_seconds),
+			NETSTACKLAT_N_HOOKS * HIST_LOGLIN_NBUCKETS, &hists[0][0]);
+
+	if (conf->bpf_conf.single_hist_map)
+		return fetch_hook_hist_map(
+			bpf_map__fd(obj->maps.netstack_latency_seconds), hists);
+
+	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
+		if (!conf->enabled_hooks[hook])
+			continue;
+
+		err = fetch_hist_map(bpf_map__fd(hook_to_histmap(hook, obj)),
+				     ARRAY_SIZE(hist), hist);
+		if (err)
+			return err;
+
+		memcpy(hists[hook], hist, sizeof(hist));
+	}
+
+	return 0;
+}
+
+/*
+ * Fetches all slots of the sliding-window histograms. The slots are returned
+ * per CPU, as each CPU rotates its slots independently.
+ */
+static int fetch_window_slots(int map_fd, int ncpus,
+			      struct hist_window_slot (**slots)[ncpus])
+{
+	__u32 n = NETSTACKLAT_N_HOOKS * HIST_WINDOW_N_RINGS * HIST_WINDOW_NSLOTS;
+	struct hist_window_slot (*percpu_slots)[ncpus];
+	__u32 in_batch, out_batch, count, fetched = 0;
+	__u32 *keys;
+	int err = 0;
+
+	percpu_slots = calloc(n, sizeof(*percpu_slots));
+	keys = calloc(n, sizeof(*keys));
+	if (!percpu_slots || !keys) {
+		err = -ENOMEM;
+		goto exit;
+	}
+
+	while (fetched < n) {
+		count = n - fetched;
+		err = bpf_map_lookup_batch(map_fd, fetched > 0 ? &in_batch : NULL,
+					   &out_batch, keys + fetched,
+					   percpu_slots + fetched, &count, NULL);
+		fetched += count;
+		if (err == -ENOENT) { // All entries fetched
+			err = 0;
+			break;
+		} else if (err) {
+			goto exit;
+		}
+
+		in_batch = out_batch;
+	}
+
+exit:
+	free(keys);
+	if (err)
+		free(percpu_slots);
+	else
+		*slots = percpu_slots;
+	return err;
+}
+
+/*
+ * Sums up the slots of the window for the hook. Only includes completed slots,
+ * i.e. the latest window (offset 0) ends at the start of the current slot, and
+ * the one before it (offset 1) ends where the latest one starts. Slots from
+ * before the system booted are simply missing if the uptime is shorter.
+ */
+static void build_window_hist(int ncpus,
+			      const struct hist_window_slot slots[][ncpus],
+			      enum netstacklat_hook hook,
+			      const struct hist_window *window, int offset,
+			      __u64 now_ns, __u64 hist[HIST_NBUCKETS])
+{
+	__u64 cur_epoch = now_ns / hist_window_slot_ns(window->ring);
+	__u64 end_back = (__u64)window->nslots * offset;
+	__u64 start_back = end_back + window->nslots;
+	const struct hist_window_slot *slot;
+	__u64 start_epoch, end_epoch;
+	__u32 idx, base;
+	int i, cpu;
+
+	memset(hist, 0, sizeof(*hist) * HIST_NBUCKETS);
+	base = (hook * HIST_WINDOW_N_RINGS + window->ring) * HIST_WINDOW_NSLOTS;
+	start_epoch = cur_epoch > start_back ? cur_epoch - start_back : 0;
+	end_epoch = cur_epoch > end_back ? cur_epoch - end_back : 0;
+
+	for (idx = base; idx < base + HIST_WINDOW_NSLOTS; idx++) {
+		for (cpu = 0; cpu < ncpus; cpu++) {
+			slot = &slots[idx][cpu];
+			if (slot->epoch >= end_epoch ||
+			    slot->epoch < start_epoch)
+				continue;
+
+			for (i = 0; i < HIST_NBUCKETS; i++)
+				hist[i] += slot->buckets[i];
+		}
+	}
+}
+
+static __u64 monotonic_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static __u64 window_hist_count(const __u64 hist[HIST_NBUCKETS])
+{
+	__u64 count = 0;
+	int i;
+
+	for (i = 0; i < HIST_NBUCKETS - 1; i++)
+		count += hist[i];
+
+	return count;
+}
+
+/*
+ * Prints the count, rate and percentiles of the window, followed by how the
+ * rate and p99 changed compared to the window just before it (prev).
+ */
+static void print_window_stats(FILE *stream, enum netstacklat_hook hook,
+			       const struct hist_window *win,
+			       const __u64 hist[HIST_NBUCKETS],
+			       const __u64 prev[HIST_NBUCKETS])
+{
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	__u64 window_ns = hist_window_slot_ns(win->ring) * win->nslots;
+	__u64 count = window_hist_count(hist);
+	__u64 prev_count = window_hist_count(prev);
+	double p99 = 0, prev_p99 = 0;
+	int i;
+
+	fprintf(stream, "%-20s %6s %*llu %9.4g", hook_to_str(hook), win->name,
+		MAX_BUCKETCOUNT_STRLEN, count,
+		(double)count * NS_PER_S / window_ns);
+
+	for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+		if (count == 0)
+			fprintf(stream, " %9s", "-");
+		else
+			print_percentile(stream,
+					 hist_percentile(HIST_NBUCKETS, hist,
+							 count, percentiles[i],
+							 false));
+	}
+
+	if (prev_count == 0) {
+		fprintf(stream, " %9s %9s\n", "-", "-");
+		return;
+	}
+
+	// The rates are over equally long windows, so compare the counts
+	fprintf(stream, " %+8.3g%%",
+		100.0 * ((double)count - prev_count) / prev_count);
+
+	if (count > 0) {
+		p99 = hist_percentile(HIST_NBUCKETS, hist, count, 0.99, false);
+		prev_p99 = hist_percentile(HIST_NBUCKETS, prev, prev_count,
+					   0.99, false);
+	}
+	if (count == 0 || isinf(p99) || isinf(prev_p99))
+		fprintf(stream, " %9s\n", "-");
+	else
+		fprintf(stream, " %8.3gx\n", p99 / prev_p99);
+}
+
+static int report_window_stats(const struct netstacklat_config *conf,
+			       const struct netstacklat_bpf *obj)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	struct hist_window_slot (*slots)[ncpus];
+	__u64 hist[HIST_NBUCKETS], prev[HIST_NBUCKETS];
+	enum netstacklat_hook hook;
+	__u64 now;
+	int err, w;
+
+	err = fetch_window_slots(
+		bpf_map__fd(obj->maps.netstack_latency_window_seconds), ncpus,
+		&slots);
+	if (err)
+		return err;
+	now = monotonic_now_ns();
+
+	printf("sliding windows (percentiles are upper bounds, changes are relative to the previous window):\n");
+	printf("%-20s %6s %*s %9s %9s %9s %9s %9s %9s %9s\n", "hook",
+	       "window", MAX_BUCKETCOUNT_STRLEN, "count", "rate/s", "p50",
+	       "p90", "p99", "p99.9", "rate chg", "p99 chg");
+	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
+		if (!conf->enabled_hooks[hook])
+			continue;
+
+		for (w = 0; w < ARRAY_SIZE(hist_windows); w++) {
+			build_window_hist(ncpus, slots, hook, &hist_windows[w],
+					  0, now, hist);
+			build_window_hist(ncpus, slots, hook, &hist_windows[w],
+					  1, now, prev);
+			print_window_stats(stdout, hook, &hist_windows[w], hist,
+					   prev);
+		}
+	}
+	printf("\n");
+
+	free(slots);
+	return 0;
+}
+
+// Sorts by descending p99, and by descending count for equal p99s
+static int cmp_process_hist_entry(const void *a, const void *b)
+{
+	const struct process_hist_entry *ea = a, *eb = b;
+
+	if (ea->p99 != eb->p99)
+		return ea->p99 > eb->p99 ? -1 : 1;
+	if (ea->count != eb->count)
+		return ea->count > eb->count ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Fetches all per-process socket read histograms and sorts them by their p99
+ * (largest first). On success, *entries must be freed by the caller.
+ */
+static int fetch_process_hists(int map_fd, struct process_hist_entry **entries,
+			       size_t *nentries)
+{
+	struct process_hist_key *keys = NULL;
+	struct process_hist *vals = NULL;
+	struct process_hist_entry *ents;
+	__u32 in_batch, out_batch, count;
+	bool first_batch = true;
+	size_t n = 0;
+	int err = 0, i, bucket;
+
+	ents = calloc(PROCESS_HIST_MAX_ENTRIES, sizeof(*ents));
+	keys = calloc(PROCESS_HIST_BATCH_SIZE, sizeof(*keys));
+	vals = calloc(PROCESS_HIST_BATCH_SIZE, sizeof(*vals));
+	if (!ents || !keys || !vals) {
+		err = -ENOMEM;
+		goto exit;
+	}
+
+	do {
+		count = PROCESS_HIST_BATCH_SIZE;
+		err = bpf_map_lookup_batch(map_fd,
+					   first_batch ? NULL : &in_batch,
+					   &out_batch, keys, vals, &count,
+					   NULL);
+		if (err && err != -ENOENT)
+			goto exit;
+
+		for (i = 0; i < count && n < PROCESS_HIST_MAX_ENTRIES; i++) {
+			ents[n].key = keys[i];
+			ents[n].hist = vals[i];
+			ents[n].count = 0;
+			for (bucket = 0; bucket < HIST_NBUCKETS - 1; bucket++)
+				ents[n].count += vals[i].buckets[bucket];
+			ents[n].p50 = hist_percentile(HIST_NBUCKETS,
+						      vals[i].buckets,
+						      ents[n].count, 0.5,
+						      false);
+			ents[n].p99 = hist_percentile(HIST_NBUCKETS,
+						      vals[i].buckets,
+						      ents[n].count, 0.99,
+						      false);
+			n++;
+		}
+
+		in_batch = out_batch;
+		first_batch = false;
+	} while (!err);
+	err = 0; // -ENOENT indicates all entries have been fetched
+
+	qsort(ents, n, sizeof(*ents), cmp_process_hist_entry);
+	*entries = ents;
+	*nentries = n;
+
+exit:
+	if (err)
+		free(ents);
+	free(keys);
+	free(vals);
+	return err;
+}
+
+/*
+ * Reports the processes with the largest p99 socket read latency, i.e. the
+ * processes that are the slowest to read the data queued on their sockets.
+ */
+static int report_process_stats(const struct netstacklat_config *conf,
+				const struct netstacklat_bpf *obj)
+{
+	struct process_hist_entry *entries;
+	size_t nentries, i;
+	int err;
+
+	err = fetch_process_hists(
+		bpf_map__fd(obj->maps.netstack_latency_process_seconds),
+		&entries, &nentries);
+	if (err)
+		return err;
+
+	printf("top %d processes by socket read p99 (upper bounds):\n",
+	       conf->top_processes);
+	printf("%*s %9s %9s  %-20s %s\n", MAX_BUCKETCOUNT_STRLEN, "count",
+	       "p50", "p99", "hook", "process");
+	for (i = 0; i < nentries && i < conf->top_processes; i++) {
+		printf("%*llu", MAX_BUCKETCOUNT_STRLEN, entries[i].count);
+		print_percentile(stdout, entries[i].p50);
+		print_percentile(stdout, entries[i].p99);
+		printf("  %-20s %.*s (pid %u)\n",
+		       hook_to_str(entries[i].key.hook),
+		       (int)sizeof(entries[i].key.comm), entries[i].key.comm,
+		       entries[i].key.tgid);
+	}
+	printf("\n");
+
+	free(entries);
+	return 0;
+}
+
+static __u32 fnv1a_hash(const void *data, size_t size, __u32 hash)
+{
+	const __u8 *p = data;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+/*
+ * Finds the entry matching the flow or process of the event using open
+ * addressing with linear probing. Returns NULL if the table is full.
+ */
+static struct outlier_entry *
+outlier_table_lookup(struct outlier_entry table[OUTLIER_TABLE_SIZE],
+		     const struct netstacklat_outlier_event *event, bool by_flow)
+{
+	struct outlier_entry *entry;
+	__u32 hash = 2166136261;
+	size_t i, idx;
+
+	if (by_flow) {
+		hash = fnv1a_hash(&event->flow, sizeof(event->flow), hash);
+	} else {
+		hash = fnv1a_hash(&event->pid, sizeof(event->pid), hash);
+		hash = fnv1a_hash(event->comm, sizeof(event->comm), hash);
+	}
+
+	for (i = 0; i < OUTLIER_TABLE_SIZE; i++) {
+		idx = (hash + i) % OUTLIER_TABLE_SIZE;
+		entry = &table[idx];
+
+		if (!entry->used) {
+			entry->used = true;
+			if (by_flow) {
+				entry->flow = event->flow;
+			} else {
+				entry->pid = event->pid;
+				memcpy(entry->comm, event->comm,
+				       sizeof(entry->comm));
+			}
+			return entry;
+		}
+
+		if (by_flow &&
+		    memcmp(&entry->flow, &event->flow, sizeof(entry->flow)) == 0)
+			return entry;
+		if (!by_flow && entry->pid == event->pid &&
+		    memcmp(entry->comm, event->comm, sizeof(entry->comm)) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void outlier_entry_add(struct outlier_entry *entry,
+			      const struct netstacklat_outlier_event *event)
+{
+	entry->count++;
+	if (event->latency > entry->max_latency) {
+		entry->max_latency = event->latency;
+		entry->max_hook = event->hook;
+	}
+}
+
+static int handle_outlier_event(void *ctx, void *data, size_t size)
+{
+	const struct netstacklat_outlier_event *event = data;
+	struct outlier_tracker *tracker = ctx;
+	struct outlier_entry *flow, *proc;
+
+	if (size < sizeof(*event))
+		return 0;
+
+	tracker->nevents++;
+
+	flow = outlier_table_lookup(tracker->flows, event, true);
+	proc = outlier_table_lookup(tracker->procs, event, false);
+	if (!flow || !proc)
+		tracker->untracked++;
+
+	if (flow)
+		outlier_entry_add(flow, event);
+	if (proc)
+		outlier_entry_add(proc, event);
+
+	return 0;
+}
+
+static int cmp_outlier_entry(const void *a, const void *b)
+{
+	const struct outlier_entry *ea = a, *eb = b;
+
+	if (ea->used != eb->used)
+		return ea->used ? -1 : 1;
+	if (ea->count != eb->count)
+		return ea->count > eb->count ? -1 : 1;
+	if (ea->max_latency != eb->max_latency)
+		return ea->max_latency > eb->max_latency ? -1 : 1;
+	return 0;
+}
+
+static const char *ipproto_to_str(__u8 ipproto)
+{
+	switch (ipproto) {
+	case IPPROTO_TCP:
+		return "tcp";
+	case IPPROTO_UDP:
+		return "udp";
+	default:
+		return "ip";
+	}
+}
+
+static void print_flow_endpoint(FILE *stream,
+				const struct netstacklat_flow *flow,
+				const __u8 *addr, __be16 port)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (!inet_ntop(flow->family, addr, buf, sizeof(buf)))
+		strcpy(buf, "?");
+
+	if (flow->family == AF_INET6)
+		fprintf(stream, "[%s]", buf);
+	else
+		fprintf(stream, "%s", buf);
+
+	if (flow->ipproto == IPPROTO_TCP || flow->ipproto == IPPROTO_UDP)
+		fprintf(stream, ":%u", ntohs(port));
+}
+
+static void print_flow(FILE *stream, const struct netstacklat_flow *flow)
+{
+	if (flow->family != AF_INET && flow->family != AF_INET6) {
+		fprintf(stream, "unknown");
+		return;
+	}
+
+	fprintf(stream, "%s ", ipproto_to_str(flow->ipproto));
+	print_flow_endpoint(stream, flow, flow->saddr, flow->sport);
+	fprintf(stream, " -> ");
+	print_flow_endpoint(stream, flow, flow->daddr, flow->dport);
+}
+
+static void print_outlier_table(FILE *stream,
+				struct outlier_entry table[OUTLIER_TABLE_SIZE],
+				bool by_flow)
+{
+	size_t i;
+
+	qsort(table, OUTLIER_TABLE_SIZE, sizeof(*table), cmp_outlier_entry);
+
+	fprintf(stream, "%*s %9s  %-20s %s\n", MAX_BUCKETCOUNT_STRLEN, "count",
+		"max", "max hook", by_flow ? "flow" : "process");
+	for (i = 0; i < OUTLIER_TOP_N && table[i].used; i++) {
+		fprintf(stream, "%*llu", MAX_BUCKETCOUNT_STRLEN,
+			table[i].count);
+		print_percentile(stream, table[i].max_latency);
+		fprintf(stream, "  %-20s ", hook_to_str(table[i].max_hook));
+
+		if (by_flow)
+			print_flow(stream, &table[i].flow);
+		else
+			fprintf(stream, "%.*s (pid %u)",
+				(int)sizeof(table[i].comm), table[i].comm,
+				table[i].pid);
+		fprintf(stream, "\n");
+	}
+	fprintf(stream, "\n");
+}
+
+static int fetch_outlier_drops(int map_fd, __u64 *ratelimited, __u64 *dropped)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	struct outlier_ratelimit_state *states;
+	__u32 key = 0;
+	int err, i;
+
+	states = calloc(ncpus, sizeof(*states));
+	if (!states)
+		return -ENOMEM;
+
+	err = bpf_map_lookup_elem(map_fd, &key, states);
+	if (err)
+		goto exit;
+
+	*ratelimited = 0;
+	*dropped = 0;
+	for (i = 0; i < ncpus; i++) {
+		*ratelimited += states[i].ratelimited;
+		*dropped += states[i].dropped;
+	}
+
+exit:
+	free(states);
+	return err;
+}
+
+/*
+ * Reports the flows and processes with the most outlier events since the last
+ * report, and then resets the tracker for the next interval.
+ */
+static int report_outliers(struct outlier_tracker *tracker)
+{
+	__u64 ratelimited, dropped;
+	int err;
+
+	// Make sure all events up to this point are included
+	err = ring_buffer__consume(tracker->rb);
+	if (err < 0)
+		return err;
+
+	err = fetch_outlier_drops(tracker->rl_map_fd, &ratelimited, &dropped);
+	if (err)
+		return err;
+
+	printf("outliers: %llu sampled, %llu rate-limited, %llu dropped",
+	       tracker->nevents, ratelimited - tracker->prev_ratelimited,
+	       dropped - tracker->prev_dropped);
+	if (tracker->untracked)
+		printf(", %llu untracked (table full)", tracker->untracked);
+	printf("\n");
+
+	if (tracker->nevents > 0) {
+		print_outlier_table(stdout, tracker->flows, true);
+		print_outlier_table(stdout, tracker->procs, false);
+	}
+
+	tracker->prev_ratelimited = ratelimited;
+	tracker->prev_dropped = dropped;
+	tracker->nevents = 0;
+	tracker->untracked = 0;
+	memset(tracker->flows, 0, sizeof(tracker->flows));
+	memset(tracker->procs, 0, sizeof(tracker->procs));
+
+	return 0;
+}
+
+static int report_stats(const struct netstacklat_config *conf,
+			const struct netstacklat_bpf *obj,
+			const struct hist_shards *shards,
+			struct outlier_tracker *outliers)
+{
+	__u64 hists[NETSTACKLAT_N_HOOKS][HIST_LOGLIN_NBUCKETS];
 	enum netstacklat_hook hook;
-	__u64 hist[HIST_NBUCKETS] = { 0 };
 	time_t t;
 	int err;
 
-	time(&t);
-	printf("%s", ctime(&t));
+	time(&t);
+	printf("%s", ctime(&t));
+
+	err = fetch_hook_hists(conf, obj, shards, hists);
+	if (err)
+		return err;
+
+	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
+		if (!conf->enabled_hooks[hook])
+			continue;
+
+		printf("%s:\n", hook_to_str(hook));
+		print_hist(stdout, hist_nbuckets(&conf->bpf_conf), hists[hook],
+			   1, conf->bpf_conf.loglinear_hist);
+		printf("\n");
+	}
+
+	if (conf->bpf_conf.hist_windows) {
+		err = report_window_stats(conf, obj);
+		if (err)
+			return err;
+	}
+
+	if (grouping_enabled(&conf->bpf_conf)) {
+		err = report_grouped_stats(conf, obj);
+		if (err)
+			return err;
+	}
+
+	if (conf->bpf_conf.process_hist) {
+		err = report_process_stats(conf, obj);
+		if (err)
+			return err;
+	}
+
+	if (outliers) {
+		err = report_outliers(outliers);
+		if (err)
+			return err;
+	}
+	fflush(stdout);
+
+	return 0;
+}
+
+/*
+ * Writes a single histogram in the OpenMetrics format, converting the
+ * histogram buckets to cumulative ones. The labels (may be NULL) should be a
+ * comma-separated list of name="value" pairs. For gauge histograms (i.e.
+ * histograms that are not cumulative over time), the count and sum are named
+ * _gcount and _gsum instead.
+ */
+static void write_openmetrics_hist(FILE *stream, const char *name,
+				   const char *labels, size_t n,
+				   const __u64 hist[n], bool loglinear,
+				   bool gauge)
+{
+	const char *sep = labels ? "," : "";
+	__u64 count = 0;
+	int bucket;
+
+	if (!labels)
+		labels = "";
+
+	for (bucket = 0; bucket < n - 2; bucket++) {
+		count += hist[bucket];
+		fprintf(stream, "%s_bucket{%s%sle=\"%.12g\"} %llu\n", name, labels,
+			sep, hist_bucket_high_bound(loglinear, bucket) / NS_PER_S,
+			count);
+	}
+
+	// Second-last bucket includes all values too large for the others
+	count += hist[n - 2];
+	fprintf(stream, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+		count);
+	fprintf(stream, "%s_%s%s%s%s %llu\n", name, gauge ? "gcount" : "count",
+		*sep ? "{" : "", labels, *sep ? "}" : "", count);
+	fprintf(stream, "%s_%s%s%s%s %.9f\n", name, gauge ? "gsum" : "sum",
+		*sep ? "{" : "", labels, *sep ? "}" : "",
+		(double)hist[n - 1] / NS_PER_S);
+}
+
+static void write_openmetrics_header(FILE *stream, const char *name,
+				     const char *help, bool gauge)
+{
+	fprintf(stream, "# TYPE %s %s\n", name,
+		gauge ? "gaugehistogram" : "histogram");
+	fprintf(stream, "# UNIT %s seconds\n", name);
+	fprintf(stream, "# HELP %s %s\n", name, help);
+}
+
+static int snprint_group_labels(char *buf, size_t size,
+				const struct netstacklat_config *conf,
+				const struct grouped_hist_key *key)
+{
+	const struct {
+		bool enabled;
+		enum group_dim dim;
+		__u64 val;
+		bool offset;
+	} members[] = {
+		{ conf->bpf_conf.groupby_cgroup, GROUP_DIM_CGROUP, key->cgroup,
+		  false },
+		{ conf->bpf_conf.groupby_netns, GROUP_DIM_NETNS, key->netns,
+		  false },
+		{ conf->bpf_conf.groupby_cpu, GROUP_DIM_CPU, key->cpu, true },
+		{ conf->bpf_conf.groupby_rxqueue, GROUP_DIM_RXQUEUE,
+		  key->rxqueue, true },
+	};
+	int i, len;
+
+	len = snprintf(buf, size, "hook=\"%s\"", hook_to_str(key->hook));
+	for (i = 0; i < ARRAY_SIZE(members) && len < size; i++) {
+		if (!members[i].enabled)
+			continue;
+
+		if (members[i].val)
+			len += snprintf(buf + len, size - len, ",%s=\"%llu\"",
+					group_dim_to_str(members[i].dim),
+					members[i].offset ? members[i].val - 1 :
+							    members[i].val);
+		else
+			len += snprintf(buf + len, size - len,
+					",%s=\"unknown\"",
+					group_dim_to_str(members[i].dim));
+	}
+
+	return len < size ? 0 : -E2BIG;
+}
+
+static int write_openmetrics_grouped(FILE *stream,
+				     const struct netstacklat_config *conf,
+				     const struct netstacklat_bpf *obj)
+{
+	struct bpf_map *map = obj->maps.netstack_latency_grouped_seconds;
+	const char *name = bpf_map__name(map);
+	size_t n = hist_nbuckets(&conf->bpf_conf);
+	struct grouped_hist_entry *entries;
+	__u64 hist[HIST_LOGLIN_NBUCKETS];
+	size_t nentries, i, j;
+	char labels[256];
+	int err;
+
+	err = fetch_grouped_hists(map, &entries, &nentries);
+	if (err)
+		return err;
+
+	write_openmetrics_header(stream, name,
+				 "Latency to the hooks, per group", false);
+	for (i = 0; i < nentries; i = j) {
+		j = build_group_hist(nentries, entries, i, n, hist);
+
+		if (!report_group_hist(conf, &entries[i].key, n, hist))
+			continue;
+
+		err = snprint_group_labels(labels, sizeof(labels), conf,
+					   &entries[i].key);
+		if (err)
+			goto exit;
+
+		write_openmetrics_hist(stream, name, labels, n, hist,
+				       conf->bpf_conf.loglinear_hist, false);
+	}
+
+exit:
+	free(entries);
+	return err;
+}
+
+/*
+ * Writes the sliding-window histograms as gauge histograms, with the hook and
+ * window as labels.
+ */
+static int write_openmetrics_windows(FILE *stream,
+				     const struct netstacklat_config *conf,
+				     const struct netstacklat_bpf *obj)
+{
+	struct bpf_map *map = obj->maps.netstack_latency_window_seconds;
+	int ncpus = libbpf_num_possible_cpus();
+	struct hist_window_slot (*slots)[ncpus];
+	const char *name = bpf_map__name(map);
+	enum netstacklat_hook hook;
+	__u64 hist[HIST_NBUCKETS];
+	char labels[128];
+	__u64 now;
+	int err, w;
+
+	err = fetch_window_slots(bpf_map__fd(map), ncpus, &slots);
+	if (err)
+		return err;
+	now = monotonic_now_ns();
+
+	write_openmetrics_header(stream, name,
+				 "Latency to the hooks over the last window",
+				 true);
+	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
+		if (!conf->enabled_hooks[hook])
+			continue;
+
+		for (w = 0; w < ARRAY_SIZE(hist_windows); w++) {
+			build_window_hist(ncpus, slots, hook, &hist_windows[w],
+					  0, now, hist);
+			snprintf(labels, sizeof(labels),
+				 "hook=\"%s\",window=\"%s\"", hook_to_str(hook),
+				 hist_windows[w].name);
+			write_openmetrics_hist(stream, name, labels,
+					       HIST_NBUCKETS, hist, false, true);
+		}
+	}
+
+	free(slots);
+	return 0;
+}
+
+/*
+ * Copies the first (at most) srclen characters of src to dst, escaping
+ * backslashes, double quotes and newlines for use as an OpenMetrics label
+ * value. A dst of 2 * srclen + 1 characters always fits the result.
+ */
+static void escape_label_value(char *dst, size_t size, const char *src,
+			       size_t srclen)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < srclen && src[i] && len + 2 < size; i++) {
+		if (src[i] == '\\' || src[i] == '"') {
+			dst[len++] = '\\';
+			dst[len++] = src[i];
+		} else if (src[i] == '\n') {
+			dst[len++] = '\\';
+			dst[len++] = 'n';
+		} else {
+			dst[len++] = src[i];
+		}
+	}
+	dst[len] = '\0';
+}
+
+/*
+ * Writes the socket read histograms of the top processes (the same ones as in
+ * the report), with the hook, pid and comm as labels. Only the top processes
+ * are included to bound the number of series.
+ */
+static int write_openmetrics_processes(FILE *stream,
+				       const struct netstacklat_config *conf,
+				       const struct netstacklat_bpf *obj)
+{
+	struct bpf_map *map = obj->maps.netstack_latency_process_seconds;
+	const char *name = bpf_map__name(map);
+	struct process_hist_entry *entries;
+	char comm[2 * sizeof(entries->key.comm) + 1];
+	size_t nentries, i;
+	char labels[256];
+	int err;
+
+	err = fetch_process_hists(bpf_map__fd(map), &entries, &nentries);
+	if (err)
+		return err;
+
+	write_openmetrics_header(stream, name,
+				 "Socket read latency of the top processes",
+				 false);
+	for (i = 0; i < nentries && i < conf->top_processes; i++) {
+		escape_label_value(comm, sizeof(comm), entries[i].key.comm,
+				   sizeof(entries[i].key.comm));
+		snprintf(labels, sizeof(labels),
+			 "hook=\"%s\",pid=\"%u\",comm=\"%s\"",
+			 hook_to_str(entries[i].key.hook), entries[i].key.tgid,
+			 comm);
+		write_openmetrics_hist(stream, name, labels, HIST_NBUCKETS,
+				       entries[i].hist.buckets, false, false);
+	}
+
+	free(entries);
+	return 0;
+}
+
+/*
+ * Writes all histograms in the OpenMetrics text format. The histograms for
+ * each hook use the same names as the corresponding maps (as exported by
+ * ebpf_exporter), also when using log-linear histograms.
+ */
+static int write_openmetrics(FILE *stream,
+			     const struct netstacklat_config *conf,
+			     const struct netstacklat_bpf *obj,
+			     const struct hist_shards *shards)
+{
+	__u64 hists[NETSTACKLAT_N_HOOKS][HIST_LOGLIN_NBUCKETS];
+	enum netstacklat_hook hook;
+	const char *name;
+	int err;
+
+	err = fetch_hook_hists(conf, obj, shards, hists);
+	if (err)
+		return err;
+
+	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
+		if (!conf->enabled_hooks[hook])
+			continue;
+
+		name = bpf_map__name(hook_to_histmap(hook, obj));
+		write_openmetrics_header(stream, name,
+					 hook_to_description(hook), false);
+		write_openmetrics_hist(stream, name, NULL,
+				       hist_nbuckets(&conf->bpf_conf),
+				       hists[hook],
+				       conf->bpf_conf.loglinear_hist, false);
+	}
+
+	if (conf->bpf_conf.hist_windows) {
+		err = write_openmetrics_windows(stream, conf, obj);
+		if (err)
+			return err;
+	}
+
+	if (grouping_enabled(&conf->bpf_conf)) {
+		err = write_openmetrics_grouped(stream, conf, obj);
+		if (err)
+			return err;
+	}
+
+	if (conf->bpf_conf.process_hist) {
+		err = write_openmetrics_processes(stream, conf, obj);
+		if (err)
+			return err;
+	}
+
+	fprintf(stream, "# EOF\n");
+	return 0;
+}
+
+/*
+ * Parses addr (unix:<path>, <host>:<port> or [<ipv6 host>]:<port>, where an
+ * empty host listens on all addresses) and creates a listening socket for it.
+ */
+static int setup_metrics_socket(const char *addr)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct addrinfo *res = NULL;
+	char host[256], *port;
+	int fd, err, one = 1;
+	struct stat st;
+
+	if (strncmp(addr, "unix:", 5) == 0) {
+		if (strlen(addr + 5) >= sizeof(sun.sun_path))
+			return -ENAMETOOLONG;
+		strcpy(sun.sun_path, addr + 5);
+
+		// Remove stale socket from previous runs, but never other files
+		if (stat(sun.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(sun.sun_path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    0);
+		if (fd < 0)
+			return -errno;
+
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)))
+			goto err_errno;
+		goto listen;
+	}
+
+	if (strlen(addr) >= sizeof(host))
+		return -ENAMETOOLONG;
+	strcpy(host, addr);
+
+	port = strrchr(host, ':');
+	if (!port)
+		return -EINVAL;
+	*port++ = '\0';
+
+	if (host[0] == '[' && strlen(host) >= 2 &&
+	    host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	err = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "Failed resolving %s: %s\n", addr,
+			gai_strerror(err));
+		return -EINVAL;
+	}
+
+	fd = socket(res->ai_family,
+		    res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    res->ai_protocol);
+	if (fd < 0) {
+		err = -errno;
+		freeaddrinfo(res);
+		return err;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	err = bind(fd, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	if (err)
+		goto err_errno;
+
+listen:
+	if (listen(fd, 16))
+		goto err_errno;
+
+	return fd;
+
+err_errno:
+	err = -errno;
+	close(fd);
+	return err;
+}
+
+static int epoll_add_event(int epoll_fd, int fd, __u64 event_type, __u64 value)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data = { .u64 = event_type | value },
+	};
+
+	if (value & NETSTACKLAT_EPOLL_TYPE_MASK)
+		return -EINVAL;
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) ? -errno : 0;
+}
+
+/*
+ * State of a connection to the metrics endpoint. The sockets are nonblocking,
+ * and each client is served from the epoll loop in steps as its socket becomes
+ * readable (request) or writable (reply), so that a slow client can not hold
+ * up the reports. The whole exchange must complete before the deadline.
+ */
+struct metrics_client {
+	int fd;
+	__u64 deadline;
+	char request[METRICS_MAX_REQUEST_SIZE];
+	size_t request_len;
+	char *reply;
+	size_t reply_size;
+	size_t reply_sent;
+};
+
+struct metrics_server {
+	int listen_fd;
+	struct metrics_client *clients[METRICS_MAX_CLIENTS];
+};
+
+static void write_http_response(FILE *stream, const char *status,
+				const char *content_type, const char *body,
+				size_t body_size)
+{
+	fprintf(stream,
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		status, content_type, body_size);
+	fwrite(body, 1, body_size, stream);
+}
+
+/*
+ * Parses the request line of a HTTP request. Returns a pointer to the start of
+ * the path, or NULL if it is not a GET request.
+ */
+static char *parse_http_request(char *buf)
+{
+	char *path;
+
+	if (strncmp(buf, "GET ", 4) != 0)
+		return NULL;
+
+	path = buf + 4;
+	path[strcspn(path, " ?\r\n")] = '\0';
+	return path;
+}
+
+/*
+ * Writes the full HTTP response to the request in buf to stream. The maps are
+ * read when the request arrives, so the metrics are always up to date.
+ */
+static void write_metrics_response(FILE *stream, char *buf,
+				   const struct netstacklat_config *conf,
+				   const struct netstacklat_bpf *obj,
+				   const struct hist_shards *shards)
+{
+	size_t body_size = 0;
+	char *body = NULL;
+	FILE *body_stream;
+	char *path;
+	int err;
+
+	path = parse_http_request(buf);
+	if (!path) {
+		write_http_response(stream, "400 Bad Request", "text/plain", "",
+				    0);
+		return;
+	}
 
-	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
-		if (!conf->enabled_hooks[hook])
-			continue;
+	if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+		write_http_response(stream, "404 Not Found", "text/plain", "",
+				    0);
+		return;
+	}
 
-		printf("%s:\n", hook_to_str(hook));
+	body_stream = open_memstream(&body, &body_size);
+	if (!body_stream) {
+		err = -errno;
+		goto err;
+	}
 
-		err = fetch_hist_map(hook_to_histmap(hook, obj), hist);
-		if (err)
-			return err;
+	err = write_openmetrics(body_stream, conf, obj, shards);
+	fclose(body_stream);
+	if (err)
+		goto err;
 
-		print_log2hist(stdout, ARRAY_SIZE(hist), hist, 1);
-		printf("\n");
+	write_http_response(stream, "200 OK", METRICS_CONTENT_TYPE, body,
+			    body_size);
+	free(body);
+	return;
+
+err:
+	free(body);
+	write_http_response(stream, "500 Internal Server Error", "text/plain",
+			    "", 0);
+	fprintf(stderr, "Failed serving metrics: %s\n", strerror(-err));
+}
+
+static void close_metrics_client(struct metrics_server *server, int slot)
+{
+	struct metrics_client *client = server->clients[slot];
+
+	// Closing the fd also removes it from the epoll instance
+	close(client->fd);
+	free(client->reply);
+	free(client);
+	server->clients[slot] = NULL;
+}
+
+static void close_metrics_server(struct metrics_server *server)
+{
+	int i;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (server->clients[i])
+			close_metrics_client(server, i);
+	}
+
+	if (server->listen_fd >= 0)
+		close(server->listen_fd);
+	server->listen_fd = -1;
+}
+
+static void expire_metrics_clients(struct metrics_server *server)
+{
+	__u64 now = monotonic_now_ns();
+	int i;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+		if (server->clients[i] && now >= server->clients[i]->deadline)
+			close_metrics_client(server, i);
+	}
+}
+
+static int handle_metrics_connection(int epoll_fd,
+				     struct metrics_server *server)
+{
+	struct metrics_client *client;
+	int fd, slot, err;
+
+	fd = accept(server->listen_fd, NULL, NULL);
+	if (fd < 0)
+		// The client may have given up before we got around to it
+		return errno == EAGAIN || errno == ECONNABORTED ? 0 : -errno;
+
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) || fcntl(fd, F_SETFD, FD_CLOEXEC))
+		goto err_close;
+
+	// Make room for new clients by dropping those that have timed out
+	expire_metrics_clients(server);
+
+	for (slot = 0; slot < METRICS_MAX_CLIENTS; slot++) {
+		if (!server->clients[slot])
+			break;
+	}
+	if (slot == METRICS_MAX_CLIENTS)
+		// Too many concurrent scrapes, let this one retry later
+		goto err_close;
+
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		goto err_close;
+
+	client->fd = fd;
+	client->deadline = monotonic_now_ns() +
+			   (__u64)METRICS_CLIENT_TIMEOUT_S * NS_PER_S;
+	server->clients[slot] = client;
+
+	err = epoll_add_event(epoll_fd, fd, NETSTACKLAT_EPOLL_METRICS_CLIENT,
+			      slot);
+	if (err) {
+		close_metrics_client(server, slot);
+		return err;
+	}
+
+	return 0;
+
+err_close:
+	close(fd);
+	return 0;
+}
+
+/*
+ * Reads the request until the end of the request line (only the path is
+ * needed). Returns 0 while more is expected, 1 once the request is complete
+ * (or the client stopped sending), or a negative error.
+ */
+static int read_metrics_request(struct metrics_client *client)
+{
+	size_t size = sizeof(client->request) - 1;
+	ssize_t ret;
+
+	while (client->request_len < size) {
+		ret = read(client->fd, client->request + client->request_len,
+			   size - client->request_len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -errno;
+		}
+		if (ret == 0)
+			break;
+
+		client->request_len += ret;
+		client->request[client->request_len] = '\0';
+		if (strstr(client->request, "\r\n"))
+			break;
+	}
+
+	return 1;
+}
+
+/*
+ * Writes as much of the reply as the socket accepts. Returns 0 while more
+ * remains, 1 once the full reply is sent, or a negative error.
+ */
+static int write_metrics_reply(struct metrics_client *client)
+{
+	ssize_t ret;
+
+	while (client->reply_sent < client->reply_size) {
+		ret = send(client->fd, client->reply + client->reply_sent,
+			   client->reply_size - client->reply_sent,
+			   MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -errno;
+		}
+
+		client->reply_sent += ret;
+	}
+
+	return 1;
+}
+
+/*
+ * Advances the exchange with a metrics client once its socket is ready. Errors
+ * on the client connection are the client's problem, and only end that
+ * connection.
+ */
+static int handle_metrics_client(int epoll_fd, struct metrics_server *server,
+				 int slot, const struct netstacklat_config *conf,
+				 const struct netstacklat_bpf *obj,
+				 const struct hist_shards *shards)
+{
+	struct metrics_client *client = server->clients[slot];
+	struct epoll_event ev = {
+		.events = EPOLLOUT,
+		.data = { .u64 = NETSTACKLAT_EPOLL_METRICS_CLIENT | slot },
+	};
+	FILE *stream;
+	int ret;
+
+	// Already closed by an earlier event in the same batch
+	if (!client)
+		return 0;
+
+	if (!client->reply) {
+		ret = read_metrics_request(client);
+		if (ret <= 0)
+			goto exit;
+
+		stream = open_memstream(&client->reply, &client->reply_size);
+		if (!stream) {
+			ret = -errno;
+			goto exit;
+		}
+		write_metrics_response(stream, client->request, conf, obj,
+				       shards);
+		fclose(stream);
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev)) {
+			ret = -errno;
+			goto exit;
+		}
 	}
-	fflush(stdout);
 
+	ret = write_metrics_reply(client);
+
+exit:
+	if (ret != 0)
+		close_metrics_client(server, slot);
 	return 0;
 }
 
@@ -751,11 +3215,60 @@ static __s64 get_tai_offset(void)
 	return ntpt.tai;
 }
 
+/*
+ * The programs recording the start time for the TX hooks, which are needed if
+ * any of the TX hooks are enabled.
+ */
+static void tx_start_progs(struct hook_prog_collection *progs,
+			   const struct netstacklat_bpf *obj)
+{
+	progs->progs[0] = obj->progs.netstacklat_ip_queue_xmit;
+	progs->progs[1] = obj->progs.netstacklat_inet6_csk_xmit;
+	progs->progs[2] = obj->progs.netstacklat_ip_send_skb;
+	progs->progs[3] = obj->progs.netstacklat_ip6_send_skb;
+	progs->nprogs = 4;
+}
+
+/*
+ * Recent kernels turned napi_gro_receive() into an inline wrapper around
+ * gro_receive_skb(), which takes the same arguments, so attach the napi-gro
+ * programs to whichever of the two exists. If neither does, the hook is
+ * disabled.
+ */
+static void set_napi_gro_target(struct netstacklat_config *conf,
+				struct netstacklat_bpf *obj)
+{
+	const char *target;
+
+	if (!conf->enabled_hooks[NETSTACKLAT_HOOK_NAPI_GRO])
+		return;
+
+	if (libbpf_find_vmlinux_btf_id("napi_gro_receive",
+				       BPF_TRACE_FENTRY) >= 0)
+		return;
+
+	target = "gro_receive_skb";
+	if (libbpf_find_vmlinux_btf_id(target, BPF_TRACE_FENTRY) < 0) {
+		fprintf(stderr,
+			"Warning: neither napi_gro_receive nor %s found, disabling the %s hook\n",
+			target, hook_to_str(NETSTACKLAT_HOOK_NAPI_GRO));
+		conf->enabled_hooks[NETSTACKLAT_HOOK_NAPI_GRO] = false;
+		return;
+	}
+
+	bpf_program__set_attach_target(obj->progs.netstacklat_napi_gro_receive,
+				       0, target);
+	bpf_program__set_attach_target(
+		obj->progs.netstacklat_napi_gro_receive_exit, 0, target);
+}
+
 static void set_programs_to_load(const struct netstacklat_config *conf,
 				 struct netstacklat_bpf *obj)
 {
 	struct hook_prog_collection progs;
 	enum netstacklat_hook hook;
+	bool tx_hooks = false;
+	bool free_progs;
 	int i;
 
 	for (hook = 1; hook < NETSTACKLAT_N_HOOKS; hook++) {
@@ -764,7 +3277,30 @@ static void set_programs_to_load(const struct netstacklat_config *conf,
 		for (i = 0; i < progs.nprogs; i++)
 			bpf_program__set_autoload(progs.progs[i],
 						  conf->enabled_hooks[hook]);
+
+		if (netstacklat_hook_is_tx(hook) && conf->enabled_hooks[hook])
+			tx_hooks = true;
 	}
+
+	tx_start_progs(&progs, obj);
+	for (i = 0; i < progs.nprogs; i++)
+		bpf_program__set_autoload(progs.progs[i], tx_hooks);
+
+	// Only needed to remove freed skbs from the side tables in use
+	obj->rodata->TRACK_TX_SKBS = tx_hooks;
+	obj->rodata->TRACK_BACKLOG_SKBS =
+		conf->enabled_hooks[NETSTACKLAT_HOOK_BACKLOG_ENQUEUE];
+	free_progs = tx_hooks ||
+		     conf->enabled_hooks[NETSTACKLAT_HOOK_BACKLOG_ENQUEUE];
+	bpf_program__set_autoload(obj->progs.netstacklat_kfree_skb, free_progs);
+	bpf_program__set_autoload(obj->progs.netstacklat_consume_skb,
+				  free_progs);
+
+	// Only needed to track the processes in the PID filter
+	bpf_program__set_autoload(obj->progs.netstacklat_sched_process_fork,
+				  conf->bpf_conf.filter_pid);
+	bpf_program__set_autoload(obj->progs.netstacklat_sched_process_exit,
+				  conf->bpf_conf.filter_pid);
 }
 
 static int init_signalfd(void)
@@ -837,7 +3373,9 @@ static int setup_timer(__u64 interval_ns)
 }
 
 static int handle_timer(int timer_fd, const struct netstacklat_config *conf,
-			const struct netstacklat_bpf *obj)
+			const struct netstacklat_bpf *obj,
+			const struct hist_shards *shards,
+			struct outlier_tracker *outliers)
 {
 	__u64 timer_exps;
 	ssize_t size;
@@ -854,23 +3392,11 @@ static int handle_timer(int timer_fd, const struct netstacklat_config *conf,
 		fprintf(stderr, "Warning: Missed %llu reporting intervals\n",
 			timer_exps - 1);
 
-	return report_stats(conf, obj);
-}
-
-static int epoll_add_event(int epoll_fd, int fd, __u64 event_type, __u64 value)
-{
-	struct epoll_event ev = {
-		.events = EPOLLIN,
-		.data = { .u64 = event_type | value },
-	};
-
-	if (value & NETSTACKLAT_EPOLL_TYPE_MASK)
-		return -EINVAL;
-
-	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) ? -errno : 0;
+	return report_stats(conf, obj, shards, outliers);
 }
 
-static int setup_epoll_instance(int sig_fd, int timer_fd)
+static int setup_epoll_instance(int sig_fd, int timer_fd, int metrics_fd,
+				const struct outlier_tracker *outliers)
 {
 	int epoll_fd, err = 0;
 
@@ -887,6 +3413,21 @@ static int setup_epoll_instance(int sig_fd, int timer_fd)
 	if (err)
 		goto err;
 
+	if (metrics_fd >= 0) {
+		err = epoll_add_event(epoll_fd, metrics_fd,
+				      NETSTACKLAT_EPOLL_METRICS, metrics_fd);
+		if (err)
+			goto err;
+	}
+
+	if (outliers) {
+		err = epoll_add_event(epoll_fd,
+				      ring_buffer__epoll_fd(outliers->rb),
+				      NETSTACKLAT_EPOLL_RINGBUF, 0);
+		if (err)
+			goto err;
+	}
+
 	return epoll_fd;
 
 err:
@@ -895,7 +3436,10 @@ err:
 }
 
 static int poll_events(int epoll_fd, const struct netstacklat_config *conf,
-		       const struct netstacklat_bpf *obj)
+		       const struct netstacklat_bpf *obj,
+		       const struct hist_shards *shards,
+		       struct outlier_tracker *outliers,
+		       struct metrics_server *metrics)
 {
 	struct epoll_event events[MAX_EPOLL_EVENTS];
 	int i, n, fd, err = 0;
@@ -914,7 +3458,18 @@ static int poll_events(int epoll_fd, const struct netstacklat_config *conf,
 			err = handle_signal(fd);
 			break;
 		case NETSTACKLAT_EPOLL_TIMER:
-			err = handle_timer(fd, conf, obj);
+			err = handle_timer(fd, conf, obj, shards, outliers);
+			break;
+		case NETSTACKLAT_EPOLL_RINGBUF:
+			err = ring_buffer__consume(outliers->rb);
+			err = err < 0 ? err : 0;
+			break;
+		case NETSTACKLAT_EPOLL_METRICS:
+			err = handle_metrics_connection(epoll_fd, metrics);
+			break;
+		case NETSTACKLAT_EPOLL_METRICS_CLIENT:
+			err = handle_metrics_client(epoll_fd, metrics, fd, conf,
+						    obj, shards);
 			break;
 		default:
 			fprintf(stderr, "Warning: unexpected epoll data: %lu\n",
@@ -926,6 +3481,9 @@ static int poll_events(int epoll_fd, const struct netstacklat_config *conf,
 			break;
 	}
 
+	// Wakes up at least every 100ms, which is precise enough for these
+	expire_metrics_clients(metrics);
+
 	return err;
 }
 
@@ -947,12 +3505,221 @@ static int init_pidfilter_map(const struct netstacklat_bpf *obj,
 	return 0;
 }
 
+static int init_cgroupfilter_map(const struct netstacklat_bpf *obj,
+				 const struct netstacklat_config *conf)
+{
+	__u8 cgroup_ok_val = 1;
+	int map_fd, err, i;
+
+	map_fd = bpf_map__fd(obj->maps.netstack_cgroupfilter);
+	for (i = 0; i < conf->ncgroups; i++) {
+		err = bpf_map_update_elem(map_fd, &conf->cgroups[i],
+					  &cgroup_ok_val, 0);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads the child processes of all threads of pid from procfs (requires
+ * CONFIG_PROC_CHILDREN). Returns the number of children added to children.
+ */
+static int read_child_pids(__u32 pid, size_t size, __u32 children[size])
+{
+	struct dirent *ent;
+	unsigned int child;
+	char path[300];
+	int n = 0, len;
+	FILE *file;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%u/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		// Process may have exited
+		return 0;
+
+	while ((ent = readdir(dir)) && n < size) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		len = snprintf(path, sizeof(path), "/proc/%u/task/%s/children",
+			       pid, ent->d_name);
+		if (len >= sizeof(path))
+			continue;
+
+		file = fopen(path, "r");
+		if (!file)
+			continue;
+
+		while (n < size && fscanf(file, "%u", &child) == 1)
+			children[n++] = child;
+		fclose(file);
+	}
+
+	closedir(dir);
+	return n;
+}
+
+/*
+ * Adds the already existing descendants of the processes in the PID filter.
+ * Processes forked from now on are added by the BPF programs, so this should
+ * be called after they have been attached.
+ */
+static int add_existing_child_pids(const struct netstacklat_bpf *obj,
+				   const struct netstacklat_config *conf)
+{
+	int map_fd = bpf_map__fd(obj->maps.netstack_pidfilter);
+	size_t head = 0, tail = 0;
+	__u8 pid_ok_val = 1;
+	__u32 *queue;
+	int err = 0;
+
+	if (!conf->bpf_conf.filter_pid)
+		return 0;
+
+	queue = calloc(PID_FILTER_MAX_ENTRIES, sizeof(*queue));
+	if (!queue)
+		return -ENOMEM;
+
+	for (tail = 0; tail < conf->npids; tail++)
+		queue[tail] = conf->pids[tail];
+
+	while (head < tail) {
+		if (head >= conf->npids) {
+			err = bpf_map_update_elem(map_fd, &queue[head],
+						  &pid_ok_val, BPF_ANY);
+			if (err == -E2BIG) {
+				fprintf(stderr,
+					"Warning: PID filter full, not all child processes are included\n");
+				err = 0;
+				break;
+			} else if (err) {
+				break;
+			}
+		}
+
+		tail += read_child_pids(queue[head], PID_FILTER_MAX_ENTRIES - tail,
+					queue + tail);
+		head++;
+	}
+
+	free(queue);
+	return err;
+}
+
+/*
+ * Creates the buckets of the catch-all group (all group members 0), which the
+ * BPF programs fall back on when the grouped histogram map is full.
+ */
+static int init_grouped_hist_map(const struct netstacklat_bpf *obj,
+				 const struct netstacklat_config *conf)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	struct grouped_hist_key key = { 0 };
+	int map_fd, err = 0;
+	__u64 *zeroes;
+
+	if (!grouping_enabled(&conf->bpf_conf))
+		return 0;
+
+	zeroes = calloc(ncpus, sizeof(*zeroes));
+	if (!zeroes)
+		return -ENOMEM;
+
+	map_fd = bpf_map__fd(obj->maps.netstack_latency_grouped_seconds);
+	for (key.hook = 1; key.hook < NETSTACKLAT_N_HOOKS; key.hook++) {
+		if (!conf->enabled_hooks[key.hook])
+			continue;
+
+		for (key.bucket = 0; key.bucket < hist_nbuckets(&conf->bpf_conf);
+		     key.bucket++) {
+			err = bpf_map_update_elem(map_fd, &key, zeroes,
+						  BPF_NOEXIST);
+			if (err)
+				goto exit;
+		}
+	}
+
+exit:
+	free(zeroes);
+	return err;
+}
+
+static int map_hist_shards(struct hist_shards *shards,
+			   const struct netstacklat_bpf *obj)
+{
+	struct bpf_map *map = obj->maps.netstack_latency_shards;
+	long page_size = getpagesize();
+	void *mem;
+
+	shards->nshards = bpf_map__max_entries(map);
+	shards->mmap_size = (size_t)bpf_map__value_size(map) * shards->nshards;
+	shards->mmap_size = (shards->mmap_size + page_size - 1) &
+			    ~(page_size - 1);
+
+	mem = mmap(NULL, shards->mmap_size, PROT_READ, MAP_SHARED,
+		   bpf_map__fd(map), 0);
+	if (mem == MAP_FAILED)
+		return -errno;
+
+	shards->shards = mem;
+	return 0;
+}
+
+static void unmap_hist_shards(struct hist_shards *shards)
+{
+	if (shards->shards)
+		munmap((void *)shards->shards, shards->mmap_size);
+}
+
+static struct outlier_tracker *
+init_outlier_tracker(const struct netstacklat_bpf *obj)
+{
+	struct outlier_tracker *tracker;
+	int err;
+
+	tracker = calloc(1, sizeof(*tracker));
+	if (!tracker) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	tracker->rl_map_fd = bpf_map__fd(obj->maps.netstack_outlier_ratelimit);
+	tracker->rb =
+		ring_buffer__new(bpf_map__fd(obj->maps.netstack_outlier_events),
+				 handle_outlier_event, tracker, NULL);
+	if (!tracker->rb) {
+		err = -errno;
+		free(tracker);
+		errno = -err;
+		return NULL;
+	}
+
+	return tracker;
+}
+
+static void free_outlier_tracker(struct outlier_tracker *tracker)
+{
+	if (!tracker)
+		return;
+
+	ring_buffer__free(tracker->rb);
+	free(tracker);
+}
+
 int main(int argc, char *argv[])
 {
+	struct metrics_server metrics = { .listen_fd = -1 };
 	int sig_fd, timer_fd, epoll_fd, sock_fd, err;
 	struct netstacklat_config config = {
 		.report_interval_s = 5,
 	};
+	struct outlier_tracker *outliers = NULL;
+	const struct hist_shards *mmapped_hists = NULL;
+	struct hist_shards shards = { 0 };
 	struct netstacklat_bpf *obj;
 	char errmsg[128];
 
@@ -983,8 +3750,34 @@ int main(int argc, char *argv[])
 	obj->rodata->TAI_OFFSET = get_tai_offset() * NS_PER_S;
 	obj->rodata->user_config = config.bpf_conf;
 
+	set_napi_gro_target(&config, obj);
 	set_programs_to_load(&config, obj);
 
+	if (config.bpf_conf.mmap_hist)
+		bpf_map__set_max_entries(obj->maps.netstack_latency_shards,
+					 libbpf_num_possible_cpus());
+
+	if (grouping_enabled(&config.bpf_conf))
+		// Room for GROUPED_HIST_MAX_HISTS histograms of the active type
+		bpf_map__set_max_entries(
+			obj->maps.netstack_latency_grouped_seconds,
+			GROUPED_HIST_MAX_HISTS *
+				hist_nbuckets(&config.bpf_conf));
+	else
+		// The per-CPU values are preallocated, so keep it minimal
+		bpf_map__set_max_entries(
+			obj->maps.netstack_latency_grouped_seconds, 1);
+
+	if (!config.bpf_conf.hist_windows)
+		// The per-CPU slots are always allocated for an array map
+		bpf_map__set_max_entries(
+			obj->maps.netstack_latency_window_seconds, 1);
+
+	if (!outliers_enabled(&config.bpf_conf))
+		// Avoid allocating the full ring buffer when it's not used
+		bpf_map__set_max_entries(obj->maps.netstack_outlier_events,
+					 getpagesize());
+
 	err = netstacklat_bpf__load(obj);
 	if (err) {
 		libbpf_strerror(err, errmsg, sizeof(errmsg));
@@ -1000,6 +3793,44 @@ int main(int argc, char *argv[])
 		goto exit_destroy_bpf;
 	}
 
+	err = init_cgroupfilter_map(obj, &config);
+	if (err) {
+		libbpf_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "Failed filling the cgroup filter map: %s\n",
+			errmsg);
+		goto exit_destroy_bpf;
+	}
+
+	err = init_grouped_hist_map(obj, &config);
+	if (err) {
+		libbpf_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr,
+			"Failed initializing the grouped histogram map: %s\n",
+			errmsg);
+		goto exit_destroy_bpf;
+	}
+
+	if (config.bpf_conf.mmap_hist) {
+		err = map_hist_shards(&shards, obj);
+		if (err) {
+			fprintf(stderr, "Failed to mmap the histograms: %s\n",
+				strerror(-err));
+			goto exit_destroy_bpf;
+		}
+		mmapped_hists = &shards;
+	}
+
+	if (outliers_enabled(&config.bpf_conf)) {
+		outliers = init_outlier_tracker(obj);
+		if (!outliers) {
+			err = -errno;
+			fprintf(stderr,
+				"Failed setting up the outlier ring buffer: %s\n",
+				strerror(-err));
+			goto exit_destroy_bpf;
+		}
+	}
+
 	err = netstacklat_bpf__attach(obj);
 	if (err) {
 		libbpf_strerror(err, errmsg, sizeof(errmsg));
@@ -1007,6 +3838,15 @@ int main(int argc, char *argv[])
 		goto exit_destroy_bpf;
 	}
 
+	err = add_existing_child_pids(obj, &config);
+	if (err) {
+		libbpf_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr,
+			"Failed adding child processes to the PID filter: %s\n",
+			errmsg);
+		goto exit_detach_bpf;
+	}
+
 	sig_fd = init_signalfd();
 	if (sig_fd < 0) {
 		err = sig_fd;
@@ -1022,22 +3862,35 @@ int main(int argc, char *argv[])
 		goto exit_sigfd;
 	}
 
-	epoll_fd = setup_epoll_instance(sig_fd, timer_fd);
+	if (config.metrics_addr) {
+		metrics.listen_fd = setup_metrics_socket(config.metrics_addr);
+		if (metrics.listen_fd < 0) {
+			err = metrics.listen_fd;
+			fprintf(stderr, "Failed listening on %s: %s\n",
+				config.metrics_addr, strerror(-err));
+			goto exit_timerfd;
+		}
+	}
+
+	epoll_fd = setup_epoll_instance(sig_fd, timer_fd, metrics.listen_fd,
+					outliers);
 	if (epoll_fd < 0) {
 		err = epoll_fd;
 		fprintf(stderr, "Failed setting up epoll: %s\n",
 			strerror(-err));
-		goto exit_timerfd;
+		goto exit_metricsfd;
 	}
 
 	// Report stats until user shuts down program
 	while (true) {
-		err = poll_events(epoll_fd, &config, obj);
+		err = poll_events(epoll_fd, &config, obj, mmapped_hists,
+				  outliers, &metrics);
 
 		if (err) {
 			if (err == NETSTACKLAT_ABORT) {
 				// Report stats a final time before terminating
-				err = report_stats(&config, obj);
+				err = report_stats(&config, obj, mmapped_hists,
+						   outliers);
 			} else {
 				libbpf_strerror(err, errmsg, sizeof(errmsg));
 				fprintf(stderr, "Failed polling fds: %s\n",
@@ -1049,6 +3902,12 @@ int main(int argc, char *argv[])
 
 	// Cleanup
 	close(epoll_fd);
+exit_metricsfd:
+	if (metrics.listen_fd >= 0) {
+		close_metrics_server(&metrics);
+		if (strncmp(config.metrics_addr, "unix:", 5) == 0)
+			unlink(config.metrics_addr + 5);
+	}
 exit_timerfd:
 	close(timer_fd);
 exit_sigfd:
@@ -1056,6 +3915,8 @@ exit_sigfd:
 exit_detach_bpf:
 	netstacklat_bpf__detach(obj);
 exit_destroy_bpf:
+	free_outlier_tracker(outliers);
+	unmap_hist_shards(&shards);
 	netstacklat_bpf__destroy(obj);
 exit_sockfd:
 	close(sock_fd);
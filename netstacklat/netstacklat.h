@@ -11,11 +11,76 @@
  */
 #define HIST_NBUCKETS (HIST_MAX_LATENCY_SLOT + 2)
 
+/*
+ * Log-linear histograms split each power of 2 into HIST_LOGLIN_SUBBUCKETS
+ * linearly spaced buckets, giving a relative error of at most
+ * 1/HIST_LOGLIN_SUBBUCKETS (12.5%) instead of 2x for the exp2 histograms.
+ * They cover the same range as the exp2 histograms, i.e. the last bucket
+ * holds all values above 2^HIST_MAX_LATENCY_SLOT ns, followed by the sum.
+ */
+#define HIST_LOGLIN_SUBBUCKET_BITS 3
+#define HIST_LOGLIN_SUBBUCKETS (1 << HIST_LOGLIN_SUBBUCKET_BITS)
+#define HIST_LOGLIN_MAX_LATENCY_SLOT                                \
+	((HIST_MAX_LATENCY_SLOT - HIST_LOGLIN_SUBBUCKET_BITS + 1) * \
+	 HIST_LOGLIN_SUBBUCKETS)
+#define HIST_LOGLIN_NBUCKETS (HIST_LOGLIN_MAX_LATENCY_SLOT + 2)
+
 #define NS_PER_S 1000000000
 
+/*
+ * Maximum number of histograms (i.e. groups across all hooks) in the grouped
+ * histogram map. Each histogram uses up to one map entry per bucket, so the
+ * map is resized to GROUPED_HIST_MAX_HISTS times the number of buckets of the
+ * active histogram type (HIST_NBUCKETS or HIST_LOGLIN_NBUCKETS) at load time.
+ */
+#define GROUPED_HIST_MAX_HISTS 512
+#define GROUPED_HIST_MAX_ENTRIES (GROUPED_HIST_MAX_HISTS * HIST_NBUCKETS)
+
+/*
+ * Maximum number of in-flight packets on the TX path that can be tracked by
+ * the TX hooks (see the netstack_tx_tstamps map).
+ */
+#define TX_TSTAMP_MAX_ENTRIES 65536
+
+/*
+ * Maximum number of packets held by GRO that can be tracked by the napi-gro
+ * hook (see the netstack_gro_tstamps map).
+ */
+#define GRO_TSTAMP_MAX_ENTRIES 4096
+
+/*
+ * Maximum number of packets waiting in the CPU backlogs that can be tracked by
+ * the backlog-enqueue hook (see the netstack_backlog_tstamps map).
+ */
+#define BACKLOG_TSTAMP_MAX_ENTRIES 16384
+
+// Size (in bytes) of the ring buffer for the latency outlier events
+#define OUTLIER_RINGBUF_SIZE (256 * 1024)
+
 // The highest possible PID on a Linux system (from /include/linux/threads.h)
 #define PID_MAX_LIMIT (4 * 1024 * 1024)
 
+/*
+ * Maximum number of processes in the PID filter, including the child
+ * processes that are added as they are forked.
+ */
+#define PID_FILTER_MAX_ENTRIES 16384
+
+// Maximum number of cgroups in the cgroup filter
+#define CGROUP_FILTER_MAX_ENTRIES 256
+
+/*
+ * Maximum cgroup depth searched when checking if a cgroup is a descendant of
+ * one of the cgroups in the cgroup filter
+ */
+#define CGROUP_MAX_DEPTH 16
+
+/*
+ * Maximum number of processes with their own socket read histograms. The
+ * least recently active processes are evicted once the map is full.
+ */
+#define PROCESS_HIST_MAX_ENTRIES 1024
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
 #endif
@@ -38,13 +103,173 @@ enum netstacklat_hook {
 	NETSTACKLAT_HOOK_UDP_SOCK_ENQUEUED,
 	NETSTACKLAT_HOOK_TCP_SOCK_READ,
 	NETSTACKLAT_HOOK_UDP_SOCK_READ,
+	NETSTACKLAT_HOOK_DEV_QUEUE_XMIT,
+	NETSTACKLAT_HOOK_QDISC_DEQUEUE,
+	NETSTACKLAT_HOOK_NET_DEV_XMIT,
+	NETSTACKLAT_HOOK_NAPI_GRO,
+	NETSTACKLAT_HOOK_BACKLOG_ENQUEUE,
+	NETSTACKLAT_HOOK_NETIF_RECEIVE,
 	NETSTACKLAT_N_HOOKS,
 };
 
+static inline bool netstacklat_hook_is_tx(enum netstacklat_hook hook)
+{
+	switch (hook) {
+	case NETSTACKLAT_HOOK_DEV_QUEUE_XMIT:
+	case NETSTACKLAT_HOOK_QDISC_DEQUEUE:
+	case NETSTACKLAT_HOOK_NET_DEV_XMIT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * The sliding-window histograms are kept in rings of HIST_WINDOW_NSLOTS time
+ * slots each, where the 1s ring covers windows of up to 20s and the 10s ring
+ * covers windows of up to 200s (the slot currently being filled is not
+ * complete, and therefore not included in any window). This fits both the 10s
+ * and 60s windows and the window just before each of them.
+ */
+#define HIST_WINDOW_NSLOTS 21
+
+enum hist_window_ring {
+	HIST_WINDOW_RING_1S,
+	HIST_WINDOW_RING_10S,
+	HIST_WINDOW_N_RINGS,
+};
+
+static inline __u64 hist_window_slot_ns(enum hist_window_ring ring)
+{
+	return ring == HIST_WINDOW_RING_10S ? 10ULL * NS_PER_S : NS_PER_S;
+}
+
 struct netstacklat_bpf_config
 {
 	bool filter_pid;
+	bool filter_cgroup;
+	bool groupby_cgroup;
+	bool groupby_netns;
+	bool groupby_cpu;
+	bool groupby_rxqueue;
+	bool loglinear_hist;
+	bool single_hist_map;
+	bool mmap_hist;
+	bool hist_windows;
+	bool process_hist;
+	/*
+	 * Latencies (in ns) at or above the threshold for the hook are
+	 * reported as outlier events (0 = disabled), at most
+	 * outlier_rate_limit events per second and CPU.
+	 */
+	__u32 outlier_rate_limit;
+	__u64 outlier_thresholds[NETSTACKLAT_N_HOOKS];
 };
 
-#endif
+/*
+ * The histograms for all hooks from a single CPU, used as the value of the
+ * memory-mappable histogram array (one entry per CPU). The histogram for each
+ * hook is stored at index hook * HIST_NBUCKETS + bucket (or
+ * HIST_LOGLIN_NBUCKETS with log-linear histograms), so the buckets are sized
+ * for the larger log-linear histograms.
+ *
+ * The seq member works as a seqcount: it is odd while the CPU is updating the
+ * shard, and incremented (to an even value) after each update. Readers can
+ * therefore detect if they read the shard during an update and retry. Nested
+ * updates on the same CPU do not touch seq (see increment_mmap_histogram()).
+ */
+struct hist_shard {
+	__u64 seq;
+	__u64 buckets[NETSTACKLAT_N_HOOKS * HIST_LOGLIN_NBUCKETS];
+} __attribute__((aligned(64)));
+
+/*
+ * A time slot in the sliding-window histograms. The epoch is the time (in
+ * CLOCK_MONOTONIC) divided by the slot width, and tells which period the
+ * buckets are for, as the slot is reset when it's reused for a new period.
+ * Always uses exp2 histograms to keep the size of the rings down.
+ */
+struct hist_window_slot {
+	__u64 epoch;
+	__u64 buckets[HIST_NBUCKETS];
+};
+
+/*
+ * Key for the netstack_latency_seconds map, which holds the exp2 histograms of
+ * all hooks when single_hist_map is enabled. Like for the grouped histograms,
+ * the bucket is the last member, so that ebpf_exporter can decode the key.
+ */
+struct hook_hist_key {
+	__u32 hook;
+	__u32 bucket;
+};
+
+/*
+ * Key for the grouped histograms. A value of 0 for any of the group members
+ * means that the packet was not grouped by it (either because grouping by it
+ * is not enabled, or the hook does not know it, e.g. the cgroup for hooks
+ * without a socket). Entries that do not fit in the map are also recorded in
+ * the group with all members 0.
+ *
+ * To keep 0 free, cpu is stored as the CPU ID + 1. Similarly, rxqueue is
+ * skb->queue_mapping, in which the kernel stores the RX queue + 1 (see
+ * skb_record_rx_queue()).
+ */
+struct grouped_hist_key {
+	__u64 cgroup;
+	__u64 netns;
+	__u32 cpu;
+	__u32 rxqueue;
+	__u32 hook;
+	__u32 bucket;
+};
+
+/*
+ * Key for the per-process socket read histograms. The comm is that of the
+ * thread reading from the socket, so threads with different names in the same
+ * process get separate histograms.
+ */
+struct process_hist_key {
+	__u32 tgid;
+	__u32 hook;
+	char comm[16];
+};
+
+// Always uses exp2 histograms to keep the size of the LRU entries down
+struct process_hist {
+	__u64 buckets[HIST_NBUCKETS];
+};
+
+/*
+ * The flow a packet belongs to. Addresses and ports are in network byte
+ * order, and IPv4 addresses only use the first 4 bytes. Ports are only set for
+ * TCP and UDP.
+ */
+struct netstacklat_flow {
+	__u8 saddr[16];
+	__u8 daddr[16];
+	__be16 sport;
+	__be16 dport;
+	__u8 family; // AF_INET or AF_INET6, 0 if unknown
+	__u8 ipproto;
+	__u8 pad[2];
+};
+
+struct netstacklat_outlier_event {
+	__u64 latency;
+	__u32 hook;
+	__u32 cpu;
+	__u32 pid; // The TGID of the current task
+	char comm[16];
+	struct netstacklat_flow flow;
+};
+
+// Per-CPU counters for outlier events that could not be reported
+struct outlier_ratelimit_state {
+	__u64 window_start;
+	__u64 nevents;
+	__u64 ratelimited;
+	__u64 dropped; // ring buffer full
+};
 
+#endif
@@ -13,6 +13,7 @@ static const char *__doc__ =
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <ctype.h>
@@ -24,6 +25,10 @@ static const char *__doc__ =
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
 #include <linux/unistd.h>
 #include <linux/membarrier.h>
 #include <limits.h>
@@ -31,6 +36,7 @@ static const char *__doc__ =
 #include "json_writer.h"
 #include "pping.h" //common structs for user-space and BPF parts
 #include "lhist.h"
+#include "uring_writer.h"
 
 // Maximum string length for IP prefix (including /xx[x] and '\0')
 #define INET_PREFIXSTRLEN (INET_ADDRSTRLEN + 3)
@@ -55,12 +61,28 @@ static const char *__doc__ =
 #define PPING_EPEVENT_TYPE_SIGNAL (1ULL << 62)
 #define PPING_EPEVENT_TYPE_PIPE (1ULL << 61)
 #define PPING_EPEVENT_TYPE_AGGTIMER (1ULL << 60)
+#define PPING_EPEVENT_TYPE_METRICS (1ULL << 59)
+#define PPING_EPEVENT_TYPE_METRICS_CLIENT (1ULL << 58)
+#define PPING_EPEVENT_TYPE_URING (1ULL << 57)
 #define PPING_EPEVENT_MASK                                                     \
 	(~(PPING_EPEVENT_TYPE_PERFBUF | PPING_EPEVENT_TYPE_SIGNAL |            \
-	   PPING_EPEVENT_TYPE_PIPE | PPING_EPEVENT_TYPE_AGGTIMER))
+	   PPING_EPEVENT_TYPE_PIPE | PPING_EPEVENT_TYPE_AGGTIMER |             \
+	   PPING_EPEVENT_TYPE_METRICS | PPING_EPEVENT_TYPE_METRICS_CLIENT |    \
+	   PPING_EPEVENT_TYPE_URING))
 
 #define AGG_BATCH_SIZE 64 // Batch size for fetching aggregation maps (bpf_map_lookup_batch)
 
+#define METRICS_DEFAULT_HOST "127.0.0.1"
+#define METRICS_LISTEN_BACKLOG 16
+#define METRICS_REQUEST_MAXLEN 4096
+#define METRICS_MAX_CLIENTS 16
+#define METRICS_CLIENT_TIMEOUT_MS 5000 // Deadline for a client to send its request and read the reply
+#define METRICS_UNIX_PREFIX "unix:"
+#define METRICS_EOF "# EOF\n"
+
+#define URING_BUF_SIZE (64 * 1024) // Size of each io_uring output buffer
+#define URING_MAX_DEPTH 1024
+
 /* Value that can be returned by functions to indicate the program should abort
  * Should ideally not collide with any error codes (including libbpf ones), but
  * can also be seperated by returning as positive (as error codes are generally
@@ -69,6 +91,10 @@ static const char *__doc__ =
 
 #define ARG_AGG_REVERSE 256
 #define AGG_ARG_TIMEOUT 257
+#define ARG_ENCAP 258
+#define ARG_VXLAN_PORT 259
+#define ARG_METRICS 260
+#define ARG_IO_URING 261
 
 enum pping_output_format {
 	PPING_OUTPUT_STANDARD,
@@ -102,9 +128,36 @@ struct map_cleanup_args {
 	bool valid_thread;
 };
 
+/*
+ * The metrics are rendered in one pass over the aggregation maps, but the
+ * samples of each metric family must be grouped together, so the per-prefix
+ * families are written to separate buffers which are joined in the reply.
+ */
+enum metrics_section {
+	METRICS_SECTION_GLOBAL,
+	METRICS_SECTION_PREFIX_PKTS,
+	METRICS_SECTION_PREFIX_BYTES,
+	METRICS_SECTION_PREFIX_ECN,
+	METRICS_SECTION_PREFIX_RTT,
+	METRICS_N_SECTIONS
+};
+
+struct metrics_buffer {
+	FILE *stream;
+	char *buf;
+	size_t len;
+};
+
+struct metrics_writer {
+	struct metrics_buffer sections[METRICS_N_SECTIONS];
+	bool openmetrics; // OpenMetrics instead of Prometheus text format
+};
+
 struct output_context {
 	FILE *stream;
 	json_writer_t *jctx;
+	struct metrics_writer *metrics;
+	struct uring_writer *uring; // Write stream with io_uring if set
 	enum pping_output_format format;
 };
 
@@ -115,6 +168,30 @@ struct aggregation_config {
 	__u64 bin_width;
 	__u8 ipv4_prefix_len;
 	__u8 ipv6_prefix_len;
+	bool cumulative; // Keep accumulating stats instead of clearing them on each report
+};
+
+/*
+ * A scrape connection. The sockets are non-blocking, and the request and the
+ * reply are read and written as the socket becomes ready, so that a slow
+ * client never holds up the main loop. A client that hasn't been served
+ * within METRICS_CLIENT_TIMEOUT_MS is dropped.
+ */
+struct metrics_client {
+	int fd;
+	__u64 deadline; // CLOCK_MONOTONIC
+	char req[METRICS_REQUEST_MAXLEN];
+	size_t req_len;
+	char *reply; // NULL until the full request has been read
+	size_t reply_len;
+	size_t reply_sent;
+};
+
+struct metrics_server {
+	char listen_addr[PATH_MAX];
+	int listen_fd;
+	bool unix_socket;
+	struct metrics_client *clients[METRICS_MAX_CLIENTS];
 };
 
 struct aggregation_maps {
@@ -138,6 +215,8 @@ struct pping_config {
 	struct aggregation_config agg_conf;
 	struct aggregation_context agg_ctx;
 	struct output_context *out_ctx;
+	struct metrics_server metrics;
+	struct uring_writer *uring;
 	char *object_path;
 	char *ingress_prog;
 	char *egress_prog;
@@ -154,7 +233,9 @@ struct pping_config {
 	char filename[PATH_MAX];
 	enum pping_output_format format;
 	enum xdp_attach_mode xdp_mode;
+	unsigned int uring_depth;
 	bool write_to_file;
+	bool export_metrics;
 	bool force;
 	bool created_tc_hook;
 };
@@ -180,6 +261,10 @@ static const struct option long_options[] = {
 	{ "aggregate-reverse",    no_argument,       NULL, ARG_AGG_REVERSE }, // Aggregate RTTs by dst IP of reply packet (instead of src like default)
 	{ "aggregate-timeout",    required_argument, NULL, AGG_ARG_TIMEOUT }, // Interval for timing out subnet entries in seconds (default 30s)
 	{ "write",                required_argument, NULL, 'w' }, // Write output to file (instead of stdout)
+	{ "encap",                required_argument, NULL, ARG_ENCAP }, // Track flows based on "outer" (tunnel endpoints) or "inner" (tunneled) headers
+	{ "vxlan-port",           required_argument, NULL, ARG_VXLAN_PORT }, // UDP port to recognize as VXLAN (default 4789)
+	{ "metrics",              required_argument, NULL, ARG_METRICS }, // Serve aggregated stats in Prometheus/OpenMetrics format on [addr:]port or unix:path
+	{ "io-uring",             required_argument, NULL, ARG_IO_URING }, // Write output file asynchronously with io_uring, using the given queue depth
 	{ 0, 0, NULL, 0 }
 };
 
@@ -277,9 +362,12 @@ static int parse_arguments(int argc, char *argv[], struct pping_config *config)
 	int err, opt, len;
 	double user_float;
 	long long user_int;
+	bool agg_interval_set = false;
 
 	config->ifindex = 0;
 	config->force = false;
+	config->export_metrics = false;
+	config->uring_depth = 0;
 
 	config->bpf_config.localfilt = true;
 	config->bpf_config.track_tcp = false;
@@ -288,6 +376,7 @@ static int parse_arguments(int argc, char *argv[], struct pping_config *config)
 	config->bpf_config.push_individual_events = true;
 	config->bpf_config.agg_rtts = false;
 	config->bpf_config.agg_by_dst = false;
+	config->bpf_config.track_inner = false;
 
 	while ((opt = getopt_long(argc, argv, "hflTCsi:r:R:t:c:F:I:x:a:4:6:w:",
 				  long_options, NULL)) != -1) {
@@ -413,6 +502,7 @@ static int parse_arguments(int argc, char *argv[], struct pping_config *config)
 
 			config->agg_conf.aggregation_interval =
 				user_int * NS_PER_SECOND;
+			agg_interval_set = true;
 			break;
 		case '4':
 			err = parse_bounded_long(&user_int, optarg, 0, 32,
@@ -440,6 +530,48 @@ static int parse_arguments(int argc, char *argv[], struct pping_config *config)
 			config->agg_conf.timeout_interval =
 				user_int * NS_PER_SECOND;
 			break;
+		case ARG_ENCAP:
+			if (strcmp(optarg, "outer") == 0) {
+				config->bpf_config.track_inner = false;
+			} else if (strcmp(optarg, "inner") == 0) {
+				config->bpf_config.track_inner = true;
+			} else {
+				fprintf(stderr,
+					"encap must be \"outer\" or \"inner\"\n");
+				return -EINVAL;
+			}
+			break;
+		case ARG_VXLAN_PORT:
+			err = parse_bounded_long(&user_int, optarg, 1, 65535,
+						 "vxlan-port");
+			if (err)
+				return -EINVAL;
+			config->bpf_config.vxlan_port = user_int;
+			break;
+		case ARG_METRICS:
+			len = strlen(optarg);
+			if (len >= sizeof(config->metrics.listen_addr)) {
+				fprintf(stderr, "metrics address too long\n");
+				return -ENAMETOOLONG;
+			}
+
+			memcpy(config->metrics.listen_addr, optarg, len);
+			config->metrics.listen_addr[len] = '\0';
+			config->export_metrics = true;
+
+			/* The exporter serves the aggregated stats, and like
+			 * --aggregate disables individual RTT events */
+			config->bpf_config.push_individual_events = false;
+			config->bpf_config.agg_rtts = true;
+			config->agg_conf.cumulative = true;
+			break;
+		case ARG_IO_URING:
+			err = parse_bounded_long(&user_int, optarg, 1,
+						 URING_MAX_DEPTH, "io-uring");
+			if (err)
+				return -EINVAL;
+			config->uring_depth = user_int;
+			break;
 		case 'w':
 			len = strlen(optarg);
 			if (len >= sizeof(config->filename)) {
@@ -467,6 +599,17 @@ static int parse_arguments(int argc, char *argv[], struct pping_config *config)
 		return -EINVAL;
 	}
 
+	if (config->uring_depth > 0 && !config->write_to_file) {
+		fprintf(stderr, "--io-uring requires --write\n");
+		return -EINVAL;
+	}
+
+	if (config->export_metrics && agg_interval_set) {
+		fprintf(stderr,
+			"--metrics can not be combined with --aggregate\n");
+		return -EINVAL;
+	}
+
 	config->bpf_config.ipv4_prefix_mask =
 		htonl(0xffffffffUL << (32 - config->agg_conf.ipv4_prefix_len));
 	config->bpf_config.ipv6_prefix_mask =
@@ -1047,6 +1190,9 @@ static void print_rttevent_fields_json(json_writer_t *ctx,
 	jsonw_u64_field(ctx, "sent_bytes", re->sent_bytes);
 	jsonw_u64_field(ctx, "rec_packets", re->rec_pkts);
 	jsonw_u64_field(ctx, "rec_bytes", re->rec_bytes);
+	jsonw_uint_field(ctx, "sent_ect0_packets", re->sent_ect0_pkts);
+	jsonw_uint_field(ctx, "sent_ect1_packets", re->sent_ect1_pkts);
+	jsonw_uint_field(ctx, "sent_ce_packets", re->sent_ce_pkts);
 	jsonw_bool_field(ctx, "match_on_egress", re->match_on_egress);
 }
 
@@ -1353,11 +1499,104 @@ static void print_globalcounters_json(json_writer_t *jctx, __u64 t_monotonic,
 	jsonw_end_object(jctx);
 }
 
+/*
+ * Samples of counters always get the _total suffix. In the Prometheus text
+ * format the suffix is also part of the metric family name, while OpenMetrics
+ * leaves it out.
+ */
+static void print_metric_family(FILE *stream, const char *name,
+				const char *type, const char *help,
+				bool openmetrics)
+{
+	const char *suffix =
+		!openmetrics && strcmp(type, "counter") == 0 ? "_total" : "";
+
+	fprintf(stream, "# HELP %s%s %s\n", name, suffix, help);
+	fprintf(stream, "# TYPE %s%s %s\n", name, suffix, type);
+}
+
+static void print_counter_metric(FILE *stream, const char *name,
+				 const char *label, const char *label_val,
+				 __u64 val)
+{
+	fprintf(stream, "%s_total{%s=\"%s\"} %llu\n", name, label, label_val,
+		val);
+}
+
+static void print_globalcounters_metrics(struct metrics_writer *metrics,
+					 const struct global_counters *counters)
+{
+	FILE *stream = metrics->sections[METRICS_SECTION_GLOBAL].stream;
+	char protostr[16];
+	int proto;
+
+	print_metric_family(stream, "pping_packets", "counter",
+			    "Packets seen by pping per protocol",
+			    metrics->openmetrics);
+	print_counter_metric(stream, "pping_packets", "protocol", "non-IP",
+			     counters->nonip_pkts);
+	print_counter_metric(stream, "pping_packets", "protocol", "TCP",
+			     counters->tcp_pkts);
+	print_counter_metric(stream, "pping_packets", "protocol", "UDP",
+			     counters->udp_pkts);
+	print_counter_metric(stream, "pping_packets", "protocol", "ICMP",
+			     counters->icmp_pkts);
+	print_counter_metric(stream, "pping_packets", "protocol", "ICMPv6",
+			     counters->icmp6_pkts);
+	for (proto = 0; proto < N_IPPROTOS; proto++) {
+		if (counters->other_ipprotos[proto] > 0) {
+			ipproto_to_str(protostr, sizeof(protostr), proto);
+			print_counter_metric(stream, "pping_packets",
+					     "protocol", protostr,
+					     counters->other_ipprotos[proto]);
+		}
+	}
+
+	print_metric_family(stream, "pping_bytes", "counter",
+			    "Bytes seen by pping per protocol",
+			    metrics->openmetrics);
+	print_counter_metric(stream, "pping_bytes", "protocol", "non-IP",
+			     counters->nonip_bytes);
+	print_counter_metric(stream, "pping_bytes", "protocol", "TCP",
+			     counters->tcp_bytes);
+	print_counter_metric(stream, "pping_bytes", "protocol", "UDP",
+			     counters->udp_bytes);
+	print_counter_metric(stream, "pping_bytes", "protocol", "ICMP",
+			     counters->icmp_bytes);
+	print_counter_metric(stream, "pping_bytes", "protocol", "ICMPv6",
+			     counters->icmp6_bytes);
+
+	print_metric_family(stream, "pping_ecn_packets", "counter",
+			    "IP packets per ECN codepoint",
+			    metrics->openmetrics);
+	print_counter_metric(stream, "pping_ecn_packets", "codepoint",
+			     "Not-ECT", counters->ecn.no_ect);
+	print_counter_metric(stream, "pping_ecn_packets", "codepoint", "ECT1",
+			     counters->ecn.ect1);
+	print_counter_metric(stream, "pping_ecn_packets", "codepoint", "ECT0",
+			     counters->ecn.ect0);
+	print_counter_metric(stream, "pping_ecn_packets", "codepoint", "CE",
+			     counters->ecn.ce);
+
+	print_metric_family(stream, "pping_errors", "counter",
+			    "Errors encountered by the BPF programs",
+			    metrics->openmetrics);
+	print_counter_metric(stream, "pping_errors", "error",
+			     "store-packet-ts", counters->err.pktts_store);
+	print_counter_metric(stream, "pping_errors", "error",
+			     "create-flow-state", counters->err.flow_create);
+	print_counter_metric(stream, "pping_errors", "error",
+			     "create-agg-subnet-state",
+			     counters->err.agg_subnet_create);
+}
+
 static void print_globalcounters(struct output_context *out_ctx,
 				 __u64 t_monotonic,
 				 const struct global_counters *counters)
 {
-	if (out_ctx->format == PPING_OUTPUT_STANDARD)
+	if (out_ctx->metrics)
+		print_globalcounters_metrics(out_ctx->metrics, counters);
+	else if (out_ctx->format == PPING_OUTPUT_STANDARD)
 		print_globalcounters_standard(out_ctx->stream, t_monotonic,
 					      counters);
 	else if (out_ctx->jctx)
@@ -1465,7 +1704,8 @@ static void diff_globalcounters(struct global_counters *diff,
 }
 
 static int report_globalcounters(struct output_context *out_ctx,
-				 struct aggregation_context *agg_ctx)
+				 struct aggregation_context *agg_ctx,
+				 bool cumulative)
 {
 	int n_cpus = libbpf_num_possible_cpus();
 	__u64 t = get_time_ns(CLOCK_MONOTONIC);
@@ -1483,6 +1723,11 @@ static int report_globalcounters(struct output_context *out_ctx,
 		goto exit;
 
 	merge_percpu_globalcounters(&tot_cnt, cpu_cnt, n_cpus);
+	if (cumulative) {
+		print_globalcounters(out_ctx, t, &tot_cnt);
+		goto exit;
+	}
+
 	diff_globalcounters(&diff, &agg_ctx->prev_counters, &tot_cnt);
 	agg_ctx->prev_counters = tot_cnt;
 
@@ -1505,6 +1750,17 @@ static __u64 sum_trafficcounts_bytes(const struct traffic_counters *counters)
 	       counters->other_bytes;
 }
 
+static __u64 ecncounters_ect_pkts(const struct ecn_counters *counters)
+{
+	return counters->ect0 + counters->ect1 + counters->ce;
+}
+
+/* Share of the ECN-capable packets that have been CE-marked */
+static double ecncounters_ce_rate(const struct ecn_counters *counters)
+{
+	return (double)counters->ce / ecncounters_ect_pkts(counters);
+}
+
 static bool trafficcounts_empty(const struct traffic_counters *counters)
 {
 	static const struct traffic_counters empty = { 0 };
@@ -1540,6 +1796,7 @@ static void add_trafficcounts(struct traffic_counters *to,
 	to->tcp_nots_bytes += from->tcp_nots_bytes;
 	to->other_pkts += from->other_pkts;
 	to->other_bytes += from->other_bytes;
+	update_ecncounters(&to->ecn, &from->ecn);
 }
 
 static void update_aggregated_stats(struct aggregated_stats *to_stats,
@@ -1559,6 +1816,7 @@ static void update_aggregated_stats(struct aggregated_stats *to_stats,
 
 	if (from_stats->rtt_max > to_stats->rtt_max)
 		to_stats->rtt_max = from_stats->rtt_max;
+	to_stats->rtt_sum += from_stats->rtt_sum;
 	if (to_stats->rtt_min == 0 || from_stats->rtt_min < to_stats->rtt_min)
 		to_stats->rtt_min = from_stats->rtt_min;
 
@@ -1639,19 +1897,25 @@ static void print_aggstats_standard(FILE *stream, __u64 t,
 		sum_trafficcounts_pkts(&stats->tx_stats),
 		sum_trafficcounts_bytes(&stats->tx_stats));
 
-	if (aggregated_stats_nortts(stats))
-		goto exit;
-
-	fprintf(stream,
-		", rtt-count=%llu, min=%.6g ms, mean=%g ms, median=%g ms, p95=%g ms, max=%.6g ms",
-		lhist_count(stats->rtt_bins, nb),
-		(double)stats->rtt_min / NS_PER_MS,
-		lhist_mean(stats->rtt_bins, nb, bw, 0) / NS_PER_MS,
-		lhist_percentile(stats->rtt_bins, 50, nb, bw, 0) / NS_PER_MS,
-		lhist_percentile(stats->rtt_bins, 95, nb, bw, 0) / NS_PER_MS,
-		(double)stats->rtt_max / NS_PER_MS);
+	if (!aggregated_stats_nortts(stats))
+		fprintf(stream,
+			", rtt-count=%llu, min=%.6g ms, mean=%g ms, median=%g ms, p95=%g ms, max=%.6g ms",
+			lhist_count(stats->rtt_bins, nb),
+			(double)stats->rtt_min / NS_PER_MS,
+			lhist_mean(stats->rtt_bins, nb, bw, 0) / NS_PER_MS,
+			lhist_percentile(stats->rtt_bins, 50, nb, bw, 0) /
+				NS_PER_MS,
+			lhist_percentile(stats->rtt_bins, 95, nb, bw, 0) /
+				NS_PER_MS,
+			(double)stats->rtt_max / NS_PER_MS);
+
+	if (ecncounters_ect_pkts(&stats->rx_stats.ecn) > 0)
+		fprintf(stream, ", rx-CE-rate=%.3g%%",
+			ecncounters_ce_rate(&stats->rx_stats.ecn) * 100);
+	if (ecncounters_ect_pkts(&stats->tx_stats.ecn) > 0)
+		fprintf(stream, ", tx-CE-rate=%.3g%%",
+			ecncounters_ce_rate(&stats->tx_stats.ecn) * 100);
 
-exit:
 	fprintf(stream, "\n");
 }
 
@@ -1666,6 +1930,10 @@ static void print_trafficcount_json(json_writer_t *jctx,
 				  counters->tcp_nots_bytes);
 	print_pktbytes_tuple_json(jctx, "other", counters->other_pkts,
 				  counters->other_bytes);
+	if (!ecncounters_empty(&counters->ecn)) {
+		jsonw_name(jctx, "ecn_counters");
+		print_ecncounters_json(jctx, &counters->ecn);
+	}
 	jsonw_end_object(jctx);
 }
 
@@ -1687,6 +1955,13 @@ static void print_aggstats_json(json_writer_t *ctx, __u64 t,
 	jsonw_name(ctx, "tx_stats");
 	print_trafficcount_json(ctx, &stats->tx_stats);
 
+	if (ecncounters_ect_pkts(&stats->rx_stats.ecn) > 0)
+		jsonw_float_field(ctx, "rx_ce_rate",
+				  ecncounters_ce_rate(&stats->rx_stats.ecn));
+	if (ecncounters_ect_pkts(&stats->tx_stats.ecn) > 0)
+		jsonw_float_field(ctx, "tx_ce_rate",
+				  ecncounters_ce_rate(&stats->tx_stats.ecn));
+
 	if (aggregated_stats_nortts(stats))
 		goto exit;
 
@@ -1710,6 +1985,78 @@ exit:
 	jsonw_end_object(ctx);
 }
 
+static void print_trafficcount_metrics(struct metrics_writer *metrics,
+				       const char *prefixstr, const char *dir,
+				       const struct traffic_counters *counters)
+{
+	FILE *pkts = metrics->sections[METRICS_SECTION_PREFIX_PKTS].stream;
+	FILE *bytes = metrics->sections[METRICS_SECTION_PREFIX_BYTES].stream;
+	FILE *ecn = metrics->sections[METRICS_SECTION_PREFIX_ECN].stream;
+	const char *fmt =
+		"%s_total{prefix=\"%s\",direction=\"%s\",type=\"%s\"} %llu\n";
+	const char *ecn_fmt =
+		"pping_prefix_ecn_packets_total{prefix=\"%s\",direction=\"%s\",codepoint=\"%s\"} %llu\n";
+
+	fprintf(pkts, fmt, "pping_prefix_packets", prefixstr, dir, "TCP_TS",
+		counters->tcp_ts_pkts);
+	fprintf(pkts, fmt, "pping_prefix_packets", prefixstr, dir, "TCP_noTS",
+		counters->tcp_nots_pkts);
+	fprintf(pkts, fmt, "pping_prefix_packets", prefixstr, dir, "other",
+		counters->other_pkts);
+
+	fprintf(bytes, fmt, "pping_prefix_bytes", prefixstr, dir, "TCP_TS",
+		counters->tcp_ts_bytes);
+	fprintf(bytes, fmt, "pping_prefix_bytes", prefixstr, dir, "TCP_noTS",
+		counters->tcp_nots_bytes);
+	fprintf(bytes, fmt, "pping_prefix_bytes", prefixstr, dir, "other",
+		counters->other_bytes);
+
+	fprintf(ecn, ecn_fmt, prefixstr, dir, "Not-ECT", counters->ecn.no_ect);
+	fprintf(ecn, ecn_fmt, prefixstr, dir, "ECT1", counters->ecn.ect1);
+	fprintf(ecn, ecn_fmt, prefixstr, dir, "ECT0", counters->ecn.ect0);
+	fprintf(ecn, ecn_fmt, prefixstr, dir, "CE", counters->ecn.ce);
+}
+
+/*
+ * All histogram buckets are always included, as Prometheus expects the same
+ * set of le labels in every scrape of a histogram. The last bin also holds
+ * all RTTs beyond the histogram range, so it's only covered by the +Inf
+ * bucket.
+ */
+static void print_aggstats_metrics(struct metrics_writer *metrics,
+				   const char *prefixstr,
+				   struct aggregated_stats *stats,
+				   struct aggregation_config *agg_conf)
+{
+	FILE *rtt = metrics->sections[METRICS_SECTION_PREFIX_RTT].stream;
+	__u64 bw = agg_conf->bin_width;
+	__u64 count = 0;
+	int i;
+
+	print_trafficcount_metrics(metrics, prefixstr, "rx", &stats->rx_stats);
+	print_trafficcount_metrics(metrics, prefixstr, "tx", &stats->tx_stats);
+
+	if (aggregated_stats_nortts(stats))
+		return;
+
+	for (i = 0; i < agg_conf->n_bins - 1; i++) {
+		count += stats->rtt_bins[i];
+		fprintf(rtt,
+			"pping_prefix_rtt_seconds_bucket{prefix=\"%s\",le=\"%.9g\"} %llu\n",
+			prefixstr, (double)((i + 1) * bw) / NS_PER_SECOND,
+			count);
+	}
+
+	count = lhist_count(stats->rtt_bins, agg_conf->n_bins);
+	fprintf(rtt,
+		"pping_prefix_rtt_seconds_bucket{prefix=\"%s\",le=\"+Inf\"} %llu\n",
+		prefixstr, count);
+	fprintf(rtt, "pping_prefix_rtt_seconds_sum{prefix=\"%s\"} %.9f\n",
+		prefixstr, (double)stats->rtt_sum / NS_PER_SECOND);
+	fprintf(rtt, "pping_prefix_rtt_seconds_count{prefix=\"%s\"} %llu\n",
+		prefixstr, count);
+}
+
 static void print_aggregated_stats(struct output_context *out_ctx, __u64 t,
 				   struct ipprefix_key *prefix, int af,
 				   __u8 prefix_len,
@@ -1723,7 +2070,10 @@ static void print_aggregated_stats(struct output_context *out_ctx, __u64 t,
 
 	format_ipprefix(prefixstr, sizeof(prefixstr), af, prefix, prefix_len);
 
-	if (out_ctx->format == PPING_OUTPUT_STANDARD)
+	if (out_ctx->metrics)
+		print_aggstats_metrics(out_ctx->metrics, prefixstr, stats,
+				       agg_conf);
+	else if (out_ctx->format == PPING_OUTPUT_STANDARD)
 		print_aggstats_standard(out_ctx->stream, t, prefixstr, stats,
 					agg_conf);
 	else if (out_ctx->jctx)
@@ -1786,8 +2136,12 @@ static void report_aggregated_stats_mapentry(
 	merge_percpu_aggreated_stats(percpu_stats, &merged_stats, n_cpus,
 				     agg_conf->n_bins);
 
+	/* Cumulative stats are read from the map the BPF programs are actively
+	 * updating, so deleting an entry could lose updates made after it was
+	 * read. Keep all prefixes instead, relying on the backup keys once the
+	 * map is full */
 	if (prefix_len > 0 && // Pointless deleting /0 entry, and ensures backup keys are never deleted
-	    agg_conf->timeout_interval > 0 &&
+	    !agg_conf->cumulative && agg_conf->timeout_interval > 0 &&
 	    merged_stats.last_updated < t_monotonic &&
 	    t_monotonic - merged_stats.last_updated >
 		    agg_conf->timeout_interval)
@@ -1801,7 +2155,7 @@ static void report_aggregated_stats_mapentry(
 				       prefix_len, &merged_stats, agg_conf);
 
 		// Clear out the reported stats
-		if (!*del_entry)
+		if (!*del_entry && !agg_conf->cumulative)
 			for (i = 0; i < n_cpus; i++) {
 				clear_aggregated_stats(&percpu_stats[i]);
 			}
@@ -1855,10 +2209,12 @@ static int report_aggregated_stats_map(struct output_context *out_ctx,
 		}
 
 		// Update cleared stats
-		err = bpf_map_update_batch(map_fd, keys, values, &count,
-					   &batch_opts);
-		if (err)
-			goto exit;
+		if (!agg_conf->cumulative) {
+			err = bpf_map_update_batch(map_fd, keys, values, &count,
+						   &batch_opts);
+			if (err)
+				goto exit;
+		}
 
 		total += count;
 		count = AGG_BATCH_SIZE; // Ensure we always try to fetch full batch
@@ -1883,7 +2239,12 @@ static int report_aggregated_stats(struct output_context *out_ctx,
 	__u64 t = get_time_ns(CLOCK_MONOTONIC);
 	int err, map_idx;
 
-	map_idx = switch_agg_map(agg_ctx->maps.map_active_fd);
+	/* Cumulative stats are never switched out or cleared, so keep reading
+	 * from the instance the BPF programs start out with */
+	if (agg_conf->cumulative)
+		map_idx = 0;
+	else
+		map_idx = switch_agg_map(agg_ctx->maps.map_active_fd);
 	if (map_idx < 0)
 		return map_idx;
 
@@ -1901,7 +2262,7 @@ static int report_aggregated_stats(struct output_context *out_ctx,
 	if (err)
 		return err;
 
-	err = report_globalcounters(out_ctx, agg_ctx);
+	err = report_globalcounters(out_ctx, agg_ctx, agg_conf->cumulative);
 	return err;
 }
 
@@ -2088,7 +2449,8 @@ destroy_ts_link:
 
 static struct output_context *open_output(const char *filename,
 					  enum pping_output_format format,
-					  struct aggregation_config *agg_conf)
+					  struct aggregation_config *agg_conf,
+					  struct uring_writer *uring)
 {
 	struct output_context *out_ctx;
 
@@ -2097,8 +2459,13 @@ static struct output_context *open_output(const char *filename,
 		return NULL;
 
 	out_ctx->format = format;
+	out_ctx->uring = uring;
 
-	if (filename) {
+	if (filename && uring) {
+		out_ctx->stream = uring_writer_fopen(uring, filename);
+		if (!out_ctx->stream)
+			goto err;
+	} else if (filename) {
 		out_ctx->stream = fopen(filename, "ax");
 		if (!out_ctx->stream)
 			goto err;
@@ -2150,7 +2517,8 @@ static int reopen_output(struct output_context **out_ctx, const char *filename,
 {
 	struct output_context *new_out;
 
-	new_out = open_output(filename, (*out_ctx)->format, agg_conf);
+	new_out = open_output(filename, (*out_ctx)->format, agg_conf,
+			      (*out_ctx)->uring);
 	if (!new_out)
 		return -errno;
 
@@ -2256,6 +2624,20 @@ static int handle_pipefd(int pipe_rfd)
 	return PPING_ABORT;
 }
 
+/* Failed writes are only warned about, as output may have been lost but
+ * pping can keep running */
+static void handle_uring_completions(struct uring_writer *uring)
+{
+	int err;
+
+	err = uring_writer_process_completions(uring);
+	if (err)
+		fprintf(stderr,
+			"Warning: failed writing output: %s (%llu bytes lost in total)\n",
+			get_libbpf_strerror(err),
+			uring_writer_lost_bytes(uring));
+}
+
 int fetch_aggregation_map_fds(struct bpf_object *obj,
 			      struct aggregation_maps *maps)
 {
@@ -2351,10 +2733,10 @@ static int setup_timer(__u64 init_delay_ns, __u64 interval_ns)
 	return fd;
 }
 
-static int init_aggregation_timer(struct bpf_object *obj,
-				  struct pping_config *config)
+static int init_aggregation_maps(struct bpf_object *obj,
+				 struct pping_config *config)
 {
-	int err, fd;
+	int err;
 
 	memset(&config->agg_ctx.prev_counters, 0,
 	       sizeof(config->agg_ctx.prev_counters));
@@ -2376,6 +2758,13 @@ static int init_aggregation_timer(struct bpf_object *obj,
 		return err;
 	}
 
+	return 0;
+}
+
+static int init_aggregation_timer(struct pping_config *config)
+{
+	int fd;
+
 	fd = setup_timer(config->agg_conf.aggregation_interval,
 			 config->agg_conf.aggregation_interval);
 	if (fd < 0) {
@@ -2450,8 +2839,463 @@ static int epoll_add_perf_buffer(int epfd, struct perf_buffer *pb)
 	return 0;
 }
 
+static int listen_unix_socket(const char *path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct stat st;
+	int fd, err;
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(sa.sun_path, path);
+
+	// Remove socket left behind by a previous instance
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(fd, METRICS_LISTEN_BACKLOG)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+/*
+ * Listen on addr in the format [host:]port, where host is a numeric IPv4 or
+ * IPv6 address (IPv6 addresses may be enclosed in brackets). If no host is
+ * provided, only listen on loopback.
+ */
+static int listen_inet_socket(const char *addr)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV,
+	};
+	char host[INET6_ADDRSTRLEN] = METRICS_DEFAULT_HOST;
+	struct addrinfo *res;
+	const char *port, *sep;
+	size_t hostlen;
+	int fd, err, one = 1;
+
+	sep = strrchr(addr, ':');
+	if (sep) {
+		hostlen = sep - addr;
+		if (addr[0] == '[' && hostlen >= 2 && addr[hostlen - 1] == ']') {
+			addr++;
+			hostlen -= 2;
+		}
+		if (hostlen >= sizeof(host))
+			return -EINVAL;
+
+		memcpy(host, addr, hostlen);
+		host[hostlen] = '\0';
+		port = sep + 1;
+	} else {
+		port = addr;
+	}
+
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "Invalid metrics address %s:%s: %s\n", host,
+			port, gai_strerror(err));
+		return -EINVAL;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+		    res->ai_protocol);
+	if (fd < 0) {
+		err = -errno;
+		goto exit;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) ||
+	    listen(fd, METRICS_LISTEN_BACKLOG)) {
+		err = -errno;
+		close(fd);
+		goto exit;
+	}
+
+	err = fd;
+exit:
+	freeaddrinfo(res);
+	return err;
+}
+
+static int init_metrics_server(struct metrics_server *server)
+{
+	const char *addr = server->listen_addr;
+	size_t prefix_len = strlen(METRICS_UNIX_PREFIX);
+
+	server->unix_socket = strncmp(addr, METRICS_UNIX_PREFIX, prefix_len) == 0;
+	server->listen_fd = server->unix_socket ?
+				    listen_unix_socket(addr + prefix_len) :
+				    listen_inet_socket(addr);
+
+	return server->listen_fd;
+}
+
+static void close_metrics_client(struct metrics_server *server, int slot)
+{
+	struct metrics_client *client = server->clients[slot];
+
+	close(client->fd); // Also removes it from the epoll instance
+	free(client->reply);
+	free(client);
+	server->clients[slot] = NULL;
+}
+
+static void close_metrics_server(struct metrics_server *server)
+{
+	int i;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+		if (server->clients[i])
+			close_metrics_client(server, i);
+
+	if (server->listen_fd < 0)
+		return;
+
+	close(server->listen_fd);
+	if (server->unix_socket)
+		unlink(server->listen_addr + strlen(METRICS_UNIX_PREFIX));
+}
+
+static void free_metrics_writer(struct metrics_writer *metrics)
+{
+	int i;
+
+	for (i = 0; i < METRICS_N_SECTIONS; i++) {
+		if (metrics->sections[i].stream)
+			fclose(metrics->sections[i].stream);
+		free(metrics->sections[i].buf);
+	}
+}
+
+static int init_metrics_writer(struct metrics_writer *metrics,
+			       bool openmetrics)
+{
+	struct metrics_buffer *mb;
+	int i, err;
+
+	memset(metrics, 0, sizeof(*metrics));
+	metrics->openmetrics = openmetrics;
+
+	for (i = 0; i < METRICS_N_SECTIONS; i++) {
+		mb = &metrics->sections[i];
+		mb->stream = open_memstream(&mb->buf, &mb->len);
+		if (!mb->stream) {
+			err = -errno;
+			free_metrics_writer(metrics);
+			return err;
+		}
+	}
+
+	print_metric_family(metrics->sections[METRICS_SECTION_PREFIX_PKTS].stream,
+			    "pping_prefix_packets", "counter",
+			    "Packets per IP-prefix, direction and type",
+			    openmetrics);
+	print_metric_family(metrics->sections[METRICS_SECTION_PREFIX_BYTES].stream,
+			    "pping_prefix_bytes", "counter",
+			    "Bytes per IP-prefix, direction and type",
+			    openmetrics);
+	print_metric_family(metrics->sections[METRICS_SECTION_PREFIX_ECN].stream,
+			    "pping_prefix_ecn_packets", "counter",
+			    "IP packets per IP-prefix, direction and ECN codepoint",
+			    openmetrics);
+	print_metric_family(metrics->sections[METRICS_SECTION_PREFIX_RTT].stream,
+			    "pping_prefix_rtt_seconds", "histogram",
+			    "RTTs per IP-prefix", openmetrics);
+
+	return 0;
+}
+
+/* Closes the streams so that all output is available in the buffers */
+static int finish_metrics_writer(struct metrics_writer *metrics,
+				 size_t *total_len)
+{
+	int i, err = 0;
+
+	*total_len = metrics->openmetrics ? strlen(METRICS_EOF) : 0;
+
+	for (i = 0; i < METRICS_N_SECTIONS; i++) {
+		if (fclose(metrics->sections[i].stream) != 0)
+			err = -errno;
+		metrics->sections[i].stream = NULL;
+		*total_len += metrics->sections[i].len;
+	}
+
+	return err;
+}
+
+static void print_http_error(FILE *stream, const char *status)
+{
+	fprintf(stream,
+		"HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s\n",
+		status, strlen(status) + 1, status);
+}
+
+/*
+ * Render the reply to a single scrape request to stream. The stats are
+ * fetched and rendered from the BPF maps at the time of the request.
+ *
+ * Failures to serve a scrape are only warned about (and replied to with an
+ * HTTP error), as they should not abort pping.
+ */
+static void print_metrics_reply(FILE *stream, const char *req,
+				struct aggregation_context *agg_ctx,
+				struct aggregation_config *agg_conf)
+{
+	struct output_context out_ctx = { 0 };
+	struct metrics_writer metrics;
+	const char *content_type;
+	size_t body_len;
+	int err, i;
+
+	if (strncmp(req, "GET ", 4) != 0) {
+		print_http_error(stream, "405 Method Not Allowed");
+		return;
+	}
+	if (strncmp(req + 4, "/metrics ", 9) != 0 &&
+	    strncmp(req + 4, "/ ", 2) != 0) {
+		print_http_error(stream, "404 Not Found");
+		return;
+	}
+
+	err = init_metrics_writer(
+		&metrics, strstr(req, "application/openmetrics-text") != NULL);
+	if (err) {
+		fprintf(stderr, "Warning: failed allocating metrics: %s\n",
+			get_libbpf_strerror(err));
+		print_http_error(stream, "500 Internal Server Error");
+		return;
+	}
+
+	out_ctx.stream = metrics.sections[METRICS_SECTION_GLOBAL].stream;
+	out_ctx.metrics = &metrics;
+
+	err = report_aggregated_stats(&out_ctx, agg_ctx, agg_conf);
+	if (!err)
+		err = finish_metrics_writer(&metrics, &body_len);
+	if (err) {
+		fprintf(stderr, "Warning: failed collecting metrics: %s\n",
+			get_libbpf_strerror(err));
+		print_http_error(stream, "500 Internal Server Error");
+		goto exit;
+	}
+
+	content_type = metrics.openmetrics ?
+			       "application/openmetrics-text; version=1.0.0; charset=utf-8" :
+			       "text/plain; version=0.0.4; charset=utf-8";
+	fprintf(stream,
+		"HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+		content_type, body_len);
+
+	for (i = 0; i < METRICS_N_SECTIONS; i++)
+		fwrite(metrics.sections[i].buf, 1, metrics.sections[i].len,
+		       stream);
+	if (metrics.openmetrics)
+		fputs(METRICS_EOF, stream);
+
+exit:
+	free_metrics_writer(&metrics);
+}
+
+/* Returns true once the end of the request header has been read */
+static bool metrics_client_read(struct metrics_client *client)
+{
+	ssize_t len;
+
+	while (client->req_len < sizeof(client->req) - 1) {
+		len = recv(client->fd, client->req + client->req_len,
+			   sizeof(client->req) - 1 - client->req_len, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		if (len <= 0)
+			return true; // Serve what we have, if anything
+
+		client->req_len += len;
+		client->req[client->req_len] = '\0';
+		if (strstr(client->req, "\r\n\r\n") ||
+		    strstr(client->req, "\n\n"))
+			return true;
+	}
+
+	// Only the request line is needed, so serve an oversized request anyway
+	return true;
+}
+
+/* Returns true once the whole reply has been sent (or sending failed) */
+static bool metrics_client_write(struct metrics_client *client)
+{
+	ssize_t len;
+	int err;
+
+	while (client->reply_sent < client->reply_len) {
+		len = send(client->fd, client->reply + client->reply_sent,
+			   client->reply_len - client->reply_sent,
+			   MSG_NOSIGNAL);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		if (len < 0) {
+			err = -errno;
+			fprintf(stderr, "Warning: failed sending metrics: %s\n",
+				get_libbpf_strerror(err));
+			return true;
+		}
+
+		client->reply_sent += len;
+	}
+
+	return true;
+}
+
+static void handle_metrics_client(int epfd, struct metrics_server *server,
+				  int slot, struct aggregation_context *agg_ctx,
+				  struct aggregation_config *agg_conf)
+{
+	struct metrics_client *client = server->clients[slot];
+	struct epoll_event ev = {
+		.events = EPOLLOUT,
+		.data = { .u64 = PPING_EPEVENT_TYPE_METRICS_CLIENT | slot },
+	};
+	FILE *stream;
+	int err;
+
+	if (!client)
+		return;
+
+	if (!client->reply) {
+		if (!metrics_client_read(client))
+			return;
+
+		if (client->req_len == 0) {
+			close_metrics_client(server, slot);
+			return;
+		}
+
+		stream = open_memstream(&client->reply, &client->reply_len);
+		if (!stream) {
+			err = -errno;
+			fprintf(stderr,
+				"Warning: failed allocating metrics reply: %s\n",
+				get_libbpf_strerror(err));
+			close_metrics_client(server, slot);
+			return;
+		}
+		print_metrics_reply(stream, client->req, agg_ctx, agg_conf);
+		if (fclose(stream) != 0) {
+			close_metrics_client(server, slot);
+			return;
+		}
+
+		// From now on, wait for room to send the reply instead
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev)) {
+			close_metrics_client(server, slot);
+			return;
+		}
+	}
+
+	if (metrics_client_write(client))
+		close_metrics_client(server, slot);
+}
+
+/* Drops the clients that have not been served before their deadline */
+static void expire_metrics_clients(struct metrics_server *server)
+{
+	__u64 now = get_time_ns(CLOCK_MONOTONIC);
+	int i;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+		if (server->clients[i] && now >= server->clients[i]->deadline)
+			close_metrics_client(server, i);
+}
+
+/* Time in ms until the next client deadline, or -1 if there are no clients */
+static int metrics_poll_timeout(struct metrics_server *server)
+{
+	__u64 now = get_time_ns(CLOCK_MONOTONIC), next = 0;
+	int i;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+		if (server->clients[i] &&
+		    (!next || server->clients[i]->deadline < next))
+			next = server->clients[i]->deadline;
+
+	if (!next)
+		return -1;
+
+	return next > now ? (next - now + NS_PER_MS - 1) / NS_PER_MS : 0;
+}
+
+static void handle_metrics_connection(int epfd, struct metrics_server *server)
+{
+	struct metrics_client *client;
+	int fd, err, slot;
+
+	fd = accept(server->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		err = -errno;
+		fprintf(stderr,
+			"Warning: failed accepting metrics connection: %s\n",
+			get_libbpf_strerror(err));
+		return;
+	}
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+		close(fd);
+		return;
+	}
+
+	expire_metrics_clients(server);
+	for (slot = 0; slot < METRICS_MAX_CLIENTS; slot++)
+		if (!server->clients[slot])
+			break;
+
+	if (slot == METRICS_MAX_CLIENTS) {
+		fprintf(stderr,
+			"Warning: too many metrics connections, dropping new connection\n");
+		close(fd);
+		return;
+	}
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(fd);
+		return;
+	}
+	client->fd = fd;
+	client->deadline = get_time_ns(CLOCK_MONOTONIC) +
+			   METRICS_CLIENT_TIMEOUT_MS * NS_PER_MS;
+	server->clients[slot] = client;
+
+	err = epoll_add_event_type(epfd, fd, PPING_EPEVENT_TYPE_METRICS_CLIENT,
+				   slot);
+	if (err) {
+		fprintf(stderr,
+			"Warning: failed adding metrics connection to epoll instance: %s\n",
+			get_libbpf_strerror(err));
+		close_metrics_client(server, slot);
+	}
+}
+
 static int epoll_add_events(int epfd, struct perf_buffer *pb, int sigfd,
-			    int pipe_rfd, int aggfd)
+			    int pipe_rfd, int aggfd, int metrics_fd,
+			    int uring_fd)
 {
 	int err;
 
@@ -2490,6 +3334,29 @@ static int epoll_add_events(int epfd, struct perf_buffer *pb, int sigfd,
 		}
 	}
 
+	if (metrics_fd >= 0) {
+		err = epoll_add_event_type(epfd, metrics_fd,
+					   PPING_EPEVENT_TYPE_METRICS,
+					   metrics_fd);
+		if (err) {
+			fprintf(stderr,
+				"Failed adding metrics socket to epoll instance: %s\n",
+				get_libbpf_strerror(err));
+			return err;
+		}
+	}
+
+	if (uring_fd >= 0) {
+		err = epoll_add_event_type(epfd, uring_fd,
+					   PPING_EPEVENT_TYPE_URING, uring_fd);
+		if (err) {
+			fprintf(stderr,
+				"Failed adding io_uring eventfd to epoll instance: %s\n",
+				get_libbpf_strerror(err));
+			return err;
+		}
+	}
+
 	return 0;
 }
 
@@ -2497,7 +3364,7 @@ static int epoll_poll_events(int epfd, struct pping_config *config,
 			     struct perf_buffer *pb, int timeout_ms)
 {
 	struct epoll_event events[MAX_EPOLL_EVENTS];
-	int err = 0, nfds, i;
+	int err = 0, err2, nfds, i;
 
 	nfds = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, timeout_ms);
 	if (nfds < 0) {
@@ -2531,6 +3398,19 @@ static int epoll_poll_events(int epfd, struct pping_config *config,
 			err = handle_pipefd(events[i].data.u64 &
 					    PPING_EPEVENT_MASK);
 			break;
+		case PPING_EPEVENT_TYPE_METRICS:
+			handle_metrics_connection(epfd, &config->metrics);
+			break;
+		case PPING_EPEVENT_TYPE_METRICS_CLIENT:
+			handle_metrics_client(epfd, &config->metrics,
+					      events[i].data.u64 &
+						      PPING_EPEVENT_MASK,
+					      &config->agg_ctx,
+					      &config->agg_conf);
+			break;
+		case PPING_EPEVENT_TYPE_URING:
+			handle_uring_completions(config->uring);
+			break;
 		default:
 			fprintf(stderr, "Warning: unexpected epoll data: %lu\n",
 				events[i].data.u64);
@@ -2540,6 +3420,16 @@ static int epoll_poll_events(int epfd, struct pping_config *config,
 			break;
 	}
 
+	expire_metrics_clients(&config->metrics);
+
+	/* Submit all output from the handled events as a single batch */
+	if (config->uring) {
+		err2 = uring_writer_flush(config->uring);
+		if (err2)
+			fprintf(stderr, "Warning: failed submitting output: %s\n",
+				get_libbpf_strerror(err2));
+	}
+
 	return err;
 }
 
@@ -2557,6 +3447,7 @@ int main(int argc, char *argv[])
 	struct pping_config config = {
 		.bpf_config = { .rate_limit = 100 * NS_PER_MS,
 				.rtt_rate = 0,
+				.vxlan_port = VXLAN_DEFAULT_PORT,
 				.use_srtt = false },
 		.clean_args = { .cleanup_interval = 1 * NS_PER_SECOND,
 				.valid_thread = false },
@@ -2615,19 +3506,35 @@ int main(int argc, char *argv[])
 				"Warning: ppviz format mainly intended for TCP traffic, but may now include ICMP traffic as well\n");
 	}
 
-	fprintf(stderr, "Starting ePPing in %s mode tracking %s on %s\n",
+	fprintf(stderr, "Starting ePPing in %s mode tracking %s%s on %s\n",
 		output_format_to_str(config.format),
-		tracked_protocols_to_str(&config), config.ifname);
+		tracked_protocols_to_str(&config),
+		config.bpf_config.track_inner ? " (inside tunnels)" : "",
+		config.ifname);
+
+	if (config.uring_depth > 0) {
+		config.uring = uring_writer_new(config.uring_depth,
+						URING_BUF_SIZE);
+		if (!config.uring) {
+			err = -errno;
+			fprintf(stderr, "Failed setting up io_uring: %s\n",
+				get_libbpf_strerror(err));
+			return EXIT_FAILURE;
+		}
+	}
 
 	config.out_ctx = open_output(
 		config.write_to_file ? config.filename : NULL, config.format,
-		config.bpf_config.agg_rtts ? &config.agg_conf : NULL);
+		config.bpf_config.agg_rtts && !config.agg_conf.cumulative ?
+			&config.agg_conf :
+			NULL,
+		config.uring);
 	if (!config.out_ctx) {
 		err = -errno;
 		fprintf(stderr, "Unable to open %s: %s\n",
 			config.write_to_file ? config.filename : "output",
 			get_libbpf_strerror(err));
-		return EXIT_FAILURE;
+		goto cleanup_uring;
 	}
 
 	// Setup signalhandling (allow graceful shutdown on SIGINT/SIGTERM, reopen on SIGHUP)
@@ -2661,7 +3568,16 @@ int main(int argc, char *argv[])
 	}
 
 	if (config.bpf_config.agg_rtts) {
-		aggfd = init_aggregation_timer(obj, &config);
+		err = init_aggregation_maps(obj, &config);
+		if (err) {
+			fprintf(stderr, "Failed setting up aggregation: %s\n",
+				get_libbpf_strerror(err));
+			goto cleanup_perf_buffer;
+		}
+	}
+
+	if (config.bpf_config.agg_rtts && !config.agg_conf.cumulative) {
+		aggfd = init_aggregation_timer(&config);
 		if (aggfd < 0) {
 			fprintf(stderr,
 				"Failed setting up aggregation timerfd: %s\n",
@@ -2672,14 +3588,31 @@ int main(int argc, char *argv[])
 		aggfd = -1;
 	}
 
+	config.metrics.listen_fd = -1;
+	if (config.export_metrics) {
+		err = init_metrics_server(&config.metrics);
+		if (err < 0) {
+			fprintf(stderr, "Failed listening for metrics on %s: %s\n",
+				config.metrics.listen_addr,
+				get_libbpf_strerror(err));
+			goto cleanup_aggfd;
+		}
+		err = 0;
+		fprintf(stderr, "Serving metrics on %s\n",
+			config.metrics.listen_addr);
+	}
+
 	epfd = epoll_create1(EPOLL_CLOEXEC);
 	if (epfd < 0) {
 		fprintf(stderr, "Failed creating epoll instance: %s\n",
 			get_libbpf_strerror(err));
-		goto cleanup_aggfd;
+		goto cleanup_metrics;
 	}
 
-	err = epoll_add_events(epfd, pb, sigfd, config.clean_args.pipe_rfd, aggfd);
+	err = epoll_add_events(epfd, pb, sigfd, config.clean_args.pipe_rfd,
+			       aggfd, config.metrics.listen_fd,
+			       config.uring ? uring_writer_eventfd(config.uring) :
+					      -1);
 	if (err) {
 		fprintf(stderr, "Failed adding events to epoll instace: %s\n",
 			get_libbpf_strerror(err));
@@ -2688,7 +3621,8 @@ int main(int argc, char *argv[])
 
 	// Main loop
 	while (true) {
-		err = epoll_poll_events(epfd, &config, pb, -1);
+		err = epoll_poll_events(epfd, &config, pb,
+					metrics_poll_timeout(&config.metrics));
 		if (err) {
 			if (err == PPING_ABORT)
 				err = 0;
@@ -2703,6 +3637,9 @@ int main(int argc, char *argv[])
 cleanup_epfd:
 	close(epfd);
 
+cleanup_metrics:
+	close_metrics_server(&config.metrics);
+
 cleanup_aggfd:
 	if (aggfd >= 0)
 		close(aggfd);
@@ -2751,5 +3688,8 @@ cleanup_sigfd:
 cleanup_output:
 	close_output(config.out_ctx);
 
+cleanup_uring:
+	uring_writer_free(config.uring);
+
 	return err != 0 || detach_err != 0;
 }
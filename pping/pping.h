@@ -16,6 +16,8 @@
 #define MAP_FLOWSTATE_SIZE 131072UL // 2^17, Maximum number of concurrent flows that can be tracked
 #define MAP_AGGREGATION_SIZE 16384UL // 2^14, Maximum number of different IP-prefixes we can aggregate stats for
 
+#define CACHE_LINE_SIZE 64
+
 typedef __u64 fixpoint64;
 #define FIXPOINT_SHIFT 16
 #define DOUBLE_TO_FIXPOINT(X) ((fixpoint64)((X) * (1UL << FIXPOINT_SHIFT)))
@@ -32,6 +34,8 @@ typedef __u64 fixpoint64;
 
 #define N_IPPROTOS 256
 
+#define VXLAN_DEFAULT_PORT 4789
+
 /* Special IPv4/IPv6 prefixes used for backup entries
  * To avoid them colliding with and actual traffic (causing the traffic to end
  * up in the backup entry), use prefixes from blocks reserved for documentation.
@@ -94,6 +98,7 @@ struct bpf_config {
 	fixpoint64 rtt_rate;
 	__u64 ipv6_prefix_mask;
 	__u32 ipv4_prefix_mask;
+	__u16 vxlan_port;
 	bool use_srtt;
 	bool track_tcp;
 	bool track_icmp;
@@ -102,6 +107,7 @@ struct bpf_config {
 	bool push_individual_events;
 	bool agg_rtts;
 	bool agg_by_dst; // dst of reply packet
+	bool track_inner; // Track flows inside tunnels instead of tunnel endpoints
 };
 
 struct ipprefix_key {
@@ -137,31 +143,79 @@ struct network_tuple {
 	__u8 reserved;
 };
 
-struct flow_state {
-	__u64 min_rtt;
-	__u64 srtt;
+/*
+ * The state of one direction of a flow is split in three parts, based on which
+ * packets update it. The tx-part is updated by packets sent in the direction
+ * of the flow (which create timestamps), while the rx-part is updated by the
+ * replies in the reverse direction (which match the timestamps). The
+ * conn-part only changes when the flow is opened or closed, but is read by the
+ * packets in both directions.
+ *
+ * The number of outstanding timestamps is not kept as a single counter, as
+ * that would be written from both directions. Instead it's calculated as
+ * created_timestamps - matched_timestamps - expired_timestamps, where each
+ * counter is only updated from one direction (or the cleanup iterator). As
+ * the packets of one direction may still be processed on several CPUs (e.g.
+ * multiple RX queues), the counters are updated with atomic adds.
+ */
+struct flow_state_conn {
+	enum connection_state conn_state;
+	enum flow_event_reason opening_reason;
+};
+
+struct flow_state_tx {
 	__u64 last_timestamp;
 	__u64 sent_pkts;
 	__u64 sent_bytes;
-	__u64 rec_pkts;
-	__u64 rec_bytes;
 	__u32 last_id;
-	__u32 outstanding_timestamps;
-	enum connection_state conn_state;
-	enum flow_event_reason opening_reason;
+	__u32 created_timestamps;
+	__u32 sent_ect0_pkts;
+	__u32 sent_ect1_pkts;
+	__u32 sent_ce_pkts;
 	bool has_been_timestamped;
-	__u8 reserved[5];
+	__u8 reserved[3];
+};
+
+struct flow_state_rx {
+	__u64 min_rtt;
+	__u64 srtt;
+	__u64 rec_pkts;
+	__u64 rec_bytes;
+	__u32 matched_timestamps;
+	__u32 reserved;
 };
 
 /*
  * Stores flowstate for both direction (src -> dst and dst -> src) of a flow
  *
- * Uses two named members instead of array of size 2 to avoid hassels with
+ * The members are ordered so that all state updated by a packet ends up in
+ * the same half of the struct (the tx-part of its own direction together with
+ * the rx-part of the reverse direction). The halves are separated by padding,
+ * so that when the two directions are processed on different CPUs they do not
+ * write to the same cache line. The read-mostly conn-parts of both directions
+ * are kept in front of the halves, again separated by padding, so that reading
+ * them does not pull in a cache line written by the other direction. Values in
+ * BPF hash maps are only guaranteed to be 8-byte aligned, so
+ * CACHE_LINE_SIZE - 8 bytes is the smallest gap which ensures two parts never
+ * share a cache line.
+ *
+ * The expired_timestamps counters are only updated by the timestamp cleanup
+ * iterator (tsmap_cleanup).
+ *
+ * Uses named members instead of arrays of size 2 to avoid hassels with
  * convincing verifier that member access is not out of bounds
  */
 struct dual_flow_state {
-	struct flow_state dir1;
-	struct flow_state dir2;
+	struct flow_state_conn dir1_conn;
+	struct flow_state_conn dir2_conn;
+	__u8 pad_conn[CACHE_LINE_SIZE - 8];
+	struct flow_state_tx dir1_tx;
+	struct flow_state_rx dir2_rx;
+	__u8 pad[CACHE_LINE_SIZE - 8];
+	struct flow_state_tx dir2_tx;
+	struct flow_state_rx dir1_rx;
+	__u32 dir1_expired_timestamps;
+	__u32 dir2_expired_timestamps;
 };
 
 struct packet_id {
@@ -195,8 +249,11 @@ struct rtt_event {
 	__u64 sent_bytes;
 	__u64 rec_pkts;
 	__u64 rec_bytes;
+	__u32 sent_ect0_pkts;
+	__u32 sent_ect1_pkts;
+	__u32 sent_ce_pkts;
 	bool match_on_egress;
-	__u8 reserved[7];
+	__u8 reserved[3];
 };
 
 /*
@@ -253,6 +310,13 @@ union pping_event {
 	struct map_clean_event map_clean_event;
 };
 
+struct ecn_counters {
+	__u64 no_ect;
+	__u64 ect1;
+	__u64 ect0;
+	__u64 ce;
+};
+
 struct traffic_counters {
 	__u64 tcp_ts_pkts;
 	__u64 tcp_ts_bytes;
@@ -260,6 +324,7 @@ struct traffic_counters {
 	__u64 tcp_nots_bytes;
 	__u64 other_pkts;
 	__u64 other_bytes;
+	struct ecn_counters ecn;
 };
 
 struct aggregated_stats {
@@ -268,16 +333,10 @@ struct aggregated_stats {
 	struct traffic_counters tx_stats;
 	__u64 rtt_min;
 	__u64 rtt_max;
+	__u64 rtt_sum;
 	__u32 rtt_bins[RTT_AGG_NR_BINS];
 };
 
-struct ecn_counters {
-	__u64 no_ect;
-	__u64 ect1;
-	__u64 ect0;
-	__u64 ce;
-};
-
 struct pping_error_counters {
 	__u64 pktts_store;
 	__u64 flow_create;
@@ -46,6 +46,20 @@
 
 #define MAX_MEMCMP_SIZE 128
 
+// GRE flags (network byte order), see RFC 2784 and RFC 2890
+#define GRE_FLAG_CSUM bpf_htons(0x8000)
+#define GRE_FLAG_ROUTING bpf_htons(0x4000)
+#define GRE_FLAG_KEY bpf_htons(0x2000)
+#define GRE_FLAG_SEQ bpf_htons(0x1000)
+#define GRE_VERSION_MASK bpf_htons(0x0007)
+
+// VXLAN flag indicating a valid VNI (network byte order), see RFC 7348
+#define VXLAN_FLAG_VNI bpf_htonl(0x08000000)
+
+#ifndef ETH_P_TEB
+#define ETH_P_TEB 0x6558
+#endif
+
 /*
  * Structs for map iteration programs
  * Copied from /tools/testing/selftest/bpf/progs/bpf_iter.h
@@ -63,6 +77,20 @@ struct bpf_iter__bpf_map_elem {
 	void *value;
 };
 
+/*
+ * The mandatory part of the GRE header (RFC 2784), may be followed by optional
+ * checksum, key and sequence number fields depending on the flags.
+ */
+struct gre_base_hdr {
+	__be16 flags;
+	__be16 protocol;
+};
+
+struct vxlanhdr {
+	__be32 vx_flags;
+	__be32 vx_vni;
+};
+
 /*
  * This struct keeps track of the data and data_end pointers from the xdp_md or
  * __skb_buff contexts, as well as a currently parsed to position kept in nh.
@@ -100,6 +128,7 @@ struct packet_info {
 		__be32 ipv6_tos;
 	} ip_tos;
 	__u16 ip_len;                // The IPv4 total length or IPv6 payload length
+	__u8 ecn;                    // The ECN codepoint from the IP header
 	bool is_ingress;             // Packet on egress or ingress?
 	bool pid_flow_is_dfkey;      // Used to determine which member of dualflow state to use for forward direction
 	bool pid_valid;              // identifier can be used to timestamp packet
@@ -123,6 +152,17 @@ struct protocol_info {
 	bool wait_first_edge;
 };
 
+/*
+ * The state for one direction of a flow, pointing into the two halves of a
+ * dual_flow_state entry (see pping.h for how the state is laid out)
+ */
+struct flow_state {
+	struct flow_state_conn *conn;
+	struct flow_state_tx *tx;
+	struct flow_state_rx *rx;
+	__u32 *expired_timestamps;
+};
+
 char _license[] SEC("license") = "GPL";
 // Global config struct - set from userspace
 static volatile const struct bpf_config config = {};
@@ -204,6 +244,14 @@ struct {
 	__uint(max_entries, 1);
 } map_packet_info SEC(".maps");
 
+// Scratch space for new flow states, as they are too large for the stack
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct dual_flow_state);
+	__uint(max_entries, 1);
+} map_new_flowstate SEC(".maps");
+
 // Help functions
 
 /*
@@ -281,10 +329,20 @@ static void make_dualflow_key(struct network_tuple *key,
 		reverse_flow(key, flow);
 }
 
-static struct flow_state *fstate_from_dfkey(struct dual_flow_state *df_state,
-					    bool is_dfkey)
+static void fstate_from_dfkey(struct flow_state *f_state,
+			      struct dual_flow_state *df_state, bool is_dfkey)
 {
-	return is_dfkey ? &df_state->dir1 : &df_state->dir2;
+	if (is_dfkey) {
+		f_state->conn = &df_state->dir1_conn;
+		f_state->tx = &df_state->dir1_tx;
+		f_state->rx = &df_state->dir1_rx;
+		f_state->expired_timestamps = &df_state->dir1_expired_timestamps;
+	} else {
+		f_state->conn = &df_state->dir2_conn;
+		f_state->tx = &df_state->dir2_tx;
+		f_state->rx = &df_state->dir2_rx;
+		f_state->expired_timestamps = &df_state->dir2_expired_timestamps;
+	}
 }
 
 /*
@@ -293,25 +351,45 @@ static struct flow_state *fstate_from_dfkey(struct dual_flow_state *df_state,
  * Note: Does not validate that any of the entries in df_state actually matches
  * flow, just selects the direction in df_state that best fits the flow.
  */
-static struct flow_state *
-get_flowstate_from_dualflow(struct dual_flow_state *df_state,
-			    struct network_tuple *flow)
+static void get_flowstate_from_dualflow(struct flow_state *f_state,
+					struct dual_flow_state *df_state,
+					struct network_tuple *flow)
 {
-	return fstate_from_dfkey(df_state, is_dualflow_key(flow));
+	fstate_from_dfkey(f_state, df_state, is_dualflow_key(flow));
 }
 
-static struct flow_state *
-get_flowstate_from_packet(struct dual_flow_state *df_state,
-			  struct packet_info *p_info)
+static void get_flowstate_from_packet(struct flow_state *f_state,
+				      struct dual_flow_state *df_state,
+				      struct packet_info *p_info)
 {
-	return fstate_from_dfkey(df_state, p_info->pid_flow_is_dfkey);
+	fstate_from_dfkey(f_state, df_state, p_info->pid_flow_is_dfkey);
 }
 
-static struct flow_state *
-get_reverse_flowstate_from_packet(struct dual_flow_state *df_state,
-				  struct packet_info *p_info)
+static void get_reverse_flowstate_from_packet(struct flow_state *f_state,
+					      struct dual_flow_state *df_state,
+					      struct packet_info *p_info)
 {
-	return fstate_from_dfkey(df_state, !p_info->pid_flow_is_dfkey);
+	fstate_from_dfkey(f_state, df_state, !p_info->pid_flow_is_dfkey);
+}
+
+/*
+ * Number of timestamps created for the flow which have not yet been matched
+ * or timed out. The three counters are not read atomically as a set, so the
+ * result is only a hint: the only consequence of it being off is a missed or
+ * unnecessary lookup in the packet_ts map. The created counter is read last,
+ * so that it includes every timestamp already counted as matched or expired,
+ * and the difference is clamped in case it went negative anyway.
+ */
+static __u32 outstanding_timestamps(struct flow_state *f_state)
+{
+	__u32 done = f_state->rx->matched_timestamps +
+		     *f_state->expired_timestamps;
+	__s32 diff;
+
+	asm volatile("" ::: "memory");
+	diff = f_state->tx->created_timestamps - done;
+
+	return diff > 0 ? diff : 0;
 }
 
 static struct network_tuple *
@@ -617,55 +695,135 @@ static int parse_icmp_identifier(struct parsing_context *pctx,
 }
 
 /*
- * Attempts to parse the packet defined by pctx for a valid packet identifier
- * and reply identifier, filling in p_info.
+ * Parses a GRE header, skipping any optional fields.
+ * Returns the protocol type (EtherType, in network byte order) of the
+ * encapsulated packet on success, and -1 on failure.
+ */
+static int parse_grehdr(struct hdr_cursor *nh, void *data_end)
+{
+	struct gre_base_hdr *greh = nh->pos;
+	int hdrsize = sizeof(*greh);
+
+	if (greh + 1 > data_end)
+		return -1;
+
+	// Only support version 0 GRE without (deprecated) routing field
+	if (greh->flags & (GRE_VERSION_MASK | GRE_FLAG_ROUTING))
+		return -1;
+
+	if (greh->flags & GRE_FLAG_CSUM)
+		hdrsize += 4;
+	if (greh->flags & GRE_FLAG_KEY)
+		hdrsize += 4;
+	if (greh->flags & GRE_FLAG_SEQ)
+		hdrsize += 4;
+
+	if (nh->pos + hdrsize > data_end)
+		return -1;
+
+	nh->pos += hdrsize;
+	return greh->protocol;
+}
+
+/*
+ * Parses a UDP header followed by a VXLAN header, provided the UDP
+ * destination port matches the configured VXLAN port.
+ * Returns 0 on success and -1 on failure.
+ */
+static int parse_vxlanhdr(struct hdr_cursor *nh, void *data_end)
+{
+	struct udphdr *udph;
+	struct vxlanhdr *vxh;
+
+	if (parse_udphdr(nh, data_end, &udph) < 0)
+		return -1;
+
+	if (udph->dest != bpf_htons(config.vxlan_port))
+		return -1;
+
+	vxh = nh->pos;
+	if (vxh + 1 > data_end)
+		return -1;
+
+	if (!(vxh->vx_flags & VXLAN_FLAG_VNI))
+		return -1;
+
+	nh->pos = vxh + 1;
+	return 0;
+}
+
+/*
+ * Attempts to parse an encapsulation header (IP-in-IP, GRE or VXLAN) directly
+ * following an IP-header whose next header is proto.
  *
- * If it can't parse the the IP-header of the packet, it will return -1 and
- * no information in p_info is valid.
- * If it can parse the IP-header, it will return 0 and the flow information
- * in p_info->pid.flow will be valid.
- * If, additionally, it was able to identify the packet was of a type that
- * the RTT can be tracked for, rtt_trackable will be set to true and all
- * members of p_info will be set.
+ * If successful, pctx->nh will be advanced to the inner IP-header, and the
+ * EtherType (in network byte order) of the inner packet is returned.
+ * If the packet is not encapsulated (or uses an unsupported encapsulation),
+ * -1 is returned and pctx->nh is left unchanged.
  */
-static int parse_packet_identifier(struct parsing_context *pctx,
-				   struct packet_info *p_info)
+static int parse_encap_header(struct parsing_context *pctx, int proto)
 {
-	int proto, err;
+	struct hdr_cursor nh = pctx->nh;
 	struct ethhdr *eth;
-	struct protocol_info proto_info;
+	int eth_proto;
+
+	switch (proto) {
+	case IPPROTO_IPIP:
+		return bpf_htons(ETH_P_IP);
+	case IPPROTO_IPV6:
+		return bpf_htons(ETH_P_IPV6);
+	case IPPROTO_GRE:
+		eth_proto = parse_grehdr(&nh, pctx->data_end);
+		if (eth_proto == bpf_htons(ETH_P_TEB))
+			eth_proto = parse_ethhdr_vlan(&nh, pctx->data_end,
+						      &eth, NULL);
+		break;
+	case IPPROTO_UDP:
+		if (parse_vxlanhdr(&nh, pctx->data_end) < 0)
+			return -1;
+		eth_proto = parse_ethhdr_vlan(&nh, pctx->data_end, &eth, NULL);
+		break;
+	default:
+		return -1;
+	}
+
+	if (eth_proto != bpf_htons(ETH_P_IP) &&
+	    eth_proto != bpf_htons(ETH_P_IPV6))
+		return -1;
+
+	pctx->nh = nh;
+	return eth_proto;
+}
+
+/*
+ * Parses the IPv4 or IPv6 header (depending on eth_proto) and fills in the
+ * IP-level members of p_info (addresses, IP-version, length and TOS).
+ *
+ * Returns the protocol of the header following the IP-header (after skipping
+ * any IPv6 extension headers) on success, and -1 on failure.
+ */
+static int parse_ip_identifier(struct parsing_context *pctx, int eth_proto,
+			       struct packet_info *p_info, __u8 *ecn)
+{
 	union {
 		struct iphdr *iph;
 		struct ipv6hdr *ip6h;
 	} iph_ptr;
-	union {
-		struct tcphdr *tcph;
-		struct icmphdr *icmph;
-		struct icmp6hdr *icmp6h;
-	} transporth_ptr;
-	__u8 ecn;
+	int proto;
 
-
-	__builtin_memset(p_info, 0, sizeof(*p_info));
-	p_info->time = bpf_ktime_get_ns();
-	p_info->pkt_len = pctx->pkt_len;
-	proto = parse_ethhdr(&pctx->nh, pctx->data_end, &eth);
-
-	// Parse IPv4/6 header
-	if (proto == bpf_htons(ETH_P_IP)) {
+	if (eth_proto == bpf_htons(ETH_P_IP)) {
 		p_info->pid.flow.ipv = AF_INET;
 		proto = parse_iphdr(&pctx->nh, pctx->data_end, &iph_ptr.iph);
-	} else if (proto == bpf_htons(ETH_P_IPV6)) {
+	} else if (eth_proto == bpf_htons(ETH_P_IPV6)) {
 		p_info->pid.flow.ipv = AF_INET6;
 		proto = parse_ip6hdr(&pctx->nh, pctx->data_end, &iph_ptr.ip6h);
 	} else {
-		goto err_not_ip;
+		return -1;
 	}
 	if (proto < 0)
-		goto err_not_ip;
+		return -1;
 
 	// IP-header was parsed sucessfully, fill in IP address
-	p_info->pid.flow.proto = proto;
 	if (p_info->pid.flow.ipv == AF_INET) {
 		map_ipv4_to_ipv6(&p_info->pid.flow.saddr.ip,
 				 iph_ptr.iph->saddr);
@@ -673,16 +831,69 @@ static int parse_packet_identifier(struct parsing_context *pctx,
 				 iph_ptr.iph->daddr);
 		p_info->ip_len = bpf_ntohs(iph_ptr.iph->tot_len);
 		p_info->ip_tos.ipv4_tos = iph_ptr.iph->tos;
-		ecn = parse_ip_ecn(iph_ptr.iph);
+		*ecn = parse_ip_ecn(iph_ptr.iph);
 	} else { // IPv6
 		p_info->pid.flow.saddr.ip = iph_ptr.ip6h->saddr;
 		p_info->pid.flow.daddr.ip = iph_ptr.ip6h->daddr;
 		p_info->ip_len = bpf_ntohs(iph_ptr.ip6h->payload_len);
 		p_info->ip_tos.ipv6_tos =
 			*(__be32 *)iph_ptr.ip6h & IPV6_FLOWINFO_MASK;
-		ecn = parse_ipv6_ecn(iph_ptr.ip6h);
+		*ecn = parse_ipv6_ecn(iph_ptr.ip6h);
 	}
-	update_global_counters(proto, p_info->pkt_len, ecn);
+
+	return proto;
+}
+
+/*
+ * Attempts to parse the packet defined by pctx for a valid packet identifier
+ * and reply identifier, filling in p_info.
+ *
+ * If it can't parse the the IP-header of the packet, it will return -1 and
+ * no information in p_info is valid.
+ * If it can parse the IP-header, it will return 0 and the flow information
+ * in p_info->pid.flow will be valid.
+ * If, additionally, it was able to identify the packet was of a type that
+ * the RTT can be tracked for, rtt_trackable will be set to true and all
+ * members of p_info will be set.
+ *
+ * If config.track_inner is set and the packet is encapsulated (IP-in-IP, GRE
+ * or VXLAN), the flow is instead based on the inner (tunneled) packet.
+ */
+static int parse_packet_identifier(struct parsing_context *pctx,
+				   struct packet_info *p_info)
+{
+	int proto, inner_proto, err;
+	struct ethhdr *eth;
+	struct protocol_info proto_info;
+	union {
+		struct tcphdr *tcph;
+		struct icmphdr *icmph;
+		struct icmp6hdr *icmp6h;
+	} transporth_ptr;
+
+	__builtin_memset(p_info, 0, sizeof(*p_info));
+	p_info->time = bpf_ktime_get_ns();
+	p_info->pkt_len = pctx->pkt_len;
+	proto = parse_ethhdr_vlan(&pctx->nh, pctx->data_end, &eth, NULL);
+
+	// Parse IPv4/6 header
+	proto = parse_ip_identifier(pctx, proto, p_info, &p_info->ecn);
+	if (proto < 0)
+		goto err_not_ip;
+
+	// Replace outer IP-header with the tunneled one
+	if (config.track_inner) {
+		inner_proto = parse_encap_header(pctx, proto);
+		if (inner_proto >= 0) {
+			proto = parse_ip_identifier(pctx, inner_proto, p_info,
+						    &p_info->ecn);
+			if (proto < 0)
+				goto err_not_ip;
+		}
+	}
+
+	p_info->pid.flow.proto = proto;
+	update_global_counters(proto, p_info->pkt_len, p_info->ecn);
 
 	// Parse identifer from suitable protocol
 	err = -1;
@@ -816,8 +1027,8 @@ static void send_flow_open_event(void *ctx, struct packet_info *p_info,
 		.flow_event_type = FLOW_EVENT_OPENING,
 		.source = EVENT_SOURCE_PKT_DEST,
 		.flow = p_info->pid.flow,
-		.reason = rev_flow->opening_reason,
-		.timestamp = rev_flow->last_timestamp,
+		.reason = rev_flow->conn->opening_reason,
+		.timestamp = rev_flow->tx->last_timestamp,
 		.reserved = 0,
 	};
 
@@ -892,11 +1103,14 @@ static void send_rtt_event(void *ctx, __u64 rtt, struct flow_state *f_state,
 		.flow = p_info->pid.flow,
 		.padding = 0,
 		.rtt = rtt,
-		.min_rtt = f_state->min_rtt,
-		.sent_pkts = f_state->sent_pkts,
-		.sent_bytes = f_state->sent_bytes,
-		.rec_pkts = f_state->rec_pkts,
-		.rec_bytes = f_state->rec_bytes,
+		.min_rtt = f_state->rx->min_rtt,
+		.sent_pkts = f_state->tx->sent_pkts,
+		.sent_bytes = f_state->tx->sent_bytes,
+		.rec_pkts = f_state->rx->rec_pkts,
+		.rec_bytes = f_state->rx->rec_bytes,
+		.sent_ect0_pkts = f_state->tx->sent_ect0_pkts,
+		.sent_ect1_pkts = f_state->tx->sent_ect1_pkts,
+		.sent_ce_pkts = f_state->tx->sent_ce_pkts,
 		.match_on_egress = !p_info->is_ingress,
 		.reserved = { 0 },
 	};
@@ -911,21 +1125,22 @@ static void send_rtt_event(void *ctx, __u64 rtt, struct flow_state *f_state,
 static void init_flowstate(struct flow_state *f_state,
 			   struct packet_info *p_info)
 {
-	f_state->conn_state = CONNECTION_STATE_WAITOPEN;
-	f_state->last_timestamp = p_info->time;
+	f_state->conn->conn_state = CONNECTION_STATE_WAITOPEN;
+	f_state->tx->last_timestamp = p_info->time;
 	/* We should only ever create new flows for packet with valid pid,
 	   so assume pid is valid*/
-	f_state->last_id = p_info->pid.identifier;
-	f_state->opening_reason = p_info->event_type == FLOW_EVENT_OPENING ?
-					  p_info->event_reason :
-						EVENT_REASON_FIRST_OBS_PCKT;
-	f_state->has_been_timestamped = false;
+	f_state->tx->last_id = p_info->pid.identifier;
+	f_state->conn->opening_reason =
+		p_info->event_type == FLOW_EVENT_OPENING ?
+			p_info->event_reason :
+			EVENT_REASON_FIRST_OBS_PCKT;
+	f_state->tx->has_been_timestamped = false;
 }
 
 static void init_empty_flowstate(struct flow_state *f_state)
 {
-	f_state->conn_state = CONNECTION_STATE_EMPTY;
-	f_state->has_been_timestamped = false;
+	f_state->conn->conn_state = CONNECTION_STATE_EMPTY;
+	f_state->tx->has_been_timestamped = false;
 }
 
 /*
@@ -935,24 +1150,30 @@ static void init_empty_flowstate(struct flow_state *f_state)
 static void init_dualflow_state(struct dual_flow_state *df_state,
 				struct packet_info *p_info)
 {
-	struct flow_state *fw_state =
-		get_flowstate_from_packet(df_state, p_info);
-	struct flow_state *rev_state =
-		get_reverse_flowstate_from_packet(df_state, p_info);
+	struct flow_state fw_state, rev_state;
+
+	get_flowstate_from_packet(&fw_state, df_state, p_info);
+	get_reverse_flowstate_from_packet(&rev_state, df_state, p_info);
 
-	init_flowstate(fw_state, p_info);
-	init_empty_flowstate(rev_state);
+	init_flowstate(&fw_state, p_info);
+	init_empty_flowstate(&rev_state);
 }
 
 static struct dual_flow_state *
 create_dualflow_state(void *ctx, struct packet_info *p_info)
 {
 	struct network_tuple *key = get_dualflow_key_from_packet(p_info);
-	struct dual_flow_state new_state = { 0 };
+	struct dual_flow_state *new_state;
+	__u32 zero = 0;
+
+	new_state = bpf_map_lookup_elem(&map_new_flowstate, &zero);
+	if (!new_state)
+		return NULL;
 
-	init_dualflow_state(&new_state, p_info);
+	__builtin_memset(new_state, 0, sizeof(*new_state));
+	init_dualflow_state(new_state, p_info);
 
-	if (bpf_map_update_elem(&flow_state, key, &new_state, BPF_NOEXIST) !=
+	if (bpf_map_update_elem(&flow_state, key, new_state, BPF_NOEXIST) !=
 	    0) {
 		update_pping_error(PPING_ERR_FLOW_CREATE);
 		send_map_full_event(ctx, p_info, PPING_MAP_FLOWSTATE);
@@ -983,20 +1204,37 @@ lookup_or_create_dualflow_state(void *ctx, struct packet_info *p_info)
 
 static bool is_flowstate_active(struct flow_state *f_state)
 {
-	return f_state->conn_state != CONNECTION_STATE_EMPTY &&
-	       f_state->conn_state != CONNECTION_STATE_CLOSED;
+	return f_state->conn->conn_state != CONNECTION_STATE_EMPTY &&
+	       f_state->conn->conn_state != CONNECTION_STATE_CLOSED;
+}
+
+static void update_flow_ecn_counters(struct flow_state_tx *f_tx, __u8 ecn)
+{
+	switch (ecn) {
+	case 0x1:
+		f_tx->sent_ect1_pkts++;
+		break;
+	case 0x2:
+		f_tx->sent_ect0_pkts++;
+		break;
+	case 0x3:
+		f_tx->sent_ce_pkts++;
+		break;
+	}
 }
 
 static void update_forward_flowstate(struct packet_info *p_info,
 				     struct flow_state *f_state)
 {
 	// "Create" flowstate if it's empty
-	if (f_state->conn_state == CONNECTION_STATE_EMPTY && p_info->pid_valid)
+	if (f_state->conn->conn_state == CONNECTION_STATE_EMPTY &&
+	    p_info->pid_valid)
 		init_flowstate(f_state, p_info);
 
 	if (is_flowstate_active(f_state)) {
-		f_state->sent_pkts++;
-		f_state->sent_bytes += p_info->payload;
+		f_state->tx->sent_pkts++;
+		f_state->tx->sent_bytes += p_info->payload;
+		update_flow_ecn_counters(f_state->tx, p_info->ecn);
 	}
 }
 
@@ -1007,19 +1245,19 @@ static void update_reverse_flowstate(void *ctx, struct packet_info *p_info,
 		return;
 
 	// First time we see reply for flow?
-	if (f_state->conn_state == CONNECTION_STATE_WAITOPEN &&
+	if (f_state->conn->conn_state == CONNECTION_STATE_WAITOPEN &&
 	    p_info->event_type != FLOW_EVENT_CLOSING_BOTH) {
-		f_state->conn_state = CONNECTION_STATE_OPEN;
+		f_state->conn->conn_state = CONNECTION_STATE_OPEN;
 		send_flow_open_event(ctx, p_info, f_state);
 	}
 
-	f_state->rec_pkts++;
-	f_state->rec_bytes += p_info->payload;
+	f_state->rx->rec_pkts++;
+	f_state->rx->rec_bytes += p_info->payload;
 }
 
 static bool should_notify_closing(struct flow_state *f_state)
 {
-	return f_state->conn_state == CONNECTION_STATE_OPEN;
+	return f_state->conn->conn_state == CONNECTION_STATE_OPEN;
 }
 
 static void close_and_delete_flows(void *ctx, struct packet_info *p_info,
@@ -1031,14 +1269,14 @@ static void close_and_delete_flows(void *ctx, struct packet_info *p_info,
 	    p_info->event_type == FLOW_EVENT_CLOSING_BOTH) {
 		if (should_notify_closing(fw_flow))
 			send_flow_event(ctx, p_info, false);
-		fw_flow->conn_state = CONNECTION_STATE_CLOSED;
+		fw_flow->conn->conn_state = CONNECTION_STATE_CLOSED;
 	}
 
 	// Reverse flow closing
 	if (p_info->event_type == FLOW_EVENT_CLOSING_BOTH) {
 		if (should_notify_closing(rev_flow))
 			send_flow_event(ctx, p_info, true);
-		rev_flow->conn_state = CONNECTION_STATE_CLOSED;
+		rev_flow->conn->conn_state = CONNECTION_STATE_CLOSED;
 	}
 
 	// Delete flowstate entry if neither flow is open anymore
@@ -1098,10 +1336,10 @@ static bool is_new_identifier(struct packet_id *pid, struct flow_state *f_state)
 		 * Check that pid > last_ts (considering wrap around) by
 		 * checking 0 < pid - last_ts < 2^31 as specified by
 		 * RFC7323 Section 5.2*/
-		return pid->identifier - f_state->last_id > 0 &&
-		       pid->identifier - f_state->last_id < 1UL << 31;
+		return pid->identifier - f_state->tx->last_id > 0 &&
+		       pid->identifier - f_state->tx->last_id < 1UL << 31;
 
-	return pid->identifier != f_state->last_id;
+	return pid->identifier != f_state->tx->last_id;
 }
 
 static void create_ipprefix_key_v4(__u32 *prefix_key, struct in6_addr *ip)
@@ -1172,6 +1410,7 @@ static void aggregate_rtt(__u64 rtt, struct aggregated_stats *agg_stats)
 		agg_stats->rtt_min = rtt;
 	if (rtt > agg_stats->rtt_max)
 		agg_stats->rtt_max = rtt;
+	agg_stats->rtt_sum += rtt;
 
 	bin_idx = rtt / RTT_AGG_BIN_WIDTH;
 	bin_idx = bin_idx >= RTT_AGG_NR_BINS ? RTT_AGG_NR_BINS - 1 : bin_idx;
@@ -1192,15 +1431,16 @@ static void pping_timestamp_packet(struct flow_state *f_state, void *ctx,
 		return;
 
 	// Check if identfier is new
-	if ((f_state->has_been_timestamped || p_info->wait_first_edge) &&
+	if ((f_state->tx->has_been_timestamped || p_info->wait_first_edge) &&
 	    !is_new_identifier(&p_info->pid, f_state))
 		return;
-	f_state->last_id = p_info->pid.identifier;
+	f_state->tx->last_id = p_info->pid.identifier;
 
 	// Check rate-limit
-	if (f_state->has_been_timestamped &&
-	    is_rate_limited(p_info->time, f_state->last_timestamp,
-			    config.use_srtt ? f_state->srtt : f_state->min_rtt))
+	if (f_state->tx->has_been_timestamped &&
+	    is_rate_limited(p_info->time, f_state->tx->last_timestamp,
+			    config.use_srtt ? f_state->rx->srtt :
+					      f_state->rx->min_rtt))
 		return;
 
 	/*
@@ -1209,12 +1449,12 @@ static void pping_timestamp_packet(struct flow_state *f_state, void *ctx,
 	 * the next available map slot somewhat fairer between heavy and sparse
 	 * flows.
 	 */
-	f_state->has_been_timestamped = true;
-	f_state->last_timestamp = p_info->time;
+	f_state->tx->has_been_timestamped = true;
+	f_state->tx->last_timestamp = p_info->time;
 
 	if (bpf_map_update_elem(&packet_ts, &p_info->pid, &p_info->time,
 				BPF_NOEXIST) == 0) {
-		__sync_fetch_and_add(&f_state->outstanding_timestamps, 1);
+		__sync_fetch_and_add(&f_state->tx->created_timestamps, 1);
 	} else {
 		update_pping_error(PPING_ERR_PKTTS_STORE);
 		send_map_full_event(ctx, p_info, PPING_MAP_PACKETTS);
@@ -1234,7 +1474,7 @@ static void pping_match_packet(struct flow_state *f_state, void *ctx,
 	if (!is_flowstate_active(f_state) || !p_info->reply_pid_valid)
 		return;
 
-	if (f_state->outstanding_timestamps == 0)
+	if (outstanding_timestamps(f_state) == 0)
 		return;
 
 	p_ts = bpf_map_lookup_elem(&packet_ts, &p_info->reply_pid);
@@ -1245,13 +1485,13 @@ static void pping_match_packet(struct flow_state *f_state, void *ctx,
 
 	// Delete timestamp entry as soon as RTT is calculated
 	if (bpf_map_delete_elem(&packet_ts, &p_info->reply_pid) == 0) {
-		__sync_fetch_and_add(&f_state->outstanding_timestamps, -1);
+		__sync_fetch_and_add(&f_state->rx->matched_timestamps, 1);
 		debug_increment_autodel(PPING_MAP_PACKETTS);
 	}
 
-	if (f_state->min_rtt == 0 || rtt < f_state->min_rtt)
-		f_state->min_rtt = rtt;
-	f_state->srtt = calculate_srtt(f_state->srtt, rtt);
+	if (f_state->rx->min_rtt == 0 || rtt < f_state->rx->min_rtt)
+		f_state->rx->min_rtt = rtt;
+	f_state->rx->srtt = calculate_srtt(f_state->rx->srtt, rtt);
 
 	send_rtt_event(ctx, rtt, f_state, p_info);
 	aggregate_rtt(rtt, agg_stats);
@@ -1282,6 +1522,7 @@ static void update_subnet_pktcnt(struct aggregated_stats *stats,
 		counters->other_pkts++;
 		counters->other_bytes += p_info->pkt_len;
 	}
+	update_ecn_counters(&counters->ecn, p_info->ecn);
 
 	stats->last_updated = p_info->time;
 }
@@ -1317,7 +1558,7 @@ static void update_aggregate_stats(struct aggregated_stats **src_stats,
 static void pping_parsed_packet(void *ctx, struct packet_info *p_info)
 {
 	struct dual_flow_state *df_state;
-	struct flow_state *fw_flow, *rev_flow;
+	struct flow_state fw_flow, rev_flow;
 	struct aggregated_stats *src_stats = NULL, *dst_stats = NULL;
 
 	update_aggregate_stats(&src_stats, &dst_stats, p_info);
@@ -1328,16 +1569,16 @@ static void pping_parsed_packet(void *ctx, struct packet_info *p_info)
 	if (!df_state)
 		return;
 
-	fw_flow = get_flowstate_from_packet(df_state, p_info);
-	update_forward_flowstate(p_info, fw_flow);
-	pping_timestamp_packet(fw_flow, ctx, p_info);
+	get_flowstate_from_packet(&fw_flow, df_state, p_info);
+	update_forward_flowstate(p_info, &fw_flow);
+	pping_timestamp_packet(&fw_flow, ctx, p_info);
 
-	rev_flow = get_reverse_flowstate_from_packet(df_state, p_info);
-	update_reverse_flowstate(ctx, p_info, rev_flow);
-	pping_match_packet(rev_flow, ctx, p_info,
+	get_reverse_flowstate_from_packet(&rev_flow, df_state, p_info);
+	update_reverse_flowstate(ctx, p_info, &rev_flow);
+	pping_match_packet(&rev_flow, ctx, p_info,
 			   config.agg_by_dst ? dst_stats : src_stats);
 
-	close_and_delete_flows(ctx, p_info, fw_flow, rev_flow);
+	close_and_delete_flows(ctx, p_info, &fw_flow, &rev_flow);
 }
 
 /*
@@ -1395,12 +1636,12 @@ static bool is_flow_old(struct network_tuple *flow, struct flow_state *f_state,
 	if (!f_state || !is_flowstate_active(f_state))
 		return false;
 
-	ts = f_state->last_timestamp; // To avoid concurrency issue between check and age calculation
+	ts = f_state->tx->last_timestamp; // To avoid concurrency issue between check and age calculation
 	if (ts > time)
 		return false;
 	age = time - ts;
 
-	return (f_state->conn_state == CONNECTION_STATE_WAITOPEN &&
+	return (f_state->conn->conn_state == CONNECTION_STATE_WAITOPEN &&
 		age > UNOPENED_FLOW_LIFETIME) ||
 	       ((flow->proto == IPPROTO_ICMP ||
 		 flow->proto == IPPROTO_ICMPV6) &&
@@ -1462,7 +1703,7 @@ SEC("iter/bpf_map_elem")
 int tsmap_cleanup(struct bpf_iter__bpf_map_elem *ctx)
 {
 	struct packet_id local_pid;
-	struct flow_state *f_state = NULL;
+	struct flow_state fstate, *f_state = NULL;
 	struct dual_flow_state *df_state;
 	struct network_tuple df_key;
 	struct packet_id *pid = ctx->key;
@@ -1481,9 +1722,11 @@ int tsmap_cleanup(struct bpf_iter__bpf_map_elem *ctx)
 
 	make_dualflow_key(&df_key, &pid->flow);
 	df_state = bpf_map_lookup_elem(&flow_state, &df_key);
-	if (df_state)
-		f_state = get_flowstate_from_dualflow(df_state, &pid->flow);
-	rtt = f_state ? f_state->srtt : 0;
+	if (df_state) {
+		get_flowstate_from_dualflow(&fstate, df_state, &pid->flow);
+		f_state = &fstate;
+	}
+	rtt = f_state ? f_state->rx->srtt : 0;
 
 	if ((rtt && now - *timestamp > rtt * TIMESTAMP_RTT_LIFETIME) ||
 	    now - *timestamp > TIMESTAMP_LIFETIME) {
@@ -1494,8 +1737,8 @@ int tsmap_cleanup(struct bpf_iter__bpf_map_elem *ctx)
 			debug_increment_timeoutdel(PPING_MAP_PACKETTS);
 
 			if (f_state)
-				__sync_fetch_and_add(
-					&f_state->outstanding_timestamps, -1);
+				__sync_fetch_and_add(f_state->expired_timestamps,
+						     1);
 		}
 	}
 
@@ -1506,7 +1749,7 @@ SEC("iter/bpf_map_elem")
 int flowmap_cleanup(struct bpf_iter__bpf_map_elem *ctx)
 {
 	struct network_tuple flow1, flow2;
-	struct flow_state *f_state1, *f_state2;
+	struct flow_state f_state1, f_state2;
 	struct dual_flow_state *df_state;
 	__u64 now = bpf_ktime_get_ns();
 	bool notify1, notify2, timeout1, timeout2;
@@ -1522,17 +1765,17 @@ int flowmap_cleanup(struct bpf_iter__bpf_map_elem *ctx)
 	reverse_flow(&flow2, &flow1);
 
 	df_state = ctx->value;
-	f_state1 = get_flowstate_from_dualflow(df_state, &flow1);
-	f_state2 = get_flowstate_from_dualflow(df_state, &flow2);
+	get_flowstate_from_dualflow(&f_state1, df_state, &flow1);
+	get_flowstate_from_dualflow(&f_state2, df_state, &flow2);
 
-	timeout1 = is_flow_old(&flow1, f_state1, now);
-	timeout2 = is_flow_old(&flow2, f_state2, now);
+	timeout1 = is_flow_old(&flow1, &f_state1, now);
+	timeout2 = is_flow_old(&flow2, &f_state2, now);
 
-	if ((!is_flowstate_active(f_state1) || timeout1) &&
-	    (!is_flowstate_active(f_state2) || timeout2)) {
+	if ((!is_flowstate_active(&f_state1) || timeout1) &&
+	    (!is_flowstate_active(&f_state2) || timeout2)) {
 		// Entry should be deleted
-		notify1 = should_notify_closing(f_state1) && timeout1;
-		notify2 = should_notify_closing(f_state2) && timeout2;
+		notify1 = should_notify_closing(&f_state1) && timeout1;
+		notify2 = should_notify_closing(&f_state2) && timeout2;
 		if (bpf_map_delete_elem(&flow_state, &flow1) == 0) {
 			debug_increment_timeoutdel(PPING_MAP_FLOWSTATE);
 			if (notify1)
@@ -0,0 +1,547 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#define _GNU_SOURCE // For fopencookie
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring_writer.h"
+
+struct uring_file;
+
+struct uring_buffer {
+	struct uring_file *file; // File the buffer is being written to
+	char *data;
+	size_t len; // Number of bytes of data in buffer
+	size_t done; // Number of bytes that have been written out
+	__u64 offset; // File offset of the start of the buffer
+	unsigned int idx;
+};
+
+struct uring_file {
+	struct uring_writer *uw;
+	struct uring_file *next;
+	struct uring_buffer *cur; // Buffer currently being filled
+	FILE *stream;
+	__u64 offset; // File offset to write the next buffer at
+	unsigned int inflight; // Number of queued, but not completed, buffers
+	int fd;
+};
+
+struct uring_writer {
+	int ring_fd;
+	int event_fd;
+	unsigned int depth;
+	size_t buf_size;
+
+	/* Mappings of the submission and completion queues */
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int to_submit;
+
+	char *buf_mem;
+	struct uring_buffer *bufs;
+	unsigned int *free_bufs;
+	unsigned int n_free;
+
+	struct uring_file *files;
+	__u64 lost_bytes;
+	int write_err; // First error from a completed write since last checked
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int map_rings(struct uring_writer *uw, struct io_uring_params *p)
+{
+	uw->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(__u32);
+	uw->cq_ring_sz =
+		p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	/* With IORING_FEAT_SINGLE_MMAP both rings share a single mapping */
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uw->cq_ring_sz > uw->sq_ring_sz)
+			uw->sq_ring_sz = uw->cq_ring_sz;
+		uw->cq_ring_sz = uw->sq_ring_sz;
+	}
+
+	uw->sq_ring = mmap(NULL, uw->sq_ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uw->ring_fd,
+			   IORING_OFF_SQ_RING);
+	if (uw->sq_ring == MAP_FAILED) {
+		uw->sq_ring = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		uw->cq_ring = uw->sq_ring;
+	} else {
+		uw->cq_ring = mmap(NULL, uw->cq_ring_sz, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, uw->ring_fd,
+				   IORING_OFF_CQ_RING);
+		if (uw->cq_ring == MAP_FAILED) {
+			uw->cq_ring = NULL;
+			return -errno;
+		}
+	}
+
+	uw->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+	uw->sqes = mmap(NULL, uw->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uw->ring_fd,
+			IORING_OFF_SQES);
+	if (uw->sqes == MAP_FAILED) {
+		uw->sqes = NULL;
+		return -errno;
+	}
+
+	uw->sq_tail = uw->sq_ring + p->sq_off.tail;
+	uw->sq_mask = uw->sq_ring + p->sq_off.ring_mask;
+	uw->sq_array = uw->sq_ring + p->sq_off.array;
+	uw->cq_head = uw->cq_ring + p->cq_off.head;
+	uw->cq_tail = uw->cq_ring + p->cq_off.tail;
+	uw->cq_mask = uw->cq_ring + p->cq_off.ring_mask;
+	uw->cqes = uw->cq_ring + p->cq_off.cqes;
+
+	return 0;
+}
+
+static int init_buffers(struct uring_writer *uw)
+{
+	struct iovec *iovs;
+	unsigned int i;
+	int err;
+
+	err = posix_memalign((void **)&uw->buf_mem, sysconf(_SC_PAGESIZE),
+			     uw->depth * uw->buf_size);
+	if (err) {
+		uw->buf_mem = NULL;
+		return -err;
+	}
+
+	uw->bufs = calloc(uw->depth, sizeof(*uw->bufs));
+	uw->free_bufs = calloc(uw->depth, sizeof(*uw->free_bufs));
+	iovs = calloc(uw->depth, sizeof(*iovs));
+	if (!uw->bufs || !uw->free_bufs || !iovs) {
+		free(iovs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < uw->depth; i++) {
+		uw->bufs[i].data = uw->buf_mem + i * uw->buf_size;
+		uw->bufs[i].idx = i;
+		uw->free_bufs[i] = i;
+		iovs[i].iov_base = uw->bufs[i].data;
+		iovs[i].iov_len = uw->buf_size;
+	}
+	uw->n_free = uw->depth;
+
+	err = io_uring_register(uw->ring_fd, IORING_REGISTER_BUFFERS, iovs,
+				uw->depth);
+	err = err ? -errno : 0;
+	free(iovs);
+	return err;
+}
+
+void uring_writer_free(struct uring_writer *uw)
+{
+	if (!uw)
+		return;
+
+	if (uw->event_fd >= 0)
+		close(uw->event_fd);
+	if (uw->sqes)
+		munmap(uw->sqes, uw->sqes_sz);
+	if (uw->cq_ring && uw->cq_ring != uw->sq_ring)
+		munmap(uw->cq_ring, uw->cq_ring_sz);
+	if (uw->sq_ring)
+		munmap(uw->sq_ring, uw->sq_ring_sz);
+	if (uw->ring_fd >= 0)
+		close(uw->ring_fd); // Also unregisters the buffers and eventfd
+
+	free(uw->buf_mem);
+	free(uw->bufs);
+	free(uw->free_bufs);
+	free(uw);
+}
+
+/* Returns NULL and sets errno on failure */
+struct uring_writer *uring_writer_new(unsigned int queue_depth,
+				      size_t buf_size)
+{
+	struct io_uring_params params = { 0 };
+	struct uring_writer *uw;
+	int err;
+
+	if (queue_depth == 0 || buf_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	uw = calloc(1, sizeof(*uw));
+	if (!uw)
+		return NULL;
+
+	uw->depth = queue_depth;
+	uw->buf_size = buf_size;
+	uw->event_fd = -1;
+
+	/* Only queue_depth buffers can be in use at once, and each buffer
+	 * occupies at most one submission queue entry, so the queues can
+	 * never overflow */
+	uw->ring_fd = io_uring_setup(queue_depth, &params);
+	if (uw->ring_fd < 0) {
+		err = -errno;
+		goto err;
+	}
+
+	err = map_rings(uw, &params);
+	if (err)
+		goto err;
+
+	err = init_buffers(uw);
+	if (err)
+		goto err;
+
+	uw->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (uw->event_fd < 0) {
+		err = -errno;
+		goto err;
+	}
+
+	err = io_uring_register(uw->ring_fd, IORING_REGISTER_EVENTFD,
+				&uw->event_fd, 1);
+	if (err) {
+		err = -errno;
+		goto err;
+	}
+
+	return uw;
+
+err:
+	uring_writer_free(uw);
+	errno = -err;
+	return NULL;
+}
+
+int uring_writer_eventfd(struct uring_writer *uw)
+{
+	return uw->event_fd;
+}
+
+__u64 uring_writer_lost_bytes(struct uring_writer *uw)
+{
+	return uw->lost_bytes;
+}
+
+static void queue_write(struct uring_writer *uw, struct uring_buffer *buf)
+{
+	unsigned int tail = *uw->sq_tail;
+	unsigned int idx = tail & *uw->sq_mask;
+	struct io_uring_sqe *sqe = &uw->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = buf->file->fd;
+	sqe->addr = (__u64)(unsigned long)(buf->data + buf->done);
+	sqe->len = buf->len - buf->done;
+	sqe->off = buf->offset + buf->done;
+	sqe->buf_index = buf->idx;
+	sqe->user_data = buf->idx;
+
+	uw->sq_array[idx] = idx;
+	__atomic_store_n(uw->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uw->to_submit++;
+}
+
+static void release_buffer(struct uring_writer *uw, struct uring_buffer *buf)
+{
+	buf->file->inflight--;
+	buf->file = NULL;
+	uw->free_bufs[uw->n_free++] = buf->idx;
+}
+
+/* Queue the buffer the file is currently filling to be written out */
+static void queue_buffer(struct uring_file *file)
+{
+	struct uring_buffer *buf = file->cur;
+
+	file->cur = NULL;
+	if (buf->len == 0) {
+		buf->file = NULL;
+		file->uw->free_bufs[file->uw->n_free++] = buf->idx;
+		return;
+	}
+
+	buf->offset = file->offset;
+	buf->done = 0;
+	file->offset += buf->len;
+	file->inflight++;
+	queue_write(file->uw, buf);
+}
+
+static void handle_completion(struct uring_writer *uw,
+			      const struct io_uring_cqe *cqe)
+{
+	struct uring_buffer *buf = &uw->bufs[cqe->user_data];
+	int err;
+
+	if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+		queue_write(uw, buf);
+		return;
+	}
+
+	if (cqe->res <= 0) {
+		err = cqe->res < 0 ? cqe->res : -EIO;
+		if (!uw->write_err)
+			uw->write_err = err;
+		uw->lost_bytes += buf->len - buf->done;
+		release_buffer(uw, buf);
+		return;
+	}
+
+	// Short write, write out the rest of the buffer
+	buf->done += cqe->res;
+	if (buf->done < buf->len) {
+		queue_write(uw, buf);
+		return;
+	}
+
+	release_buffer(uw, buf);
+}
+
+static void reap_completions(struct uring_writer *uw)
+{
+	unsigned int head = *uw->cq_head;
+	unsigned int tail = __atomic_load_n(uw->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		handle_completion(uw, &uw->cqes[head & *uw->cq_mask]);
+		head++;
+	}
+
+	__atomic_store_n(uw->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submit all queued writes, and if wait is set also wait for (at least) one
+ * of them to complete */
+static int submit_writes(struct uring_writer *uw, bool wait)
+{
+	int ret;
+
+	while (uw->to_submit > 0 || wait) {
+		ret = io_uring_enter(uw->ring_fd, uw->to_submit, wait ? 1 : 0,
+				     wait ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		uw->to_submit -= ret;
+		if (wait) {
+			reap_completions(uw);
+			wait = false;
+		}
+	}
+
+	return 0;
+}
+
+static int get_buffer(struct uring_file *file)
+{
+	struct uring_writer *uw = file->uw;
+	int err;
+
+	while (uw->n_free == 0) {
+		err = submit_writes(uw, true);
+		if (err)
+			return err;
+	}
+
+	file->cur = &uw->bufs[uw->free_bufs[--uw->n_free]];
+	file->cur->file = file;
+	file->cur->len = 0;
+	return 0;
+}
+
+static ssize_t uring_file_write(void *cookie, const char *data, size_t size)
+{
+	struct uring_file *file = cookie;
+	size_t buf_size = file->uw->buf_size;
+	size_t written = 0, n;
+	int err;
+
+	while (written < size) {
+		if (!file->cur) {
+			err = get_buffer(file);
+			if (err) {
+				errno = -err;
+				return written > 0 ? (ssize_t)written : -1;
+			}
+		}
+
+		n = size - written;
+		if (n > buf_size - file->cur->len)
+			n = buf_size - file->cur->len;
+
+		memcpy(file->cur->data + file->cur->len, data + written, n);
+		file->cur->len += n;
+		written += n;
+
+		if (file->cur->len == buf_size)
+			queue_buffer(file);
+	}
+
+	return written;
+}
+
+static int uring_file_close(void *cookie)
+{
+	struct uring_file *file = cookie, **pprev;
+	struct uring_writer *uw = file->uw;
+	int err = 0;
+
+	for (pprev = &uw->files; *pprev; pprev = &(*pprev)->next) {
+		if (*pprev == file) {
+			*pprev = file->next;
+			break;
+		}
+	}
+
+	if (file->cur)
+		queue_buffer(file);
+
+	err = submit_writes(uw, false);
+	while (!err && file->inflight > 0)
+		err = submit_writes(uw, true);
+
+	if (!err && uw->write_err) {
+		err = uw->write_err;
+		uw->write_err = 0;
+	}
+
+	close(file->fd);
+	/* If the ring failed the buffers may still point to the file, so
+	 * rather leak it than risk a use after free */
+	if (file->inflight == 0)
+		free(file);
+
+	if (err) {
+		errno = -err;
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns NULL and sets errno on failure */
+FILE *uring_writer_fopen(struct uring_writer *uw, const char *filename)
+{
+	cookie_io_functions_t io_funcs = {
+		.write = uring_file_write,
+		.close = uring_file_close,
+	};
+	struct uring_file *file;
+	int err;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return NULL;
+
+	file->uw = uw;
+	/* Writes are done at explicit offsets, so the file can not be opened
+	 * with O_APPEND. Instead it must be a new file (like the "x" mode of
+	 * fopen) so the offsets start from 0. */
+	file->fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			0666);
+	if (file->fd < 0) {
+		err = errno;
+		free(file);
+		errno = err;
+		return NULL;
+	}
+
+	file->stream = fopencookie(file, "w", io_funcs);
+	if (!file->stream) {
+		err = errno;
+		close(file->fd);
+		free(file);
+		errno = err;
+		return NULL;
+	}
+
+	file->next = uw->files;
+	uw->files = file;
+	return file->stream;
+}
+
+/* Queue everything written to the streams so far and submit the queued writes
+ * to the kernel. Returns 0 or a negative error code. */
+int uring_writer_flush(struct uring_writer *uw)
+{
+	struct uring_file *file;
+
+	for (file = uw->files; file; file = file->next) {
+		fflush(file->stream);
+		if (file->cur)
+			queue_buffer(file);
+	}
+
+	return submit_writes(uw, false);
+}
+
+/* Handle the writes that have completed since last call, should be called when
+ * the eventfd is readable. Returns 0, or a negative error code if any of the
+ * writes failed (in which case the data of that write is lost). */
+int uring_writer_process_completions(struct uring_writer *uw)
+{
+	__u64 val;
+	int err;
+
+	if (read(uw->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	reap_completions(uw);
+
+	// Resubmit remaining parts of short writes
+	err = submit_writes(uw, false);
+	if (!err && uw->write_err) {
+		err = uw->write_err;
+		uw->write_err = 0;
+	}
+
+	return err;
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef URING_WRITER_H
+#define URING_WRITER_H
+
+#include <stdio.h>
+#include <linux/types.h>
+
+/*
+ * Asynchronous file output using io_uring
+ *
+ * Streams opened with uring_writer_fopen() are regular stdio FILE streams, but
+ * instead of blocking on write(2) the output is copied into a set of
+ * registered (fixed) buffers, which are written out with io_uring. Full
+ * buffers are queued immediately, while partially filled buffers are only
+ * queued by uring_writer_flush(), so that many small writes (ex. one per
+ * event) can be batched into a few large ones. Queued writes are submitted to
+ * the kernel in batches by uring_writer_flush(), and their completions are
+ * signaled through the eventfd from uring_writer_eventfd().
+ *
+ * Writing only blocks when all buffers are in use (i.e. queue_depth buffers
+ * are waiting to be written), in which case it waits for the oldest writes to
+ * complete.
+ */
+struct uring_writer;
+
+struct uring_writer *uring_writer_new(unsigned int queue_depth,
+				      size_t buf_size);
+void uring_writer_free(struct uring_writer *uw);
+
+/* Create a new file (fails if it already exists) to be written by uw. Closing
+ * the stream with fclose() waits for all outstanding writes to the file. */
+FILE *uring_writer_fopen(struct uring_writer *uw, const char *filename);
+
+int uring_writer_eventfd(struct uring_writer *uw);
+int uring_writer_flush(struct uring_writer *uw);
+int uring_writer_process_completions(struct uring_writer *uw);
+__u64 uring_writer_lost_bytes(struct uring_writer *uw);
+
+#endif